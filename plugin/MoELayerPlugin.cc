@@ -3,20 +3,69 @@
 #include <cublas_v2.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+
 #include "cuda/moe.h"
-#include "cuda/ops.h"
+#include "host/gating.h"
+#include "host/shuffle.h"
+#include "runtime/ExpertPlacement.h"
+#include "runtime/ExpertScheduler.h"
+#include "runtime/ExpertStore.h"
 #include "sublayers/IdentityLayer.hh"
 #include "sublayers/T5FFLayer.h"
 #include "thirdparty/dbg.h"
 #include "utility.h"
 
+namespace {
+// strings are followed by their null terminators and padded to 8 bytes
+size_t serializedStringsSize(const char* expertWeightFile, const char* sublayerType) {
+    auto string_size = strlen(expertWeightFile) + strlen(sublayerType) + 2;
+    return (string_size + 7) / 8 * 8;
+}
+
+// lists selected for each token by fused gating, which supports k = 1, 2, 4 or 8
+int probeStride(int probes) {
+    int stride = 1;
+    while (stride < probes) stride *= 2;
+    return stride;
+}
+
+// page-locks host memory of HostAllocator::PINNED, mapped by the allocator instead of cudaHostAlloc so that small
+// buffers share slabs
+bool pinHostMemory(void* data, size_t size, bool pin) {
+    auto err = pin ? cudaHostRegister(data, size, cudaHostRegisterPortable) : cudaHostUnregister(data);
+    if (err != cudaSuccess) fprintf(stderr, "CUDA Error %d (%s) when pinning host memory\n", err, cudaGetErrorString(err));
+    return err == cudaSuccess;
+}
+const bool HOST_MEMORY_PINNED = (HostAllocator::instance().setPinner(pinHostMemory), true);
+
+template <typename T>
+T* copyToGPU(const T* data, size_t count) {
+    T* result = nullptr;
+    CUDA_SAFE_CALL(cudaMalloc(&result, count * sizeof(T)));
+    CUDA_SAFE_CALL(cudaMemcpy(result, data, count * sizeof(T), cudaMemcpyHostToDevice));
+    return result;
+}
+}  // namespace
+
 
 void MoELayerPlugin::ensureGPUWeights() {
-    if (mCentroidsGpu != nullptr) return;
+    if (!scoresTokens() || mCentroidsGpu != nullptr || mSortedCentroidsGpu != nullptr) return;
     dbg("first time copy weights to GPU");
-    auto size = centroidsSize() * sizeof(float);
-    CUDA_SAFE_CALL(cudaMalloc(&mCentroidsGpu, size));
-    CUDA_SAFE_CALL(cudaMemcpy(mCentroidsGpu, mCentroidsCpu, size, cudaMemcpyHostToDevice));
+    if (mCentroidIndex != nullptr) {
+        // centroids are only read through the index, grouped by list
+        auto& index = *mCentroidIndex;
+        mListCentroidsGpu = copyToGPU(index.listCentroids().data(), index.listCentroids().size());
+        mSortedCentroidsGpu = copyToGPU(index.sortedCentroids().data(), index.sortedCentroids().size());
+        mListOffsetGpu = copyToGPU(index.listOffset().data(), index.listOffset().size());
+        mListExpertsGpu = copyToGPU(index.listExperts().data(), index.listExperts().size());
+    } else {
+        mCentroidsGpu = copyToGPU(mCentroidsCpu, centroidsSize());
+    }
     if (mLayernormCpu != nullptr) {
         dbg("copy layer norm weights additionally");
         auto size = mEmbeddingSize * sizeof(float);
@@ -38,6 +87,26 @@ void MoELayerPlugin::createSublayer() {
         fprintf(stderr, "ERROR: unsupported sublayer type: %s\n", mSublayerType);
         assert(false);
     }
+    mSublayer->setWeightBudgets(static_cast<size_t>(mOptions.hotExpertBudget) << 20,
+                                static_cast<size_t>(mOptions.warmExpertBudget) << 20);
+}
+
+// balanced assignment needs the full score matrix of raw input, neither layernorm nor centroid index are supported
+void MoELayerPlugin::createAssigner() {
+    if (mOptions.balancedAssignment == BalancedAssignment::NONE) return;
+    if (!scoresTokens() || mFlags.layernormOnInputBeforeScore || mOptions.routingLists > 0) {
+        fprintf(stderr, "ERROR: balanced assignment only supports scores of raw input without routing lists\n");
+        assert(false);
+    }
+    mAssigner = std::make_unique<BalancedAssignment>(
+        static_cast<BalancedAssignment::Algorithm>(mOptions.balancedAssignment));
+}
+
+void MoELayerPlugin::createReplicator() {
+    if (mOptions.replicationThreshold <= 0) return;
+    // replicas of a device expert are slots, of a host expert chunks on separate tasks
+    auto max_replicas = mFlags.expertsOnHost ? MAX_HOST_REPLICAS : mMaxConcurrency;
+    mReplicator = std::make_unique<ExpertReplicator>(mExpertCount, mOptions.replicationThreshold, max_replicas);
 }
 
 // static function
@@ -50,6 +119,10 @@ MoEFlags MoELayerPlugin::parseFlags(const char* moeVariant) {
         flags.layernormOnInputBeforeScore = true;
     } else if (strcmp(moeVariant, moe_variant::DEFAULT) == 0) {
         // do nothing
+    } else if (strcmp(moeVariant, moe_variant::HASH_LAYER) == 0) {
+        flags.hashRouting = true;
+    } else if (strcmp(moeVariant, moe_variant::EXTERNAL_ROUTING) == 0) {
+        flags.externalRouting = true;
     } else {
         fprintf(stderr, "ERROR: unsupported moe variant: %s\n", moeVariant);
         assert(false);
@@ -59,7 +132,8 @@ MoEFlags MoELayerPlugin::parseFlags(const char* moeVariant) {
 
 MoELayerPlugin::MoELayerPlugin(const char* layerName, int expertCount, int embeddingSize, int hiddenSize,
                                int maxConcurrency, float* centroidsCpu, float* layernormCpu,
-                               const char* expertWeightFile, const char* sublayerType, const MoEFlags flags)
+                               const char* expertWeightFile, const char* sublayerType, const MoEFlags flags,
+                               const MoEOptions options, std::shared_ptr<const CentroidIndex> centroidIndex)
     : mLayerName(strdup(layerName)),
       mExpertCount(expertCount),
       mEmbeddingSize(embeddingSize),
@@ -67,31 +141,42 @@ MoELayerPlugin::MoELayerPlugin(const char* layerName, int expertCount, int embed
       mMaxConcurrency(maxConcurrency),
       mCentroidsCpu(centroidsCpu),
       mLayernormCpu(layernormCpu),
+      mCentroidIndex(std::move(centroidIndex)),
       mExpertWeightFile(expertWeightFile),
       mSublayerType(strdup(sublayerType)),
-      mFlags(flags) {
+      mFlags(flags),
+      mOptions(options) {
     dbg(this, "MoELayerPlugin main constructor");
     // check parameters
-    assert(mCentroidsCpu != nullptr);
+    assert(!scoresTokens() || mCentroidsCpu != nullptr);
     if (mFlags.layernormOnInputBeforeScore && layernormCpu == nullptr) {
         fprintf(stderr, "ERROR: might provide layer norm weight if layernormOnInputBeforeScore is set\n");
         assert(false);
     }
+    if (mOptions.routingLists > 0) {
+        assert(mCentroidIndex != nullptr && mCentroidIndex->listCount() == mOptions.routingLists);
+        assert(mOptions.routingProbes >= 1 && mOptions.routingProbes <= CentroidIndex::MAX_PROBES);
+    }
     createSublayer();
+    createAssigner();
+    createReplicator();
+    if (mOptions.tokenDedup) mDedup = std::make_unique<TokenDedup>();
 }
 
 MoELayerPlugin::MoELayerPlugin(const MoELayerPlugin& src)
     : MoELayerPlugin(strdup(src.mLayerName), src.mExpertCount, src.mEmbeddingSize, src.mHiddenSize, src.mMaxConcurrency,
                      src.mCentroidsCpu, src.mLayernormCpu, strdup(src.mExpertWeightFile), strdup(src.mSublayerType),
-                     src.mFlags) {
+                     src.mFlags, src.mOptions, src.mCentroidIndex) {
     dbg(this, "MoELayerPlugin copy constructor");
     dbg(centroidsSize(), src.mExpertCount, src.mEmbeddingSize);
     // WORKAROUND
     mSublayer = nullptr;
     // copy centroids
     size_t size = centroidsSize();
-    mCentroidsCpu = new float[size];
-    memcpy(mCentroidsCpu, src.mCentroidsCpu, size * sizeof(float));
+    if (size > 0) {
+        mCentroidsCpu = new float[size];
+        memcpy(mCentroidsCpu, src.mCentroidsCpu, size * sizeof(float));
+    }
     // copy layer norm
     if (src.mLayernormCpu != nullptr) {
         mLayernormCpu = new float[mEmbeddingSize];
@@ -99,6 +184,8 @@ MoELayerPlugin::MoELayerPlugin(const MoELayerPlugin& src)
     }
     this->mSublayer = src.mSublayer;
     // createSublayer();
+    // workers already hold the experts, a clone does not spawn its own ones
+    mShards = src.mShards;
 }
 
 MoELayerPlugin::MoELayerPlugin(const char* layerName, const void* serialData, size_t serialLength)
@@ -113,33 +200,46 @@ MoELayerPlugin::MoELayerPlugin(const char* layerName, const void* serialData, si
     mMaxConcurrency = *int_buffer++;
     auto expert_weight_file_len = *int_buffer++;
     auto sublayer_type_len = *int_buffer++;
-    // flag
+    // flag & options
     auto flag_buffer = reinterpret_cast<const MoEFlags*>(int_buffer);
     mFlags = *flag_buffer++;
+    auto option_buffer = reinterpret_cast<const MoEOptions*>(flag_buffer);
+    mOptions = *option_buffer++;
     // 2 strings
-    auto char_buffer = reinterpret_cast<const char*>(flag_buffer);
+    auto char_buffer = reinterpret_cast<const char*>(option_buffer);
     mExpertWeightFile = strdup(char_buffer);
-    char_buffer += expert_weight_file_len + 1;
-    mSublayerType = strdup(char_buffer);
-    char_buffer += sublayer_type_len + 1;
-    auto string_size = expert_weight_file_len + sublayer_type_len + 2;
-    // align to 8 byte
-    if (string_size % 8 != 0) {
-        char_buffer += 8 - (string_size % 8);
-    }
-    // initialize centroids (int64_t)
-    auto float_buffer = reinterpret_cast<const int64_t*>(char_buffer);
+    mSublayerType = strdup(char_buffer + expert_weight_file_len + 1);
+    assert(strlen(mExpertWeightFile) == static_cast<size_t>(expert_weight_file_len));
+    assert(strlen(mSublayerType) == static_cast<size_t>(sublayer_type_len));
+    // aligned to 8 byte
+    char_buffer += serializedStringsSize(mExpertWeightFile, mSublayerType);
+    // initialize centroids
+    auto float_buffer = reinterpret_cast<const float*>(char_buffer);
     auto size = centroidsSize();
-    // assert(size * sizeof(float) == serialLength - METADATA_LENGTH);
-    mCentroidsCpu = new float[size];
-    memcpy(mCentroidsCpu, float_buffer, size * sizeof(float));
-    float_buffer += size;
+    if (size > 0) {
+        mCentroidsCpu = new float[size];
+        memcpy(mCentroidsCpu, float_buffer, size * sizeof(float));
+        float_buffer += size;
+    }
     // initialize layer norm
     if (mFlags.layernormOnInputBeforeScore) {
         mLayernormCpu = new float[mEmbeddingSize];
-        memcpy(mLayernormCpu, float_buffer, size * sizeof(float));
+        memcpy(mLayernormCpu, float_buffer, mEmbeddingSize * sizeof(float));
+        float_buffer += mEmbeddingSize;
+    }
+    // centroid index is restored from the list of each expert
+    auto end = reinterpret_cast<const char*>(float_buffer);
+    if (mOptions.routingLists > 0) {
+        auto assignment = reinterpret_cast<const int*>(float_buffer);
+        mCentroidIndex = std::make_shared<CentroidIndex>(mCentroidsCpu, mExpertCount, mEmbeddingSize,
+                                                         mOptions.routingLists, assignment);
+        end = reinterpret_cast<const char*>(assignment + mExpertCount);
     }
+    assert(end - static_cast<const char*>(serialData) <= static_cast<ptrdiff_t>(serialLength));
     createSublayer();
+    createAssigner();
+    createReplicator();
+    if (mOptions.tokenDedup) mDedup = std::make_unique<TokenDedup>();
 }
 
 MoELayerPlugin::~MoELayerPlugin() {
@@ -156,9 +256,11 @@ DimsExprs MoELayerPlugin::getOutputDimensions(int32_t outputIndex, const DimsExp
 
 bool MoELayerPlugin::supportsFormatCombination(int32_t pos, const PluginTensorDesc* inOut, int32_t nbInputs,
                                                int32_t nbOutputs) noexcept {
-    assert(nbInputs == 1 && nbOutputs == 1);
+    assert(validInputCount(nbInputs) && nbOutputs == 1);
     auto& desc = inOut[pos];
-    return desc.format == TensorFormat::kLINEAR && desc.type == DataType::kFLOAT;
+    // inputs after token features hold token ids, experts, sequence lengths or token mask
+    auto type = pos > 0 && pos < nbInputs ? DataType::kINT32 : DataType::kFLOAT;
+    return desc.format == TensorFormat::kLINEAR && desc.type == type;
 }
 
 nvinfer1::DataType MoELayerPlugin::getOutputDataType([[maybe_unused]] int32_t index,
@@ -169,14 +271,37 @@ nvinfer1::DataType MoELayerPlugin::getOutputDataType([[maybe_unused]] int32_t in
 
 void MoELayerPlugin::configurePlugin(const DynamicPluginTensorDesc* in, int32_t nbInputs,
                                      const DynamicPluginTensorDesc* out, int32_t nbOutputs) noexcept {
-    assert(nbInputs == 1 && nbOutputs == 1);
+    assert(validInputCount(nbInputs) && nbOutputs == 1);
     dbg(in[0].desc.dims.d);
-    assert(mSublayer->configureWithFormat(&in[0].desc.dims, nbInputs, &out[0].desc.dims, nbOutputs));
+    // sub-layer only sees token features
+    assert(mSublayer->configureWithFormat(&in[0].desc.dims, 1, &out[0].desc.dims, nbOutputs));
     auto& dim = in[0].desc.dims;
     assert(dim.nbDims == 3);
     assert(mEmbeddingSize == dim.d[2]);
-    mSequenceLength = dim.d[1];
-    dbg(mEmbeddingSize, mSequenceLength);
+    // batch size & sequence length may change on every call within the optimization profile
+    mMaxTokenCount = tokenCount(in[0].max);
+    auto routing_inputs = routingInputCount();
+    if (routing_inputs > 0) {
+        // (batch_size, seq_len) token ids or experts
+        auto& routing_dim = in[1].desc.dims;
+        if (routing_dim.nbDims != 2) {
+            fprintf(stderr, "ERROR: routing input must be of shape (batch_size, seq_len), got %d dims\n",
+                    routing_dim.nbDims);
+            assert(false);
+        }
+    }
+    mPaddingInputRank = 0;
+    if (nbInputs == 2 + routing_inputs) {
+        // (batch_size) sequence lengths or (batch_size, seq_len) token mask
+        auto& padding_dim = in[1 + routing_inputs].desc.dims;
+        if (padding_dim.nbDims != 1 && padding_dim.nbDims != 2) {
+            fprintf(stderr, "ERROR: padding input must be sequence lengths or token mask, got %d dims\n",
+                    padding_dim.nbDims);
+            assert(false);
+        }
+        mPaddingInputRank = padding_dim.nbDims;
+    }
+    dbg(mEmbeddingSize, mMaxTokenCount, mPaddingInputRank);
 }
 
 void MoELayerPlugin::ensureCUDAContext() {
@@ -186,6 +311,17 @@ void MoELayerPlugin::ensureCUDAContext() {
         for (int i = 0; i < mMaxConcurrency; ++i) {
             CUDA_SAFE_CALL(cudaStreamCreate(&mStreams[i]));
         }
+        CUDA_SAFE_CALL(cudaStreamCreate(&mGatherStream));
+        // events are only used for ordering
+        mStreamEvents = new cudaEvent_t[mMaxConcurrency];
+        for (int i = 0; i < mMaxConcurrency; ++i) {
+            CUDA_SAFE_CALL(cudaEventCreateWithFlags(&mStreamEvents[i], cudaEventDisableTiming));
+        }
+        for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+            CUDA_SAFE_CALL(cudaEventCreateWithFlags(&mRoutedEvents[i], cudaEventDisableTiming));
+            CUDA_SAFE_CALL(cudaEventCreateWithFlags(&mGatheredEvents[i], cudaEventDisableTiming));
+            CUDA_SAFE_CALL(cudaEventCreateWithFlags(&mCopiedEvents[i], cudaEventDisableTiming));
+        }
     }
     if (mCublasHandle == nullptr) {
         CUBLAS_SAFE_CALL(cublasCreate_v2(&mCublasHandle));
@@ -194,14 +330,74 @@ void MoELayerPlugin::ensureCUDAContext() {
     }
 }
 
+// sized for DECODE_TOKENS once, so that decoding never allocates
+void MoELayerPlugin::ensureDecodeBuffers() {
+    if (mDecodeBuffer.data() != nullptr) return;
+    auto feature_size = sizeof(float) * DECODE_TOKENS * mEmbeddingSize;
+    auto size = feature_size * 2 + sizeof(int) * DECODE_TOKENS * 2 + mSublayer->hostWorkspaceSize(DECODE_TOKENS);
+    mDecodeBuffer = HostMemory(size, HostAllocator::PINNED);
+    mDecodeSelection.resize(DECODE_TOKENS);
+    mDecodeTokenPos.resize(DECODE_TOKENS);
+    mDecodeScore.resize(DECODE_TOKENS);
+    mDecodeExpertCount.resize(mExpertCount);
+    mDecodeExpertOffset.resize(mExpertCount + 1);
+    if (mScheduler == nullptr) {
+        mScheduler = std::make_unique<ExpertScheduler>(mSublayer->weightSize(), mSublayer->flopsPerToken(),
+                                                       ThreadPool::instance(), mSublayer->placement());
+    }
+}
+
+void MoELayerPlugin::ensureHostBuffer(size_t size) {
+    if (mHostBuffer.size() >= size) return;
+    dbg(mHostBuffer.size(), size);
+    // copies of previous calls may still read or write the old buffer
+    if (mHostBuffer.data() != nullptr) CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    mHostBuffer = HostMemory(size, HostAllocator::PINNED);
+}
+
 int32_t MoELayerPlugin::initialize() noexcept {
     dbg(this, "call initialize");
+    if (mOptions.expertShards > 0) {
+        // this process holds no expert weight, each worker loads its own experts
+        if (mShards == nullptr) {
+            ExpertShards::Config config;
+            config.shardCount = mOptions.expertShards;
+            config.expertCount = mExpertCount;
+            config.embeddingSize = mEmbeddingSize;
+            config.hiddenSize = mHiddenSize;
+            config.sublayerType = mSublayerType;
+            config.weightFile = mExpertWeightFile;
+            config.hotBytes = static_cast<size_t>(mOptions.hotExpertBudget) << 20;
+            config.warmBytes = static_cast<size_t>(mOptions.warmExpertBudget) << 20;
+            mShards = std::make_shared<ExpertShards>(config);
+        }
+        return 0;
+    }
+    // host weights are placed on NUMA nodes before being loaded, placement is shared by clones with the sublayer
+    if (mFlags.expertsOnHost && mSublayer->placement() == nullptr) {
+        mSublayer->setPlacement(std::make_shared<ExpertPlacement>(mExpertCount));
+    }
     mSublayer->initialize();
+#ifdef DEBUG
+    HostAllocator::instance().report(stderr);
+#endif
     return 0;
 }
 
 void MoELayerPlugin::terminate() noexcept {
     dbg(this, "call terminate");
+#ifdef DEBUG
+    if (mGateTokens > 0) {
+        fprintf(stderr, "gate skip: %ld of %ld routed tokens below gate weight %g (%.2f%%)\n",
+                static_cast<long>(mGateSkippedTokens), static_cast<long>(mGateTokens), mOptions.gateSkipThreshold,
+                100 * gateSkipRate());
+    }
+    if (mDedup != nullptr) {
+        auto& stats = mDedup->stats();
+        fprintf(stderr, "token dedup: %ld of %ld routed tokens reused the output of an identical row (%.2f%%)\n",
+                static_cast<long>(stats.duplicates), static_cast<long>(stats.tokens), 100 * stats.hitRate());
+    }
+#endif
     // free centroids on CPU and GPU
     if (mCentroidsCpu != nullptr) {
         delete[] mCentroidsCpu;
@@ -211,6 +407,13 @@ void MoELayerPlugin::terminate() noexcept {
         CUDA_SAFE_CALL(cudaFree(mCentroidsGpu));
         mCentroidsGpu = nullptr;
     }
+    // free centroid index on GPU, the host one is shared with clones
+    for (auto buffer : {static_cast<void*>(mListCentroidsGpu), static_cast<void*>(mSortedCentroidsGpu),
+                        static_cast<void*>(mListOffsetGpu), static_cast<void*>(mListExpertsGpu)}) {
+        if (buffer != nullptr) CUDA_SAFE_CALL(cudaFree(buffer));
+    }
+    mListCentroidsGpu = mSortedCentroidsGpu = nullptr;
+    mListOffsetGpu = mListExpertsGpu = nullptr;
     // free layer norm
     if (mLayernormCpu != nullptr) {
         delete[] mLayernormCpu;
@@ -231,49 +434,101 @@ void MoELayerPlugin::terminate() noexcept {
             CUDA_SAFE_CALL(cudaStreamDestroy(mStreams[i]));
         }
         delete[] mStreams;
+        mStreams = nullptr;
+        CUDA_SAFE_CALL(cudaStreamDestroy(mGatherStream));
+        mGatherStream = nullptr;
+        for (int i = 0; i < mMaxConcurrency; ++i) {
+            CUDA_SAFE_CALL(cudaEventDestroy(mStreamEvents[i]));
+        }
+        delete[] mStreamEvents;
+        mStreamEvents = nullptr;
+        for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+            CUDA_SAFE_CALL(cudaEventDestroy(mRoutedEvents[i]));
+            CUDA_SAFE_CALL(cudaEventDestroy(mGatheredEvents[i]));
+            CUDA_SAFE_CALL(cudaEventDestroy(mCopiedEvents[i]));
+        }
     }
+    // free host buffers
+    mHostBuffer.reset();
+    mDecodeBuffer.reset();
+    // free device tier of expert weights
+    if (mDeviceExperts != nullptr) {
+        CUDA_SAFE_CALL(cudaFree(mDeviceExperts));
+        mDeviceExperts = nullptr;
+        mDeviceExpert.clear();
+        mDeviceExpertVersion.clear();
+    }
+    // stop shard workers once no clone uses them
+    mShards.reset();
     // decrement sublayer ref counter
     mSublayer.reset();
 }
 
-void MoELayerPlugin::ensureSublayerWorkspaceSize(size_t tokenCount) const {
-    mSublayerWorkspacecSize = mSublayer->weightSize() + mSublayer->workspaceSize(tokenCount);
+void MoELayerPlugin::ensureSublayerWorkspaceSize(int microBatchSize) const {
+    mSlotTokens = MoEWorkspaceLayout::slotTokens(microBatchSize, mExpertCount, mAssigner != nullptr);
+    mSublayerWorkspacecSize = mSublayer->weightSize() + mSublayer->workspaceSize(mSlotTokens);
 }
 
-// GPU workspace is consists of:
-// 1. maxConcurrency times of layer workspace (weights + intermedaite variables)
-// 2. MoE buffer, including:
-//     a. token-gate affiliation (token_num * expert_count) where token_num = batch_size * seq_len
-//     b. gate selection (int, token_num)
-//     c. token original position (int, token_num)
-//     d. routed features (token_num * d_model)
-//     e. routed features after expert (token_num * d_model)
-//     f. 2 * coefficient to mix routed features after & before expert (token_num)
-// They will not be simultaneously used, so we take the max of two space
+// GPU workspace is laid out by MoEWorkspaceLayout::plan (runtime/MoEWorkspace.cc)
 size_t MoELayerPlugin::getWorkspaceSize(const PluginTensorDesc* inputs, int32_t nbInputs,
                                         [[maybe_unused]] const PluginTensorDesc* outputs,
                                         int32_t nbOutputs) const noexcept {
-    // the maximum tokens that might go to one single expert
-    // FIXME: currently set to full size
-    assert(nbInputs == 1 && nbOutputs == 1 && inputs[0].dims.nbDims == 3);
+    assert(validInputCount(nbInputs) && nbOutputs == 1 && inputs[0].dims.nbDims == 3);
     auto& input_dim = inputs[0].dims;
     dbg(input_dim.d);
-    size_t batch_size = input_dim.d[0];
-    auto max_single_expert_token_count = static_cast<int32_t>(batch_size * mSequenceLength);
-    ensureSublayerWorkspaceSize(max_single_expert_token_count);
-    auto sublayer_size = mSublayerWorkspacecSize * mMaxConcurrency;
-    // maximum tokens that might be processed by this layer
-    auto max_token_count = batch_size * mSequenceLength;
-    auto plugin_size =
-        (max_token_count * mExpertCount + max_token_count * 2 + max_token_count * mEmbeddingSize * 2) * sizeof(float) +
-        max_token_count * 2 * sizeof(int);
-    auto final_size = plugin_size + sublayer_size;
-    dbg(final_size);
+    // maximum tokens that might be processed by this layer, enqueue carves a smaller share for shorter inputs
+    auto max_token_count = std::max(tokenCount(input_dim), mMaxTokenCount);
+    auto micro_batch_size = microBatchSize(max_token_count);
+    ensureSublayerWorkspaceSize(micro_batch_size);
+    auto depth = micro_batch_size < max_token_count ? PIPELINE_DEPTH : 1;
+    auto layout = MoEWorkspaceLayout::plan(workspaceShape(), micro_batch_size, depth);
+#ifdef DEBUG
+    layout.planner.dump();
+#endif
+    auto final_size = layout.planner.totalSize();
+    dbg(micro_batch_size, final_size, layout.planner.unsharedSize());
     return final_size;
 }
 
-namespace {
-static cudaDeviceProp DEVICE_PROP = cudaDevicePropDontCare;
+int MoELayerPlugin::microBatchSize(int tokenCount) const {
+    if (mOptions.microBatchSize <= 0) return tokenCount;
+    return std::min(mOptions.microBatchSize, tokenCount);
+}
+
+// Must only depend on mSublayerWorkspacecSize and attributes, as getWorkspaceSize and enqueue plan separately.
+MoEWorkspaceShape MoELayerPlugin::workspaceShape() const {
+    MoEWorkspaceShape shape;
+    shape.embeddingSize = mEmbeddingSize;
+    shape.expertCount = mExpertCount;
+    shape.slotSize = mSublayerWorkspacecSize;
+    shape.slotCount = mMaxConcurrency;
+    shape.probeStride = mCentroidIndex != nullptr ? probeStride(mOptions.routingProbes) : 0;
+    shape.scoresTokens = scoresTokens();
+    shape.balanced = mAssigner != nullptr;
+    shape.dedup = mDedup != nullptr;
+    shape.expertsOnHost = mFlags.expertsOnHost;
+    shape.baseLayerOutputMix = mFlags.baseLayerOutputMix;
+    return shape;
+}
+
+void MoELayerPlugin::carveBatchBuffers(MoEBatch& batch, void* workspace, const MoEWorkspaceLayout& layout,
+                                       int slot) const {
+    auto& planner = layout.planner;
+    auto& ids = layout.slots[slot];
+    if (layout.mixCoeff >= 0) batch.mixCoeff = planner.at<float>(workspace, layout.mixCoeff);
+    if (layout.probeLists >= 0) batch.probeLists = planner.at<int>(workspace, layout.probeLists);
+    if (layout.tokenExpertAff >= 0) batch.tokenExpertAff = planner.at<float>(workspace, layout.tokenExpertAff);
+    if (layout.rowHash >= 0) batch.rowHash = planner.at<uint64_t>(workspace, layout.rowHash);
+    batch.gateSelection = planner.at<int>(workspace, ids.gateSelection);
+    if (ids.tokenPos >= 0) {
+        batch.tokenPos = planner.at<int>(workspace, ids.tokenPos);
+        batch.routedFeatures = planner.at<float>(workspace, ids.routedFeatures);
+        batch.postExpertFeatures = planner.at<float>(workspace, ids.postExpertFeatures);
+        batch.routedMixCoeff = planner.at<float>(workspace, ids.routedMixCoeff);
+    }
+    if (ids.duplicates >= 0) batch.duplicates = planner.at<int>(workspace, ids.duplicates);
+    batch.expertCount.assign(mExpertCount, 0);
+    batch.expertOffset.assign(mExpertCount + 1, 0);
 }
 
 int32_t MoELayerPlugin::enqueue(const PluginTensorDesc* inputDesc, [[maybe_unused]] const PluginTensorDesc* outputDesc,
@@ -285,140 +540,675 @@ int32_t MoELayerPlugin::enqueue(const PluginTensorDesc* inputDesc, [[maybe_unuse
     dbg(this);
     ensureCUDAContext();
     ensureGPUWeights();
-    auto batch_size = inputDesc[0].dims.d[0];
-    auto token_num = batch_size * mSequenceLength;
+    // one version of expert weights for the whole call, valid until it returns even if reloaded meanwhile
+    auto weights = mSublayer->readWeights();
+    // token count of this call, not the profile maximum
+    auto token_num = tokenCount(inputDesc[0].dims);
+    auto seq_len = inputDesc[0].dims.d[1];
+    auto padding_input = 1 + routingInputCount();
+    if (routingInputCount() > 0) {
+        auto& routing_dim = inputDesc[1].dims;
+        assert(routing_dim.d[0] == inputDesc[0].dims.d[0] && routing_dim.d[1] == seq_len);
+    }
+    if (mPaddingInputRank > 0) {
+        auto& padding_dim = inputDesc[padding_input].dims;
+        assert(padding_dim.d[0] == inputDesc[0].dims.d[0] && (mPaddingInputRank == 1 || padding_dim.d[1] == seq_len));
+    }
     auto token_len = mEmbeddingSize;
-    ensureSublayerWorkspaceSize(token_num);
-    // dbg(token_num, token_len);
     auto d_layer_input = static_cast<const float*>(inputs[0]);
-    auto d_expert_centroids = static_cast<const float*>(mCentroidsGpu);
-    auto d_layer_norm_weights = static_cast<const float*>(mLayernormGpu);
-    auto moe_buffer =
-        reinterpret_cast<float*>(static_cast<char*>(workspace) + mSublayerWorkspacecSize * mMaxConcurrency);
-    auto d_token_expert_aff = moe_buffer;
-    auto d_gate_selection = reinterpret_cast<int*>(moe_buffer + token_num * mExpertCount);
-    auto d_token_pos = d_gate_selection + token_num;
-    auto d_routed_features = reinterpret_cast<float*>(d_token_pos + token_num);
-    auto d_post_expert_features = d_routed_features + token_num * token_len;
-    auto d_mix_coeff = d_post_expert_features + token_num * token_len;
-    auto d_routed_mix_coeff = d_mix_coeff + token_num;
     auto d_layer_output = static_cast<float*>(outputs[0]);
-
+    // host time of this call drives load shedding, which is all of it with experts on host
+    auto& shedder = LoadShedder::instance();
+    auto start = std::chrono::steady_clock::now();
+    auto record_latency = [&] {
+        if (!shedder.enabled()) return;
+        auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+        shedder.recordLayerLatency(this, elapsed.count(), token_num);
+    };
+    if (decodesOnHost(token_num)) {
+        MoEBatch batch;
+        batch.tokenCount = token_num;
+        batch.sequenceLength = seq_len;
+        batch.weights = weights.table();
+        if (routingInputCount() > 0) batch.routingInput = static_cast<const int*>(inputs[1]);
+        if (mPaddingInputRank == 1) batch.seqLengths = static_cast<const int*>(inputs[padding_input]);
+        if (mPaddingInputRank == 2) batch.tokenMask = static_cast<const int*>(inputs[padding_input]);
+        batch.input = d_layer_input;
+        batch.output = d_layer_output;
+        runDecodeOnHost(batch, stream);
+        record_latency();
+        return 0;
+    }
+    // split into micro-batches, micro-batch i uses the buffers of i % PIPELINE_DEPTH
+    auto micro_batch_size = microBatchSize(token_num);
+    auto batch_count = (token_num + micro_batch_size - 1) / micro_batch_size;
+    auto depth = std::min(batch_count, PIPELINE_DEPTH);
+    ensureSublayerWorkspaceSize(micro_batch_size);
+    dbg(token_num, micro_batch_size, batch_count);
+    auto layout = MoEWorkspaceLayout::plan(workspaceShape(), micro_batch_size, depth);
     CHECK_CUDA_POINTER(d_layer_output);
-    CHECK_CUDA_POINTER(d_mix_coeff);
-    CHECK_CUDA_POINTER(d_post_expert_features);
-    CHECK_CUDA_POINTER(d_routed_features);
 
-    const float* d_affiliation_input = d_layer_input;
+    // host buffer: input, output, token positions & mix coefficients of every micro-batch in flight, followed by
+    // sublayer host workspace of one micro-batch
+    auto feature_size = static_cast<size_t>(micro_batch_size) * token_len * sizeof(float);
+    auto host_slot_size = feature_size * 2 + static_cast<size_t>(micro_batch_size) * (sizeof(int) + sizeof(float));
+    auto token_workspace_size = mSublayer->hostWorkspaceSize(1);
+    if (mFlags.expertsOnHost) ensureHostBuffer(host_slot_size * depth + token_workspace_size * micro_batch_size);
 
-    // 0. pre-process input if needed
-    if (mFlags.layernormOnInputBeforeScore) {
-        dbg("run layernorm on input");
-        CHECK_CUDA_POINTER(d_layer_norm_weights);
-        if (DEVICE_PROP.major == -1) {
-            CUDA_SAFE_CALL(cudaGetDeviceProperties(&DEVICE_PROP, 0));
-            assert(DEVICE_PROP.major >= 6);  // we don't want too old devices
+    std::vector<MoEBatch> batches(batch_count);
+    for (int i = 0; i < batch_count; ++i) {
+        auto& batch = batches[i];
+        auto slot = i % depth;
+        auto first_token = static_cast<size_t>(i) * micro_batch_size;
+        carveBatchBuffers(batch, workspace, layout, slot);
+        batch.tokenCount = std::min<int>(micro_batch_size, token_num - first_token);
+        batch.firstToken = first_token;
+        batch.sequenceLength = seq_len;
+        batch.weights = weights.table();
+        if (routingInputCount() > 0) batch.routingInput = static_cast<const int*>(inputs[1]);
+        if (mPaddingInputRank == 1) batch.seqLengths = static_cast<const int*>(inputs[padding_input]);
+        if (mPaddingInputRank == 2) batch.tokenMask = static_cast<const int*>(inputs[padding_input]);
+        batch.input = d_layer_input + first_token * token_len;
+        batch.output = d_layer_output + first_token * token_len;
+        if (mFlags.expertsOnHost) {
+            auto host_slot = mHostBuffer.data() + host_slot_size * slot;
+            batch.hostInput = reinterpret_cast<float*>(host_slot);
+            batch.hostOutput = reinterpret_cast<float*>(host_slot + feature_size);
+            batch.hostTokenPos = reinterpret_cast<int*>(host_slot + feature_size * 2);
+            if (mFlags.baseLayerOutputMix) {
+                batch.hostMixCoeff = reinterpret_cast<float*>(batch.hostTokenPos + micro_batch_size);
+            }
         }
-        dbg(DEVICE_PROP.maxGridSize);
-        // temporarily use d_routed_features to store input after layernorm
-        layernorm_gpu<float, float>(d_routed_features, d_layer_input, token_num, mEmbeddingSize, (double)1e-6,
-                                    d_layer_norm_weights, nullptr, DEVICE_PROP.maxGridSize[1], stream);
-        d_affiliation_input = d_routed_features;
     }
 
-    // 1. calculate token-expert affiliation
-    // (token_num, token_len) @ (token_len, expert_count)
-    // showCudaArray(d_affiliation_input, token_num, token_len);
-    float alpha = 1.0, beta = 0.0;
+    if (mFlags.expertsOnHost) {
+        runPipelineOnHost(batches, mHostBuffer.data() + host_slot_size * depth, stream);
+    } else {
+        runPipelineOnDevice(batches, layout.planner.at<char>(workspace, layout.sublayerSlots), stream);
+    }
     CUBLAS_SAFE_CALL(cublasSetStream_v2(mCublasHandle, stream));
-    CUBLAS_SAFE_CALL(cublasSgemm_v2(mCublasHandle, CUBLAS_OP_T, CUBLAS_OP_N, mExpertCount, token_num, token_len, &alpha,
-                                    d_expert_centroids, token_len, d_affiliation_input, token_len, &beta,
-                                    d_token_expert_aff, mExpertCount));
-    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    record_latency();
+    return 0;
+}
+
+// layernorm (optional), score, select, count and scatter tokens of one micro-batch, blocking the host until the
+// expert of every token is known (moe_expert_count)
+void MoELayerPlugin::routeTokens(MoEBatch& batch, cudaStream_t stream) {
+    auto token_num = batch.tokenCount;
+    auto token_len = mEmbeddingSize;
+    auto d_expert_centroids = static_cast<const float*>(mCentroidsGpu);
+    auto d_layer_norm_weights = static_cast<const float*>(mLayernormGpu);
+
+    if (scoresTokens()) CHECK_CUDA_POINTER(batch.mixCoeff);
+    if (!mFlags.expertsOnHost) {
+        CHECK_CUDA_POINTER(batch.postExpertFeatures);
+        CHECK_CUDA_POINTER(batch.routedFeatures);
+    }
+
+    // 0. pre-process input if needed & 1. calculate token-expert affiliation & 2. get expert assignments, fused so that
+    // neither layernorm output nor the (token_num, expert_count) affiliation matrix is written to memory
+    // (TODO: support multiple experts for each token)
+    if (mFlags.layernormOnInputBeforeScore) CHECK_CUDA_POINTER(d_layer_norm_weights);
+    auto d_gamma = mFlags.layernormOnInputBeforeScore ? d_layer_norm_weights : nullptr;
+    if (!scoresTokens()) {
+        // no scores: expert from the hash of token id / position or from routing input, nothing to mix
+        if (mFlags.hashRouting) {
+            moe_expert_hash_select(token_num, batch.firstToken, batch.sequenceLength, mExpertCount, batch.routingInput,
+                                   batch.gateSelection, stream);
+        } else {
+            moe_expert_external_select(token_num, batch.firstToken, mExpertCount, batch.routingInput,
+                                       batch.gateSelection, stream);
+        }
+    } else if (mAssigner != nullptr) {
+        // balanced: every score is needed, experts are assigned on host once padding tokens are known
+        // (token_num, token_len) @ (token_len, expert_count)
+        float alpha = 1.0, beta = 0.0;
+        CUBLAS_SAFE_CALL(cublasSetStream_v2(mCublasHandle, stream));
+        CUBLAS_SAFE_CALL(cublasSgemm_v2(mCublasHandle, CUBLAS_OP_T, CUBLAS_OP_N, mExpertCount, token_num, token_len,
+                                        &alpha, d_expert_centroids, token_len, batch.input, token_len, &beta,
+                                        batch.tokenExpertAff, mExpertCount));
+        CUDA_SAFE_CALL(cudaMemsetAsync(batch.gateSelection, 0, token_num * sizeof(int), stream));
+    } else if (mCentroidIndex != nullptr) {
+        // approximate: best lists of centroid index first, then only the experts of these lists
+        auto probe_stride = probeStride(mOptions.routingProbes);
+        moe_expert_fused_gate_topk(token_num, token_len, mOptions.routingLists, probe_stride, batch.input,
+                                   mListCentroidsGpu, d_gamma, (double)1e-6, batch.probeLists, nullptr, stream);
+        moe_expert_probe_top1(token_num, token_len, mOptions.routingProbes, probe_stride, batch.probeLists,
+                              mListOffsetGpu, mListExpertsGpu, mSortedCentroidsGpu, batch.input, d_gamma,
+                              (double)1e-6, batch.gateSelection, batch.mixCoeff, stream);
+    } else {
+        moe_expert_fused_gate_topk(token_num, token_len, mExpertCount, 1, batch.input, d_expert_centroids, d_gamma,
+                                   (double)1e-6, batch.gateSelection, batch.mixCoeff, stream);
+    }
+
+    // padding tokens are left out of sorting, so experts, scatter & gather only process valid tokens
+    if (batch.seqLengths != nullptr || batch.tokenMask != nullptr) {
+        moe_expert_mask_padding(token_num, batch.firstToken, batch.sequenceLength, batch.seqLengths, batch.tokenMask,
+                                batch.gateSelection, stream);
+    }
+    if (mAssigner != nullptr) assignTokensOnHost(batch, stream);
+    // tokens of low gate weight skip their expert before they are sorted, by threshold then under overload
+    if (mOptions.gateSkipThreshold > 0) {
+        moe_expert_skip_low_gate(token_num, gateSkipScore(), batch.mixCoeff, batch.gateSelection, stream);
+    }
+    auto shed = LoadShedder::instance().enabled() ? shedTokens(batch, stream) : 0;
 
-    // dbg("after affiliation");
-    // showCudaArray(d_token_expert_aff, token_num, mExpertCount);
-    // showArray(static_cast<const float*>(mExpertCentroidsCPU.values), mExpertCount, token_len);
-    // showCudaArray(d_expert_centroids, mExpertCount, token_len);
-
-    // 2. get expert assignments (TODO: support multiple experts for each token)
-    moe_expert_select(token_num, mExpertCount, d_token_expert_aff, d_gate_selection, d_mix_coeff, stream);
-    // dbg("after select");
-    // showCudaArray(d_mix_coeff, 1, token_num);
-
-    // 3. count & sort & gather (a.k.a. shuffle) tokens for each expert
-    auto expert_offset = new int[mExpertCount + 1](), expert_count = new int[mExpertCount]();
-    expert_offset[mExpertCount] = token_num;
-    moe_expert_count(token_num, mExpertCount, d_gate_selection, d_token_pos, expert_count, expert_offset, stream);
-    // dbg("after count");
-    moe_expert_scatter(token_num, token_len, d_layer_input, d_mix_coeff, d_token_pos, d_routed_features,
-                       d_routed_mix_coeff, stream);
-    // dbg("after scatter");
+    // row hashes reach host along with gate selection, as moe_expert_count waits for the stream
+    auto host_token_pos = batch.hostTokenPos;
+    if (mDedup != nullptr) {
+        mHostRowHash.resize(2 * static_cast<size_t>(token_num));
+        moe_expert_row_hash(token_num, token_len, batch.input, batch.rowHash, stream);
+        CUDA_SAFE_CALL(cudaMemcpyAsync(mHostRowHash.data(), batch.rowHash, mHostRowHash.size() * sizeof(uint64_t),
+                                       cudaMemcpyDeviceToHost, stream));
+        if (host_token_pos == nullptr) {
+            mDedupTokenPos.resize(token_num);
+            host_token_pos = mDedupTokenPos.data();
+        }
+    }
+
+    // 3. count & sort & gather (a.k.a. shuffle) tokens for each expert, experts on host only need the positions
+    std::fill(batch.expertCount.begin(), batch.expertCount.end(), 0);
+    int skipped = 0;
+    batch.routedTokenCount = moe_expert_count(token_num, mExpertCount, batch.gateSelection,
+                                              mDedup != nullptr ? nullptr : batch.tokenPos, batch.expertCount.data(),
+                                              batch.expertOffset.data(), stream, host_token_pos, &skipped);
+    dbg(token_num, batch.routedTokenCount);
+    if (mOptions.gateSkipThreshold > 0) recordGateSkip(batch.routedTokenCount + skipped, skipped - shed);
+    if (mDedup != nullptr) dedupTokens(batch, host_token_pos, stream);
+    recordRouting(batch.expertCount.data());
+    if (mReplicator != nullptr) batch.expertReplicas = mReplicator->replicas();
+    if (batch.routedTokenCount > 0 && !mFlags.expertsOnHost) {
+        moe_expert_scatter(batch.routedTokenCount, token_len, batch.input, batch.mixCoeff, batch.tokenPos,
+                           batch.routedFeatures, batch.routedMixCoeff, stream);
+    }
     // showCudaArray(d_routed_features, token_num, token_len);
     // showCudaArray(d_routed_mix_coeff, 1, token_num);
+}
 
-    // 4. run each expert: state = sublayer.run(state) (skip expert with empty data)
-    int next_expert = 0;  // skip all expert with no work to do
-    while (expert_count[next_expert] == 0 && next_expert < mExpertCount) next_expert++;
-    assert(next_expert < mExpertCount);
-
-    mSublayer->copyWeights(workspace, next_expert, mStreams[0]);
-    // dbg("after first copy");
+// copy scores & padding marks to host, solve the balanced assignment on the shared pool, then copy expert & score of
+// each token back to gate selection & mix coefficient
+void MoELayerPlugin::assignTokensOnHost(MoEBatch& batch, cudaStream_t stream) {
+    auto token_num = batch.tokenCount;
+    mHostScores.resize(static_cast<size_t>(token_num) * mExpertCount);
+    mHostSelection.resize(token_num);
+    mHostMixCoeff.resize(token_num);
+    CUDA_SAFE_CALL(cudaMemcpyAsync(mHostScores.data(), batch.tokenExpertAff, mHostScores.size() * sizeof(float),
+                                   cudaMemcpyDeviceToHost, stream));
+    CUDA_SAFE_CALL(cudaMemcpyAsync(mHostSelection.data(), batch.gateSelection, token_num * sizeof(int),
+                                   cudaMemcpyDeviceToHost, stream));
+    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    auto report = mAssigner->assign(mHostScores.data(), token_num, mExpertCount, mHostSelection.data(),
+                                    mHostMixCoeff.data());
+    dbg(report.tokenCount, report.capacity, report.loss(), report.maxLoad, report.greedyMaxLoad, report.rounds);
+    CUDA_SAFE_CALL(cudaMemcpyAsync(batch.gateSelection, mHostSelection.data(), token_num * sizeof(int),
+                                   cudaMemcpyHostToDevice, stream));
+    CUDA_SAFE_CALL(cudaMemcpyAsync(batch.mixCoeff, mHostMixCoeff.data(), token_num * sizeof(float),
+                                   cudaMemcpyHostToDevice, stream));
+}
 
+// under overload, tokens beyond the capacity of their expert or of low gate weight skip it (see LoadShedder): gate
+// selection (& scores of base layer) copied to host, skipped tokens marked there and copied back
+int MoELayerPlugin::shedTokens(MoEBatch& batch, cudaStream_t stream) {
+    auto policy = LoadShedder::instance().policy();
+    if (!policy.active()) return 0;
+    auto token_num = batch.tokenCount;
+    auto gate_score = mFlags.baseLayerOutputMix && scoresTokens();
+    mHostSelection.resize(token_num);
+    mHostMixCoeff.resize(token_num);
+    CUDA_SAFE_CALL(cudaMemcpyAsync(mHostSelection.data(), batch.gateSelection, token_num * sizeof(int),
+                                   cudaMemcpyDeviceToHost, stream));
+    if (gate_score) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(mHostMixCoeff.data(), batch.mixCoeff, token_num * sizeof(float),
+                                       cudaMemcpyDeviceToHost, stream));
+    }
     CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    auto skipped = LoadShedder::instance().shed(policy, token_num, mExpertCount, mHostSelection.data(),
+                                                gate_score ? mHostMixCoeff.data() : nullptr,
+                                                mSublayer->flopsPerToken());
+    dbg(token_num, skipped);
+    if (skipped > 0) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(batch.gateSelection, mHostSelection.data(), token_num * sizeof(int),
+                                       cudaMemcpyHostToDevice, stream));
+    }
+    return skipped;
+}
+
+float MoELayerPlugin::gateSkipScore() const {
+    auto threshold = mOptions.gateSkipThreshold;
+    return std::log(threshold / (1 - threshold));
+}
+
+// skipped tokens take their input as output, which is off the exact output by at most threshold times the
+// contribution of their expert
+void MoELayerPlugin::recordGateSkip(int tokenCount, int skippedCount) {
+    mGateTokens += tokenCount;
+    mGateSkippedTokens += skippedCount;
+    dbg(tokenCount, skippedCount, gateSkipRate());
+}
 
-    // TODO: port dynamic scheduling code to public source
-    // i: expert index, j: expert (with non-empty features) index
-    for (int i = next_expert, j = 0; i < mExpertCount; i = next_expert, j++) {
-        auto current_token_offset = expert_offset[i];
-        auto workspace_byte = reinterpret_cast<char*>(workspace);
-        auto current_idx = j % mMaxConcurrency;
-        auto next_idx = (j + 1) % mMaxConcurrency;
-        auto current_stream = mStreams[current_idx];
-        auto next_stream = mStreams[next_idx];
-        auto current_workspace = workspace_byte + mSublayerWorkspacecSize * current_idx;
-        auto next_workspace = workspace_byte + mSublayerWorkspacecSize * next_idx;
-        CUDA_SAFE_CALL(cudaStreamSynchronize(next_stream));
-        // start copying weights to next expert
-        next_expert = i + 1;
-        while (expert_count[next_expert] == 0 && next_expert < mExpertCount) next_expert++;
-        if (next_expert < mExpertCount) {
-            mSublayer->copyWeights(next_workspace, next_expert, next_stream);
+// drop tokens of rows already routed to the same expert from the sorted token positions, then copy them (& the
+// duplicates to fan out after gather) to device for experts on device
+void MoELayerPlugin::dedupTokens(MoEBatch& batch, int* hostTokenPos, cudaStream_t stream) {
+    auto routed = batch.routedTokenCount;
+    batch.routedTokenCount = mDedup->dedup(mExpertCount, batch.expertCount.data(), batch.expertOffset.data(),
+                                           hostTokenPos, mHostRowHash.data(), batch.hostDuplicates);
+    dbg(routed, batch.routedTokenCount, mDedup->stats().hitRate());
+    if (mFlags.expertsOnHost) return;
+    if (batch.routedTokenCount > 0) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(batch.tokenPos, hostTokenPos, batch.routedTokenCount * sizeof(int),
+                                       cudaMemcpyHostToDevice, stream));
+    }
+    if (!batch.hostDuplicates.empty()) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(batch.duplicates, batch.hostDuplicates.data(),
+                                       batch.hostDuplicates.size() * sizeof(int), cudaMemcpyHostToDevice, stream));
+    }
+}
+
+// 6. (optional) mix features before & after expert
+// 7. unshuffle results
+void MoELayerPlugin::gatherTokens(const MoEBatch& batch, cudaStream_t stream) {
+    if (batch.routedTokenCount > 0) {
+        if (mFlags.baseLayerOutputMix) {
+            moe_expert_base_layer_fused_mix_and_gather(batch.routedTokenCount, mEmbeddingSize, batch.tokenPos,
+                                                       batch.routedFeatures, batch.postExpertFeatures,
+                                                       batch.routedMixCoeff, batch.output, stream);
+        } else {
+            moe_expert_gather(batch.routedTokenCount, mEmbeddingSize, batch.postExpertFeatures, batch.tokenPos,
+                              batch.output, stream);
         }
-        // run expert on corresponding input / output buffer
-        CUBLAS_SAFE_CALL(cublasSetStream_v2(mCublasHandle, current_stream));
-        dbg(i);
-        mSublayer->run(expert_count[i], current_workspace, d_routed_features + current_token_offset,
-                       d_post_expert_features + current_token_offset, current_workspace + mSublayer->weightSize(),
-                       current_stream);
     }
+    if (!batch.hostDuplicates.empty()) {
+        moe_expert_fan_out(batch.hostDuplicates.size() / 2, mEmbeddingSize, batch.duplicates, batch.output, stream);
+    }
+    fillPadding(batch, stream);
+}
 
-    // 5. free CPU buffer & synchronize all streams
-    delete[] expert_offset;
-    delete[] expert_count;
-    for (int i = 0; i < mMaxConcurrency; ++i) {
-        CUDA_SAFE_CALL(cudaStreamSynchronize(mStreams[i]));
+// 8. fill output of padding tokens, and of tokens that skipped their expert (input of base layer, zeros otherwise)
+void MoELayerPlugin::fillPadding(const MoEBatch& batch, cudaStream_t stream) {
+    if (batch.routedTokenCount < batch.tokenCount) {
+        moe_expert_fill_padding(batch.tokenCount, mEmbeddingSize, batch.gateSelection,
+                                mFlags.passThroughPadding ? batch.input : nullptr,
+                                mFlags.baseLayerOutputMix ? batch.input : nullptr, batch.output, stream);
     }
-    CUBLAS_SAFE_CALL(cublasSetStream_v2(mCublasHandle, stream));
+}
+
+// routing frequency drives the device tier, host replicas and hot expert replication here, and the tiers of host
+// weights in the sublayer
+void MoELayerPlugin::recordRouting(const int* expertTokenCount) {
+    if (mReplicator != nullptr) mReplicator->record(expertTokenCount);
+    if (mOptions.deviceExperts > 0 || mOptions.replicatedExperts > 0) {
+        mRoutingFrequency.resize(mExpertCount, 0.0);
+        for (int i = 0; i < mExpertCount; ++i) {
+            mRoutingFrequency[i] = mRoutingFrequency[i] * ExpertStore::FREQUENCY_DECAY + expertTokenCount[i];
+        }
+    }
+    mSublayer->recordRouting(expertTokenCount);
+}
+
+// keep the deviceExperts most routed experts so far (the first ones before any routing) in the device tier, copying
+// reloaded weights again. Copies are ordered on stream before routing, hence before experts of this call, and after
+// experts of previous calls that may still read replaced blocks.
+void MoELayerPlugin::refreshDeviceExperts(const ExpertWeightTable& weights, cudaStream_t stream) {
+    auto block_count = std::min(mOptions.deviceExperts, mExpertCount);
+    auto block_size = mSublayer->weightSize();
+    if (mDeviceExperts == nullptr) {
+        CUDA_SAFE_CALL(cudaMalloc(&mDeviceExperts, block_size * block_count));
+        mDeviceExpert.assign(block_count, -1);
+        mDeviceExpertVersion.assign(block_count, 0);
+    }
+    auto hottest = hottestExperts(block_count);
+    bool waited = false;
+    for (auto expert : hottest) {
+        auto version = weights.versions[expert];
+        auto block = std::find(mDeviceExpert.begin(), mDeviceExpert.end(), expert);
+        if (block != mDeviceExpert.end() && mDeviceExpertVersion[block - mDeviceExpert.begin()] == version) continue;
+        // replace a block whose expert left the hottest ones
+        if (block == mDeviceExpert.end()) {
+            block = std::find_if(mDeviceExpert.begin(), mDeviceExpert.end(), [&](int e) {
+                return e == -1 || std::find(hottest.begin(), hottest.end(), e) == hottest.end();
+            });
+        }
+        assert(block != mDeviceExpert.end());
+        if (!waited && *block != -1) {
+            for (int k = 0; k < mMaxConcurrency; ++k) CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, mStreamEvents[k], 0));
+            waited = true;
+        }
+        dbg(expert, *block, version);
+        mSublayer->copyWeights(weights, mDeviceExperts + block_size * (block - mDeviceExpert.begin()), expert, stream);
+        *block = expert;
+        mDeviceExpertVersion[block - mDeviceExpert.begin()] = version;
+    }
+}
+
+// resident blocks of the device tier are copied again by the next enqueue of each clone, which sees their expert
+// version bumped. Experts run by worker processes are out of reach
+int MoELayerPlugin::reloadExperts(const std::vector<int>& experts, const char* weightFile) {
+    if (mShards != nullptr) {
+        fprintf(stderr, "ERROR: cannot reload weights of experts sharded across worker processes\n");
+        return -1;
+    }
+    assert(mSublayer != nullptr);
+    std::vector<int> all(mExpertCount);
+    std::iota(all.begin(), all.end(), 0);
+    auto reloaded = mSublayer->reloadExperts(experts.empty() ? all : experts, weightFile);
+    dbg(reloaded, mSublayer->weightVersion());
+    return reloaded;
+}
+
+// the count most routed experts so far, the first ones before any routing
+std::vector<int> MoELayerPlugin::hottestExperts(int count) {
+    mRoutingFrequency.resize(mExpertCount, 0.0);
+    std::vector<int> hottest(mExpertCount);
+    std::iota(hottest.begin(), hottest.end(), 0);
+    std::stable_sort(hottest.begin(), hottest.end(),
+                     [&](int a, int b) { return mRoutingFrequency[a] > mRoutingFrequency[b]; });
+    hottest.resize(std::min(count, mExpertCount));
+    return hottest;
+}
+
+// keep the replicatedExperts most routed experts replicated on every NUMA node (nothing to do on a single node). As
+// copying an expert to every node costs as much as reading it many times, a replicated expert only leaves the set for
+// one clearly more routed. Called before experts of an enqueue call run, after those of the previous one are done.
+void MoELayerPlugin::refreshReplicatedExperts(const ExpertWeightTable& weights) {
+    auto& placement = mSublayer->placement();
+    if (placement == nullptr || !placement->numa()) return;
+    auto hottest = hottestExperts(mOptions.replicatedExperts);
+    if (mReplicatedExperts.empty()) mReplicatedExperts = hottest;
+    for (auto expert : hottest) {
+        if (std::find(mReplicatedExperts.begin(), mReplicatedExperts.end(), expert) != mReplicatedExperts.end()) {
+            continue;
+        }
+        auto coldest = std::min_element(mReplicatedExperts.begin(), mReplicatedExperts.end(), [&](int a, int b) {
+            return mRoutingFrequency[a] < mRoutingFrequency[b];
+        });
+        if (mRoutingFrequency[expert] > REPLICA_HYSTERESIS * mRoutingFrequency[*coldest]) *coldest = expert;
+    }
+    mSublayer->replicateExperts(weights, mReplicatedExperts);
+}
+
+// enqueue every expert with tokens on the expert streams without blocking the host. Each slot (weights +
+// intermediate variables) belongs to one stream, so stream order alone keeps a slot from being overwritten while in
+// use. Experts still resident in a slot from the previous micro-batch are not copied again, others take slots round
+// robin (starting from nextSlot). Experts of the device tier are run from there, only taking the intermediate
+// variables of a slot. A slot holds intermediate variables of mSlotTokens tokens, more tokens of an expert run in
+// chunks one after the other on its stream.
+void MoELayerPlugin::launchExpertsOnDevice(const MoEBatch& batch, void* sublayerSlots, std::vector<int>& slotExpert,
+                                           int& nextSlot) {
+    auto workspace_byte = reinterpret_cast<char*>(sublayerSlots);
+    std::vector<bool> taken(mMaxConcurrency);
+    for (int i = 0; i < mExpertCount; ++i) {
+        auto count = batch.expertCount[i];
+        if (count == 0) continue;
+        auto block = std::find(mDeviceExpert.begin(), mDeviceExpert.end(), i) - mDeviceExpert.begin();
+        auto resident = block < static_cast<int>(mDeviceExpert.size());
+        // a replicated expert runs a slice of its tokens in each of several slots
+        auto replicas = batch.expertReplicas.empty() ? 1 : batch.expertReplicas[i];
+        auto parts = std::min({replicas, mMaxConcurrency, count});
+        std::fill(taken.begin(), taken.end(), false);
+        for (int part = 0; part < parts; ++part) {
+            int slot = 0;
+            while (slot < mMaxConcurrency && (taken[slot] || slotExpert[slot] != i)) ++slot;
+            auto reuse = slot < mMaxConcurrency;
+            if (!reuse) {
+                while (taken[nextSlot]) nextSlot = (nextSlot + 1) % mMaxConcurrency;
+                slot = nextSlot;
+                nextSlot = (nextSlot + 1) % mMaxConcurrency;
+            }
+            taken[slot] = true;
+            auto slot_stream = mStreams[slot];
+            auto slot_workspace = workspace_byte + mSublayerWorkspacecSize * slot;
+            auto weights = resident ? mDeviceExperts + mSublayer->weightSize() * block : slot_workspace;
+            if (!reuse && !resident) {
+                mSublayer->copyWeights(*batch.weights, slot_workspace, i, slot_stream);
+                slotExpert[slot] = i;
+            }
+            // run expert on corresponding input / output buffer
+            auto begin = count * part / parts, end = count * (part + 1) / parts;
+            CUBLAS_SAFE_CALL(cublasSetStream_v2(mCublasHandle, slot_stream));
+            dbg(i, part, slot, reuse, resident);
+            for (auto chunk = begin; chunk < end; chunk += mSlotTokens) {
+                auto token_offset = static_cast<size_t>(batch.expertOffset[i] + chunk) * mEmbeddingSize;
+                mSublayer->run(std::min(end - chunk, mSlotTokens), weights, batch.routedFeatures + token_offset,
+                               batch.postExpertFeatures + token_offset, slot_workspace + mSublayer->weightSize(),
+                               slot_stream);
+            }
+        }
+    }
+}
+
+// micro-batches flow through three stages, at step i:
+//     stream:         route(i + 1), after gather(i + 1 - PIPELINE_DEPTH) released its buffers
+//     expert streams: experts(i), after route(i)
+//     gather stream:  gather(i), after experts(i)
+// The host only blocks in moe_expert_count of route(i + 1), while experts(i) and gather(i - 1) keep the GPU busy.
+// Without micro-batching this degenerates to the sequential route / experts / gather.
+void MoELayerPlugin::runPipelineOnDevice(std::vector<MoEBatch>& batches, void* sublayerSlots, cudaStream_t stream) {
+    auto batch_count = static_cast<int>(batches.size());
+    // workspace content does not outlive an enqueue call, so no expert is resident at start
+    std::vector<int> slot_expert(mMaxConcurrency, -1);
+    int next_slot = 0;
+    if (mOptions.deviceExperts > 0) refreshDeviceExperts(*batches[0].weights, stream);
+
+    routeTokens(batches[0], stream);
+    CUDA_SAFE_CALL(cudaEventRecord(mRoutedEvents[0], stream));
+    for (int i = 0; i < batch_count; ++i) {
+        auto event = i % PIPELINE_DEPTH;
+        // 4. run each expert: state = sublayer.run(state) (skip expert with empty data)
+        for (int k = 0; k < mMaxConcurrency; ++k) {
+            CUDA_SAFE_CALL(cudaStreamWaitEvent(mStreams[k], mRoutedEvents[event], 0));
+        }
+        launchExpertsOnDevice(batches[i], sublayerSlots, slot_expert, next_slot);
+        for (int k = 0; k < mMaxConcurrency; ++k) {
+            CUDA_SAFE_CALL(cudaEventRecord(mStreamEvents[k], mStreams[k]));
+            CUDA_SAFE_CALL(cudaStreamWaitEvent(mGatherStream, mStreamEvents[k], 0));
+        }
+        // route next micro-batch while experts are running
+        if (i + 1 < batch_count) {
+            auto next_event = (i + 1) % PIPELINE_DEPTH;
+            if (i + 1 >= PIPELINE_DEPTH) CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, mGatheredEvents[next_event], 0));
+            routeTokens(batches[i + 1], stream);
+            CUDA_SAFE_CALL(cudaEventRecord(mRoutedEvents[next_event], stream));
+        }
+        gatherTokens(batches[i], mGatherStream);
+        CUDA_SAFE_CALL(cudaEventRecord(mGatheredEvents[event], mGatherStream));
+    }
+    // gather stream is in order, waiting for the last gather covers all of them
+    CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, mGatheredEvents[(batch_count - 1) % PIPELINE_DEPTH], 0));
+}
+
+// plan & run two-level (inter-expert x intra-expert) parallel work of one micro-batch on the shared pool, each
+// expert using the slice of host workspace at its token offset
+void MoELayerPlugin::runExpertsOnHost(const MoEBatch& batch, char* hostWorkspace) {
+    if (mShards != nullptr) {
+        mShards->run(batch.expertCount.data(), batch.expertOffset.data(), batch.hostTokenPos, batch.hostInput,
+                     batch.hostMixCoeff, batch.hostOutput);
+        return;
+    }
+    // host workspace of sublayer must grow linearly with token count
+    auto token_workspace_size = mSublayer->hostWorkspaceSize(1);
+    auto plan = mScheduler->plan(mExpertCount, batch.expertCount.data(), batch.expertOffset.data(),
+                                 batch.expertReplicas.empty() ? nullptr : batch.expertReplicas.data());
+    mScheduler->execute(plan, [&](const ExpertScheduler::WorkItem& item) {
+        mSublayer->runHostIndexed(*batch.weights, item.expert, item.tokenCount,
+                                  batch.hostTokenPos + item.tokenOffset, batch.hostInput, batch.hostOutput,
+                                  batch.hostMixCoeff, hostWorkspace + token_workspace_size * item.tokenOffset,
+                                  item.parallelism);
+    });
+}
+
+// same stages as runPipelineOnDevice with experts on the pool, at step i:
+//     pool:           experts(i)
+//     calling thread: route(i + 1) and copy its input (& mix coefficients) to host
+//     gather stream:  copy output of experts(i) to device and fill its padding
+// Tokens are neither scattered before nor gathered after experts: the first GEMM of each expert reads its tokens from
+// the input through token positions, and the last one writes (and mixes) results to their place in the output.
+void MoELayerPlugin::runPipelineOnHost(std::vector<MoEBatch>& batches, char* hostWorkspace, cudaStream_t stream) {
+    auto batch_count = static_cast<int>(batches.size());
+    if (mScheduler == nullptr) {
+        mScheduler = std::make_unique<ExpertScheduler>(mSublayer->weightSize(), mSublayer->flopsPerToken(),
+                                                       ThreadPool::instance(), mSublayer->placement());
+    }
+    if (mOptions.replicatedExperts > 0) refreshReplicatedExperts(*batches[0].weights);
+    auto route_and_fetch = [&](int i) {
+        auto& batch = batches[i];
+        routeTokens(batch, stream);
+        if (batch.routedTokenCount > 0) {
+            auto feature_size = static_cast<size_t>(batch.tokenCount) * mEmbeddingSize * sizeof(float);
+            CUDA_SAFE_CALL(
+                cudaMemcpyAsync(batch.hostInput, batch.input, feature_size, cudaMemcpyDeviceToHost, stream));
+            if (batch.hostMixCoeff != nullptr) {
+                CUDA_SAFE_CALL(cudaMemcpyAsync(batch.hostMixCoeff, batch.mixCoeff, batch.tokenCount * sizeof(float),
+                                               cudaMemcpyDeviceToHost, stream));
+            }
+        }
+        CUDA_SAFE_CALL(cudaEventRecord(mRoutedEvents[i % PIPELINE_DEPTH], stream));
+    };
+
+    route_and_fetch(0);
+    for (int i = 0; i < batch_count; ++i) {
+        auto event = i % PIPELINE_DEPTH;
+        auto& batch = batches[i];
+        CUDA_SAFE_CALL(cudaEventSynchronize(mRoutedEvents[event]));
+        // host buffer after expert is still being copied to device for micro-batch i - PIPELINE_DEPTH
+        if (i >= PIPELINE_DEPTH) CUDA_SAFE_CALL(cudaEventSynchronize(mCopiedEvents[event]));
+        TaskGroup experts;
+        experts.run([&] { runExpertsOnHost(batch, hostWorkspace); });
+        if (i + 1 < batch_count) {
+            auto next_event = (i + 1) % PIPELINE_DEPTH;
+            if (i + 1 >= PIPELINE_DEPTH) CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, mGatheredEvents[next_event], 0));
+            route_and_fetch(i + 1);
+        }
+        experts.wait();
+        // duplicates take the output of their representative before it is copied to device
+        if (!batch.hostDuplicates.empty()) {
+            fan_out_rows_cpu(batch.hostDuplicates.size() / 2, mEmbeddingSize, batch.hostDuplicates.data(),
+                             batch.hostOutput, ThreadPool::instance().workerCount());
+        }
+        // the first stage on gather stream must also come after earlier work on stream (which route(i) followed)
+        CUDA_SAFE_CALL(cudaStreamWaitEvent(mGatherStream, mRoutedEvents[event], 0));
+        // rows of padding tokens are left as is on host, then overwritten on device
+        if (batch.routedTokenCount > 0) {
+            auto feature_size = static_cast<size_t>(batch.tokenCount) * mEmbeddingSize * sizeof(float);
+            CUDA_SAFE_CALL(cudaMemcpyAsync(batch.output, batch.hostOutput, feature_size, cudaMemcpyHostToDevice,
+                                           mGatherStream));
+        }
+        CUDA_SAFE_CALL(cudaEventRecord(mCopiedEvents[event], mGatherStream));
+        fillPadding(batch, mGatherStream);
+        CUDA_SAFE_CALL(cudaEventRecord(mGatheredEvents[event], mGatherStream));
+    }
+    CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, mGatheredEvents[(batch_count - 1) % PIPELINE_DEPTH], 0));
+}
 
-    // 6. (optional) mix features before & after expert
-    // 7. unshuffle results
-    // dbg("before gather");
-    if (mFlags.baseLayerOutputMix) {
-        moe_expert_base_layer_fused_mix_and_gather(token_num, token_len, d_token_pos, d_routed_features,
-                                                   d_post_expert_features, d_routed_mix_coeff, d_layer_output, stream);
+// one copy of the tokens to host, routing (top-1 gating, hash or external) & experts on host, one copy back. Compared
+// with the pipeline, there is no kernel launch, no workspace, a single stream synchronization and no allocation.
+// Workers of the pool are kept spinning between calls, as the next decoding step comes back within microseconds.
+void MoELayerPlugin::runDecodeOnHost(const MoEBatch& batch, cudaStream_t stream) {
+    auto token_num = batch.tokenCount;
+    auto token_len = mEmbeddingSize;
+    ThreadPool::instance().keepAwake();
+    ensureDecodeBuffers();
+    if (mOptions.replicatedExperts > 0) refreshReplicatedExperts(*batch.weights);
+    auto feature_size = sizeof(float) * DECODE_TOKENS * token_len;
+    auto host_input = mDecodeBuffer.data<float>();
+    auto host_output = reinterpret_cast<float*>(mDecodeBuffer.data() + feature_size);
+    auto host_routing = reinterpret_cast<int*>(mDecodeBuffer.data() + feature_size * 2);
+    auto host_padding = host_routing + DECODE_TOKENS;
+    auto host_workspace = reinterpret_cast<char*>(host_padding + DECODE_TOKENS);
+
+    // output of the previous call may still be copied to device
+    CUDA_SAFE_CALL(cudaEventSynchronize(mCopiedEvents[0]));
+    CUDA_SAFE_CALL(cudaMemcpyAsync(host_input, batch.input, sizeof(float) * token_num * token_len,
+                                   cudaMemcpyDeviceToHost, stream));
+    if (batch.routingInput != nullptr) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(host_routing, batch.routingInput, sizeof(int) * token_num,
+                                       cudaMemcpyDeviceToHost, stream));
+    }
+    // sequence lengths: one per sequence, token mask: one per token
+    auto padding = batch.seqLengths != nullptr ? batch.seqLengths : batch.tokenMask;
+    if (padding != nullptr) {
+        auto count = batch.seqLengths != nullptr ? token_num / batch.sequenceLength : token_num;
+        CUDA_SAFE_CALL(
+            cudaMemcpyAsync(host_padding, padding, sizeof(int) * count, cudaMemcpyDeviceToHost, stream));
+    }
+    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+
+    auto selection = mDecodeSelection.data();
+    auto score = mDecodeScore.data();
+    if (mFlags.externalRouting) {
+        select_without_scores_cpu(token_num, 0, batch.sequenceLength, mExpertCount, nullptr, host_routing, selection);
+    } else if (mFlags.hashRouting) {
+        select_without_scores_cpu(token_num, 0, batch.sequenceLength, mExpertCount,
+                                  mFlags.hashOnPosition ? nullptr : host_routing, nullptr, selection);
     } else {
-        moe_expert_gather(token_num, token_len, d_routed_features, d_token_pos, d_layer_output, stream);
+        gate_topk_cpu(host_input, token_num, token_len, mCentroidsCpu, mExpertCount,
+                      mFlags.layernormOnInputBeforeScore ? mLayernormCpu : nullptr, 1e-6, 1, selection, score, 1);
+    }
+    if (padding != nullptr) {
+        mask_padding_cpu(token_num, 0, batch.sequenceLength, batch.seqLengths != nullptr ? host_padding : nullptr,
+                         batch.tokenMask != nullptr ? host_padding : nullptr, selection);
+    }
+    auto mix_coeff = mFlags.baseLayerOutputMix && scoresTokens() ? score : nullptr;
+    auto gate_skipped = 0, shed = 0;
+    if (mOptions.gateSkipThreshold > 0) gate_skipped = skip_low_gate_cpu(token_num, gateSkipScore(), score, selection);
+    auto& shedder = LoadShedder::instance();
+    if (shedder.enabled()) {
+        auto policy = shedder.policy();
+        if (policy.active()) {
+            shed = shedder.shed(policy, token_num, mExpertCount, selection, mix_coeff, mSublayer->flopsPerToken());
+        }
+    }
+    auto token_pos = mDecodeTokenPos.data();
+    auto routed = count_tokens_cpu(token_num, mExpertCount, selection, token_pos, mDecodeExpertCount.data(),
+                                   mDecodeExpertOffset.data());
+    dbg(token_num, routed);
+    if (mOptions.gateSkipThreshold > 0) recordGateSkip(routed + gate_skipped + shed, gate_skipped);
+    if (mDedup != nullptr) {
+        mHostRowHash.resize(2 * token_num);
+        row_hash_cpu(token_num, token_len, host_input, mHostRowHash.data());
+        auto unique = mDedup->dedup(mExpertCount, mDecodeExpertCount.data(), mDecodeExpertOffset.data(), token_pos,
+                                    mHostRowHash.data(), mDecodeDuplicates);
+        dbg(routed, unique);
     }
-    // showCudaArray(d_layer_output, token_num, token_len);
+    recordRouting(mDecodeExpertCount.data());
 
-    return 0;
+    if (mShards != nullptr) {
+        mShards->run(mDecodeExpertCount.data(), mDecodeExpertOffset.data(), token_pos, host_input, mix_coeff,
+                     host_output);
+    } else {
+        auto token_workspace_size = mSublayer->hostWorkspaceSize(1);
+        auto plan = mScheduler->plan(mExpertCount, mDecodeExpertCount.data(), mDecodeExpertOffset.data(),
+                                     mReplicator != nullptr ? mReplicator->replicas().data() : nullptr);
+        mScheduler->execute(plan, [&](const ExpertScheduler::WorkItem& item) {
+            mSublayer->runHostIndexed(*batch.weights, item.expert, item.tokenCount, token_pos + item.tokenOffset,
+                                      host_input, host_output, mix_coeff,
+                                      host_workspace + token_workspace_size * item.tokenOffset, item.parallelism);
+        });
+    }
+    if (mDedup != nullptr && !mDecodeDuplicates.empty()) {
+        fan_out_rows_cpu(mDecodeDuplicates.size() / 2, token_len, mDecodeDuplicates.data(), host_output, 1);
+    }
+    // padding & skipped tokens, as moe_expert_fill_padding
+    for (int i = 0; routed < token_num && i < token_num; ++i) {
+        if (selection[i] >= 0) continue;
+        auto row = host_output + static_cast<size_t>(i) * token_len;
+        auto pass_through = selection[i] == -1 ? mFlags.passThroughPadding : mFlags.baseLayerOutputMix;
+        if (pass_through) {
+            memcpy(row, host_input + static_cast<size_t>(i) * token_len, sizeof(float) * token_len);
+        } else {
+            std::fill(row, row + token_len, 0.0f);
+        }
+    }
+    CUDA_SAFE_CALL(cudaMemcpyAsync(batch.output, host_output, sizeof(float) * token_num * token_len,
+                                   cudaMemcpyHostToDevice, stream));
+    CUDA_SAFE_CALL(cudaEventRecord(mCopiedEvents[0], stream));
 }
 
 size_t MoELayerPlugin::getSerializationSize() const noexcept {
     auto total_size =
-        METADATA_LENGTH + strlen(mExpertWeightFile) + strlen(mSublayerType) + centroidsSize() * sizeof(float);
-    if (mLayernormCpu != nullptr) total_size += sizeof(float) * mEmbeddingSize;
+        METADATA_LENGTH + serializedStringsSize(mExpertWeightFile, mSublayerType) + centroidsSize() * sizeof(float);
+    // layer norm weights are only kept when used
+    if (mFlags.layernormOnInputBeforeScore) total_size += sizeof(float) * mEmbeddingSize;
+    if (mOptions.routingLists > 0) total_size += sizeof(int) * mExpertCount;
     return total_size;
 }
 
@@ -433,27 +1223,30 @@ void MoELayerPlugin::serialize(void* buffer) const noexcept {
     auto sublayer_type_len = strlen(mSublayerType);
     *int_buffer++ = expert_weight_file_len;
     *int_buffer++ = sublayer_type_len;
-    // flag
+    // flag & options
     auto flag_buffer = reinterpret_cast<MoEFlags*>(int_buffer);
     *flag_buffer++ = mFlags;
+    auto option_buffer = reinterpret_cast<MoEOptions*>(flag_buffer);
+    *option_buffer++ = mOptions;
     // 2 strings
-    auto char_buffer = reinterpret_cast<char*>(flag_buffer);
+    auto char_buffer = reinterpret_cast<char*>(option_buffer);
+    memset(char_buffer, 0, serializedStringsSize(mExpertWeightFile, mSublayerType));
     strcpy(char_buffer, mExpertWeightFile);
-    char_buffer += expert_weight_file_len + 1;
-    strcpy(char_buffer, mSublayerType);
-    char_buffer += sublayer_type_len + 1;
-    auto string_size = expert_weight_file_len + sublayer_type_len + 2;
-    // align to 8 byte
-    if (string_size % 8 != 0) {
-        char_buffer += 8 - (string_size % 8);
-    }
+    strcpy(char_buffer + expert_weight_file_len + 1, mSublayerType);
+    // aligned to 8 byte
+    char_buffer += serializedStringsSize(mExpertWeightFile, mSublayerType);
     // centroids
-    auto float_buffer = reinterpret_cast<int64_t*>(char_buffer);
+    auto float_buffer = reinterpret_cast<float*>(char_buffer);
     memcpy(float_buffer, mCentroidsCpu, centroidsSize() * sizeof(float));
     float_buffer += centroidsSize();
     // layer norm
-    if (mLayernormCpu != nullptr) {
+    if (mFlags.layernormOnInputBeforeScore) {
         memcpy(float_buffer, mLayernormCpu, mEmbeddingSize * sizeof(float));
+        float_buffer += mEmbeddingSize;
+    }
+    // centroid index
+    if (mOptions.routingLists > 0) {
+        memcpy(float_buffer, mCentroidIndex->assignment().data(), mExpertCount * sizeof(int));
     }
 }
 
@@ -8,7 +8,17 @@
 
 #include <memory>
 #include <array>
+#include <vector>
 
+#include "runtime/BalancedAssignment.h"
+#include "runtime/CentroidIndex.h"
+#include "runtime/ExpertReplicator.h"
+#include "runtime/ExpertScheduler.h"
+#include "runtime/ExpertShards.h"
+#include "runtime/HostAllocator.h"
+#include "runtime/LoadShedder.h"
+#include "runtime/TokenDedup.h"
+#include "runtime/MoEWorkspace.h"
 #include "sublayers/SubLayer.h"
 
 using namespace nvinfer1;
@@ -29,17 +39,103 @@ namespace moe_variant {
 [[maybe_unused]] static const char* BASE_LAYER{"base_layer"}; // no preprocess on input, mix expert-output with input by sigmoid(score)
 [[maybe_unused]] static const char* CPM_2{"cpm_2"}; // score = layernorm(input) @ centroid, no mix
 [[maybe_unused]] static const char* DEFAULT{"default"}; // no preprocess on input, no mix
+[[maybe_unused]] static const char* HASH_LAYER{"hash_layer"}; // expert = hash(token id or position), no centroids, no mix
+[[maybe_unused]] static const char* EXTERNAL_ROUTING{"external_routing"}; // expert of each token given as input, no centroids, no mix
 } // namespace moe_variant
 
+namespace expert_backend {
+[[maybe_unused]] static const char* GPU{"gpu"}; // experts run on GPU, weights copied to device slot by slot
+[[maybe_unused]] static const char* CPU{"cpu"}; // experts run on host on the shared ThreadPool, weights stay in host memory
+} // namespace expert_backend
+
+
+namespace padding_output {
+[[maybe_unused]] static const char* ZERO{"zero"}; // output of padding tokens is filled with zeros
+[[maybe_unused]] static const char* INPUT{"input"}; // input of padding tokens is passed through to output
+} // namespace padding_output
+
+
+namespace hash_key {
+[[maybe_unused]] static const char* TOKEN_ID{"token_id"}; // hash of token ids given as second input
+[[maybe_unused]] static const char* POSITION{"position"}; // hash of the position of each token in its sequence
+} // namespace hash_key
+
+
+namespace balanced_assignment {
+[[maybe_unused]] static const char* NONE{"none"}; // greedy top-1 routing, experts take any number of tokens
+[[maybe_unused]] static const char* GREEDY{"greedy"}; // equal capacity per expert, tokens of higher regret choose first
+[[maybe_unused]] static const char* AUCTION{"auction"}; // equal capacity per expert, near-optimal total score
+} // namespace balanced_assignment
+
 
 // store behaviour flags of MoE layers
-struct MoEFlags {
+struct alignas(4) MoEFlags {
     bool layernormOnInputBeforeScore = false;
     bool baseLayerOutputMix= false;
-    uint16_t padding = 0;
+    bool expertsOnHost = false;
+    bool passThroughPadding = false;
+    // routing without centroids
+    bool hashRouting = false;
+    bool hashOnPosition = false;
+    bool externalRouting = false;
+};
+
+static_assert(sizeof(MoEFlags) == 8);
+
+// numeric tunables of MoE layers, serialized right after MoEFlags
+struct MoEOptions {
+    int32_t microBatchSize = 0; // tokens per micro-batch of the enqueue pipeline, 0 to run the batch as a whole
+    int32_t routingLists = 0; // lists of the centroid index for approximate routing, 0 to score all experts
+    int32_t routingProbes = 0; // lists probed by each token, resolved when the index is built
+    int32_t balancedAssignment = BalancedAssignment::NONE; // algorithm of capacity-constrained routing
+    int32_t hotExpertBudget = 0; // MiB of uncompressed expert weights in host memory, 0 to keep every expert
+    int32_t warmExpertBudget = 0; // MiB of compressed expert weights in host memory, with hotExpertBudget only
+    int32_t deviceExperts = 0; // most routed experts kept on device across enqueue calls (experts on GPU)
+    int32_t replicatedExperts = 0; // most routed experts replicated on every NUMA node (experts on CPU)
+    float replicationThreshold = 0; // load (to mean load) above which experts run as several replicas, 0 to disable
+    int32_t expertShards = 0; // worker processes loading & running a range of experts each, 0 to run them here
+    float gateSkipThreshold = 0; // gate weight below which base layer tokens skip their expert, 0 to route all
+    int32_t tokenDedup = 0; // run bit-identical rows routed to the same expert once (TokenDedup), 0 to disable
 };
 
-static_assert(sizeof(MoEFlags) == 4);
+// buffers and routing result of one micro-batch (the whole batch when pipelining is off)
+struct MoEBatch {
+    int tokenCount = 0;
+    int firstToken = 0; // index of first token of this micro-batch in the whole batch
+    const float *input = nullptr; // first token of this micro-batch in layer input / output
+    float *output = nullptr;
+    // token ids (hash routing) or experts (external routing) of the whole batch, from the second layer input
+    const int *routingInput = nullptr;
+    // optional last layer input telling padding tokens apart, at most one is set (whole batch)
+    const int *seqLengths = nullptr;
+    const int *tokenMask = nullptr;
+    int sequenceLength = 0;
+    int routedTokenCount = 0; // tokens that are not padding
+    // expert weights read by the whole enqueue call (see MoESubLayer::readWeights), nullptr with expert shards
+    const ExpertWeightTable *weights = nullptr;
+    // device buffers
+    int *gateSelection = nullptr;
+    int *tokenPos = nullptr;
+    float *routedFeatures = nullptr;
+    float *postExpertFeatures = nullptr;
+    float *mixCoeff = nullptr;
+    int *probeLists = nullptr;
+    float *tokenExpertAff = nullptr;
+    float *routedMixCoeff = nullptr;
+    uint64_t *rowHash = nullptr; // token deduplication only
+    int *duplicates = nullptr; // (duplicate, representative) pairs, token deduplication only
+    // page-locked host buffers, only used when experts run on host: tokens stay in their order, experts read and
+    // write them through hostTokenPos
+    float *hostInput = nullptr;
+    float *hostOutput = nullptr;
+    int *hostTokenPos = nullptr;
+    float *hostMixCoeff = nullptr; // base layer only
+    // filled by moe_expert_count
+    std::vector<int> expertCount;
+    std::vector<int> expertOffset;
+    std::vector<int> expertReplicas; // replicas of each expert when routed, with replication only
+    std::vector<int> hostDuplicates; // (duplicate, representative) pairs, with token deduplication only
+};
 
 
 class MoELayerPlugin : public IPluginV2DynamicExt  {
@@ -50,6 +146,13 @@ class MoELayerPlugin : public IPluginV2DynamicExt  {
     const char* mPluginNamespace = nullptr;
     cublasHandle_t mCublasHandle = nullptr;
     cudaStream_t* mStreams = nullptr;
+    // micro-batch pipeline: gather runs on its own stream, events order stages of different micro-batches
+    constexpr const static int PIPELINE_DEPTH = 2;
+    cudaStream_t mGatherStream = nullptr;
+    cudaEvent_t* mStreamEvents = nullptr;  // one per expert stream
+    cudaEvent_t mRoutedEvents[PIPELINE_DEPTH] = {};
+    cudaEvent_t mGatheredEvents[PIPELINE_DEPTH] = {};
+    cudaEvent_t mCopiedEvents[PIPELINE_DEPTH] = {};
 
     // layer parameters
     int mExpertCount;
@@ -58,27 +161,122 @@ class MoELayerPlugin : public IPluginV2DynamicExt  {
     int mMaxConcurrency;  // maximum number of sublayers on GPU memory
     float *mCentroidsCpu = nullptr, *mCentroidsGpu = nullptr;
     float *mLayernormCpu = nullptr, *mLayernormGpu = nullptr;
+    // approximate routing, immutable once built so shared by clones
+    std::shared_ptr<const CentroidIndex> mCentroidIndex = nullptr;
+    float *mListCentroidsGpu = nullptr, *mSortedCentroidsGpu = nullptr;
+    int *mListOffsetGpu = nullptr, *mListExpertsGpu = nullptr;
     const char *mExpertWeightFile, *mSublayerType;
     MoEFlags mFlags; // store other flags
+    MoEOptions mOptions;
 
     // sublayer related
     std::shared_ptr<MoESubLayer> mSublayer = nullptr;
     mutable size_t mSublayerWorkspacecSize;
+    mutable int mSlotTokens = 0; // tokens a sub-layer slot runs at once, see MoEWorkspaceLayout::slotTokens
+
+    // page-locked host buffer for host execution of experts
+    HostMemory mHostBuffer;
+    std::unique_ptr<ExpertScheduler> mScheduler = nullptr;
+    // expert parallelism: experts are loaded & run by worker processes instead of the sublayer (experts on CPU),
+    // shared by clones with the sublayer
+    std::shared_ptr<ExpertShards> mShards = nullptr;
+    // decoding (experts on host, at most DECODE_TOKENS tokens): routed on host in buffers kept between calls
+    constexpr const static int DECODE_TOKENS = 64;
+    HostMemory mDecodeBuffer; // page-locked input, output, routing input & padding input, then sublayer workspace
+    std::vector<int> mDecodeSelection, mDecodeTokenPos, mDecodeExpertCount, mDecodeExpertOffset, mDecodeDuplicates;
+    std::vector<float> mDecodeScore;
+
+    // device tier of expert weights: blocks of the most routed experts, kept between enqueue calls
+    char *mDeviceExperts = nullptr;
+    std::vector<int> mDeviceExpert; // expert in each block, -1 if none
+    std::vector<uint64_t> mDeviceExpertVersion; // version of the weight table copied to each block
+    std::vector<double> mRoutingFrequency; // routed tokens of each expert, decaying with every batch
+
+    // host experts replicated on every NUMA node, replaced when others become REPLICA_HYSTERESIS times as routed
+    constexpr const static double REPLICA_HYSTERESIS = 1.5;
+    std::vector<int> mReplicatedExperts;
+
+    // hot expert replication: load of each expert & its replica count, copied into each batch when routed. Replicas of
+    // a device expert take separate slots, of a host expert separate token chunks (at most MAX_HOST_REPLICAS)
+    constexpr const static int MAX_HOST_REPLICAS = 8;
+    std::unique_ptr<ExpertReplicator> mReplicator = nullptr;
+
+    // balanced assignment (& load shedding): scores copied to host, expert & score of each token copied back
+    std::unique_ptr<BalancedAssignment> mAssigner = nullptr;
+    std::vector<float> mHostScores, mHostMixCoeff;
+    std::vector<int> mHostSelection;
+
+    // confidence-based skipping (gate_skip_threshold): routed tokens & those that skipped their expert for a low gate
+    // weight, since the layer was created
+    int64_t mGateTokens = 0, mGateSkippedTokens = 0;
+
+    // token deduplication (dedup_tokens): row hashes of a batch copied to host, where token positions are compacted
+    // (for experts on device, sorted into mDedupTokenPos then copied to device along with duplicates)
+    std::unique_ptr<TokenDedup> mDedup = nullptr;
+    std::vector<uint64_t> mHostRowHash;
+    std::vector<int> mDedupTokenPos;
 
-    // inferred from network
-    int mSequenceLength = -1;
+    // inferred from network: most tokens of one enqueue call allowed by the optimization profile
+    int mMaxTokenCount = -1;
+    // rank of the optional padding input: 0 (absent), 1 (sequence lengths) or 2 (token mask)
+    int mPaddingInputRank = 0;
+    // routing by token scores against centroids, otherwise by hash or external routing
+    bool scoresTokens() const { return !mFlags.hashRouting && !mFlags.externalRouting; }
+    // routing input of shape (batch_size, seq_len) right after token features: token ids or experts
+    int routingInputCount() const { return mFlags.externalRouting || (mFlags.hashRouting && !mFlags.hashOnPosition); }
+    // token features, routing input (if any) and the optional padding input
+    bool validInputCount(int nbInputs) const {
+        return nbInputs == 1 + routingInputCount() || nbInputs == 2 + routingInputCount();
+    }
     void ensureGPUWeights();
-    void ensureSublayerWorkspaceSize(size_t tokenCount) const;
+    // size slots of sub-layers for micro-batches of microBatchSize tokens
+    void ensureSublayerWorkspaceSize(int microBatchSize) const;
     void createSublayer();
+    void createAssigner();
+    void createReplicator();
     void ensureCUDAContext();
-    size_t centroidsSize() const { return mEmbeddingSize * mExpertCount; }
+    void ensureHostBuffer(size_t size);
+    void ensureDecodeBuffers();
+    // small batches skip the micro-batch pipeline, except for routing that needs the GPU (index, balanced)
+    bool decodesOnHost(int tokenCount) const {
+        return mFlags.expertsOnHost && tokenCount <= DECODE_TOKENS && mCentroidIndex == nullptr && mAssigner == nullptr;
+    }
+    // tokens per micro-batch for a batch of tokenCount tokens
+    int microBatchSize(int tokenCount) const;
+    // batch_size * seq_len of a (batch_size, seq_len, d_model) input
+    static int tokenCount(const Dims& dims) { return dims.d[0] * dims.d[1]; }
+    // what the workspace depends on besides micro-batches, after ensureSublayerWorkspaceSize
+    MoEWorkspaceShape workspaceShape() const;
+    void carveBatchBuffers(MoEBatch& batch, void* workspace, const MoEWorkspaceLayout& layout, int slot) const;
+    void routeTokens(MoEBatch& batch, cudaStream_t stream);
+    void assignTokensOnHost(MoEBatch& batch, cudaStream_t stream);
+    // returns skipped tokens
+    int shedTokens(MoEBatch& batch, cudaStream_t stream);
+    // gate score whose sigmoid is gateSkipThreshold
+    float gateSkipScore() const;
+    void recordGateSkip(int tokenCount, int skippedCount);
+    void dedupTokens(MoEBatch& batch, int* hostTokenPos, cudaStream_t stream);
+    void recordRouting(const int* expertTokenCount);
+    void refreshDeviceExperts(const ExpertWeightTable& weights, cudaStream_t stream);
+    std::vector<int> hottestExperts(int count);
+    void refreshReplicatedExperts(const ExpertWeightTable& weights);
+    void launchExpertsOnDevice(const MoEBatch& batch, void* sublayerSlots, std::vector<int>& slotExpert, int& nextSlot);
+    void runExpertsOnHost(const MoEBatch& batch, char* hostWorkspace);
+    void gatherTokens(const MoEBatch& batch, cudaStream_t stream);
+    void fillPadding(const MoEBatch& batch, cudaStream_t stream);
+    void runPipelineOnDevice(std::vector<MoEBatch>& batches, void* sublayerSlots, cudaStream_t stream);
+    void runPipelineOnHost(std::vector<MoEBatch>& batches, char* hostWorkspace, cudaStream_t stream);
+    void runDecodeOnHost(const MoEBatch& batch, cudaStream_t stream);
+    size_t centroidsSize() const { return scoresTokens() ? mEmbeddingSize * mExpertCount : 0; }
     constexpr const static size_t METADATA_LENGTH = sizeof(mExpertCount) + sizeof(mEmbeddingSize) + sizeof(mHiddenSize) +
-                                                    sizeof(mMaxConcurrency) + sizeof(mFlags) + sizeof(int) * 2;
+                                                    sizeof(mMaxConcurrency) + sizeof(mFlags) + sizeof(mOptions) +
+                                                    sizeof(int) * 2;
 
    public:
     // constructor for MoELayerPluginCreator
     explicit MoELayerPlugin(const char* layerName, int expertCount, int embeddingSize, int hiddenSize, int maxConcurrency,
-                            float *centroidsCpu, float *layernormCpu, const char* expertWeightFile, const char* sublayerType, const MoEFlags flags);
+                            float *centroidsCpu, float *layernormCpu, const char* expertWeightFile, const char* sublayerType, const MoEFlags flags,
+                            const MoEOptions options, std::shared_ptr<const CentroidIndex> centroidIndex = nullptr);
     // constructor for clone
     explicit MoELayerPlugin(const MoELayerPlugin& src);
     // constructor for deserialization
@@ -87,6 +285,17 @@ class MoELayerPlugin : public IPluginV2DynamicExt  {
     virtual ~MoELayerPlugin();
     // parse flags from variant
     static MoEFlags parseFlags(const char* moeVariant);
+    // share of routed tokens that skipped their expert for a gate weight below gate_skip_threshold
+    double gateSkipRate() const { return mGateTokens > 0 ? static_cast<double>(mGateSkippedTokens) / mGateTokens : 0; }
+    // share of routed tokens that reused the expert output of an identical row, with dedup_tokens
+    double dedupHitRate() const { return mDedup != nullptr ? mDedup->stats().hitRate() : 0; }
+    // hot swap of expert weights while serving, thread-safe against enqueue of this layer & its clones: reread experts
+    // (every one if empty) from weightFile, expert_weight_file if null, only reading those whose arrays changed.
+    // Calls in flight finish on the weights they started with (see MoESubLayer::reloadExperts). Returns experts
+    // reloaded, -1 (weights unchanged) on failure
+    int reloadExperts(const std::vector<int>& experts = {}, const char* weightFile = nullptr);
+    // bumped by every reload changing some experts
+    uint64_t weightVersion() const { return mSublayer != nullptr ? mSublayer->weightVersion() : 0; }
     // overloaded virtual functions from IPluginV2
     const char* getPluginType() const noexcept override { return ::MOE_LAYER_PLUGIN_NAME; };
     const char* getPluginVersion() const noexcept override { return ::MOE_LAYER_PLUGIN_VERSION; }
@@ -136,7 +345,7 @@ class MoELayerPlugin : public IPluginV2DynamicExt  {
 class MoELayerPluginCreator : public IPluginCreator {
    private:
     const char* mPluginNamespace = nullptr;
-    const static std::array<PluginField, 9> mPluginAttributes;
+    const static std::array<PluginField, 26> mPluginAttributes;
     const static PluginFieldCollection mFC;
 
    public:
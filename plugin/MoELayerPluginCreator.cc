@@ -3,9 +3,12 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include "MoELayerPlugin.h"
+#include "host/ops.h"
+#include "thirdparty/cnpy/cnpy.h"
 #include "thirdparty/dbg.h"
 #include "utility.h"
 
@@ -22,10 +25,27 @@ const char *EXPERT_WEIGHT_FILE{"expert_weight_file"};
 const char *EXPERT_SUBLAYER_TYPE{"expert_sublayer_type"};
 const char *MOE_VARIANT{"moe_variant"};
 const char *LAYERNORM_WEIGHT{"layernorm_weight"};
+const char *EXPERT_BACKEND{"expert_backend"};
+const char *MICRO_BATCH_SIZE{"micro_batch_size"};
+const char *PADDING_OUTPUT{"padding_output"};
+const char *ROUTING_LISTS{"routing_lists"};
+const char *ROUTING_PROBES{"routing_probes"};
+const char *ROUTING_RECALL{"routing_recall"};
+const char *ROUTING_CALIBRATION_FILE{"routing_calibration_file"};
+const char *BALANCED_ASSIGNMENT{"balanced_assignment"};
+const char *HASH_KEY{"hash_key"};
+const char *HOT_EXPERT_BUDGET{"hot_expert_budget"};
+const char *WARM_EXPERT_BUDGET{"warm_expert_budget"};
+const char *DEVICE_EXPERTS{"device_experts"};
+const char *REPLICATED_EXPERTS{"replicated_experts"};
+const char *REPLICATION_THRESHOLD{"replication_threshold"};
+const char *EXPERT_SHARDS{"expert_shards"};
+const char *GATE_SKIP_THRESHOLD{"gate_skip_threshold"};
+const char *DEDUP_TOKENS{"dedup_tokens"};
 }  // namespace field_name
 
 // static class member
-const std::array<PluginField, 9> MoELayerPluginCreator::mPluginAttributes{
+const std::array<PluginField, 26> MoELayerPluginCreator::mPluginAttributes{
     // count of experts
     PluginField{field_name::EXPERT_COUNT, nullptr, PluginFieldType::kINT32, 1},
     // embedding size
@@ -44,6 +64,40 @@ const std::array<PluginField, 9> MoELayerPluginCreator::mPluginAttributes{
     PluginField{field_name::MOE_VARIANT, moe_variant::CPM_2, PluginFieldType::kUNKNOWN, 1},
     // type of MoE variant
     PluginField{field_name::LAYERNORM_WEIGHT, nullptr, PluginFieldType::kFLOAT32, 1},
+    // where experts are executed
+    PluginField{field_name::EXPERT_BACKEND, expert_backend::GPU, PluginFieldType::kUNKNOWN, 1},
+    // tokens per micro-batch of the enqueue pipeline (0 to disable)
+    PluginField{field_name::MICRO_BATCH_SIZE, nullptr, PluginFieldType::kINT32, 1},
+    // output of padding tokens (when padding input is given)
+    PluginField{field_name::PADDING_OUTPUT, padding_output::ZERO, PluginFieldType::kUNKNOWN, 1},
+    // lists of centroid index for approximate routing (0 to score all experts)
+    PluginField{field_name::ROUTING_LISTS, nullptr, PluginFieldType::kINT32, 1},
+    // lists probed by each token (0 to calibrate)
+    PluginField{field_name::ROUTING_PROBES, nullptr, PluginFieldType::kINT32, 1},
+    // agreement with exact routing to reach when calibrating
+    PluginField{field_name::ROUTING_RECALL, nullptr, PluginFieldType::kFLOAT32, 1},
+    // recorded layer inputs to calibrate on
+    PluginField{field_name::ROUTING_CALIBRATION_FILE, nullptr, PluginFieldType::kUNKNOWN, 1},
+    // capacity-constrained routing (base_layer & default variants)
+    PluginField{field_name::BALANCED_ASSIGNMENT, balanced_assignment::NONE, PluginFieldType::kUNKNOWN, 1},
+    // what hash_layer hashes into experts
+    PluginField{field_name::HASH_KEY, hash_key::TOKEN_ID, PluginFieldType::kUNKNOWN, 1},
+    // MiB of uncompressed expert weights kept in host memory (0 to keep all)
+    PluginField{field_name::HOT_EXPERT_BUDGET, nullptr, PluginFieldType::kINT32, 1},
+    // MiB of compressed expert weights kept in host memory
+    PluginField{field_name::WARM_EXPERT_BUDGET, nullptr, PluginFieldType::kINT32, 1},
+    // most routed experts kept on device across calls
+    PluginField{field_name::DEVICE_EXPERTS, nullptr, PluginFieldType::kINT32, 1},
+    // most routed experts replicated on every NUMA node (experts on CPU)
+    PluginField{field_name::REPLICATED_EXPERTS, nullptr, PluginFieldType::kINT32, 1},
+    // load (to mean load) above which an expert runs as several replicas (0 to disable)
+    PluginField{field_name::REPLICATION_THRESHOLD, nullptr, PluginFieldType::kFLOAT32, 1},
+    // worker processes loading & running a range of experts each (experts on CPU, 0 to run them in this process)
+    PluginField{field_name::EXPERT_SHARDS, nullptr, PluginFieldType::kINT32, 1},
+    // gate weight below which base_layer tokens skip their expert (0 to route all)
+    PluginField{field_name::GATE_SKIP_THRESHOLD, nullptr, PluginFieldType::kFLOAT32, 1},
+    // run bit-identical tokens routed to the same expert once (0 or 1)
+    PluginField{field_name::DEDUP_TOKENS, nullptr, PluginFieldType::kINT32, 1},
 };
 
 const PluginFieldCollection MoELayerPluginCreator::mFC{MoELayerPluginCreator::mPluginAttributes.size(),
@@ -55,6 +109,47 @@ MoELayerPluginCreator::~MoELayerPluginCreator() {}
 
 const PluginFieldCollection *MoELayerPluginCreator::getFieldNames() noexcept { return &mFC; }
 
+namespace {
+// build centroid index of approximate routing, and calibrate it on recorded inputs (array `input` of shape
+// (..., d_model) in a npz file) if given: options.routingProbes is set to the fewest probes reaching the recall target
+std::shared_ptr<const CentroidIndex> buildCentroidIndex(const float *centroids, int expertCount, int embeddingSize,
+                                                        const float *layernormWeight, MoEOptions &options,
+                                                        float recall, const char *calibrationFile) {
+    if (options.routingLists < CentroidIndex::MAX_PROBES || options.routingLists > expertCount) {
+        fprintf(stderr, "ERROR: routing lists must be in [%d, expert_count], got %d\n", CentroidIndex::MAX_PROBES,
+                options.routingLists);
+        assert(false);
+    }
+    if (options.routingProbes == 0 && calibrationFile == nullptr) {
+        fprintf(stderr, "ERROR: routing lists require either routing probes or a calibration file\n");
+        assert(false);
+    }
+    auto index = std::make_shared<CentroidIndex>(centroids, expertCount, embeddingSize, options.routingLists);
+    if (calibrationFile == nullptr) return index;
+
+    auto input = cnpy::npz_load(calibrationFile, "input");
+    assert(input.word_size == sizeof(float) && !input.fortran_order);
+    assert(!input.shape.empty() && input.shape.back() == static_cast<size_t>(embeddingSize));
+    auto count = static_cast<int32_t>(input.num_vals / embeddingSize);
+    std::vector<float> queries(input.data<float>(), input.data<float>() + input.num_vals);
+    if (layernormWeight != nullptr) {
+        layernorm_cpu(queries.data(), input.data<float>(), count, embeddingSize, 1e-6, layernormWeight, nullptr);
+    }
+    double achieved;
+    if (options.routingProbes == 0) {
+        options.routingProbes = index->calibrate(queries.data(), count, 1, recall, &achieved);
+    } else {
+        achieved = index->recall(queries.data(), count, 1, options.routingProbes);
+    }
+    fprintf(stderr, "routing index: %d lists, %d probes, agreement with exact routing %.4f on %d recorded tokens\n",
+            options.routingLists, options.routingProbes, achieved, count);
+    if (achieved < recall) {
+        fprintf(stderr, "WARNING: routing index does not reach recall target %.4f\n", recall);
+    }
+    return index;
+}
+}  // namespace
+
 IPluginV2 *MoELayerPluginCreator::createPlugin(const char *name, const PluginFieldCollection *fc) noexcept {
 
     dbg("invoke createPlugin with name", name);
@@ -68,6 +163,13 @@ IPluginV2 *MoELayerPluginCreator::createPlugin(const char *name, const PluginFie
     char *weight_file = nullptr;
     char *sublayer = nullptr;
     char *variant = nullptr;
+    char *backend = nullptr;
+    char *padding = nullptr;
+    char *calibration_file = nullptr;
+    char *assignment = nullptr;
+    char *hash = nullptr;
+    float routing_recall = 0.95f;
+    MoEOptions options;
     int centroid_length;
     int layernorm_length;
 
@@ -108,6 +210,61 @@ IPluginV2 *MoELayerPluginCreator::createPlugin(const char *name, const PluginFie
             layernorm_length = field.length;
             layernorm_weight = new float[field.length];
             memcpy(layernorm_weight, field.data, field.length * sizeof(float));
+        } else if (strcmp(name, field_name::EXPERT_BACKEND) == 0) {
+            dbg(static_cast<const char *>(field.data));
+            assert(field.length > 0 && field.data != nullptr);
+            backend = strdup(static_cast<const char *>(field.data));
+        } else if (strcmp(name, field_name::MICRO_BATCH_SIZE) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.microBatchSize = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::PADDING_OUTPUT) == 0) {
+            dbg(static_cast<const char *>(field.data));
+            assert(field.length > 0 && field.data != nullptr);
+            padding = strdup(static_cast<const char *>(field.data));
+        } else if (strcmp(name, field_name::ROUTING_LISTS) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.routingLists = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::ROUTING_PROBES) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.routingProbes = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::ROUTING_RECALL) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            routing_recall = *static_cast<const float *>(field.data);
+        } else if (strcmp(name, field_name::ROUTING_CALIBRATION_FILE) == 0) {
+            assert(field.length > 0 && field.data != nullptr);
+            calibration_file = strdup(static_cast<const char *>(field.data));
+        } else if (strcmp(name, field_name::BALANCED_ASSIGNMENT) == 0) {
+            dbg(static_cast<const char *>(field.data));
+            assert(field.length > 0 && field.data != nullptr);
+            assignment = strdup(static_cast<const char *>(field.data));
+        } else if (strcmp(name, field_name::HASH_KEY) == 0) {
+            dbg(static_cast<const char *>(field.data));
+            assert(field.length > 0 && field.data != nullptr);
+            hash = strdup(static_cast<const char *>(field.data));
+        } else if (strcmp(name, field_name::HOT_EXPERT_BUDGET) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.hotExpertBudget = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::WARM_EXPERT_BUDGET) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.warmExpertBudget = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::DEVICE_EXPERTS) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.deviceExperts = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::REPLICATED_EXPERTS) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.replicatedExperts = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::REPLICATION_THRESHOLD) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.replicationThreshold = *static_cast<const float *>(field.data);
+        } else if (strcmp(name, field_name::EXPERT_SHARDS) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.expertShards = *static_cast<const int *>(field.data);
+        } else if (strcmp(name, field_name::GATE_SKIP_THRESHOLD) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.gateSkipThreshold = *static_cast<const float *>(field.data);
+        } else if (strcmp(name, field_name::DEDUP_TOKENS) == 0) {
+            assert(field.length == 1 && field.data != nullptr);
+            options.tokenDedup = *static_cast<const int *>(field.data);
         } else {
             fprintf(stderr, "unknown field name in PluginFieldCollection: %s\n", name);
             assert(false);
@@ -119,10 +276,28 @@ IPluginV2 *MoELayerPluginCreator::createPlugin(const char *name, const PluginFie
     assert(expert_count > 0);
     assert(hidden_size > 0);
     assert(max_concurrency > 0);
-    assert(centroid_length == embedding_size * expert_count);
-    assert(expert_centroids != nullptr);
+    assert(options.microBatchSize >= 0);
+    assert(options.routingLists >= 0);
+    assert(options.routingProbes >= 0 && options.routingProbes <= CentroidIndex::MAX_PROBES);
+    assert(routing_recall > 0 && routing_recall <= 1);
+    assert(options.hotExpertBudget >= 0 && options.warmExpertBudget >= 0);
+    assert(options.deviceExperts >= 0 && options.deviceExperts <= expert_count);
+    assert(options.replicatedExperts >= 0 && options.replicatedExperts <= expert_count);
+    assert(options.replicationThreshold == 0 || options.replicationThreshold > 1);
+    assert(options.expertShards >= 0 && options.expertShards <= expert_count);
+    assert(options.gateSkipThreshold >= 0 && options.gateSkipThreshold < 1);
+    assert(options.tokenDedup == 0 || options.tokenDedup == 1);
     assert(sublayer != nullptr);
     assert(variant != nullptr);
+    auto flags = MoELayerPlugin::parseFlags(variant);
+    // hash & external routing need no centroids
+    if (!flags.hashRouting && !flags.externalRouting) {
+        assert(centroid_length == embedding_size * expert_count);
+        assert(expert_centroids != nullptr);
+    } else if (options.routingLists > 0) {
+        fprintf(stderr, "ERROR: routing lists require routing by centroids, got moe variant %s\n", variant);
+        assert(false);
+    }
     if (layernorm_weight != nullptr) {
         assert(layernorm_length == embedding_size);
     }
@@ -139,9 +314,85 @@ IPluginV2 *MoELayerPluginCreator::createPlugin(const char *name, const PluginFie
         assert(false);
     }
 
-    auto flags = MoELayerPlugin::parseFlags(variant);
+    if (hash != nullptr) {
+        if (strcmp(hash, hash_key::POSITION) == 0) {
+            flags.hashOnPosition = true;
+        } else if (strcmp(hash, hash_key::TOKEN_ID) != 0) {
+            fprintf(stderr, "ERROR: unsupported hash key: %s\n", hash);
+            assert(false);
+        }
+        if (!flags.hashRouting) {
+            fprintf(stderr, "ERROR: hash key is only used by moe variant %s\n", moe_variant::HASH_LAYER);
+            assert(false);
+        }
+    }
+    if (backend != nullptr) {
+        if (strcmp(backend, expert_backend::CPU) == 0) {
+            flags.expertsOnHost = true;
+        } else if (strcmp(backend, expert_backend::GPU) != 0) {
+            fprintf(stderr, "ERROR: unsupported expert backend: %s\n", backend);
+            assert(false);
+        }
+    }
+    if (padding != nullptr) {
+        if (strcmp(padding, padding_output::INPUT) == 0) {
+            flags.passThroughPadding = true;
+        } else if (strcmp(padding, padding_output::ZERO) != 0) {
+            fprintf(stderr, "ERROR: unsupported padding output: %s\n", padding);
+            assert(false);
+        }
+    }
+    if (assignment != nullptr) {
+        if (strcmp(assignment, balanced_assignment::GREEDY) == 0) {
+            options.balancedAssignment = BalancedAssignment::GREEDY;
+        } else if (strcmp(assignment, balanced_assignment::AUCTION) == 0) {
+            options.balancedAssignment = BalancedAssignment::AUCTION;
+        } else if (strcmp(assignment, balanced_assignment::NONE) != 0) {
+            fprintf(stderr, "ERROR: unsupported balanced assignment: %s\n", assignment);
+            assert(false);
+        }
+    }
+    if (options.warmExpertBudget > 0 && options.hotExpertBudget == 0) {
+        fprintf(stderr, "ERROR: warm expert budget requires a hot expert budget\n");
+        assert(false);
+    }
+    if (options.deviceExperts > 0 && flags.expertsOnHost) {
+        fprintf(stderr, "ERROR: device experts require expert backend %s\n", expert_backend::GPU);
+        assert(false);
+    }
+    if (options.replicatedExperts > 0 && !flags.expertsOnHost) {
+        fprintf(stderr, "ERROR: replicated experts require expert backend %s\n", expert_backend::CPU);
+        assert(false);
+    }
+    if (options.expertShards > 0 && !flags.expertsOnHost) {
+        fprintf(stderr, "ERROR: expert shards require expert backend %s\n", expert_backend::CPU);
+        assert(false);
+    }
+    // shard workers plan their own experts, replicas only exist in this process
+    if (options.expertShards > 0 && (options.replicatedExperts > 0 || options.replicationThreshold > 0)) {
+        fprintf(stderr, "ERROR: expert shards exclude replicated experts and replication threshold\n");
+        assert(false);
+    }
+    // only base_layer mixes expert output by a gate weight, other variants take all of it
+    if (options.gateSkipThreshold > 0 && !flags.baseLayerOutputMix) {
+        fprintf(stderr, "ERROR: gate skip threshold requires moe variant %s\n", moe_variant::BASE_LAYER);
+        assert(false);
+    }
+    std::shared_ptr<const CentroidIndex> centroid_index = nullptr;
+    if (options.routingLists > 0) {
+        centroid_index = buildCentroidIndex(expert_centroids, expert_count, embedding_size,
+                                            flags.layernormOnInputBeforeScore ? layernorm_weight : nullptr, options,
+                                            routing_recall, calibration_file);
+        assert(options.routingProbes <= options.routingLists);
+    }
+    // only read while parsing, unlike the strings handed over to the plugin
+    free(backend);
+    free(padding);
+    free(calibration_file);
+    free(assignment);
+    free(hash);
     auto plugin = new MoELayerPlugin(name, expert_count, embedding_size, hidden_size, max_concurrency, expert_centroids,
-                                     layernorm_weight, weight_file, sublayer, flags);
+                                     layernorm_weight, weight_file, sublayer, flags, options, centroid_index);
     plugin->setPluginNamespace(mPluginNamespace);
 
     return plugin;
@@ -0,0 +1,57 @@
+// Balanced assignment (equal capacity per expert) against greedy top-1 routing: score lost, load of the most loaded
+// expert (the critical path of the layer) and host latency of each algorithm.
+// Scores are gaussian plus a per-expert bias growing with `skew`, so that top-1 routing crowds the first experts.
+//
+// usage: bench_balanced_assignment [tokens] [experts] [skew] [iterations]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../runtime/BalancedAssignment.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+int main(int argc, char **argv) {
+    auto tokens = argc > 1 ? atoi(argv[1]) : 4096;
+    auto experts = argc > 2 ? atoi(argv[2]) : 64;
+    auto skew = argc > 3 ? atof(argv[3]) : 1.0;
+    auto iterations = argc > 4 ? atoi(argv[4]) : 5;
+
+    auto &pool = ThreadPool::instance();
+    printf("tokens=%d experts=%d skew=%.2f workers=%d\n", tokens, experts, skew, pool.workerCount());
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist;
+    std::vector<float> scores(static_cast<size_t>(tokens) * experts);
+    for (int t = 0; t < tokens; ++t) {
+        for (int e = 0; e < experts; ++e) {
+            scores[static_cast<size_t>(t) * experts + e] = dist(rng) - static_cast<float>(skew * std::log1p(e));
+        }
+    }
+
+    // loss per token is in units of the score noise
+    printf("%-8s %10s %11s %10s %10s %12s %8s\n", "router", "loss", "loss/token", "max load", "capacity",
+           "latency(ms)", "rounds");
+    for (auto algorithm : {BalancedAssignment::GREEDY, BalancedAssignment::AUCTION}) {
+        BalancedAssignment assigner(algorithm, pool);
+        std::vector<int> selection(tokens);
+        BalancedAssignment::Report report;
+        auto ms = measure(iterations, [&] {
+            std::fill(selection.begin(), selection.end(), 0);
+            report = assigner.assign(scores.data(), tokens, experts, selection.data(), nullptr);
+        });
+        if (algorithm == BalancedAssignment::GREEDY) {
+            printf("%-8s %9.3f%% %11.4f %10d %10d %12s %8s\n", "top1", 0.0, 0.0, report.greedyMaxLoad,
+                   report.capacity, "-", "-");
+        }
+        printf("%-8s %9.3f%% %11.4f %10d %10d %12.3f %8d\n",
+               algorithm == BalancedAssignment::GREEDY ? "greedy" : "auction", 100 * report.loss(),
+               (report.greedyObjective - report.objective) / report.tokenCount, report.maxLoad, report.capacity, ms,
+               report.rounds);
+    }
+    return 0;
+}
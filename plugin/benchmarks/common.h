@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef BENCHMARKS_COMMON_H
+#define BENCHMARKS_COMMON_H
+
+// Helpers shared by host benchmarks: random inputs & expert weights, and timing.
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../host/t5ff.h"
+
+inline std::vector<float> randomVector(size_t size, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> dist(-0.05f, 0.05f);
+    std::vector<float> result(size);
+    for (auto &v : result) v = dist(rng);
+    return result;
+}
+
+inline double elapsedMs(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// mean latency (ms) of body over iterations, after one warm-up run
+template <typename F>
+double measure(int iterations, const F &body) {
+    body();  // warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; ++it) body();
+    return elapsedMs(start) / iterations;
+}
+
+// random weights of T5FF experts, weights pointing into storage
+struct RandomT5FFExperts {
+    std::vector<std::vector<float>> storage;
+    std::vector<T5FFWeights> weights;
+
+    RandomT5FFExperts(int experts, int d_model, int hidden, std::mt19937 &rng) {
+        for (int i = 0; i < experts; ++i) {
+            storage.push_back(randomVector(d_model, rng));
+            storage.push_back(randomVector(static_cast<size_t>(hidden) * d_model, rng));
+            storage.push_back(randomVector(static_cast<size_t>(hidden) * d_model, rng));
+            storage.push_back(randomVector(static_cast<size_t>(hidden) * d_model, rng));
+            auto base = storage.size() - 4;
+            weights.push_back(T5FFWeights{storage[base].data(), storage[base + 1].data(), storage[base + 2].data(),
+                                          storage[base + 3].data()});
+        }
+    }
+    RandomT5FFExperts(const RandomT5FFExperts &) = delete;
+    RandomT5FFExperts &operator=(const RandomT5FFExperts &) = delete;
+};
+
+#endif  // BENCHMARKS_COMMON_H
@@ -0,0 +1,88 @@
+// Latency of one decoding step on host (top-1 gating, counting sort & experts reading tokens in place, as
+// MoELayerPlugin does for at most DECODE_TOKENS tokens with expert_backend = cpu) for 1 to 64 tokens, with workers of
+// the pool blocking between steps against kept spinning by ThreadPool::keepAwake().
+// Steps are separated by a gap standing for the rest of the model (attention, other layers); the spinning window is
+// INFMOE_SPIN_US, so keep the gap below it to measure the warm case.
+//
+// usage: bench_decode [experts] [d_model] [hidden_size] [iterations] [gap_us]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../host/gating.h"
+#include "../host/t5ff.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+namespace {
+
+// busy wait, so that the gap is not lengthened by the sleeping granularity of the OS
+void pause(int microseconds) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto d_model = argc > 2 ? atoi(argv[2]) : 1024;
+    auto hidden = argc > 3 ? atoi(argv[3]) : 2048;
+    auto iterations = argc > 4 ? atoi(argv[4]) : 200;
+    auto gap_us = argc > 5 ? atoi(argv[5]) : 200;
+    const int max_tokens = 64;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d d_model=%d hidden=%d workers=%d gap=%dus\n", experts, d_model, hidden, pool.workerCount(),
+           gap_us);
+
+    std::mt19937 rng(42);
+    RandomT5FFExperts expert_weights(experts, d_model, hidden, rng);
+    auto &weights = expert_weights.weights;
+    auto centroids = randomVector(static_cast<size_t>(experts) * d_model, rng);
+    auto input = randomVector(static_cast<size_t>(max_tokens) * d_model, rng);
+    std::vector<float> output(input.size()), score(max_tokens);
+    std::vector<float> workspace(t5_ff_workspace_size(max_tokens, d_model, hidden));
+    std::vector<int> selection(max_tokens), token_pos(max_tokens), count(experts), offset(experts + 1);
+    ExpertScheduler scheduler(sizeof(float) * (3ul * d_model * hidden + d_model), 6.0 * d_model * hidden);
+
+    auto step = [&](int tokens) {
+        gate_topk_cpu(input.data(), tokens, d_model, centroids.data(), experts, nullptr, 0, 1, selection.data(),
+                      score.data(), 1);
+        count_tokens_cpu(tokens, experts, selection.data(), token_pos.data(), count.data(), offset.data());
+        auto plan = scheduler.plan(experts, count.data(), offset.data());
+        scheduler.execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+            t5_ff_cpu_indexed(weights[item.expert], item.tokenCount, d_model, hidden,
+                              token_pos.data() + item.tokenOffset, input.data(), output.data(), nullptr,
+                              workspace.data() + t5_ff_workspace_size(item.tokenOffset, d_model, hidden),
+                              item.parallelism);
+        });
+    };
+
+    printf("%-8s %-8s %10s %10s %10s\n", "tokens", "workers", "p50(us)", "p99(us)", "max(us)");
+    std::vector<double> latency(iterations);
+    for (int tokens : {1, 2, 4, 8, 16, 32, 64}) {
+        for (auto awake : {false, true}) {
+            step(tokens);  // warm up
+            for (int it = 0; it < iterations; ++it) {
+                pause(gap_us);
+                auto start = std::chrono::steady_clock::now();
+                if (awake) pool.keepAwake();
+                step(tokens);
+                std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                latency[it] = elapsed.count();
+            }
+            std::sort(latency.begin(), latency.end());
+            printf("%-8d %-8s %10.1f %10.1f %10.1f\n", tokens, awake ? "spinning" : "blocking",
+                   latency[iterations / 2], latency[iterations * 99 / 100], latency.back());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Reading experts from disk (runtime/ExpertReader.h), one expert at a time as when an uncached expert is routed: a
+// serial pread of each array (as cnpy does) against both engines of ExpertReader, through the page cache or with
+// O_DIRECT. The file is evicted from the page cache before each run, and the share of it cached afterwards is
+// reported. Put the file on the drive to measure (tmpfs supports neither O_DIRECT nor eviction).
+//
+// usage: bench_expert_reader [experts] [expert_mb] [depth] [directory]
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../runtime/ExpertReader.h"
+
+namespace {
+
+uint64_t checksum(const char *data, size_t size) {
+    uint64_t hash = 1469598103934665603ull;
+    auto words = reinterpret_cast<const uint64_t *>(data);
+    for (size_t i = 0; i < size / 8; ++i) hash = (hash ^ words[i]) * 1099511628211ull;
+    return hash;
+}
+
+void evict(int fd) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// share of the file in the page cache
+double cachedShare(int fd, size_t size) {
+    auto map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    std::vector<unsigned char> resident((size + page - 1) / page);
+    size_t cached = 0;
+    if (mincore(map, size, resident.data()) == 0) {
+        for (auto r : resident) cached += r & 1;
+    }
+    munmap(map, size);
+    return static_cast<double>(cached) / resident.size();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto expert_mb = argc > 2 ? atoi(argv[2]) : 64;
+    auto depth = argc > 3 ? atoi(argv[3]) : 32;
+    std::string directory = argc > 4 ? argv[4] : "/var/tmp";
+    size_t expert_size = static_cast<size_t>(expert_mb) << 20;
+    // four arrays per expert at unaligned offsets, as in npz files
+    const size_t header = 128;
+    size_t array_size = expert_size / 4;
+    size_t stride = 4 * (header + array_size);
+    size_t file_size = stride * experts;
+    printf("experts=%d expert=%dMiB depth=%d file=%s\n", experts, expert_mb, depth, directory.c_str());
+
+    auto path = directory + "/bench_expert_reader_XXXXXX";
+    auto fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    std::vector<uint64_t> expected(experts);
+    {
+        std::mt19937_64 rng(42);
+        std::vector<uint64_t> data(stride / 8 + 1);
+        for (int i = 0; i < experts; ++i) {
+            for (auto &v : data) v = rng();
+            auto bytes = reinterpret_cast<const char *>(data.data());
+            std::vector<char> block;
+            for (int k = 0; k < 4; ++k) {
+                auto begin = bytes + k * (header + array_size) + header;
+                block.insert(block.end(), begin, begin + array_size);
+            }
+            expected[i] = checksum(block.data(), expert_size);
+            if (pwrite(fd, bytes, stride, stride * i) != static_cast<ssize_t>(stride)) {
+                perror("pwrite");
+                return 1;
+            }
+        }
+    }
+    auto extentsOf = [&](int expert, char *dst) {
+        std::vector<ExpertReader::Extent> extents;
+        for (int k = 0; k < 4; ++k) {
+            extents.push_back({stride * expert + k * (header + array_size) + header, array_size, dst + k * array_size});
+        }
+        return extents;
+    };
+
+    auto block = std::make_unique<char[]>(expert_size);
+    int failures = 0;
+    auto measure = [&](const char *name, int read_fd, const std::function<void(int)> &load) {
+        evict(fd);
+        std::chrono::duration<double> elapsed(0);
+        for (int i = 0; i < experts; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            load(i);
+            elapsed += std::chrono::steady_clock::now() - start;
+            if (checksum(block.get(), expert_size) != expected[i]) ++failures;
+        }
+        auto bandwidth = static_cast<double>(expert_size) * experts / elapsed.count() / 1e9;
+        printf("%-24s %10.2f %12.1f %10.1f%%\n", name, bandwidth, elapsed.count() * 1e3 / experts,
+               100 * cachedShare(fd, file_size));
+        if (read_fd != fd) close(read_fd);
+    };
+
+    printf("%-24s %10s %12s %11s\n", "reader", "GB/s", "expert(ms)", "cached");
+    measure("serial pread", fd, [&](int expert) {
+        for (auto &extent : extentsOf(expert, block.get())) {
+            if (pread(fd, extent.dst, extent.size, extent.offset) != static_cast<ssize_t>(extent.size)) abort();
+        }
+    });
+    for (auto engine : {ExpertReader::URING, ExpertReader::PREAD}) {
+        for (auto direct : {false, true}) {
+            ExpertReader reader(engine, depth, direct, false);
+            if (reader.engine() != engine) continue;
+            auto read_fd = reader.openFile(path.c_str());
+            auto flags = fcntl(read_fd, F_GETFL);
+            if (direct && !(flags & O_DIRECT)) {
+                printf("%-24s (O_DIRECT not supported in %s)\n", "", directory.c_str());
+                close(read_fd);
+                continue;
+            }
+            std::string name = std::string(engine == ExpertReader::URING ? "uring" : "pread") +
+                               (direct ? " direct" : " buffered");
+            measure(name.c_str(), read_fd, [&](int expert) {
+                if (reader.readAll(read_fd, extentsOf(expert, block.get())) != 0) ++failures;
+            });
+        }
+    }
+    close(fd);
+    unlink(path.c_str());
+    if (failures > 0) fprintf(stderr, "%d wrong experts\n", failures);
+    return failures != 0;
+}
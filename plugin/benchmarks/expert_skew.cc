@@ -0,0 +1,97 @@
+// Core utilization & latency of host expert execution under skewed routing, comparing:
+//   inter:     one task per expert, no split inside experts
+//   intra:     experts one after another, each split over all workers
+//   two-level: ExpertScheduler plan (split large experts, pack small ones)
+//   replicated: two-level with hot experts replicated by ExpertReplicator (threshold 1.5, after warm-up batches)
+//
+// usage: bench_expert_skew [experts] [tokens] [d_model] [hidden_size] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../host/t5ff.h"
+#include "../runtime/ExpertReplicator.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+namespace {
+
+// hottest expert receives `hot` of all tokens, the others share the rest evenly
+void skewedCounts(int experts, int tokens, double hot, std::vector<int> &count, std::vector<int> &offset) {
+    count.assign(experts, 0);
+    offset.assign(experts + 1, 0);
+    count[0] = std::max(1, static_cast<int>(tokens * hot));
+    auto rest = tokens - count[0];
+    for (int i = 1; i < experts; ++i) count[i] = rest / (experts - 1) + (i <= rest % (experts - 1) ? 1 : 0);
+    for (int i = 0; i < experts; ++i) offset[i + 1] = offset[i] + count[i];
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto tokens = argc > 2 ? atoi(argv[2]) : 2048;
+    auto d_model = argc > 3 ? atoi(argv[3]) : 512;
+    auto hidden = argc > 4 ? atoi(argv[4]) : 2048;
+    auto iterations = argc > 5 ? atoi(argv[5]) : 3;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d tokens=%d d_model=%d hidden=%d workers=%d nodes=%d\n", experts, tokens, d_model, hidden,
+           pool.workerCount(), pool.nodeCount());
+
+    std::mt19937 rng(42);
+    RandomT5FFExperts expert_weights(experts, d_model, hidden, rng);
+    auto &weights = expert_weights.weights;
+    auto input = randomVector(static_cast<size_t>(tokens) * d_model, rng);
+    std::vector<float> output(input.size());
+    std::vector<float> workspace(t5_ff_workspace_size(tokens, d_model, hidden));
+
+    auto run_item = [&](const ExpertScheduler::WorkItem &item) {
+        auto offset = static_cast<size_t>(item.tokenOffset);
+        t5_ff_cpu(weights[item.expert], item.tokenCount, d_model, hidden, input.data() + offset * d_model,
+                  output.data() + offset * d_model, workspace.data() + t5_ff_workspace_size(offset, d_model, hidden),
+                  item.parallelism);
+    };
+
+    ExpertScheduler scheduler(sizeof(float) * (3ul * d_model * hidden + d_model), 6.0 * d_model * hidden);
+    const char *modes[] = {"inter", "intra", "two-level", "replicated"};
+    printf("%-8s %-10s %12s %12s %10s\n", "hot", "mode", "latency(ms)", "utilization", "imbalance");
+
+    for (auto hot : {1.0 / experts, 0.2, 0.4, 0.6, 0.8}) {
+        std::vector<int> count, offset;
+        skewedCounts(experts, tokens, hot, count, offset);
+        ExpertReplicator replicator(experts, 1.5, pool.workerCount());
+        for (int batch = 0; batch < 8; ++batch) replicator.record(count.data());
+        for (int mode = 0; mode < 4; ++mode) {
+            ExpertScheduler::Plan plan;
+            if (mode >= 2) {
+                plan = scheduler.plan(experts, count.data(), offset.data(),
+                                      mode == 3 ? replicator.replicas().data() : nullptr);
+            } else {
+                for (int i = 0; i < experts; ++i) {
+                    if (count[i] == 0) continue;
+                    ExpertScheduler::WorkItem item{i, offset[i], count[i], mode == 0 ? 1 : pool.workerCount()};
+                    if (mode == 0 || plan.tasks.empty()) plan.tasks.push_back(ExpertScheduler::Task{{}, 0});
+                    plan.tasks.back().items.push_back(item);
+                    plan.tasks.back().cost += scheduler.cost(count[i]);
+                    plan.totalCost += scheduler.cost(count[i]);
+                }
+                plan.estimatedMakespan = plan.totalCost;
+            }
+            double latency = 0, utilization = 0;
+            for (int it = 0; it < iterations; ++it) {
+                scheduler.execute(plan, run_item);
+                latency += scheduler.stats().lastLatencyMs;
+                utilization += scheduler.stats().lastUtilization;
+            }
+            printf("%-8.3f %-10s %12.2f %11.1f%% %10.2f\n", hot, modes[mode], latency / iterations,
+                   100 * utilization / iterations, mode >= 2 ? scheduler.stats().lastImbalance : 0.0);
+        }
+    }
+    return 0;
+}
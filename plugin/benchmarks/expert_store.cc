@@ -0,0 +1,146 @@
+// Tiered expert storage (runtime/ExpertStore.h) with disk & host memory tiers: experts are written to a temporary
+// file, then batches with Zipf-skewed routing acquire their routed experts in parallel, as host experts would.
+// Reports hit rate, promotion latency & memory of each tier, the compression ratio, and checks every acquired expert.
+// Weights are normal with std 0.02, at full FP32 precision or rounded to BF16 (as checkpoints trained in BF16).
+//
+// usage: bench_expert_store [experts] [expert_mb] [hot_mb] [warm_mb] [batches] [skew] [bf16]
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../runtime/ExpertStore.h"
+#include "../runtime/ThreadPool.h"
+
+namespace {
+
+// same words for the same expert, to check blocks without keeping them
+uint64_t checksum(const char *data, size_t size) {
+    uint64_t hash = 1469598103934665603ull;
+    auto words = reinterpret_cast<const uint64_t *>(data);
+    for (size_t i = 0; i < size / 8; ++i) hash = (hash ^ words[i]) * 1099511628211ull;
+    return hash;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 32;
+    auto expert_mb = argc > 2 ? atoi(argv[2]) : 8;
+    auto hot_mb = argc > 3 ? atoi(argv[3]) : 64;
+    auto warm_mb = argc > 4 ? atoi(argv[4]) : 64;
+    auto batches = argc > 5 ? atoi(argv[5]) : 200;
+    auto skew = argc > 6 ? atof(argv[6]) : 1.2;
+    auto bf16 = argc > 7 ? atoi(argv[7]) != 0 : false;
+    const int tokens = 64;
+
+    auto &pool = ThreadPool::instance();
+    size_t expert_size = static_cast<size_t>(expert_mb) << 20;
+    printf("experts=%d expert=%dMiB hot=%dMiB warm=%dMiB batches=%d skew=%.2f bf16=%d workers=%d\n", experts,
+           expert_mb, hot_mb, warm_mb, batches, skew, bf16, pool.workerCount());
+
+    // weight file
+    char path[] = "/tmp/bench_expert_store_XXXXXX";
+    auto fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    std::vector<uint64_t> expected(experts);
+    {
+        std::mt19937 rng(42);
+        std::normal_distribution<float> dist(0, 0.02f);
+        std::vector<float> block(expert_size / sizeof(float));
+        for (int i = 0; i < experts; ++i) {
+            for (auto &v : block) {
+                v = dist(rng);
+                if (bf16) {
+                    uint32_t bits;
+                    memcpy(&bits, &v, sizeof(bits));
+                    bits = (bits + 0x8000u) & 0xffff0000u;
+                    memcpy(&v, &bits, sizeof(bits));
+                }
+            }
+            auto data = reinterpret_cast<const char *>(block.data());
+            expected[i] = checksum(data, expert_size);
+            if (pwrite(fd, data, expert_size, expert_size * i) != static_cast<ssize_t>(expert_size)) {
+                perror("pwrite");
+                return 1;
+            }
+        }
+    }
+    ExpertStore store(experts, expert_size, static_cast<size_t>(hot_mb) << 20, static_cast<size_t>(warm_mb) << 20,
+                      [&](int expert, char *dst) {
+                          if (pread(fd, dst, expert_size, expert_size * expert) != static_cast<ssize_t>(expert_size)) {
+                              perror("pread");
+                              abort();
+                          }
+                      });
+
+    // Zipf routing over a fixed random order of experts
+    std::mt19937 rng(7);
+    std::vector<double> weights(experts);
+    for (int i = 0; i < experts; ++i) weights[i] = 1.0 / std::pow(i + 1, skew);
+    std::discrete_distribution<int> rank(weights.begin(), weights.end());
+    std::vector<int> order(experts);
+    for (int i = 0; i < experts; ++i) order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    int failures = 0;
+    std::vector<int> count(experts), routed;
+    std::vector<double> latency;
+    for (int b = 0; b < batches; ++b) {
+        std::fill(count.begin(), count.end(), 0);
+        for (int t = 0; t < tokens; ++t) ++count[order[rank(rng)]];
+        store.recordRouting(count.data());
+        routed.clear();
+        for (int i = 0; i < experts; ++i) {
+            if (count[i] > 0) routed.push_back(i);
+        }
+        auto start = std::chrono::steady_clock::now();
+        pool.parallelFor(0, routed.size(), 1, [&](int64_t begin, int64_t end) {
+            for (auto i = begin; i < end; ++i) {
+                auto pin = store.acquire(routed[i]);
+                if (checksum(pin.data(), expert_size) != expected[routed[i]]) {
+                    fprintf(stderr, "wrong weights of expert %d\n", routed[i]);
+                    ++failures;
+                }
+            }
+        });
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        latency.push_back(elapsed.count());
+    }
+    close(fd);
+
+    // the first batches only warm up tiers
+    std::sort(latency.begin(), latency.end());
+    printf("batch latency: p50 %.2f ms, p99 %.2f ms (including checksums of %d routed experts on average)\n",
+           latency[latency.size() / 2], latency[latency.size() * 99 / 100],
+           static_cast<int>(routed.size()));
+    const char *names[] = {"disk", "compressed", "hot"};
+    int64_t acquires = 0;
+    for (int t = 0; t < ExpertStore::TIER_COUNT; ++t) acquires += store.metrics(static_cast<ExpertStore::Tier>(t)).hits;
+    printf("%-12s %8s %10s %14s %10s %10s\n", "tier", "experts", "hit rate", "promote(ms)", "MiB", "demotions");
+    for (int t = ExpertStore::TIER_COUNT - 1; t >= 0; --t) {
+        auto m = store.metrics(static_cast<ExpertStore::Tier>(t));
+        auto promote_ms = m.hits > 0 && t != ExpertStore::HOT ? m.loadNanoseconds / 1e6 / m.hits : 0.0;
+        printf("%-12s %8d %9.1f%% %14.2f %10.1f %10ld\n", names[t], m.experts, 100.0 * m.hits / acquires, promote_ms,
+               m.bytes / 1048576.0, static_cast<long>(m.demotions));
+    }
+    auto compressed = store.metrics(ExpertStore::COMPRESSED);
+    if (compressed.rawBytes > 0) {
+        printf("compression ratio %.3f, %.2f s compressing demoted experts\n",
+               compressed.bytes / static_cast<double>(compressed.rawBytes), compressed.demoteNanoseconds / 1e9);
+    }
+    if (failures > 0) fprintf(stderr, "%d wrong experts\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,125 @@
+// Confidence-based skipping of base layer experts (gate_skip_threshold) against running every routed token: skip
+// rate, host latency of experts and error against the exact output for several thresholds.
+// Scores are gaussian plus a per-expert bias growing with `skew`, and tokens are assigned to experts by greedy
+// balanced assignment, so that tokens pushed to a crowded-out expert get a low gate weight sigmoid(score).
+// A skipped token takes its input as output, which must be off the exact output by at most threshold times the
+// feed-forward output of its expert: violations of this bound are counted.
+//
+// usage: bench_gate_skip [experts] [tokens] [d_model] [hidden_size] [skew] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../host/gating.h"
+#include "../host/t5ff.h"
+#include "../runtime/BalancedAssignment.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto tokens = argc > 2 ? atoi(argv[2]) : 2048;
+    auto d_model = argc > 3 ? atoi(argv[3]) : 1024;
+    auto hidden = argc > 4 ? atoi(argv[4]) : 2048;
+    auto skew = argc > 5 ? atof(argv[5]) : 1.0;
+    auto iterations = argc > 6 ? atoi(argv[6]) : 3;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d tokens=%d d_model=%d hidden=%d skew=%.2f workers=%d\n", experts, tokens, d_model, hidden, skew,
+           pool.workerCount());
+
+    std::mt19937 rng(42);
+    RandomT5FFExperts expert_weights(experts, d_model, hidden, rng);
+    auto &weights = expert_weights.weights;
+    auto feature_count = static_cast<size_t>(tokens) * d_model;
+    auto input = randomVector(feature_count, rng);
+    std::vector<float> workspace(t5_ff_workspace_size(tokens, d_model, hidden));
+
+    std::normal_distribution<float> dist;
+    std::vector<float> scores(static_cast<size_t>(tokens) * experts);
+    for (int t = 0; t < tokens; ++t) {
+        for (int e = 0; e < experts; ++e) {
+            scores[static_cast<size_t>(t) * experts + e] = dist(rng) - static_cast<float>(skew * std::log1p(e));
+        }
+    }
+    BalancedAssignment assigner(BalancedAssignment::GREEDY, pool);
+    std::vector<int> assigned(tokens, 0);
+    std::vector<float> score(tokens);
+    assigner.assign(scores.data(), tokens, experts, assigned.data(), score.data());
+
+    ExpertScheduler scheduler(sizeof(float) * (3ul * d_model * hidden + d_model), 6.0 * d_model * hidden);
+    std::vector<int> selection(tokens), count(experts), offset(experts + 1), token_pos(tokens);
+    // experts of tokens left in selection, then input of skipped tokens, as moe_expert_fill_padding
+    auto run = [&](const float *mix_coeff, float *output) {
+        auto routed = count_tokens_cpu(tokens, experts, selection.data(), token_pos.data(), count.data(),
+                                       offset.data());
+        auto plan = scheduler.plan(experts, count.data(), offset.data());
+        scheduler.execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+            t5_ff_cpu_indexed(weights[item.expert], item.tokenCount, d_model, hidden,
+                              token_pos.data() + item.tokenOffset, input.data(), output, mix_coeff,
+                              workspace.data() + t5_ff_workspace_size(item.tokenOffset, d_model, hidden),
+                              item.parallelism);
+        });
+        for (int t = 0; routed < tokens && t < tokens; ++t) {
+            if (selection[t] >= 0) continue;
+            memcpy(output + static_cast<size_t>(t) * d_model, input.data() + static_cast<size_t>(t) * d_model,
+                   sizeof(float) * d_model);
+        }
+    };
+
+    // exact output, and feed-forward output of the expert of each token (unmixed output - input) for the bound
+    std::vector<float> exact(feature_count), unmixed(feature_count), output(feature_count);
+    selection = assigned;
+    run(nullptr, unmixed.data());
+    double exact_ms = 0;
+    for (int it = 0; it < iterations; ++it) {
+        auto start = std::chrono::steady_clock::now();
+        run(score.data(), exact.data());
+        exact_ms += elapsedMs(start);
+    }
+    exact_ms /= iterations;
+
+    printf("%-10s %10s %12s %8s %12s %12s %10s\n", "threshold", "skipped", "latency(ms)", "speedup", "max error",
+           "mean error", "violations");
+    printf("%-10s %9.2f%% %12.2f %7.2fx %12s %12s %10s\n", "exact", 0.0, exact_ms, 1.0, "-", "-", "-");
+    int total_violations = 0;
+    for (auto threshold : {0.01f, 0.05f, 0.1f, 0.2f, 0.3f}) {
+        auto min_score = std::log(threshold / (1 - threshold));
+        int skipped = 0;
+        double ms = 0;
+        for (int it = 0; it < iterations; ++it) {
+            auto start = std::chrono::steady_clock::now();
+            selection = assigned;
+            skipped = skip_low_gate_cpu(tokens, min_score, score.data(), selection.data());
+            run(score.data(), output.data());
+            ms += elapsedMs(start);
+        }
+        ms /= iterations;
+        double max_error = 0, error_sum = 0;
+        int violations = 0;
+        for (int t = 0; t < tokens; ++t) {
+            float token_error = 0, contribution = 0;
+            for (int i = 0; i < d_model; ++i) {
+                auto index = static_cast<size_t>(t) * d_model + i;
+                token_error = std::max(token_error, std::abs(output[index] - exact[index]));
+                contribution = std::max(contribution, std::abs(unmixed[index] - input[index]));
+            }
+            // tokens that kept their expert only differ by rounding of differently tiled GEMMs
+            auto bound = selection[t] == -2 ? threshold * contribution : 0.0f;
+            if (token_error > bound + 1e-5f * (1 + contribution)) ++violations;
+            max_error = std::max(max_error, static_cast<double>(token_error));
+            error_sum += token_error;
+        }
+        total_violations += violations;
+        printf("%-10.2f %9.2f%% %12.2f %7.2fx %12.2e %12.2e %10d\n", threshold, 100.0 * skipped / tokens, ms,
+               exact_ms / ms, max_error, error_sum / tokens, violations);
+    }
+    return total_violations != 0;
+}
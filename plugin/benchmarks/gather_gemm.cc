@@ -0,0 +1,110 @@
+// Host expert execution with tokens moved through buffers in expert order, against reading & writing them in place:
+//   copy:    scatter tokens into expert order, run experts, gather (and mix for base layer) results back
+//            (host/shuffle.h)
+//   indexed: the first GEMM of each expert reads its tokens through token positions, the epilogue of the last one
+//            writes (and mixes) results to their final rows (t5_ff_cpu_indexed)
+// Routing is uniform. Copy time and traffic only count the scatter & gather passes, which indexed does not have.
+//
+// usage: bench_gather_gemm [experts] [tokens] [d_model] [hidden_size] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../host/shuffle.h"
+#include "../host/t5ff.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto tokens = argc > 2 ? atoi(argv[2]) : 2048;
+    auto d_model = argc > 3 ? atoi(argv[3]) : 1024;
+    auto hidden = argc > 4 ? atoi(argv[4]) : 2048;
+    auto iterations = argc > 5 ? atoi(argv[5]) : 3;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d tokens=%d d_model=%d hidden=%d workers=%d\n", experts, tokens, d_model, hidden,
+           pool.workerCount());
+
+    std::mt19937 rng(42);
+    RandomT5FFExperts expert_weights(experts, d_model, hidden, rng);
+    auto &weights = expert_weights.weights;
+    auto feature_count = static_cast<size_t>(tokens) * d_model;
+    auto input = randomVector(feature_count, rng);
+    auto mix_coeff = randomVector(tokens, rng);
+    std::vector<float> routed_mix_coeff(tokens);
+    std::vector<float> output(feature_count), reference(feature_count);
+    std::vector<float> routed(feature_count), post_expert(feature_count);
+    std::vector<float> workspace(t5_ff_workspace_size(tokens, d_model, hidden));
+
+    // counting sort of uniform routing, as moe_expert_count
+    std::uniform_int_distribution<int> pick(0, experts - 1);
+    std::vector<int> selection(tokens), count(experts, 0), offset(experts + 1, 0), token_pos(tokens);
+    for (auto &s : selection) ++count[s = pick(rng)];
+    for (int i = 0; i < experts; ++i) offset[i + 1] = offset[i] + count[i];
+    {
+        auto next = offset;
+        for (int t = 0; t < tokens; ++t) token_pos[next[selection[t]]++] = t;
+    }
+
+    ExpertScheduler scheduler(sizeof(float) * (3ul * d_model * hidden + d_model), 6.0 * d_model * hidden);
+    auto plan = scheduler.plan(experts, count.data(), offset.data());
+
+    printf("%-8s %-4s %12s %10s %12s %10s %10s\n", "mode", "mix", "latency(ms)", "copy(ms)", "traffic(MB)",
+           "copy GB/s", "max diff");
+    for (auto mix : {false, true}) {
+        double copy_ms = 0, total_ms = 0;
+        for (int it = 0; it < iterations; ++it) {
+            auto start = std::chrono::steady_clock::now();
+            moe_expert_scatter_cpu(tokens, d_model, input.data(), mix_coeff.data(), token_pos.data(), routed.data(),
+                                   routed_mix_coeff.data(), pool.workerCount());
+            copy_ms += elapsedMs(start);
+            scheduler.execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+                auto offset = static_cast<size_t>(item.tokenOffset);
+                t5_ff_cpu(weights[item.expert], item.tokenCount, d_model, hidden, routed.data() + offset * d_model,
+                          post_expert.data() + offset * d_model,
+                          workspace.data() + t5_ff_workspace_size(offset, d_model, hidden), item.parallelism);
+            });
+            auto gather_start = std::chrono::steady_clock::now();
+            if (mix) {
+                moe_expert_base_layer_fused_mix_and_gather_cpu(tokens, tokens, d_model, token_pos.data(),
+                                                               routed.data(), post_expert.data(),
+                                                               routed_mix_coeff.data(), reference.data(),
+                                                               pool.workerCount());
+            } else {
+                moe_expert_gather_cpu(tokens, tokens, d_model, post_expert.data(), token_pos.data(),
+                                      reference.data(), pool.workerCount());
+            }
+            copy_ms += elapsedMs(gather_start);
+            total_ms += elapsedMs(start);
+        }
+        // scatter reads & writes every token once, gather too, and the mix reads routed tokens again
+        auto traffic = static_cast<double>(feature_count) * sizeof(float) * (mix ? 5 : 4);
+        printf("%-8s %-4s %12.2f %10.2f %12.1f %10.2f %10s\n", "copy", mix ? "yes" : "no", total_ms / iterations,
+               copy_ms / iterations, traffic / 1e6, traffic / (copy_ms / iterations) / 1e6, "-");
+
+        total_ms = 0;
+        for (int it = 0; it < iterations; ++it) {
+            auto start = std::chrono::steady_clock::now();
+            scheduler.execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+                auto offset = static_cast<size_t>(item.tokenOffset);
+                t5_ff_cpu_indexed(weights[item.expert], item.tokenCount, d_model, hidden,
+                                  token_pos.data() + item.tokenOffset, input.data(), output.data(),
+                                  mix ? mix_coeff.data() : nullptr,
+                                  workspace.data() + t5_ff_workspace_size(offset, d_model, hidden), item.parallelism);
+            });
+            total_ms += elapsedMs(start);
+        }
+        float max_diff = 0;
+        for (size_t i = 0; i < feature_count; ++i) max_diff = std::max(max_diff, std::abs(output[i] - reference[i]));
+        printf("%-8s %-4s %12.2f %10s %12.1f %10s %10.2e\n", "indexed", mix ? "yes" : "no", total_ms / iterations, "-",
+               0.0, "-", max_diff);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Latency of host gating (layernorm + scores + top-k), comparing:
+//   unfused: layernorm of the whole batch, token x expert scores written out by linear_cpu, then a top-k scan
+//   fused:   gate_topk_cpu, scores of a tile of tokens are reduced to top-k while in registers
+//
+// usage: bench_gating [tokens] [d_model] [k] [iterations]
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../host/gating.h"
+#include "../host/ops.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+namespace {
+
+const int TOKEN_TILE = 32;
+
+// same result as gate_topk_cpu, materializing layernorm output & the (tokens, experts) score matrix
+void gateUnfused(const std::vector<float> &input, int tokens, int d_model, const std::vector<float> &centroids,
+                 int experts, const std::vector<float> &gamma, int k, std::vector<float> &normalized,
+                 std::vector<float> &scores, std::vector<int> &selection) {
+    auto &pool = ThreadPool::instance();
+    auto tiles = (tokens + TOKEN_TILE - 1) / TOKEN_TILE;
+    pool.parallelFor(0, tiles, 1, [&](int64_t begin, int64_t end) {
+        for (auto tile = begin; tile < end; ++tile) {
+            auto row = tile * TOKEN_TILE;
+            auto rows = std::min<int64_t>(TOKEN_TILE, tokens - row);
+            layernorm_cpu(normalized.data() + row * d_model, input.data() + row * d_model, rows, d_model, 1e-6,
+                          gamma.data(), nullptr);
+            linear_cpu(scores.data() + row * experts, experts, normalized.data() + row * d_model, d_model,
+                       centroids.data(), rows, experts, d_model, false);
+        }
+    });
+    pool.parallelFor(0, tokens, 64, [&](int64_t begin, int64_t end) {
+        std::vector<float> best(k);
+        for (auto token = begin; token < end; ++token) {
+            auto *row = scores.data() + token * experts;
+            auto *out = selection.data() + token * k;
+            std::fill(best.begin(), best.end(), -FLT_MAX);
+            std::fill(out, out + k, -1);
+            for (int e = 0; e < experts; ++e) {
+                if (!(row[e] > best[k - 1])) continue;
+                auto pos = k - 1;
+                for (; pos > 0 && row[e] > best[pos - 1]; --pos) {
+                    best[pos] = best[pos - 1];
+                    out[pos] = out[pos - 1];
+                }
+                best[pos] = row[e];
+                out[pos] = e;
+            }
+        }
+    });
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto tokens = argc > 1 ? atoi(argv[1]) : 2048;
+    auto d_model = argc > 2 ? atoi(argv[2]) : 1024;
+    auto k = argc > 3 ? atoi(argv[3]) : 1;
+    auto iterations = argc > 4 ? atoi(argv[4]) : 5;
+
+    auto &pool = ThreadPool::instance();
+    printf("tokens=%d d_model=%d k=%d workers=%d\n", tokens, d_model, k, pool.workerCount());
+
+    std::mt19937 rng(42);
+    auto input = randomVector(static_cast<size_t>(tokens) * d_model, rng);
+    auto gamma = randomVector(d_model, rng);
+    for (auto &v : gamma) v += 1;
+    std::vector<float> normalized(input.size());
+
+    printf("%-8s %14s %14s %10s %16s %10s\n", "experts", "unfused(ms)", "fused(ms)", "speedup", "avoided(MiB)",
+           "mismatch");
+    for (auto experts : {64, 256, 1024, 4096}) {
+        if (k > experts) continue;
+        auto centroids = randomVector(static_cast<size_t>(experts) * d_model, rng);
+        std::vector<float> scores(static_cast<size_t>(tokens) * experts);
+        std::vector<int> unfused(static_cast<size_t>(tokens) * k), fused(unfused.size());
+
+        auto unfused_ms = measure(iterations, [&] {
+            gateUnfused(input, tokens, d_model, centroids, experts, gamma, k, normalized, scores, unfused);
+        });
+        auto fused_ms = measure(iterations, [&] {
+            gate_topk_cpu(input.data(), tokens, d_model, centroids.data(), experts, gamma.data(), 1e-6, k,
+                          fused.data(), nullptr, pool.workerCount());
+        });
+        // summation order differs, so near ties may be broken differently
+        size_t mismatch = 0;
+        for (size_t i = 0; i < fused.size(); ++i) mismatch += fused[i] != unfused[i];
+        auto avoided = (scores.size() + normalized.size()) * sizeof(float) / 1048576.0;
+        printf("%-8d %14.3f %14.3f %9.2fx %16.1f %10zu\n", experts, unfused_ms, fused_ms, unfused_ms / fused_ms,
+               avoided, mismatch);
+    }
+    return 0;
+}
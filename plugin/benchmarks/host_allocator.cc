@@ -0,0 +1,85 @@
+// Host memory backends (runtime/HostAllocator.h):
+//   arrays:  allocating & freeing many small arrays (as npz weight files of many experts or per-call scratch) with
+//            new[] against slabs of the allocator
+//   weights: first touch (page faults) and streaming read bandwidth of one large weight block of each backend
+// PINNED has no pinner here (no CUDA), so it is plain memory and left out. Usage of each backend is reported last.
+//
+// usage: bench_host_allocator [arrays] [array_kb] [weight_mb] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../runtime/HostAllocator.h"
+#include "common.h"
+
+namespace {
+
+// keeps reads from being optimized out
+volatile uint64_t SINK;
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto arrays = argc > 1 ? atoi(argv[1]) : 10000;
+    auto array_kb = argc > 2 ? atoi(argv[2]) : 16;
+    auto weight_mb = argc > 3 ? atoi(argv[3]) : 1024;
+    auto iterations = argc > 4 ? atoi(argv[4]) : 5;
+    size_t array_size = static_cast<size_t>(array_kb) << 10;
+    size_t weight_size = static_cast<size_t>(weight_mb) << 20;
+    auto &allocator = HostAllocator::instance();
+    printf("arrays=%d array=%dKiB weight=%dMiB iterations=%d\n", arrays, array_kb, weight_mb, iterations);
+
+    printf("%-12s %14s %12s\n", "arrays", "alloc+free(us)", "touch(ms)");
+    std::vector<void *> pointers(arrays);
+    for (int backend = -1; backend < HostAllocator::BACKEND_COUNT; ++backend) {
+        if (backend == HostAllocator::PINNED) continue;
+        double alloc_ms = 0, touch_ms = 0;
+        for (int it = 0; it < iterations; ++it) {
+            auto start = std::chrono::steady_clock::now();
+            for (auto &p : pointers) {
+                p = backend < 0 ? new char[array_size]
+                                : allocator.allocate(array_size, static_cast<HostAllocator::Backend>(backend));
+            }
+            alloc_ms += elapsedMs(start);
+            start = std::chrono::steady_clock::now();
+            for (auto p : pointers) memset(p, 1, array_size);
+            touch_ms += elapsedMs(start);
+            start = std::chrono::steady_clock::now();
+            for (auto p : pointers) {
+                if (backend < 0) {
+                    delete[] static_cast<char *>(p);
+                } else {
+                    allocator.deallocate(p, array_size, static_cast<HostAllocator::Backend>(backend));
+                }
+            }
+            alloc_ms += elapsedMs(start);
+        }
+        auto name = backend < 0 ? "new[]" : HostAllocator::backendName(static_cast<HostAllocator::Backend>(backend));
+        printf("%-12s %14.3f %12.2f\n", name, alloc_ms * 1e3 / iterations / arrays, touch_ms / iterations);
+    }
+
+    printf("%-12s %14s %12s\n", "weights", "touch(ms)", "read(GB/s)");
+    for (int backend = HostAllocator::HUGE_PAGE; backend < HostAllocator::BACKEND_COUNT; ++backend) {
+        HostMemory block(weight_size, static_cast<HostAllocator::Backend>(backend));
+        auto start = std::chrono::steady_clock::now();
+        memset(block.data(), 0, weight_size);
+        auto touch_ms = elapsedMs(start);
+        auto words = block.data<uint64_t>();
+        uint64_t sum = 0;
+        start = std::chrono::steady_clock::now();
+        for (int it = 0; it < iterations; ++it) {
+            for (size_t i = 0; i < weight_size / 8; ++i) sum += words[i];
+        }
+        auto read_ms = elapsedMs(start);
+        SINK = sum;
+        printf("%-12s %14.2f %12.2f\n", HostAllocator::backendName(static_cast<HostAllocator::Backend>(backend)),
+               touch_ms, static_cast<double>(weight_size) * iterations / read_ms / 1e6);
+    }
+    allocator.report(stdout);
+    return 0;
+}
@@ -0,0 +1,108 @@
+// NUMA placement of expert weights (runtime/ExpertPlacement.h): streaming read bandwidth of a weight block
+// allocated on each node (HostAllocator with a node) by threads pinned on each node, so that local (diagonal) and
+// remote reads can be compared, followed by the aggregate bandwidth of every node reading its own block against
+// every node reading the block of the next node. On a single node there is only the local figure.
+//
+// usage: bench_numa [weight_mb] [threads_per_node] [iterations]
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../runtime/HostAllocator.h"
+#include "../runtime/Topology.h"
+
+namespace {
+
+// keeps reads from being optimized out
+volatile uint64_t SINK;
+
+void pinToNode(const NumaNode &node) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (auto cpu : node.cpus) CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+// each reader (node of its CPUs, block it reads) streams its block iterations times with threads threads, returns
+// total bytes read per second
+double readBandwidth(const std::vector<std::pair<int, const HostMemory *>> &readers, int threads, int iterations) {
+    auto &nodes = Topology::host().nodes();
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (auto &[node, block] : readers) {
+        total += block->size() * iterations;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&, node = node, block = block, t] {
+                pinToNode(nodes[node]);
+                auto words = block->data<uint64_t>();
+                auto count = block->size() / 8;
+                auto begin = count * t / threads, end = count * (t + 1) / threads;
+                uint64_t sum = 0;
+                for (int it = 0; it < iterations; ++it) {
+                    for (auto i = begin; i < end; ++i) sum += words[i];
+                }
+                SINK = sum;
+            });
+        }
+    }
+    for (auto &thread : pool) thread.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return total / elapsed.count() / 1e9;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto weight_mb = argc > 1 ? atoi(argv[1]) : 512;
+    auto threads = argc > 2 ? atoi(argv[2]) : 0;
+    auto iterations = argc > 3 ? atoi(argv[3]) : 5;
+    size_t weight_size = static_cast<size_t>(weight_mb) << 20;
+    auto &topology = Topology::host();
+    auto node_count = topology.nodeCount();
+    printf("nodes=%d weight=%dMiB iterations=%d\n", node_count, weight_mb, iterations);
+    for (auto &node : topology.nodes()) printf("node %d: %zu cpus\n", node.id, node.cpus.size());
+    if (threads <= 0) {
+        threads = static_cast<int>(topology.nodes()[0].cpus.size());
+        for (auto &node : topology.nodes()) threads = std::min(threads, static_cast<int>(node.cpus.size()));
+    }
+
+    std::vector<HostMemory> blocks;
+    for (int node = 0; node < node_count; ++node) {
+        blocks.emplace_back(weight_size, HostAllocator::weightBackend(), node);
+        // first touch from the node itself, as a fallback where binding memory is not permitted
+        std::thread([&, node] {
+            pinToNode(topology.nodes()[node]);
+            memset(blocks[node].data(), 1, weight_size);
+        }).join();
+    }
+
+    printf("read GB/s of %d threads, rows: memory node, columns: cpu node\n%8s", threads, "");
+    for (auto &node : topology.nodes()) printf(" %8d", node.id);
+    printf("\n");
+    for (int memory = 0; memory < node_count; ++memory) {
+        printf("%8d", topology.nodes()[memory].id);
+        for (int cpu = 0; cpu < node_count; ++cpu) {
+            printf(" %8.2f", readBandwidth({{cpu, &blocks[memory]}}, threads, iterations));
+        }
+        printf("\n");
+    }
+
+    std::vector<std::pair<int, const HostMemory *>> local, remote;
+    for (int node = 0; node < node_count; ++node) {
+        local.emplace_back(node, &blocks[node]);
+        remote.emplace_back(node, &blocks[(node + 1) % node_count]);
+    }
+    printf("all nodes, local weights:  %8.2f GB/s\n", readBandwidth(local, threads, iterations));
+    if (node_count > 1) printf("all nodes, remote weights: %8.2f GB/s\n", readBandwidth(remote, threads, iterations));
+    return 0;
+}
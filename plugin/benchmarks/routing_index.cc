@@ -0,0 +1,84 @@
+// Approximate routing with CentroidIndex against exact gating over all experts, for every number of probed lists:
+// recall@k, latency and share of expert centroids scored.
+// Experts are drawn around random directions (as trained centroids are rarely uniform), tokens around experts.
+//
+// usage: bench_routing_index [experts] [d_model] [lists] [tokens] [k]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../host/gating.h"
+#include "../runtime/CentroidIndex.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+namespace {
+
+// count rows around `groups` random directions, relative noise `spread`
+std::vector<float> clustered(int count, int length, int groups, float spread, std::mt19937 &rng) {
+    std::normal_distribution<float> dist;
+    std::vector<float> centers(static_cast<size_t>(groups) * length);
+    for (auto &v : centers) v = dist(rng);
+    std::vector<float> result(static_cast<size_t>(count) * length);
+    for (int i = 0; i < count; ++i) {
+        auto *center = centers.data() + static_cast<size_t>(rng() % groups) * length;
+        for (int j = 0; j < length; ++j) result[static_cast<size_t>(i) * length + j] = center[j] + spread * dist(rng);
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 4096;
+    auto d_model = argc > 2 ? atoi(argv[2]) : 1024;
+    auto lists = argc > 3 ? atoi(argv[3]) : static_cast<int>(std::sqrt(experts));
+    auto tokens = argc > 4 ? atoi(argv[4]) : 2048;
+    auto k = argc > 5 ? atoi(argv[5]) : 1;
+    const int iterations = 3;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d d_model=%d lists=%d tokens=%d k=%d workers=%d\n", experts, d_model, lists, tokens, k,
+           pool.workerCount());
+
+    std::mt19937 rng(42);
+    auto centroids = clustered(experts, d_model, lists, 2.0f, rng);
+    // tokens close to one expert each
+    std::vector<float> queries(static_cast<size_t>(tokens) * d_model);
+    std::normal_distribution<float> dist;
+    for (int t = 0; t < tokens; ++t) {
+        auto *expert = centroids.data() + static_cast<size_t>(rng() % experts) * d_model;
+        for (int j = 0; j < d_model; ++j) queries[static_cast<size_t>(t) * d_model + j] = expert[j] + 4.0f * dist(rng);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    CentroidIndex index(centroids.data(), experts, d_model, lists);
+    std::chrono::duration<double, std::milli> build = std::chrono::steady_clock::now() - start;
+    auto &offset = index.listOffset();
+    int largest = 0;
+    for (int l = 0; l < lists; ++l) largest = std::max(largest, offset[l + 1] - offset[l]);
+    printf("build %.1f ms, largest list %d experts (mean %.1f)\n", build.count(), largest,
+           static_cast<double>(experts) / lists);
+
+    std::vector<int> selection(static_cast<size_t>(tokens) * k);
+    auto exact_ms = measure(iterations, [&] {
+        gate_topk_cpu(queries.data(), tokens, d_model, centroids.data(), experts, nullptr, 0, k, selection.data(),
+                      nullptr, pool.workerCount());
+    });
+    printf("%-8s %10s %12s %10s %10s\n", "probes", "recall", "latency(ms)", "speedup", "scored");
+    printf("%-8s %10.4f %12.3f %9.2fx %9.1f%%\n", "exact", 1.0, exact_ms, 1.0, 100.0);
+    for (int probes = 1; probes <= std::min(CentroidIndex::MAX_PROBES, lists); ++probes) {
+        auto recall = index.recall(queries.data(), tokens, k, probes);
+        auto ms = measure(iterations, [&] {
+            index.search(queries.data(), tokens, k, probes, selection.data(), nullptr);
+        });
+        // lists are probed by size in expectation, count the lists themselves too
+        auto scored = (lists + static_cast<double>(experts) * probes / lists) / experts;
+        printf("%-8d %10.4f %12.3f %9.2fx %9.1f%%\n", probes, recall, ms, exact_ms / ms, 100 * scored);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Shared-memory rings of expert parallelism (runtime/ShmRing.h) between two processes: throughput of streaming
+// total_mb through one ring in writes of various sizes (from one token row up), and round-trip latency of a small
+// message over a pair of rings, as a worker of ExpertShards sees it.
+//
+// usage: bench_shm_ring [ring_mb] [total_mb] [round_trips]
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../runtime/ShmRing.h"
+
+int main(int argc, char **argv) {
+    auto ring_mb = argc > 1 ? atoi(argv[1]) : 16;
+    auto total_mb = argc > 2 ? atoi(argv[2]) : 4096;
+    auto round_trips = argc > 3 ? atoi(argv[3]) : 100000;
+    size_t capacity = static_cast<size_t>(ring_mb) << 20;
+    size_t total = static_cast<size_t>(total_mb) << 20;
+    if ((capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "ring_mb must be a power of 2\n");
+        return 1;
+    }
+    auto ring_size = ShmRing::sizeFor(capacity);
+    auto memory = static_cast<char *>(
+        mmap(nullptr, ring_size * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    printf("ring=%dMiB total=%dMiB\n", ring_mb, total_mb);
+    printf("%12s %12s\n", "write(B)", "GB/s");
+    for (size_t message : {size_t(4) << 10, size_t(64) << 10, size_t(1) << 20, size_t(16) << 20}) {
+        ShmRing ring(memory, capacity, true);
+        auto child = fork();
+        if (child == 0) {
+            std::vector<char> buffer(message);
+            for (size_t done = 0; done < total; done += message) ring.read(buffer.data(), message);
+            _exit(0);
+        }
+        std::vector<char> buffer(message, 1);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t done = 0; done < total; done += message) ring.write(buffer.data(), message);
+        waitpid(child, nullptr, 0);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%12zu %12.2f\n", message, total / elapsed.count() / 1e9);
+    }
+
+    // ping on one ring, pong on the other
+    ShmRing ping(memory, capacity, true), pong(memory + ring_size, capacity, true);
+    auto child = fork();
+    if (child == 0) {
+        int64_t value;
+        for (int i = 0; i < round_trips; ++i) {
+            ping.read(&value, sizeof(value));
+            pong.write(&value, sizeof(value));
+        }
+        _exit(0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < round_trips; ++i) {
+        int64_t value = i;
+        ping.write(&value, sizeof(value));
+        pong.read(&value, sizeof(value));
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    waitpid(child, nullptr, 0);
+    printf("round trip: %.2f us\n", elapsed.count() / round_trips);
+    munmap(memory, ring_size * 2);
+    return 0;
+}
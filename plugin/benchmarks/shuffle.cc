@@ -0,0 +1,91 @@
+// Bandwidth of host scatter / gather / mix-and-gather (host/shuffle.h) against plain memcpy of the same bytes and
+// against the naive row by row memcpy, for a random token order at d_model 1024 to 8192.
+// Bandwidth counts bytes read & written once (twice the destination, three times for mix).
+//
+// usage: bench_shuffle [tokens] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "../host/shuffle.h"
+#include "../runtime/ThreadPool.h"
+#include "common.h"
+
+int main(int argc, char **argv) {
+    auto tokens = argc > 1 ? atoi(argv[1]) : 4096;
+    auto iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    auto &pool = ThreadPool::instance();
+    auto workers = pool.workerCount();
+    printf("tokens=%d workers=%d\n", tokens, workers);
+
+    std::mt19937 rng(42);
+    std::vector<int> token_pos(tokens);
+    std::iota(token_pos.begin(), token_pos.end(), 0);
+    std::shuffle(token_pos.begin(), token_pos.end(), rng);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    std::vector<float> mix_coeff(tokens);
+    for (auto &v : mix_coeff) v = dist(rng);
+
+    printf("%-8s %-12s %8s %12s %10s %10s\n", "d_model", "routine", "threads", "latency(ms)", "GB/s", "of memcpy");
+    for (int d_model = 1024; d_model <= 8192; d_model *= 2) {
+        auto count = static_cast<size_t>(tokens) * d_model;
+        auto row_bytes = d_model * sizeof(float);
+        std::vector<float> input(count), routed(count), output(count), reference(count);
+        for (auto &v : input) v = dist(rng);
+        auto bytes = static_cast<double>(count) * sizeof(float);
+
+        auto memcpy_ms = measure(iterations, [&] { memcpy(output.data(), input.data(), count * sizeof(float)); });
+        auto report = [&](const char *routine, int threads, double ms, double passes) {
+            printf("%-8d %-12s %8d %12.3f %10.2f %9.2fx\n", d_model, routine, threads, ms, passes * bytes / ms / 1e6,
+                   memcpy_ms / ms * passes / 2);
+        };
+        report("memcpy", 1, memcpy_ms, 2);
+
+        // naive row by row memcpy, the reference results
+        auto naive_scatter = measure(iterations, [&] {
+            for (int r = 0; r < tokens; ++r) {
+                memcpy(&routed[r * d_model], &input[static_cast<size_t>(token_pos[r]) * d_model], row_bytes);
+            }
+        });
+        report("naive scat.", 1, naive_scatter, 2);
+        auto naive_gather = measure(iterations, [&] {
+            for (int r = 0; r < tokens; ++r) {
+                memcpy(&reference[static_cast<size_t>(token_pos[r]) * d_model], &routed[r * d_model], row_bytes);
+            }
+        });
+        report("naive gath.", 1, naive_gather, 2);
+
+        for (auto threads : {1, workers}) {
+            report("scatter", threads, measure(iterations, [&] {
+                       moe_expert_scatter_cpu(tokens, d_model, input.data(), nullptr, token_pos.data(), routed.data(),
+                                              nullptr, threads);
+                   }), 2);
+            report("gather", threads, measure(iterations, [&] {
+                       moe_expert_gather_cpu(tokens, tokens, d_model, routed.data(), token_pos.data(), output.data(),
+                                             threads);
+                   }), 2);
+            if (output != reference || output != input) fprintf(stderr, "wrong gather result\n");
+            report("mix+gather", threads, measure(iterations, [&] {
+                       moe_expert_base_layer_fused_mix_and_gather_cpu(tokens, tokens, d_model, token_pos.data(),
+                                                                      routed.data(), routed.data(), mix_coeff.data(),
+                                                                      output.data(), threads);
+                   }), 3);
+            // mixing a token with itself only leaves rounding errors
+            for (size_t i = 0; i < count; ++i) {
+                if (std::abs(output[i] - input[i]) > 1e-6f) {
+                    fprintf(stderr, "wrong mix result\n");
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
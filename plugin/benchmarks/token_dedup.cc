@@ -0,0 +1,118 @@
+// Token deduplication (dedup_tokens) against running every routed token through host experts: hit rate, latency of
+// routing & experts and error against the exact output, for batches of sequences sharing a growing prefix.
+// Tokens of a shared prefix are the same rows at the same position of every sequence (as hidden states of a causal
+// model), routed by top-1 gating on centroids so that identical rows go to the same expert. Deduplicated output may
+// only differ from the exact one by rounding of differently tiled GEMMs (experts run on fewer rows): tokens off by
+// more are counted as mismatches.
+//
+// usage: bench_token_dedup [experts] [sequences] [seq_len] [d_model] [hidden_size] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../host/gating.h"
+#include "../host/shuffle.h"
+#include "../host/t5ff.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ThreadPool.h"
+#include "../runtime/TokenDedup.h"
+#include "common.h"
+
+int main(int argc, char **argv) {
+    auto experts = argc > 1 ? atoi(argv[1]) : 16;
+    auto sequences = argc > 2 ? atoi(argv[2]) : 16;
+    auto seq_len = argc > 3 ? atoi(argv[3]) : 128;
+    auto d_model = argc > 4 ? atoi(argv[4]) : 1024;
+    auto hidden = argc > 5 ? atoi(argv[5]) : 2048;
+    auto iterations = argc > 6 ? atoi(argv[6]) : 3;
+    auto tokens = sequences * seq_len;
+
+    auto &pool = ThreadPool::instance();
+    printf("experts=%d sequences=%d seq_len=%d d_model=%d hidden=%d workers=%d\n", experts, sequences, seq_len,
+           d_model, hidden, pool.workerCount());
+
+    std::mt19937 rng(42);
+    RandomT5FFExperts expert_weights(experts, d_model, hidden, rng);
+    auto &weights = expert_weights.weights;
+    auto centroids = randomVector(static_cast<size_t>(experts) * d_model, rng);
+    auto feature_count = static_cast<size_t>(tokens) * d_model;
+    auto row_size = sizeof(float) * d_model;
+    auto distinct = randomVector(feature_count, rng);
+    std::vector<float> input(feature_count), exact(feature_count), output(feature_count);
+    std::vector<float> workspace(t5_ff_workspace_size(tokens, d_model, hidden));
+
+    ExpertScheduler scheduler(sizeof(float) * (3ul * d_model * hidden + d_model), 6.0 * d_model * hidden);
+    TokenDedup dedup;
+    std::vector<int> selection(tokens), count(experts), offset(experts + 1), token_pos(tokens), duplicates;
+    std::vector<float> score(tokens);
+    std::vector<uint64_t> row_hash(2 * static_cast<size_t>(tokens));
+    // routing, deduplication when enabled, experts and fan-out of duplicates
+    auto run = [&](bool deduplicate, float *out) {
+        gate_topk_cpu(input.data(), tokens, d_model, centroids.data(), experts, nullptr, 1e-6, 1, selection.data(),
+                      score.data(), pool.workerCount());
+        count_tokens_cpu(tokens, experts, selection.data(), token_pos.data(), count.data(), offset.data());
+        if (deduplicate) {
+            row_hash_cpu(tokens, d_model, input.data(), row_hash.data());
+            dedup.dedup(experts, count.data(), offset.data(), token_pos.data(), row_hash.data(), duplicates);
+        }
+        auto plan = scheduler.plan(experts, count.data(), offset.data());
+        scheduler.execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+            t5_ff_cpu_indexed(weights[item.expert], item.tokenCount, d_model, hidden,
+                              token_pos.data() + item.tokenOffset, input.data(), out, nullptr,
+                              workspace.data() + t5_ff_workspace_size(item.tokenOffset, d_model, hidden),
+                              item.parallelism);
+        });
+        if (deduplicate) fan_out_rows_cpu(duplicates.size() / 2, d_model, duplicates.data(), out, pool.workerCount());
+    };
+
+    printf("%-8s %9s %14s %14s %8s %12s %10s\n", "prefix", "hit rate", "exact(ms)", "dedup(ms)", "speedup",
+           "max error", "mismatch");
+    int total_mismatch = 0;
+    for (auto prefix_share : {0.0, 0.25, 0.5, 0.75, 0.9}) {
+        // the first prefix tokens of every sequence are those of sequence 0
+        auto prefix = static_cast<int>(prefix_share * seq_len);
+        for (int s = 0; s < sequences; ++s) {
+            for (int t = 0; t < seq_len; ++t) {
+                auto source = static_cast<size_t>(t < prefix ? t : s * seq_len + t);
+                memcpy(input.data() + (static_cast<size_t>(s) * seq_len + t) * d_model,
+                       distinct.data() + source * d_model, row_size);
+            }
+        }
+        double exact_ms = 0, dedup_ms = 0;
+        auto before = dedup.stats();
+        for (int it = 0; it < iterations; ++it) {
+            auto start = std::chrono::steady_clock::now();
+            run(false, exact.data());
+            exact_ms += elapsedMs(start);
+            start = std::chrono::steady_clock::now();
+            run(true, output.data());
+            dedup_ms += elapsedMs(start);
+        }
+        exact_ms /= iterations;
+        dedup_ms /= iterations;
+        auto after = dedup.stats();
+        auto hit_rate = static_cast<double>(after.duplicates - before.duplicates) / (after.tokens - before.tokens);
+        double max_error = 0;
+        int mismatch = 0;
+        for (int t = 0; t < tokens; ++t) {
+            float token_error = 0, magnitude = 0;
+            for (int i = 0; i < d_model; ++i) {
+                auto index = static_cast<size_t>(t) * d_model + i;
+                token_error = std::max(token_error, std::abs(output[index] - exact[index]));
+                magnitude = std::max(magnitude, std::abs(exact[index]));
+            }
+            if (token_error > 1e-5f * (1 + magnitude)) ++mismatch;
+            max_error = std::max(max_error, static_cast<double>(token_error));
+        }
+        total_mismatch += mismatch;
+        printf("%6.0f%%  %8.2f%% %14.2f %14.2f %7.2fx %12.2e %10d\n", 100 * prefix_share, 100 * hit_rate, exact_ms,
+               dedup_ms, exact_ms / dedup_ms, max_error, mismatch);
+    }
+    return total_mismatch != 0;
+}
@@ -16,6 +16,14 @@ __device__ __forceinline__ T WARP_SHFL(T value, int srcLane, int width = warpSiz
     return __shfl_sync(mask, value, srcLane, width);
 }
 
+// sum over all lanes of a warp, every lane gets the result
+template <typename T>
+__device__ __forceinline__ T warp_reduce_sum(T value) {
+#pragma unroll
+    for (int offset = WARP_SIZE / 2; offset > 0; offset >>= 1) value += WARP_SHFL_XOR(value, offset);
+    return value;
+}
+
 template <typename T>
 __device__ __host__ __forceinline__ T ceiling(T m, T n) {
     return (m + (n - 1)) / n;
@@ -0,0 +1,428 @@
+#include <cstdio>
+#include <cfloat>
+#include <cuda_runtime.h>
+
+#include "moe.h"
+
+#include "../utility.h"
+#include "../thirdparty/dbg.h"
+#include "common.cuh"
+
+namespace {
+
+// each block scores TILE_TOKENS tokens against all experts, TILE_EXPERTS experts at a time
+constexpr int TILE_TOKENS = 64;
+constexpr int TILE_EXPERTS = 64;
+constexpr int TILE_K = 16;
+// 16 x 16 threads, thread (tx, ty) owns tokens ty + 16 * r and experts tx + 16 * c of a tile
+constexpr int THREADS_X = 16;
+constexpr int THREADS_Y = 16;
+constexpr int ROWS_PER_THREAD = TILE_TOKENS / THREADS_Y;
+constexpr int COLS_PER_THREAD = TILE_EXPERTS / THREADS_X;
+
+// running top-k kept in registers, sorted by descending score, earlier expert first on ties
+template <int K>
+struct TopK {
+    float score[K];
+    int index[K];
+
+    __device__ __forceinline__ void init() {
+#pragma unroll
+        for (int k = 0; k < K; ++k) {
+            score[k] = -FLT_MAX;
+            index[k] = -1;
+        }
+    }
+
+    // experts are pushed in increasing index order, so strict comparison keeps the earlier one on ties
+    __device__ __forceinline__ void push(float s, int i) {
+        if (!(s > score[K - 1])) return;
+#pragma unroll
+        for (int k = 0; k < K; ++k) {
+            if (s > score[k]) {
+                auto ts = score[k];
+                auto ti = index[k];
+                score[k] = s;
+                index[k] = i;
+                s = ts;
+                i = ti;
+            }
+        }
+    }
+
+    __device__ __forceinline__ void pop() {
+#pragma unroll
+        for (int k = 0; k + 1 < K; ++k) {
+            score[k] = score[k + 1];
+            index[k] = index[k + 1];
+        }
+        score[K - 1] = -FLT_MAX;
+        index[K - 1] = -1;
+    }
+};
+
+__device__ __forceinline__ bool better(float s1, int i1, float s2, int i2) {
+    if (i2 < 0) return i1 >= 0;
+    if (i1 < 0) return false;
+    return s1 > s2 || (s1 == s2 && i1 < i2);
+}
+
+// score = layernorm(input) @ centroids^T computed tile by tile (register-blocked GEMM), only the top k experts of each
+// token are kept, so the token x expert affiliation matrix never reaches global memory
+template <int K, bool LAYERNORM>
+__global__ void fused_gate_topk_kernel(
+    const int token_num,
+    const int token_len,
+    const int expert_num,
+    const float *input,
+    const float *centroids,
+    const float *gamma,
+    const float epsilon,
+    int *gate_selection,
+    float *gate_score
+) {
+    __shared__ float token_tile[TILE_K][TILE_TOKENS];
+    __shared__ float expert_tile[TILE_K][TILE_EXPERTS];
+    __shared__ float token_mean[TILE_TOKENS];
+    __shared__ float token_invvar[TILE_TOKENS];
+
+    const int tx = threadIdx.x;
+    const int ty = threadIdx.y;
+    const int tid = ty * THREADS_X + tx;
+    const int first_token = blockIdx.x * TILE_TOKENS;
+
+    // prologue: layernorm statistics of the tokens of this block, one warp per token
+    if constexpr (LAYERNORM) {
+        const int warp = tid / WARP_SIZE;
+        const int lane = tid % WARP_SIZE;
+        constexpr int WARPS = THREADS_X * THREADS_Y / WARP_SIZE;
+        for (int t = warp; t < TILE_TOKENS; t += WARPS) {
+            const int token = first_token + t;
+            float sum = 0;
+            if (token < token_num) {
+                for (int i = lane; i < token_len; i += WARP_SIZE) sum += input[(size_t)token * token_len + i];
+            }
+            sum = warp_reduce_sum(sum);
+            const float mean = sum / token_len;
+            // second pass on centered values, rows are still in cache
+            float square_sum = 0;
+            if (token < token_num) {
+                for (int i = lane; i < token_len; i += WARP_SIZE) {
+                    auto centered = input[(size_t)token * token_len + i] - mean;
+                    square_sum += centered * centered;
+                }
+            }
+            square_sum = warp_reduce_sum(square_sum);
+            if (lane == 0) {
+                token_mean[t] = mean;
+                token_invvar[t] = rsqrtf(square_sum / token_len + epsilon);
+            }
+        }
+        __syncthreads();
+    }
+
+    TopK<K> top[ROWS_PER_THREAD];
+#pragma unroll
+    for (int r = 0; r < ROWS_PER_THREAD; ++r) top[r].init();
+
+    for (int first_expert = 0; first_expert < expert_num; first_expert += TILE_EXPERTS) {
+        float acc[ROWS_PER_THREAD][COLS_PER_THREAD] = {};
+        for (int k0 = 0; k0 < token_len; k0 += TILE_K) {
+            // load both tiles, coalesced along the feature dimension
+            for (int i = tid; i < TILE_TOKENS * TILE_K; i += THREADS_X * THREADS_Y) {
+                const int t = i / TILE_K, k = i % TILE_K;
+                const int token = first_token + t, feature = k0 + k;
+                float value = 0;
+                if (token < token_num && feature < token_len) {
+                    value = input[(size_t)token * token_len + feature];
+                    if constexpr (LAYERNORM) value = (value - token_mean[t]) * token_invvar[t] * gamma[feature];
+                }
+                token_tile[k][t] = value;
+            }
+            for (int i = tid; i < TILE_EXPERTS * TILE_K; i += THREADS_X * THREADS_Y) {
+                const int e = i / TILE_K, k = i % TILE_K;
+                const int expert = first_expert + e, feature = k0 + k;
+                expert_tile[k][e] = expert < expert_num && feature < token_len
+                                        ? centroids[(size_t)expert * token_len + feature]
+                                        : 0;
+            }
+            __syncthreads();
+#pragma unroll
+            for (int k = 0; k < TILE_K; ++k) {
+                float a[ROWS_PER_THREAD], b[COLS_PER_THREAD];
+#pragma unroll
+                for (int r = 0; r < ROWS_PER_THREAD; ++r) a[r] = token_tile[k][ty + THREADS_Y * r];
+#pragma unroll
+                for (int c = 0; c < COLS_PER_THREAD; ++c) b[c] = expert_tile[k][tx + THREADS_X * c];
+#pragma unroll
+                for (int r = 0; r < ROWS_PER_THREAD; ++r) {
+#pragma unroll
+                    for (int c = 0; c < COLS_PER_THREAD; ++c) acc[r][c] += a[r] * b[c];
+                }
+            }
+            __syncthreads();
+        }
+#pragma unroll
+        for (int c = 0; c < COLS_PER_THREAD; ++c) {
+            const int expert = first_expert + tx + THREADS_X * c;
+            if (expert >= expert_num) continue;
+#pragma unroll
+            for (int r = 0; r < ROWS_PER_THREAD; ++r) top[r].push(acc[r][c], expert);
+        }
+    }
+
+    // epilogue: merge the 16 lists of each token (16 consecutive lanes of one warp) by k rounds of arg max
+#pragma unroll
+    for (int r = 0; r < ROWS_PER_THREAD; ++r) {
+        const int token = first_token + ty + THREADS_Y * r;
+        for (int k = 0; k < K; ++k) {
+            float best_score = top[r].score[0];
+            int best_index = top[r].index[0];
+#pragma unroll
+            for (int offset = THREADS_X / 2; offset > 0; offset >>= 1) {
+                auto other_score = WARP_SHFL_XOR(best_score, offset, THREADS_X);
+                auto other_index = WARP_SHFL_XOR(best_index, offset, THREADS_X);
+                if (better(other_score, other_index, best_score, best_index)) {
+                    best_score = other_score;
+                    best_index = other_index;
+                }
+            }
+            // experts are partitioned among lanes, so only the owner pops the winner
+            if (best_index >= 0 && top[r].index[0] == best_index) top[r].pop();
+            if (tx == 0 && token < token_num) {
+                gate_selection[(size_t)token * K + k] = best_index;
+                if (gate_score != nullptr) gate_score[(size_t)token * K + k] = best_score;
+            }
+        }
+    }
+}
+
+// approximate gating over a centroid index (see runtime/CentroidIndex.h), one warp per token: only experts of the lists
+// probed by the token are scored
+template <bool LAYERNORM>
+__global__ void probe_top1_kernel(
+    const int token_num,
+    const int token_len,
+    const int probes,
+    const int probe_stride,
+    const int *probe_lists,
+    const int *list_offset,
+    const int *list_experts,
+    const float *sorted_centroids,
+    const float *input,
+    const float *gamma,
+    const float epsilon,
+    int *gate_selection,
+    float *gate_score
+) {
+    const int token = (blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+    const int lane = threadIdx.x % WARP_SIZE;
+    if (token >= token_num) return;
+    const float *row = input + (size_t)token * token_len;
+
+    float mean = 0, invvar = 1;
+    if constexpr (LAYERNORM) {
+        float sum = 0;
+        for (int i = lane; i < token_len; i += WARP_SIZE) sum += row[i];
+        mean = warp_reduce_sum(sum) / token_len;
+        float square_sum = 0;
+        for (int i = lane; i < token_len; i += WARP_SIZE) square_sum += (row[i] - mean) * (row[i] - mean);
+        invvar = rsqrtf(warp_reduce_sum(square_sum) / token_len + epsilon);
+    }
+
+    float best_score = -FLT_MAX;
+    int best_index = -1;
+    for (int p = 0; p < probes; ++p) {
+        const int list = probe_lists[(size_t)token * probe_stride + p];
+        if (list < 0) continue;
+        for (int pos = list_offset[list]; pos < list_offset[list + 1]; ++pos) {
+            const float *centroid = sorted_centroids + (size_t)pos * token_len;
+            float partial = 0;
+            for (int i = lane; i < token_len; i += WARP_SIZE) {
+                float value = row[i];
+                if constexpr (LAYERNORM) value = (value - mean) * invvar * gamma[i];
+                partial += value * centroid[i];
+            }
+            // every lane holds the full sum after the butterfly
+            const float score = warp_reduce_sum(partial);
+            const int expert = list_experts[pos];
+            if (better(score, expert, best_score, best_index)) {
+                best_score = score;
+                best_index = expert;
+            }
+        }
+    }
+    if (lane == 0) {
+        gate_selection[token] = best_index;
+        if (gate_score != nullptr) gate_score[token] = best_score;
+    }
+}
+
+// finalizer of MurmurHash3: consecutive keys land on unrelated experts
+__device__ __forceinline__ unsigned int mix_hash(unsigned int key) {
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+// expert of each token without scores: hash of its id (token_ids) or of its position in the sequence (token_ids is
+// nullptr), or given by expert_ids where experts out of [0, expert_num) drop the token (selection -1)
+__global__ void select_without_scores_kernel(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int expert_num,
+    const int *token_ids,
+    const int *expert_ids,
+    int *gate_selection
+) {
+    int row_id = blockIdx.x * blockDim.x + threadIdx.x;
+    if (row_id >= token_num) return;
+    int token = first_token + row_id;
+    int expert;
+    if (expert_ids != nullptr) {
+        expert = expert_ids[token];
+        if (expert < 0 || expert >= expert_num) expert = -1;
+    } else {
+        unsigned int key = token_ids != nullptr ? token_ids[token] : token % seq_len;
+        expert = mix_hash(key) % expert_num;
+    }
+    gate_selection[row_id] = expert;
+}
+
+template <int K>
+void launch_fused_gate_topk(
+    const int token_num,
+    const int token_len,
+    const int expert_num,
+    const float *d_input,
+    const float *d_centroids,
+    const float *d_layernorm_weight,
+    const double epsilon,
+    int *d_gate_selection,
+    float *d_gate_score,
+    cudaStream_t stream
+) {
+    dim3 block(THREADS_X, THREADS_Y);
+    dim3 grid(ceiling(token_num, TILE_TOKENS));
+    if (d_layernorm_weight != nullptr) {
+        fused_gate_topk_kernel<K, true><<<grid, block, 0, stream>>>(
+            token_num, token_len, expert_num, d_input, d_centroids, d_layernorm_weight, (float)epsilon,
+            d_gate_selection, d_gate_score
+        );
+    } else {
+        fused_gate_topk_kernel<K, false><<<grid, block, 0, stream>>>(
+            token_num, token_len, expert_num, d_input, d_centroids, nullptr, (float)epsilon,
+            d_gate_selection, d_gate_score
+        );
+    }
+}
+
+}; // unnamed namespace
+
+void moe_expert_fused_gate_topk(
+    const int token_num,
+    const int token_len,
+    const int expert_num,
+    const int k,
+    const float *d_input,
+    const float *d_centroids,
+    const float *d_layernorm_weight,
+    const double epsilon,
+    int *d_gate_selection,
+    float *d_gate_score,
+    cudaStream_t stream
+) {
+    if (token_num == 0) return;
+    assert(k <= expert_num);
+    switch (k) {
+        case 1:
+            launch_fused_gate_topk<1>(token_num, token_len, expert_num, d_input, d_centroids, d_layernorm_weight,
+                                      epsilon, d_gate_selection, d_gate_score, stream);
+            break;
+        case 2:
+            launch_fused_gate_topk<2>(token_num, token_len, expert_num, d_input, d_centroids, d_layernorm_weight,
+                                      epsilon, d_gate_selection, d_gate_score, stream);
+            break;
+        case 4:
+            launch_fused_gate_topk<4>(token_num, token_len, expert_num, d_input, d_centroids, d_layernorm_weight,
+                                      epsilon, d_gate_selection, d_gate_score, stream);
+            break;
+        case 8:
+            launch_fused_gate_topk<8>(token_num, token_len, expert_num, d_input, d_centroids, d_layernorm_weight,
+                                      epsilon, d_gate_selection, d_gate_score, stream);
+            break;
+        default:
+            fprintf(stderr, "ERROR: unsupported k of fused gating: %d\n", k);
+            assert(false);
+    }
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_probe_top1(
+    const int token_num,
+    const int token_len,
+    const int probes,
+    const int probe_stride,
+    const int *d_probe_lists,
+    const int *d_list_offset,
+    const int *d_list_experts,
+    const float *d_sorted_centroids,
+    const float *d_input,
+    const float *d_layernorm_weight,
+    const double epsilon,
+    int *d_gate_selection,
+    float *d_gate_score,
+    cudaStream_t stream
+) {
+    if (token_num == 0) return;
+    assert(probes >= 1 && probes <= probe_stride);
+    constexpr int BLOCK_SIZE = 128;
+    dim3 grid(ceiling(token_num * WARP_SIZE, BLOCK_SIZE));
+    if (d_layernorm_weight != nullptr) {
+        probe_top1_kernel<true><<<grid, BLOCK_SIZE, 0, stream>>>(
+            token_num, token_len, probes, probe_stride, d_probe_lists, d_list_offset, d_list_experts,
+            d_sorted_centroids, d_input, d_layernorm_weight, (float)epsilon, d_gate_selection, d_gate_score
+        );
+    } else {
+        probe_top1_kernel<false><<<grid, BLOCK_SIZE, 0, stream>>>(
+            token_num, token_len, probes, probe_stride, d_probe_lists, d_list_offset, d_list_experts,
+            d_sorted_centroids, d_input, nullptr, (float)epsilon, d_gate_selection, d_gate_score
+        );
+    }
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_hash_select(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int expert_num,
+    const int *d_token_ids,
+    int *d_gate_selection,
+    cudaStream_t stream
+) {
+    if (token_num == 0) return;
+    select_without_scores_kernel<<<ceiling(token_num, 512), 512, 0, stream>>>(
+        token_num, first_token, seq_len, expert_num, d_token_ids, nullptr, d_gate_selection
+    );
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_external_select(
+    const int token_num,
+    const int first_token,
+    const int expert_num,
+    const int *d_expert_ids,
+    int *d_gate_selection,
+    cudaStream_t stream
+) {
+    if (token_num == 0) return;
+    select_without_scores_kernel<<<ceiling(token_num, 512), 512, 0, stream>>>(
+        token_num, first_token, 1, expert_num, nullptr, d_expert_ids, d_gate_selection
+    );
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <cstdio>
 #include <cfloat>
 #include <cuda_runtime.h>
@@ -5,6 +6,7 @@
 #include "moe.h"
 
 #include "../utility.h"
+#include "../runtime/HostAllocator.h"
 #include "../thirdparty/dbg.h"
 #include "common.cuh"
 
@@ -127,6 +129,91 @@ __global__ void fused_batch_mix_and_gather_kernel(
 }
 
 
+// a token is padding if its position is beyond the length of its sequence, or if its mask value is zero
+__global__ void mask_padding_kernel(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int *seq_lengths,
+    const int *token_mask,
+    int *gate_selection
+) {
+    int row_id = blockIdx.x * blockDim.x + threadIdx.x;
+    if (row_id >= token_num) return;
+    int token = first_token + row_id;
+    bool valid = seq_lengths != nullptr ? token % seq_len < seq_lengths[token / seq_len] : token_mask[token] != 0;
+    if (!valid) gate_selection[row_id] = -1;
+}
+
+// a routed token skips its expert if its gate score is below min_score
+__global__ void skip_low_gate_kernel(
+    const int token_num,
+    const float min_score,
+    const float *gate_score,
+    int *gate_selection
+) {
+    int row_id = blockIdx.x * blockDim.x + threadIdx.x;
+    if (row_id >= token_num) return;
+    if (gate_selection[row_id] >= 0 && gate_score[row_id] < min_score) gate_selection[row_id] = -2;
+}
+
+template <typename T>
+__global__ void fill_padding_kernel(
+    size_t wid, const int *gate_selection, const T *padding_inbuf, const T *skipped_inbuf, T *oubuf
+) {
+    auto selection = gate_selection[blockIdx.x];
+    if (selection >= 0) return;
+    // padding (-1) or skipped (-2) token
+    auto inbuf = selection == -1 ? padding_inbuf : skipped_inbuf;
+    oubuf += wid * blockIdx.x;
+    if (inbuf != nullptr) inbuf += wid * blockIdx.x;
+    for (int i = threadIdx.x; i < wid; i += blockDim.x) {
+        oubuf[i] = inbuf != nullptr ? inbuf[i] : T(0);
+    }
+}
+
+// finalizer of splitmix64: every bit of the result depends on every bit of the word
+__device__ __forceinline__ uint64_t mix_word(uint64_t word) {
+    word ^= word >> 30;
+    word *= 0xbf58476d1ce4e5b9ull;
+    word ^= word >> 27;
+    word *= 0x94d049bb133111ebull;
+    word ^= word >> 31;
+    return word;
+}
+
+// 128-bit hash of each row (one warp per row), as two sums over its words of the mixed (position, bits) pair under
+// two seeds: sums do not depend on the order lanes reduce them, positions keep permuted rows apart
+__global__ void row_hash_kernel(size_t wid, const float *inbuf, uint64_t *hash) {
+    auto row = reinterpret_cast<const unsigned int *>(inbuf + wid * blockIdx.x);
+    uint64_t low = 0, high = 0;
+    for (int i = threadIdx.x; i < wid; i += blockDim.x) {
+        auto word = (static_cast<uint64_t>(i) << 32) | row[i];
+        low += mix_word(word ^ 0x9e3779b97f4a7c15ull);
+        high += mix_word(word ^ 0xd1b54a32d192ed03ull);
+    }
+#pragma unroll
+    for (int offset = WARP_SIZE / 2; offset > 0; offset >>= 1) {
+        low += __shfl_down_sync(0xffffffff, low, offset);
+        high += __shfl_down_sync(0xffffffff, high, offset);
+    }
+    if (threadIdx.x == 0) {
+        hash[2 * blockIdx.x] = low;
+        hash[2 * blockIdx.x + 1] = high;
+    }
+}
+
+// copy output of the representative of each duplicate token to its row, pairs: (duplicate, representative)
+template <typename T>
+__global__ void fan_out_kernel(size_t wid, const int *pairs, T *oubuf) {
+    auto dst = oubuf + wid * pairs[2 * blockIdx.x];
+    auto src = oubuf + wid * pairs[2 * blockIdx.x + 1];
+    for (int i = threadIdx.x; i < wid; i += blockDim.x) {
+        dst[i] = src[i];
+    }
+}
+
+
 template <typename T, bool USE_WARP_SHFL>
 __global__ void expert_select_average_kernel(
     const int token_num,
@@ -155,20 +242,57 @@ void moe_expert_select(
     expert_select_top1_kernel<float, false><<<ceiling(token_num, 512), 512, 0, stream>>>(
         token_num, expert_num, d_token_expert_aff, d_gate_selection, d_expert_weight
     );
-    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    CUDA_SAFE_CALL(cudaGetLastError());
 }
 
-void moe_expert_count(
+void moe_expert_mask_padding(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int *d_seq_lengths,
+    const int *d_token_mask,
+    int *d_gate_selection,
+    cudaStream_t stream
+) {
+    assert((d_seq_lengths == nullptr) != (d_token_mask == nullptr));
+    mask_padding_kernel<<<ceiling(token_num, 512), 512, 0, stream>>>(
+        token_num, first_token, seq_len, d_seq_lengths, d_token_mask, d_gate_selection
+    );
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_skip_low_gate(
+    const int token_num,
+    const float min_score,
+    const float *d_gate_score,
+    int *d_gate_selection,
+    cudaStream_t stream
+) {
+    skip_low_gate_kernel<<<ceiling(token_num, 512), 512, 0, stream>>>(
+        token_num, min_score, d_gate_score, d_gate_selection
+    );
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+int moe_expert_count(
     const int token_num,
     const int expert_num,
     const int *d_gate_selection,
     int *d_token_pos,
     int *expert_count,
     int *expert_offset,
-    cudaStream_t stream
+    cudaStream_t stream,
+    int *token_pos,
+    int *skipped_num
 ) {
-    auto gate_selection = new int[token_num];
-    auto token_pos = new int[token_num];
+    // scratch of every call, recycled by the allocator
+    HostMemory gate_selection_memory(sizeof(int) * token_num, HostAllocator::ALIGNED);
+    auto gate_selection = gate_selection_memory.data<int>();
+    HostMemory token_pos_memory;
+    if (token_pos == nullptr) {
+        token_pos_memory = HostMemory(sizeof(int) * token_num, HostAllocator::ALIGNED);
+        token_pos = token_pos_memory.data<int>();
+    }
 
     CUDA_SAFE_CALL(cudaMemcpyAsync(
         gate_selection, d_gate_selection, token_num * sizeof(int), cudaMemcpyDeviceToHost, stream
@@ -180,22 +304,31 @@ void moe_expert_count(
     // dbg("gate_selection");
     // showArray(gate_selection, 1, token_num);
     // showCudaArray(d_gate_selection, 1, token_num);
+    // padding (-1) & skipped (-2) tokens are not routed at all
+    if (skipped_num != nullptr) *skipped_num = 0;
     for (int i = 0; i < token_num; ++i) {
-        assert(gate_selection[i] != -1);
+        if (gate_selection[i] < 0) {
+            if (skipped_num != nullptr && gate_selection[i] == -2) ++*skipped_num;
+            continue;
+        }
+        assert(gate_selection[i] >= 0 && gate_selection[i] < expert_num);
         expert_count[gate_selection[i]]++;
     }
     expert_offset[0] = 0;
-    for (int i = 1; i < expert_num; ++i) {
+    for (int i = 1; i <= expert_num; ++i) {
         expert_offset[i] = expert_offset[i - 1] + expert_count[i - 1];
     }
+    auto routed_num = expert_offset[expert_num];
     // dbg("expert_count");
     // showArray(expert_count, 1, expert_num);
     // dbg("expert_offset");
     // showArray(expert_offset, 1, expert_num);
     // use expert_pos to fill token_pos
-    auto expert_pos = new int[expert_num];
+    HostMemory expert_pos_memory(sizeof(int) * expert_num, HostAllocator::ALIGNED);
+    auto expert_pos = expert_pos_memory.data<int>();
     memcpy(expert_pos, expert_offset, sizeof(int) * expert_num);
     for (int i = 0; i < token_num; ++i) {
+        if (gate_selection[i] < 0) continue;
         token_pos[expert_pos[gate_selection[i]]++] = i;
     }
     // dbg("expert_pos");
@@ -204,11 +337,13 @@ void moe_expert_count(
     // showArray(token_pos, 1, token_num);
 
     // copy back to GPU
-    CUDA_SAFE_CALL(cudaMemcpyAsync(d_token_pos, token_pos, token_num * sizeof(int), cudaMemcpyHostToDevice, stream));
-    delete[] expert_pos; // FIXME: potential memory corruption
-    delete[] gate_selection;
+    if (d_token_pos != nullptr) {
+        CUDA_SAFE_CALL(
+            cudaMemcpyAsync(d_token_pos, token_pos, routed_num * sizeof(int), cudaMemcpyHostToDevice, stream));
+    }
+    // token positions are freed on return
     CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
-    delete[] token_pos;
+    return routed_num;
 }
 
 void moe_expert_scatter(
@@ -224,7 +359,7 @@ void moe_expert_scatter(
     batch_scatter_feature_and_weight_kernel<<<token_num, 256, 0, stream>>>(
         token_len, d_token_pos, d_input, d_routed_features, d_mix_coeff, d_routed_mix_coeff
     );
-    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    CUDA_SAFE_CALL(cudaGetLastError());
 }
 
 void moe_expert_gather(
@@ -236,7 +371,7 @@ void moe_expert_gather(
     cudaStream_t stream
 ) {
     batch_gather_kernel<<<token_num, 256, 0, stream>>>(token_len, d_token_pos, d_routed_features, d_output);
-    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    CUDA_SAFE_CALL(cudaGetLastError());
 }
 
 void moe_expert_base_layer_fused_mix_and_gather(
@@ -254,5 +389,42 @@ void moe_expert_base_layer_fused_mix_and_gather(
     fused_batch_mix_and_gather_kernel<<<token_num, 256, 0, stream>>>(
         token_len, d_token_pos, d_mix_coeff, d_post_expert_features, d_routed_features, d_output
     );
-    CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_fill_padding(
+    const int token_num,
+    const int token_len,
+    const int *d_gate_selection,
+    const float *d_input,
+    const float *d_skipped_input,
+    float *d_output,
+    cudaStream_t stream
+) {
+    fill_padding_kernel<<<token_num, 256, 0, stream>>>(
+        token_len, d_gate_selection, d_input, d_skipped_input, d_output
+    );
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_row_hash(
+    const int token_num,
+    const int token_len,
+    const float *d_input,
+    uint64_t *d_row_hash,
+    cudaStream_t stream
+) {
+    row_hash_kernel<<<token_num, WARP_SIZE, 0, stream>>>(token_len, d_input, d_row_hash);
+    CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+void moe_expert_fan_out(
+    const int duplicate_num,
+    const int token_len,
+    const int *d_duplicates,
+    float *d_output,
+    cudaStream_t stream
+) {
+    fan_out_kernel<<<duplicate_num, 256, 0, stream>>>(token_len, d_duplicates, d_output);
+    CUDA_SAFE_CALL(cudaGetLastError());
 }
@@ -3,8 +3,13 @@
 #ifndef MOE_H
 #define MOE_H
 
+#include <cstdint>
+
 #include <cuda_runtime.h>
 
+// all functions only enqueue work on the given stream, except moe_expert_count which waits for the stream as it
+// sorts tokens on host
+
 // select expert index & weight for each token
 void moe_expert_select(
     const int token_num,
@@ -15,15 +20,105 @@ void moe_expert_select(
     cudaStream_t stream
 );
 
+// mark padding tokens of a (micro-)batch starting at first_token with gate selection -1, either by sequence lengths
+// (d_seq_lengths, one per sequence of seq_len tokens) or by token mask (d_token_mask, 0 for padding)
+void moe_expert_mask_padding(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int *d_seq_lengths,
+    const int *d_token_mask,
+    int *d_gate_selection,
+    cudaStream_t stream
+);
+
+// fused gating: score = layernorm(d_input) @ d_centroids^T (no layernorm if d_layernorm_weight is nullptr), keep the
+// best k experts (k = 1, 2, 4 or 8) of each token without materializing the token x expert affiliation matrix
+// d_centroids: (expert_num, token_len), d_gate_selection / d_gate_score: (token_num, k) best first, earlier expert
+// first on ties, d_gate_score can be nullptr
+void moe_expert_fused_gate_topk(
+    const int token_num,
+    const int token_len,
+    const int expert_num,
+    const int k,
+    const float *d_input,
+    const float *d_centroids,
+    const float *d_layernorm_weight,
+    const double epsilon,
+    int *d_gate_selection,
+    float *d_gate_score,
+    cudaStream_t stream
+);
+
+// approximate top-1 gating over a centroid index (runtime/CentroidIndex.h): each token is scored against the experts
+// of its lists d_probe_lists[token * probe_stride + i] (i < probes, e.g. from moe_expert_fused_gate_topk on list
+// centroids) only, d_list_offset / d_list_experts / d_sorted_centroids: experts grouped by list and their centroids
+// in that order, same output as moe_expert_fused_gate_topk with k = 1
+void moe_expert_probe_top1(
+    const int token_num,
+    const int token_len,
+    const int probes,
+    const int probe_stride,
+    const int *d_probe_lists,
+    const int *d_list_offset,
+    const int *d_list_experts,
+    const float *d_sorted_centroids,
+    const float *d_input,
+    const float *d_layernorm_weight,
+    const double epsilon,
+    int *d_gate_selection,
+    float *d_gate_score,
+    cudaStream_t stream
+);
+
+// hash routing without scores: expert = hash(key) % expert_num where key is the token id (d_token_ids of the whole
+// batch, shape (batch_size, seq_len)) or the position in its sequence of seq_len tokens when d_token_ids is nullptr
+void moe_expert_hash_select(
+    const int token_num,
+    const int first_token,
+    const int seq_len,
+    const int expert_num,
+    const int *d_token_ids,
+    int *d_gate_selection,
+    cudaStream_t stream
+);
+
+// external routing: expert of each token copied from d_expert_ids (whole batch), experts out of [0, expert_num) give
+// gate selection -1 so that the token is dropped like padding
+void moe_expert_external_select(
+    const int token_num,
+    const int first_token,
+    const int expert_num,
+    const int *d_expert_ids,
+    int *d_gate_selection,
+    cudaStream_t stream
+);
+
+// base layer: routed tokens whose gate score is below min_score skip their expert (gate selection set to -2), as
+// their gate weight sigmoid(score) leaves almost nothing of its output
+void moe_expert_skip_low_gate(
+    const int token_num,
+    const float min_score,
+    const float *d_gate_score,
+    int *d_gate_selection,
+    cudaStream_t stream
+);
+
 // count the tokens on each expert and obtain position for each token in routed_features
-void moe_expert_count(
+// padding & skipped tokens (gate selection -1 or -2) are left out, return the number of routed tokens (also
+// expert_offset[expert_num])
+// d_token_pos may be null when only the host copy token_pos (if not null) is used, skipped tokens are counted into
+// skipped_num if not null
+int moe_expert_count(
     const int token_num,
     const int expert_num,
     const int *d_gate_selection,
     int *d_token_pos,
     int *expert_count,
     int *expert_offset,
-    cudaStream_t stream
+    cudaStream_t stream,
+    int *token_pos = nullptr,
+    int *skipped_num = nullptr
 );
 
 // scatter d_input & d_mix_coeff according to d_token_pos into d_routed_features
@@ -63,4 +158,36 @@ void moe_expert_base_layer_fused_mix_and_gather(
     cudaStream_t stream
 );
 
+// write zeros (d_input is nullptr) or the corresponding input to d_output at padding tokens (gate selection -1), and
+// the same with d_skipped_input at tokens that skipped their expert (gate selection LoadShedder::SKIPPED, -2)
+void moe_expert_fill_padding(
+    const int token_num,
+    const int token_len,
+    const int *d_gate_selection,
+    const float *d_input,
+    const float *d_skipped_input,
+    float *d_output,
+    cudaStream_t stream
+);
+
+// 128-bit hash of each token row of d_input (same as row_hash_cpu of host/shuffle.h) into d_row_hash (token_num, 2):
+// rows of equal hashes are taken as bit-identical by token deduplication
+void moe_expert_row_hash(
+    const int token_num,
+    const int token_len,
+    const float *d_input,
+    uint64_t *d_row_hash,
+    cudaStream_t stream
+);
+
+// fan results of deduplicated tokens back out after gather: d_output[duplicate] = d_output[representative] for each
+// pair of d_duplicates (duplicate_num, 2)
+void moe_expert_fan_out(
+    const int duplicate_num,
+    const int token_len,
+    const int *d_duplicates,
+    float *d_output,
+    cudaStream_t stream
+);
+
 #endif // MOE_H
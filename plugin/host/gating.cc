@@ -0,0 +1,145 @@
+#include "gating.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "../runtime/ThreadPool.h"
+#include "ops.h"
+#include "simd.h"
+
+namespace {
+
+// tokens normalized together, each block of centroids is reused by all of them while in cache
+const int TOKEN_TILE = 32;
+const int EXPERT_TILE = 64;
+// tokens sharing one load of a centroid row
+const int TOKEN_GROUP = 4;
+
+// running top-k of one token, sorted by descending score, experts are pushed in increasing order so strict comparison
+// keeps the earlier one on ties
+void pushTopK(float s, int expert, int k, int *index, float *score) {
+    if (!(s > score[k - 1])) return;
+    auto pos = k - 1;
+    for (; pos > 0 && s > score[pos - 1]; --pos) {
+        score[pos] = score[pos - 1];
+        index[pos] = index[pos - 1];
+    }
+    score[pos] = s;
+    index[pos] = expert;
+}
+
+void gateTile(const float *input, int rows, int embeddingSize, const float *centroids, int expertCount,
+              const float *gamma, double epsilon, int k, int *selection, float *score) {
+    // layernorm output of the tile only, never the whole batch
+    thread_local std::vector<float> normalized;
+    thread_local std::vector<float> top_score;
+    const float *x = input;
+    if (gamma != nullptr) {
+        normalized.resize(static_cast<size_t>(TOKEN_TILE) * embeddingSize);
+        layernorm_cpu(normalized.data(), input, rows, embeddingSize, epsilon, gamma, nullptr);
+        x = normalized.data();
+    }
+    top_score.assign(static_cast<size_t>(rows) * k, -FLT_MAX);
+    std::fill(selection, selection + static_cast<size_t>(rows) * k, -1);
+
+    for (int first_expert = 0; first_expert < expertCount; first_expert += EXPERT_TILE) {
+        auto last_expert = std::min(first_expert + EXPERT_TILE, expertCount);
+        for (int row = 0; row < rows; row += TOKEN_GROUP) {
+            // rows past the tile repeat the last one, their scores are dropped
+            const float *a[TOKEN_GROUP];
+            for (int i = 0; i < TOKEN_GROUP; ++i)
+                a[i] = x + static_cast<size_t>(std::min(row + i, rows - 1)) * embeddingSize;
+            auto group = std::min(TOKEN_GROUP, rows - row);
+            for (int expert = first_expert; expert < last_expert; ++expert) {
+                float s[TOKEN_GROUP];
+                simd::dot4(a[0], a[1], a[2], a[3], centroids + static_cast<size_t>(expert) * embeddingSize,
+                           embeddingSize, s);
+                for (int i = 0; i < group; ++i) {
+                    auto token = static_cast<size_t>(row + i) * k;
+                    pushTopK(s[i], expert, k, selection + token, top_score.data() + token);
+                }
+            }
+        }
+    }
+    if (score != nullptr) std::copy(top_score.begin(), top_score.end(), score);
+}
+
+// same as mix_hash of cuda/gating.cu (murmur3 finalizer), so that both backends route alike
+inline uint32_t mixHash(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+}  // namespace
+
+void gate_topk_cpu(const float *input, int32_t tokenCount, int embeddingSize, const float *centroids, int expertCount,
+                   const float *gamma, double epsilon, int k, int *selection, float *score, int parallelism) {
+    auto token_tiles = (tokenCount + TOKEN_TILE - 1) / TOKEN_TILE;
+    auto body = [&](int64_t begin, int64_t end) {
+        for (auto tile = begin; tile < end; ++tile) {
+            auto row = static_cast<size_t>(tile) * TOKEN_TILE;
+            auto rows = std::min<int>(TOKEN_TILE, tokenCount - row);
+            gateTile(input + row * embeddingSize, rows, embeddingSize, centroids, expertCount, gamma, epsilon, k,
+                     selection + row * k, score == nullptr ? nullptr : score + row * k);
+        }
+    };
+    if (parallelism <= 1 || token_tiles <= 1) {
+        body(0, token_tiles);
+        return;
+    }
+    ThreadPool::instance().parallelFor(0, token_tiles, std::max<int64_t>(1, token_tiles / parallelism), body);
+}
+
+void select_without_scores_cpu(int32_t tokenCount, int firstToken, int seqLen, int expertCount, const int *tokenIds,
+                               const int *expertIds, int *selection) {
+    for (int32_t row = 0; row < tokenCount; ++row) {
+        auto token = firstToken + row;
+        if (expertIds != nullptr) {
+            auto expert = expertIds[token];
+            selection[row] = expert >= 0 && expert < expertCount ? expert : -1;
+        } else {
+            uint32_t key = tokenIds != nullptr ? tokenIds[token] : token % seqLen;
+            selection[row] = static_cast<int>(mixHash(key) % expertCount);
+        }
+    }
+}
+
+void mask_padding_cpu(int32_t tokenCount, int firstToken, int seqLen, const int *seqLengths, const int *tokenMask,
+                      int *selection) {
+    for (int32_t row = 0; row < tokenCount; ++row) {
+        auto token = firstToken + row;
+        auto valid = seqLengths != nullptr ? token % seqLen < seqLengths[token / seqLen] : tokenMask[token] != 0;
+        if (!valid) selection[row] = -1;
+    }
+}
+
+int skip_low_gate_cpu(int32_t tokenCount, float minScore, const float *score, int *selection) {
+    int skipped = 0;
+    for (int32_t i = 0; i < tokenCount; ++i) {
+        if (selection[i] < 0 || score[i] >= minScore) continue;
+        selection[i] = -2;
+        ++skipped;
+    }
+    return skipped;
+}
+
+int count_tokens_cpu(int32_t tokenCount, int expertCount, const int *selection, int *tokenPos, int *expertTokenCount,
+                     int *expertOffset) {
+    std::fill(expertTokenCount, expertTokenCount + expertCount, 0);
+    for (int32_t i = 0; i < tokenCount; ++i) {
+        if (selection[i] >= 0) ++expertTokenCount[selection[i]];
+    }
+    expertOffset[0] = 0;
+    for (int e = 0; e < expertCount; ++e) expertOffset[e + 1] = expertOffset[e] + expertTokenCount[e];
+    // expertOffset[e] is the cursor of expert e while placing tokens, then moved back to its start
+    for (int32_t i = 0; i < tokenCount; ++i) {
+        if (selection[i] >= 0) tokenPos[expertOffset[selection[i]]++] = i;
+    }
+    for (int e = 0; e < expertCount; ++e) expertOffset[e] -= expertTokenCount[e];
+    return expertOffset[expertCount];
+}
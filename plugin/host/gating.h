@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef HOST_GATING_H
+#define HOST_GATING_H
+
+#include <cstdint>
+
+// host counterpart of moe_expert_fused_gate_topk: score = layernorm(input) @ centroids^T (no layernorm if gamma is
+// NULL), keeping the best k experts of each token without materializing the token x expert affiliation matrix
+// centroids: (expertCount, embeddingSize), selection / score: (tokenCount, k) best first, earlier expert first on
+// ties, score can be NULL
+// parallelism is the number of workers the call may occupy, as in t5_ff_cpu
+void gate_topk_cpu(const float *input, int32_t tokenCount, int embeddingSize, const float *centroids, int expertCount,
+                   const float *gamma, double epsilon, int k, int *selection, float *score, int parallelism);
+
+// host counterparts of moe_expert_hash_select (expertIds NULL, tokenIds NULL to hash positions) and
+// moe_expert_external_select (expertIds given), tokens are [firstToken, firstToken + tokenCount) of the batch
+void select_without_scores_cpu(int32_t tokenCount, int firstToken, int seqLen, int expertCount, const int *tokenIds,
+                               const int *expertIds, int *selection);
+
+// host counterpart of moe_expert_mask_padding: selection of padding tokens is set to -1
+void mask_padding_cpu(int32_t tokenCount, int firstToken, int seqLen, const int *seqLengths, const int *tokenMask,
+                      int *selection);
+
+// host counterpart of moe_expert_skip_low_gate: routed tokens whose score is below minScore are marked -2, returns
+// how many
+int skip_low_gate_cpu(int32_t tokenCount, float minScore, const float *score, int *selection);
+
+// counting sort of moe_expert_count without allocation: tokens of expert e are
+// tokenPos[expertOffset[e], expertOffset[e + 1]), padding & skipped tokens (-1, -2) are left out, returns the number
+// of routed tokens
+int count_tokens_cpu(int32_t tokenCount, int expertCount, const int *selection, int *tokenPos, int *expertTokenCount,
+                     int *expertOffset);
+
+#endif  // HOST_GATING_H
@@ -0,0 +1,41 @@
+#pragma once
+
+#ifndef HOST_OPS_H
+#define HOST_OPS_H
+
+#include <cstddef>
+
+// host counterparts of cuda/ops.h, all matrices are row major
+// every function works on the given rows only, callers split work among ThreadPool workers
+
+// y[m, n] = x[m, k] @ w[n, k]^T (+ y[m, n] if accumulate), the layout of torch.nn.Linear
+void linear_cpu(float* __restrict__ y, int ldy,
+                const float* __restrict__ x, int ldx,
+                const float* __restrict__ w,  // n rows of k contiguous floats
+                int m, int n, int k, bool accumulate);
+
+// linear_cpu for m <= 4 rows (decoding): each row of w is read once for all rows of x, where the remainder of
+// linear_cpu reads it once per row
+void gemv_cpu(float* __restrict__ y, int ldy, const float* __restrict__ x, int ldx, const float* __restrict__ w, int m,
+              int n, int k, bool accumulate);
+
+void layernorm_cpu(float* __restrict__ output, const float* __restrict__ input,
+                   int n1,  // rows
+                   int n2,  // embedding_size (or d_model)
+                   double epsilon,  // default to 1e-6
+                   const float* gamma,  // weight, can be NULL
+                   const float* beta);  // bias, can be NULL
+
+// B = gelu(A) . B
+void fused_gelu_dot_cpu(const float* A, float* B, size_t len);
+
+// rows [begin, end) of dst with width floats each: dst[r] = src[source[r]], rows with source -1 are left as is.
+// Source rows a few rows ahead are prefetched, and with streaming dst is written with non-temporal stores
+// (simd::storeFence is called before returning)
+void copy_rows_cpu(float* dst, const float* src, const int* source, int begin, int end, int width, bool streaming);
+
+// same as copy_rows_cpu with dst[r] = alpha * a[s] + (1 - alpha) * b[s], s = source[r], alpha = sigmoid(mixCoeff[s])
+void mix_rows_cpu(float* dst, const float* a, const float* b, const float* mixCoeff, const int* source, int begin,
+                  int end, int width, bool streaming);
+
+#endif  // HOST_OPS_H
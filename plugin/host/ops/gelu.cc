@@ -0,0 +1,20 @@
+#include <cmath>
+
+#include "../ops.h"
+
+namespace {
+
+// same constants as gelu_dot in cuda/ops/gelu.cu
+const float GELU_A = 0.5f;
+const float GELU_B = 0.7978845608028654f;    // sqrt(2.0/M_PI)
+const float GELU_C = 0.035677408136300125f;  // 0.044715 * sqrt(2.0/M_PI)
+
+}  // namespace
+
+void fused_gelu_dot_cpu(const float* A, float* B, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        auto a = A[i];
+        auto cdf = GELU_A * (1 + std::tanh(a * (GELU_C * a * a + GELU_B)));
+        B[i] = a * cdf * B[i];
+    }
+}
@@ -0,0 +1,27 @@
+#include <cmath>
+
+#include "../ops.h"
+
+// same semantics as layernorm_gpu (adapted from apex), statistics are accumulated in double
+void layernorm_cpu(float* __restrict__ output, const float* __restrict__ input, int n1, int n2, double epsilon,
+                   const float* gamma, const float* beta) {
+    for (int i1 = 0; i1 < n1; ++i1) {
+        auto row = input + static_cast<size_t>(i1) * n2;
+        auto out = output + static_cast<size_t>(i1) * n2;
+        double sum = 0, square_sum = 0;
+        for (int i2 = 0; i2 < n2; ++i2) {
+            sum += row[i2];
+            square_sum += static_cast<double>(row[i2]) * row[i2];
+        }
+        auto mu = sum / n2;
+        auto sigma2 = square_sum / n2 - mu * mu;
+        auto invvar = static_cast<float>(1.0 / std::sqrt(sigma2 + epsilon));
+        auto mean = static_cast<float>(mu);
+        for (int i2 = 0; i2 < n2; ++i2) {
+            auto value = invvar * (row[i2] - mean);
+            if (gamma != nullptr) value *= gamma[i2];
+            if (beta != nullptr) value += beta[i2];
+            out[i2] = value;
+        }
+    }
+}
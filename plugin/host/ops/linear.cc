@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <cassert>
+
+#include "../ops.h"
+#include "../simd.h"
+
+namespace {
+
+// columns of w processed together, sized so that the block stays in L2 for typical d_model
+const int COLUMN_BLOCK = 64;
+
+}  // namespace
+
+void linear_cpu(float* __restrict__ y, int ldy, const float* __restrict__ x, int ldx, const float* __restrict__ w,
+                int m, int n, int k, bool accumulate) {
+    float out[4];
+    for (int col_begin = 0; col_begin < n; col_begin += COLUMN_BLOCK) {
+        auto col_end = std::min(n, col_begin + COLUMN_BLOCK);
+        int i = 0;
+        // 4 rows at a time, each row of w is reused by all of them
+        for (; i + 4 <= m; i += 4) {
+            auto x0 = x + i * ldx;
+            for (int j = col_begin; j < col_end; ++j) {
+                simd::dot4(x0, x0 + ldx, x0 + 2 * ldx, x0 + 3 * ldx, w + static_cast<size_t>(j) * k, k, out);
+                for (int r = 0; r < 4; ++r) {
+                    auto& dst = y[(i + r) * ldy + j];
+                    dst = accumulate ? dst + out[r] : out[r];
+                }
+            }
+        }
+        for (; i < m; ++i) {
+            for (int j = col_begin; j < col_end; ++j) {
+                auto value = simd::dot(x + i * ldx, w + static_cast<size_t>(j) * k, k);
+                auto& dst = y[i * ldy + j];
+                dst = accumulate ? dst + value : value;
+            }
+        }
+    }
+}
+
+void gemv_cpu(float* __restrict__ y, int ldy, const float* __restrict__ x, int ldx, const float* __restrict__ w, int m,
+              int n, int k, bool accumulate) {
+    assert(m >= 1 && m <= 4);
+    // rows past m repeat the last one, their results are dropped
+    const float* rows[4];
+    for (int r = 0; r < 4; ++r) rows[r] = x + std::min(r, m - 1) * ldx;
+    float out[4];
+    for (int j = 0; j < n; ++j) {
+        auto* w_row = w + static_cast<size_t>(j) * k;
+        if (m == 1) {
+            out[0] = simd::dot(rows[0], w_row, k);
+        } else {
+            simd::dot4(rows[0], rows[1], rows[2], rows[3], w_row, k, out);
+        }
+        for (int r = 0; r < m; ++r) {
+            auto& dst = y[r * ldy + j];
+            dst = accumulate ? dst + out[r] : out[r];
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#include <cmath>
+
+#include "../ops.h"
+#include "../simd.h"
+
+namespace {
+
+// rows between the row being copied and the row being prefetched, enough to cover memory latency of random rows
+const int PREFETCH_ROWS = 2;
+
+// source row PREFETCH_ROWS after r, or null (end of range or skipped row)
+inline const float* ahead(const float* base, const int* source, int r, int end, size_t width) {
+    auto next = r + PREFETCH_ROWS;
+    return next < end && source[next] >= 0 ? base + source[next] * width : nullptr;
+}
+
+}  // namespace
+
+void copy_rows_cpu(float* dst, const float* src, const int* source, int begin, int end, int width, bool streaming) {
+    auto row_width = static_cast<size_t>(width);
+    for (auto r = begin; r < end; ++r) {
+        if (source[r] < 0) continue;
+        simd::copy(dst + r * row_width, src + source[r] * row_width, width, ahead(src, source, r, end, row_width),
+                   streaming);
+    }
+    if (streaming) simd::storeFence();
+}
+
+void mix_rows_cpu(float* dst, const float* a, const float* b, const float* mixCoeff, const int* source, int begin,
+                  int end, int width, bool streaming) {
+    auto row_width = static_cast<size_t>(width);
+    for (auto r = begin; r < end; ++r) {
+        auto s = source[r];
+        if (s < 0) continue;
+        auto alpha = 1.0f / (1.0f + std::exp(-mixCoeff[s]));
+        simd::mix(dst + r * row_width, a + s * row_width, b + s * row_width, alpha, width,
+                  ahead(a, source, r, end, row_width), ahead(b, source, r, end, row_width), streaming);
+    }
+    if (streaming) simd::storeFence();
+}
@@ -0,0 +1,105 @@
+#include "shuffle.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "../runtime/ThreadPool.h"
+#include "ops.h"
+
+namespace {
+
+// destinations of at least this many bytes are streamed: they would not fit in the caches anyway, and bypassing them
+// keeps weights & activations of experts cached
+const size_t STREAMING_BYTES = 8ul << 20;
+// rows per task, large enough for prefetching to reach a steady state
+const int64_t ROW_GRAIN = 64;
+
+bool streams(int32_t rows, int tokenLen) {
+    return static_cast<size_t>(rows) * tokenLen * sizeof(float) >= STREAMING_BYTES;
+}
+
+// run body on row ranges of [0, count), split among at most parallelism workers
+template <typename F>
+void forRows(int32_t count, int parallelism, const F &body) {
+    if (parallelism <= 1 || count <= ROW_GRAIN) {
+        body(0, count);
+        return;
+    }
+    auto grain = std::max<int64_t>(ROW_GRAIN, (count + parallelism - 1) / parallelism);
+    ThreadPool::instance().parallelFor(0, count, grain, body);
+}
+
+// routed row of each output row, -1 for rows without token; kept between calls so that gathers do not allocate
+const int *invert(int32_t routedCount, int32_t tokenCount, const int *tokenPos) {
+    thread_local std::vector<int> source;
+    source.assign(tokenCount, -1);
+    for (int32_t r = 0; r < routedCount; ++r) source[tokenPos[r]] = r;
+    return source.data();
+}
+
+// same as mix_word of cuda/moe.cu (splitmix64 finalizer), so that both backends hash rows alike
+inline uint64_t mixWord(uint64_t word) {
+    word ^= word >> 30;
+    word *= 0xbf58476d1ce4e5b9ull;
+    word ^= word >> 27;
+    word *= 0x94d049bb133111ebull;
+    word ^= word >> 31;
+    return word;
+}
+
+}  // namespace
+
+void moe_expert_scatter_cpu(int32_t routedCount, int tokenLen, const float *input, const float *mixCoeff,
+                            const int *tokenPos, float *routed, float *routedMixCoeff, int parallelism) {
+    auto streaming = streams(routedCount, tokenLen);
+    forRows(routedCount, parallelism, [&](int64_t begin, int64_t end) {
+        copy_rows_cpu(routed, input, tokenPos, begin, end, tokenLen, streaming);
+        if (mixCoeff == nullptr || routedMixCoeff == nullptr) return;
+        for (auto r = begin; r < end; ++r) routedMixCoeff[r] = mixCoeff[tokenPos[r]];
+    });
+}
+
+void moe_expert_gather_cpu(int32_t routedCount, int32_t tokenCount, int tokenLen, const float *postExpert,
+                           const int *tokenPos, float *output, int parallelism) {
+    auto source = invert(routedCount, tokenCount, tokenPos);
+    auto streaming = streams(tokenCount, tokenLen);
+    forRows(tokenCount, parallelism, [&](int64_t begin, int64_t end) {
+        copy_rows_cpu(output, postExpert, source, begin, end, tokenLen, streaming);
+    });
+}
+
+void moe_expert_base_layer_fused_mix_and_gather_cpu(int32_t routedCount, int32_t tokenCount, int tokenLen,
+                                                    const int *tokenPos, const float *routed,
+                                                    const float *postExpert, const float *routedMixCoeff,
+                                                    float *output, int parallelism) {
+    auto source = invert(routedCount, tokenCount, tokenPos);
+    auto streaming = streams(tokenCount, tokenLen);
+    forRows(tokenCount, parallelism, [&](int64_t begin, int64_t end) {
+        mix_rows_cpu(output, postExpert, routed, routedMixCoeff, source, begin, end, tokenLen, streaming);
+    });
+}
+
+void row_hash_cpu(int32_t tokenCount, int tokenLen, const float *input, uint64_t *rowHash) {
+    for (int32_t t = 0; t < tokenCount; ++t) {
+        auto row = reinterpret_cast<const uint32_t *>(input + static_cast<size_t>(t) * tokenLen);
+        uint64_t low = 0, high = 0;
+        for (int i = 0; i < tokenLen; ++i) {
+            auto word = (static_cast<uint64_t>(i) << 32) | row[i];
+            low += mixWord(word ^ 0x9e3779b97f4a7c15ull);
+            high += mixWord(word ^ 0xd1b54a32d192ed03ull);
+        }
+        rowHash[2 * t] = low;
+        rowHash[2 * t + 1] = high;
+    }
+}
+
+void fan_out_rows_cpu(int32_t duplicateCount, int tokenLen, const int *duplicates, float *output, int parallelism) {
+    auto row_size = sizeof(float) * tokenLen;
+    forRows(duplicateCount, parallelism, [&](int64_t begin, int64_t end) {
+        for (auto d = begin; d < end; ++d) {
+            memcpy(output + static_cast<size_t>(duplicates[2 * d]) * tokenLen,
+                   output + static_cast<size_t>(duplicates[2 * d + 1]) * tokenLen, row_size);
+        }
+    });
+}
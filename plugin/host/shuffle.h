@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef HOST_SHUFFLE_H
+#define HOST_SHUFFLE_H
+
+#include <cstdint>
+
+// host counterparts of moe_expert_scatter, moe_expert_gather and moe_expert_base_layer_fused_mix_and_gather of
+// cuda/moe.h, for tokens of width tokenLen floats. Work is split by ranges of destination rows among at most
+// parallelism workers of ThreadPool::instance() (1 runs inline), so each worker writes one contiguous range:
+// gathers first invert tokenPos to read source rows in destination order. Destinations larger than the caches are
+// written with non-temporal stores.
+
+// routed[r] = input[tokenPos[r]] and routedMixCoeff[r] = mixCoeff[tokenPos[r]] (when both are not null)
+void moe_expert_scatter_cpu(int32_t routedCount, int tokenLen, const float *input, const float *mixCoeff,
+                            const int *tokenPos, float *routed, float *routedMixCoeff, int parallelism);
+
+// output[tokenPos[r]] = postExpert[r], output has tokenCount rows, rows of no routed token (padding) are left as is
+void moe_expert_gather_cpu(int32_t routedCount, int32_t tokenCount, int tokenLen, const float *postExpert,
+                           const int *tokenPos, float *output, int parallelism);
+
+// output[tokenPos[r]] = alpha * postExpert[r] + (1 - alpha) * routed[r], alpha = sigmoid(routedMixCoeff[r])
+void moe_expert_base_layer_fused_mix_and_gather_cpu(int32_t routedCount, int32_t tokenCount, int tokenLen,
+                                                    const int *tokenPos, const float *routed,
+                                                    const float *postExpert, const float *routedMixCoeff,
+                                                    float *output, int parallelism);
+
+// same 128-bit hash of each row as moe_expert_row_hash: rowHash[2 * t] and rowHash[2 * t + 1] for token t
+void row_hash_cpu(int32_t tokenCount, int tokenLen, const float *input, uint64_t *rowHash);
+
+// output[duplicates[2 * d]] = output[duplicates[2 * d + 1]], as moe_expert_fan_out
+void fan_out_rows_cpu(int32_t duplicateCount, int tokenLen, const int *duplicates, float *output, int parallelism);
+
+#endif  // HOST_SHUFFLE_H
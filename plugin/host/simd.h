@@ -0,0 +1,158 @@
+#pragma once
+
+#ifndef HOST_SIMD_H
+#define HOST_SIMD_H
+
+// thin helpers over x86 SIMD intrinsics, with scalar fallbacks for other targets
+// (the plugin is built with -march=native by default, see CPU_ARCH in meson_options.txt)
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define HOST_SIMD_AVX2 1
+#if defined(__AVX512F__)
+#define HOST_SIMD_AVX512 1
+#endif
+#endif
+
+namespace simd {
+
+#ifdef HOST_SIMD_AVX2
+static const int WIDTH = 8;
+
+inline float hsum(__m256 v) {
+    auto lo = _mm256_castps256_ps128(v);
+    auto hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+#else
+static const int WIDTH = 1;
+#endif
+
+inline float dot(const float* __restrict__ a, const float* __restrict__ b, int len) {
+    int i = 0;
+    float result = 0;
+#ifdef HOST_SIMD_AVX2
+    auto acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= len; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    result = hsum(_mm256_add_ps(acc0, acc1));
+#endif
+    for (; i < len; ++i) result += a[i] * b[i];
+    return result;
+}
+
+// four dot products sharing the right-hand side, so that it is loaded only once
+inline void dot4(const float* a0, const float* a1, const float* a2, const float* a3, const float* __restrict__ b,
+                 int len, float* out) {
+    int i = 0;
+    float r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+#ifdef HOST_SIMD_AVX2
+    auto acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    auto acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    for (; i + 8 <= len; i += 8) {
+        auto vb = _mm256_loadu_ps(b + i);
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + i), vb, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + i), vb, acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + i), vb, acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + i), vb, acc3);
+    }
+    r0 = hsum(acc0);
+    r1 = hsum(acc1);
+    r2 = hsum(acc2);
+    r3 = hsum(acc3);
+#endif
+    for (; i < len; ++i) {
+        r0 += a0[i] * b[i];
+        r1 += a1[i] * b[i];
+        r2 += a2[i] * b[i];
+        r3 += a3[i] * b[i];
+    }
+    out[0] = r0;
+    out[1] = r1;
+    out[2] = r2;
+    out[3] = r3;
+}
+
+// floats per cache line
+static const int LINE = 16;
+
+// into L2 rather than L1: rows are prefetched a few rows ahead, too early and too large for L1
+inline void prefetch(const float* p) { __builtin_prefetch(p, 0, 2); }
+
+inline bool lineAligned(const float* p) { return (reinterpret_cast<uintptr_t>(p) & (LINE * sizeof(float) - 1)) == 0; }
+
+// make non-temporal stores of this thread visible before others read them
+inline void storeFence() {
+#ifdef HOST_SIMD_AVX2
+    _mm_sfence();
+#endif
+}
+
+// dst[0, len) = src[0, len) while prefetching the same range of next (the row copied after this one, may be null).
+// With streaming, whole cache lines of dst are written with non-temporal stores that bypass caches, for write-once
+// destinations that would only evict useful data; storeFence must follow before dst is read by another thread.
+inline void copy(float* __restrict__ dst, const float* __restrict__ src, int len, const float* next,
+                 [[maybe_unused]] bool streaming) {
+    int i = 0;
+#ifdef HOST_SIMD_AVX2
+    if (streaming) {
+        for (; i < len && !lineAligned(dst + i); ++i) dst[i] = src[i];
+        for (; i + LINE <= len; i += LINE) {
+            if (next != nullptr) prefetch(next + i);
+#ifdef HOST_SIMD_AVX512
+            _mm512_stream_ps(dst + i, _mm512_loadu_ps(src + i));
+#else
+            _mm256_stream_ps(dst + i, _mm256_loadu_ps(src + i));
+            _mm256_stream_ps(dst + i + 8, _mm256_loadu_ps(src + i + 8));
+#endif
+        }
+    }
+#endif
+    if (next != nullptr) {
+        for (auto j = i; j < len; j += LINE) prefetch(next + j);
+    }
+    if (i < len) memcpy(dst + i, src + i, (len - i) * sizeof(float));
+}
+
+// dst[0, len) = alpha * a + (1 - alpha) * b, prefetching and streaming as copy
+inline void mix(float* __restrict__ dst, const float* a, const float* b, float alpha, int len, const float* nextA,
+                const float* nextB, [[maybe_unused]] bool streaming) {
+    int i = 0;
+#ifdef HOST_SIMD_AVX2
+    auto va = _mm256_set1_ps(alpha), vb = _mm256_set1_ps(1 - alpha);
+    auto line = [&](int at, bool stream) {
+        if (nextA != nullptr) prefetch(nextA + at);
+        if (nextB != nullptr) prefetch(nextB + at);
+        for (int k = at; k < at + LINE; k += 8) {
+            auto value = _mm256_fmadd_ps(va, _mm256_loadu_ps(a + k), _mm256_mul_ps(vb, _mm256_loadu_ps(b + k)));
+            if (stream) {
+                _mm256_stream_ps(dst + k, value);
+            } else {
+                _mm256_storeu_ps(dst + k, value);
+            }
+        }
+    };
+    if (streaming) {
+        for (; i < len && !lineAligned(dst + i); ++i) dst[i] = alpha * a[i] + (1 - alpha) * b[i];
+    }
+    for (; i + LINE <= len; i += LINE) line(i, streaming);
+#else
+    for (int j = 0; j < len; j += LINE) {
+        if (nextA != nullptr) prefetch(nextA + j);
+        if (nextB != nullptr) prefetch(nextB + j);
+    }
+#endif
+    for (; i < len; ++i) dst[i] = alpha * a[i] + (1 - alpha) * b[i];
+}
+
+}  // namespace simd
+
+#endif  // HOST_SIMD_H
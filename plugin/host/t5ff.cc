@@ -0,0 +1,141 @@
+#include "t5ff.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "../runtime/ThreadPool.h"
+#include "ops.h"
+
+namespace {
+
+// GEMM tiles: tokens x output features
+const int TOKEN_TILE = 32;
+const int FEATURE_TILE = 256;
+// experts of at most GEMV_TOKENS tokens (decoding) are bound by streaming weights: each weight row is read once for
+// all tokens (gemv_cpu), in narrower feature tiles so that one expert spreads over more workers
+const int GEMV_TOKENS = 4;
+const int GEMV_FEATURE_TILE = 64;
+
+int featureTile(int32_t tokenCount) { return tokenCount <= GEMV_TOKENS ? GEMV_FEATURE_TILE : FEATURE_TILE; }
+
+void linear(float *y, int ldy, const float *x, int ldx, const float *w, int m, int n, int k, bool accumulate) {
+    if (m <= GEMV_TOKENS) {
+        gemv_cpu(y, ldy, x, ldx, w, m, n, k, accumulate);
+    } else {
+        linear_cpu(y, ldy, x, ldx, w, m, n, k, accumulate);
+    }
+}
+
+// run body on [0, count), split among at most parallelism workers
+template <typename F>
+void forTiles(int64_t count, int parallelism, const F &body) {
+    if (parallelism <= 1 || count <= 1) {
+        body(0, count);
+        return;
+    }
+    ThreadPool::instance().parallelFor(0, count, std::max<int64_t>(1, count / parallelism), body);
+}
+
+// layer_norm(hs) of rows picked by rowOf into layernorm_output, then
+// wi_1_o = gelu(ln_output @ wi_0^T) * (ln_output @ wi_1^T), tiled over tokens x hidden features
+template <typename RowOf>
+void dense_gated_gelu(const T5FFWeights &weights, int32_t tokenCount, int embeddingSize, int hiddenSize,
+                      const float *input, const RowOf &rowOf, float *workspace, int parallelism) {
+    auto token_tiles = (tokenCount + TOKEN_TILE - 1) / TOKEN_TILE;
+    auto feature_tile = featureTile(tokenCount);
+
+    // same layout as the GPU workspace: layernorm_output, wi_0_o, wi_1_o
+    auto *layernorm_output = workspace;
+    auto *wi_0_output = layernorm_output + static_cast<size_t>(tokenCount) * embeddingSize;
+    auto *wi_1_output = wi_0_output + static_cast<size_t>(tokenCount) * hiddenSize;
+
+    forTiles(token_tiles, parallelism, [&](int64_t begin, int64_t end) {
+        auto row = begin * TOKEN_TILE;
+        auto last = std::min<int64_t>(end * TOKEN_TILE, tokenCount);
+        for (; row < last; ++row) {
+            layernorm_cpu(layernorm_output + row * embeddingSize, input + rowOf(row) * embeddingSize, 1,
+                          embeddingSize, 1e-6, weights.layernorm, nullptr);
+        }
+    });
+
+    auto hidden_tiles = (hiddenSize + feature_tile - 1) / feature_tile;
+    forTiles(token_tiles * hidden_tiles, parallelism, [&](int64_t begin, int64_t end) {
+        for (auto tile = begin; tile < end; ++tile) {
+            auto row = (tile / hidden_tiles) * TOKEN_TILE;
+            auto col = (tile % hidden_tiles) * feature_tile;
+            auto rows = std::min<int>(TOKEN_TILE, tokenCount - row);
+            auto cols = std::min<int>(feature_tile, hiddenSize - col);
+            auto *ln = layernorm_output + row * embeddingSize;
+            auto *h0 = wi_0_output + row * hiddenSize + col;
+            auto *h1 = wi_1_output + row * hiddenSize + col;
+            linear(h0, hiddenSize, ln, embeddingSize, weights.wi0 + col * embeddingSize, rows, cols, embeddingSize,
+                   false);
+            linear(h1, hiddenSize, ln, embeddingSize, weights.wi1 + col * embeddingSize, rows, cols, embeddingSize,
+                   false);
+            for (int r = 0; r < rows; ++r) fused_gelu_dot_cpu(h0 + r * hiddenSize, h1 + r * hiddenSize, cols);
+        }
+    });
+}
+
+}  // namespace
+
+void t5_ff_cpu(const T5FFWeights &weights, int32_t tokenCount, int embeddingSize, int hiddenSize, const float *input,
+               float *output, float *workspace, int parallelism) {
+    auto token_tiles = (tokenCount + TOKEN_TILE - 1) / TOKEN_TILE;
+    auto feature_tile = featureTile(tokenCount);
+    auto *wi_1_output = workspace + static_cast<size_t>(tokenCount) * (embeddingSize + hiddenSize);
+    dense_gated_gelu(weights, tokenCount, embeddingSize, hiddenSize, input, [](int64_t row) { return row; },
+                     workspace, parallelism);
+
+    // output = input + wi_1_o @ wo^T, tiled over tokens x embedding features
+    auto embedding_tiles = (embeddingSize + feature_tile - 1) / feature_tile;
+    forTiles(token_tiles * embedding_tiles, parallelism, [&](int64_t begin, int64_t end) {
+        for (auto tile = begin; tile < end; ++tile) {
+            auto row = (tile / embedding_tiles) * TOKEN_TILE;
+            auto col = (tile % embedding_tiles) * feature_tile;
+            auto rows = std::min<int>(TOKEN_TILE, tokenCount - row);
+            auto cols = std::min<int>(feature_tile, embeddingSize - col);
+            auto *out = output + row * embeddingSize + col;
+            for (int r = 0; r < rows; ++r) {
+                memcpy(out + r * embeddingSize, input + (row + r) * embeddingSize + col, cols * sizeof(float));
+            }
+            linear(out, embeddingSize, wi_1_output + row * hiddenSize, hiddenSize, weights.wo + col * hiddenSize, rows,
+                   cols, hiddenSize, true);
+        }
+    });
+}
+
+void t5_ff_cpu_indexed(const T5FFWeights &weights, int32_t tokenCount, int embeddingSize, int hiddenSize,
+                       const int *tokenPos, const float *input, float *output, const float *mixCoeff,
+                       float *workspace, int parallelism) {
+    auto token_tiles = (tokenCount + TOKEN_TILE - 1) / TOKEN_TILE;
+    auto feature_tile = featureTile(tokenCount);
+    auto *wi_1_output = workspace + static_cast<size_t>(tokenCount) * (embeddingSize + hiddenSize);
+    dense_gated_gelu(weights, tokenCount, embeddingSize, hiddenSize, input,
+                     [tokenPos](int64_t row) { return static_cast<int64_t>(tokenPos[row]); }, workspace,
+                     parallelism);
+
+    // output[pos] = input[pos] + alpha * (wi_1_o @ wo^T): each tile is computed in a buffer that stays in L1, then
+    // written (and mixed) straight to the rows of its tokens
+    auto embedding_tiles = (embeddingSize + feature_tile - 1) / feature_tile;
+    forTiles(token_tiles * embedding_tiles, parallelism, [&](int64_t begin, int64_t end) {
+        float result[TOKEN_TILE * FEATURE_TILE];
+        for (auto tile = begin; tile < end; ++tile) {
+            auto row = (tile / embedding_tiles) * TOKEN_TILE;
+            auto col = (tile % embedding_tiles) * feature_tile;
+            auto rows = std::min<int>(TOKEN_TILE, tokenCount - row);
+            auto cols = std::min<int>(feature_tile, embeddingSize - col);
+            linear(result, FEATURE_TILE, wi_1_output + row * hiddenSize, hiddenSize, weights.wo + col * hiddenSize,
+                   rows, cols, hiddenSize, false);
+            for (int r = 0; r < rows; ++r) {
+                auto pos = static_cast<size_t>(tokenPos[row + r]);
+                auto *in = input + pos * embeddingSize + col;
+                auto *out = output + pos * embeddingSize + col;
+                auto *res = result + r * FEATURE_TILE;
+                auto alpha = mixCoeff != nullptr ? 1.0f / (1.0f + std::exp(-mixCoeff[pos])) : 1.0f;
+                for (int c = 0; c < cols; ++c) out[c] = in[c] + alpha * res[c];
+            }
+        }
+    });
+}
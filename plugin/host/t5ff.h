@@ -0,0 +1,37 @@
+#pragma once
+
+#ifndef HOST_T5FF_H
+#define HOST_T5FF_H
+
+#include <cstddef>
+#include <cstdint>
+
+// host implementation of T5FFLayer: hs := hs + dense_relu_dense(layer_norm(hs))
+// kept free of CUDA so that it can be used by benchmarks and CPU-only tools
+
+// host pointers to the weights of one expert
+struct T5FFWeights {
+    const float *layernorm;  // d_model
+    const float *wi0;        // hidden_size * d_model
+    const float *wi1;        // hidden_size * d_model
+    const float *wo;         // d_model * hidden_size
+};
+
+// floats of workspace needed for tokenCount tokens: layernorm_output, wi_0_o, wi_1_o
+inline size_t t5_ff_workspace_size(int32_t tokenCount, int embeddingSize, int hiddenSize) {
+    return static_cast<size_t>(tokenCount) * (embeddingSize + 2 * hiddenSize);
+}
+
+// parallelism is the number of workers the call may occupy: 1 runs inline on the calling thread, larger values split
+// the GEMMs into tokens x features tiles on ThreadPool::instance()
+void t5_ff_cpu(const T5FFWeights &weights, int32_t tokenCount, int embeddingSize, int hiddenSize, const float *input,
+               float *output, float *workspace, int parallelism);
+
+// same layer on tokens picked by index, without routed / post-expert copies of them: token r is row tokenPos[r] of
+// input, layernorm reads it in place, and the epilogue of the last GEMM writes row tokenPos[r] of output. With
+// mixCoeff (base layer), output = input + sigmoid(mixCoeff[tokenPos[r]]) * dense_relu_dense(layer_norm(input))
+void t5_ff_cpu_indexed(const T5FFWeights &weights, int32_t tokenCount, int embeddingSize, int hiddenSize,
+                       const int *tokenPos, const float *input, float *output, const float *mixCoeff,
+                       float *workspace, int parallelism);
+
+#endif  // HOST_T5FF_H
@@ -0,0 +1,240 @@
+#include "BalancedAssignment.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <mutex>
+#include <numeric>
+
+namespace {
+
+// minimum raise of a bid relative to the range of scores: the total score is within tokens * epsilon of the optimum,
+// rounds grow with 1 / epsilon (epsilon scaling restarts cost more rounds than they save here)
+const float AUCTION_EPSILON = 1e-2f;
+// tokens still unassigned after this many rounds are placed greedily
+const int MAX_AUCTION_ROUNDS = 10000;
+const int64_t TOKEN_GRAIN = 64;
+
+// one of the `capacity` places of an expert, the price rises with every bid won
+struct Slot {
+    float price;
+    int token;  // -1 when free
+};
+
+struct Bid {
+    float value;
+    int token;
+    // higher bid first, earlier token first on ties
+    bool operator<(const Bid &other) const {
+        return value > other.value || (value == other.value && token < other.token);
+    }
+};
+
+}  // namespace
+
+BalancedAssignment::BalancedAssignment(Algorithm algorithm, ThreadPool &pool) : mAlgorithm(algorithm), mPool(pool) {
+    assert(algorithm == GREEDY || algorithm == AUCTION);
+}
+
+// best & second best score of every token, and range of all scores
+void BalancedAssignment::rankExperts(const float *scores, int expertCount) {
+    auto count = static_cast<int64_t>(mTokens.size());
+    mBest.resize(count);
+    mBestScore.resize(count);
+    mSecondScore.resize(count);
+    mLowest = FLT_MAX;
+    mHighest = -FLT_MAX;
+    std::mutex range_lock;
+    mPool.parallelFor(0, count, TOKEN_GRAIN, [&](int64_t begin, int64_t end) {
+        float lowest = FLT_MAX, highest = -FLT_MAX;
+        for (auto i = begin; i < end; ++i) {
+            auto row = scores + static_cast<size_t>(mTokens[i]) * expertCount;
+            int best = 0;
+            float best_score = row[0], second_score = -FLT_MAX;
+            for (int e = 1; e < expertCount; ++e) {
+                if (row[e] > best_score) {
+                    second_score = best_score;
+                    best_score = row[e];
+                    best = e;
+                } else if (row[e] > second_score) {
+                    second_score = row[e];
+                }
+            }
+            mBest[i] = best;
+            mBestScore[i] = best_score;
+            mSecondScore[i] = expertCount > 1 ? second_score : best_score;
+            lowest = std::min(lowest, *std::min_element(row, row + expertCount));
+            highest = std::max(highest, best_score);
+        }
+        std::lock_guard<std::mutex> guard(range_lock);
+        mLowest = std::min(mLowest, lowest);
+        mHighest = std::max(mHighest, highest);
+    });
+}
+
+// sequential: a token only sees the load left by tokens of higher regret
+void BalancedAssignment::assignGreedy(const float *scores, int expertCount, int capacity, int *selection) {
+    auto count = static_cast<int>(mTokens.size());
+    std::vector<int> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return mBestScore[a] - mSecondScore[a] > mBestScore[b] - mSecondScore[b];
+    });
+    std::vector<int> load(expertCount, 0);
+    for (auto i : order) {
+        auto expert = mBest[i];
+        if (load[expert] == capacity) {
+            auto row = scores + static_cast<size_t>(mTokens[i]) * expertCount;
+            expert = -1;
+            for (int e = 0; e < expertCount; ++e) {
+                if (load[e] < capacity && (expert < 0 || row[e] > row[expert])) expert = e;
+            }
+        }
+        ++load[expert];
+        selection[mTokens[i]] = expert;
+    }
+}
+
+// Every round, each unassigned token bids for the expert of best net value (score - price of its cheapest slot),
+// raising that price by its margin over the second best expert plus epsilon. Bids are placed in parallel over
+// tokens, then each expert keeps its highest bids in parallel over experts, outbid tokens bid again next round.
+int BalancedAssignment::assignAuction(const float *scores, int expertCount, int capacity, int *selection) {
+    auto count = static_cast<int>(mTokens.size());
+    auto range = mHighest - mLowest;
+    auto epsilon = range > 0 ? range * AUCTION_EPSILON : 1.0f;
+
+    std::vector<std::vector<Slot>> slots(expertCount, std::vector<Slot>(capacity, Slot{0, -1}));
+    std::vector<float> price(expertCount, 0);  // of the cheapest slot
+    std::vector<int> unassigned(count);
+    std::iota(unassigned.begin(), unassigned.end(), 0);
+    std::vector<int> bid_expert(count);
+    std::vector<float> bid_value(count);
+    std::vector<int> bid_offset(expertCount + 1);
+    std::vector<int> bid_order(count);
+    std::vector<std::vector<int>> outbid(expertCount);
+    auto expert_grain = std::max<int64_t>(1, expertCount / (mPool.workerCount() * 4));
+
+    int rounds = 0;
+    for (; !unassigned.empty() && rounds < MAX_AUCTION_ROUNDS; ++rounds) {
+        auto bidders = static_cast<int64_t>(unassigned.size());
+        mPool.parallelFor(0, bidders, TOKEN_GRAIN, [&](int64_t begin, int64_t end) {
+            for (auto j = begin; j < end; ++j) {
+                auto row = scores + static_cast<size_t>(mTokens[unassigned[j]]) * expertCount;
+                int best = 0;
+                float best_value = row[0] - price[0], second_value = -FLT_MAX;
+                for (int e = 1; e < expertCount; ++e) {
+                    auto value = row[e] - price[e];
+                    if (value > best_value) {
+                        second_value = best_value;
+                        best_value = value;
+                        best = e;
+                    } else if (value > second_value) {
+                        second_value = value;
+                    }
+                }
+                if (expertCount == 1) second_value = best_value;
+                bid_expert[j] = best;
+                bid_value[j] = row[best] - second_value + epsilon;
+            }
+        });
+        // group bids by expert
+        std::fill(bid_offset.begin(), bid_offset.end(), 0);
+        for (int64_t j = 0; j < bidders; ++j) ++bid_offset[bid_expert[j] + 1];
+        std::partial_sum(bid_offset.begin(), bid_offset.end(), bid_offset.begin());
+        {
+            auto next = bid_offset;
+            for (int64_t j = 0; j < bidders; ++j) bid_order[next[bid_expert[j]]++] = static_cast<int>(j);
+        }
+        // highest bids take the cheapest slots
+        mPool.parallelFor(0, expertCount, expert_grain, [&](int64_t begin, int64_t end) {
+            std::vector<Bid> bids;
+            for (auto e = begin; e < end; ++e) {
+                auto &lost = outbid[e];
+                lost.clear();
+                if (bid_offset[e] == bid_offset[e + 1]) continue;
+                bids.clear();
+                for (auto k = bid_offset[e]; k < bid_offset[e + 1]; ++k) {
+                    auto j = bid_order[k];
+                    bids.push_back(Bid{bid_value[j], unassigned[j]});
+                }
+                std::sort(bids.begin(), bids.end());
+                auto &expert_slots = slots[e];
+                std::sort(expert_slots.begin(), expert_slots.end(),
+                          [](const Slot &a, const Slot &b) { return a.price < b.price; });
+                size_t won = 0;
+                while (won < bids.size() && won < expert_slots.size() &&
+                       bids[won].value > expert_slots[won].price) {
+                    if (expert_slots[won].token >= 0) lost.push_back(expert_slots[won].token);
+                    expert_slots[won] = Slot{bids[won].value, bids[won].token};
+                    ++won;
+                }
+                for (auto k = won; k < bids.size(); ++k) lost.push_back(bids[k].token);
+                auto cheapest = std::min_element(expert_slots.begin(), expert_slots.end(),
+                                                 [](const Slot &a, const Slot &b) { return a.price < b.price; });
+                price[e] = cheapest->price;
+            }
+        });
+        unassigned.clear();
+        for (auto &lost : outbid) unassigned.insert(unassigned.end(), lost.begin(), lost.end());
+    }
+
+    std::vector<int> load(expertCount, 0);
+    for (int e = 0; e < expertCount; ++e) {
+        for (auto &slot : slots[e]) {
+            if (slot.token < 0) continue;
+            selection[mTokens[slot.token]] = e;
+            ++load[e];
+        }
+    }
+    // out of rounds: remaining tokens take their best expert with room left
+    for (auto i : unassigned) {
+        auto row = scores + static_cast<size_t>(mTokens[i]) * expertCount;
+        int expert = -1;
+        for (int e = 0; e < expertCount; ++e) {
+            if (load[e] < capacity && (expert < 0 || row[e] > row[expert])) expert = e;
+        }
+        ++load[expert];
+        selection[mTokens[i]] = expert;
+    }
+    return rounds;
+}
+
+BalancedAssignment::Report BalancedAssignment::assign(const float *scores, int tokenCount, int expertCount,
+                                                      int *selection, float *score) {
+    assert(expertCount > 0);
+    Report report;
+    mTokens.clear();
+    for (int t = 0; t < tokenCount; ++t) {
+        if (selection[t] >= 0) mTokens.push_back(t);
+    }
+    report.tokenCount = static_cast<int>(mTokens.size());
+    if (mTokens.empty()) {
+        if (score != nullptr) std::fill(score, score + tokenCount, 0.0f);
+        return report;
+    }
+    report.capacity = (report.tokenCount + expertCount - 1) / expertCount;
+
+    rankExperts(scores, expertCount);
+    if (mAlgorithm == GREEDY) {
+        assignGreedy(scores, expertCount, report.capacity, selection);
+    } else {
+        report.rounds = assignAuction(scores, expertCount, report.capacity, selection);
+    }
+
+    std::vector<int> load(expertCount, 0), greedy_load(expertCount, 0);
+    for (size_t i = 0; i < mTokens.size(); ++i) {
+        auto t = mTokens[i];
+        report.objective += scores[static_cast<size_t>(t) * expertCount + selection[t]];
+        report.greedyObjective += mBestScore[i];
+        ++load[selection[t]];
+        ++greedy_load[mBest[i]];
+    }
+    report.maxLoad = *std::max_element(load.begin(), load.end());
+    report.greedyMaxLoad = *std::max_element(greedy_load.begin(), greedy_load.end());
+    if (score != nullptr) {
+        for (int t = 0; t < tokenCount; ++t) {
+            score[t] = selection[t] >= 0 ? scores[static_cast<size_t>(t) * expertCount + selection[t]] : 0.0f;
+        }
+    }
+    return report;
+}
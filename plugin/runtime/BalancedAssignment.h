@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef BALANCED_ASSIGNMENT_H
+#define BALANCED_ASSIGNMENT_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Token -> expert assignment with equal capacity per expert (BASE layers), instead of greedy top-1.
+//
+// Each expert takes at most ceil(tokens / experts) tokens, so the most loaded expert (the critical path of the layer)
+// holds as few tokens as possible, at the price of routing some tokens to an expert with a lower score.
+//   GREEDY:  tokens ordered by regret (best score - second best score) take their best expert with room left
+//   AUCTION: tokens bid for experts in parallel rounds (Jacobi auction), the total score is within tokens * epsilon of
+//            the optimal balanced assignment
+class BalancedAssignment {
+   public:
+    enum Algorithm : int32_t { NONE = 0, GREEDY = 1, AUCTION = 2 };
+
+    // quality of the last assignment against greedy top-1 routing of the same tokens
+    struct Report {
+        int tokenCount = 0;           // tokens assigned (not padding)
+        int capacity = 0;             // tokens per expert
+        double objective = 0;         // total score of the assigned experts
+        double greedyObjective = 0;   // total score of top-1 routing, the upper bound
+        int maxLoad = 0;              // tokens of the most loaded expert
+        int greedyMaxLoad = 0;
+        int rounds = 0;               // bidding rounds of auction
+        // objective lost by balancing, relative to greedy
+        double loss() const {
+            return greedyObjective == objective ? 0 : (greedyObjective - objective) / std::abs(greedyObjective);
+        }
+    };
+
+   private:
+    Algorithm mAlgorithm;
+    ThreadPool &mPool;
+    // per token, indexed like tokens: best & second best expert of top-1 routing
+    std::vector<int> mTokens;
+    std::vector<int> mBest;
+    std::vector<float> mBestScore, mSecondScore;
+    float mLowest = 0, mHighest = 0;  // range of all scores
+
+    void rankExperts(const float *scores, int expertCount);
+    void assignGreedy(const float *scores, int expertCount, int capacity, int *selection);
+    int assignAuction(const float *scores, int expertCount, int capacity, int *selection);
+
+   public:
+    explicit BalancedAssignment(Algorithm algorithm, ThreadPool &pool = ThreadPool::instance());
+
+    Algorithm algorithm() const { return mAlgorithm; }
+    // scores: (tokenCount, expertCount). selection: tokens marked -1 (padding) are left out and stay -1, others get
+    // their expert. score: score of the assigned expert of each token (0 for padding), may be null
+    Report assign(const float *scores, int tokenCount, int expertCount, int *selection, float *score);
+};
+
+#endif  // BALANCED_ASSIGNMENT_H
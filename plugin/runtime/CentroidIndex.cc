@@ -0,0 +1,208 @@
+#include "CentroidIndex.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <random>
+
+#include "../host/gating.h"
+#include "../host/simd.h"
+#include "ThreadPool.h"
+
+namespace {
+
+const int KMEANS_ITERATIONS = 25;
+
+void normalizeRows(float *rows, int count, int length) {
+    for (int i = 0; i < count; ++i) {
+        auto *row = rows + static_cast<size_t>(i) * length;
+        auto norm = std::sqrt(simd::dot(row, row, length));
+        if (norm > 0) std::for_each(row, row + length, [norm](float &v) { v /= norm; });
+    }
+}
+
+// same order as gate_topk_cpu: higher score first, earlier expert first on ties
+bool better(float s1, int i1, float s2, int i2) {
+    if (i2 < 0) return i1 >= 0;
+    if (i1 < 0) return false;
+    return s1 > s2 || (s1 == s2 && i1 < i2);
+}
+
+}  // namespace
+
+CentroidIndex::CentroidIndex(const float *centroids, int expertCount, int embeddingSize, int listCount)
+    : mExpertCount(expertCount), mEmbeddingSize(embeddingSize), mListCount(listCount) {
+    assert(listCount >= MAX_PROBES && listCount <= expertCount);
+    auto workers = ThreadPool::instance().workerCount();
+    auto row_size = static_cast<size_t>(embeddingSize);
+    std::vector<float> directions(centroids, centroids + expertCount * row_size);
+    normalizeRows(directions.data(), expertCount, embeddingSize);
+
+    // k-means++ seeding on cosine distance, fixed seed so that builds are reproducible
+    std::mt19937 rng(0);
+    mListCentroids.resize(listCount * row_size);
+    std::vector<float> distance(expertCount, FLT_MAX);
+    auto seed = static_cast<int>(rng() % expertCount);
+    for (int list = 0; list < listCount; ++list) {
+        std::copy_n(directions.data() + seed * row_size, row_size, mListCentroids.data() + list * row_size);
+        double total = 0;
+        for (int e = 0; e < expertCount; ++e) {
+            auto d = 1 - simd::dot(directions.data() + e * row_size, mListCentroids.data() + list * row_size,
+                                   embeddingSize);
+            distance[e] = std::min(distance[e], std::max(d, 0.0f));
+            total += distance[e];
+        }
+        if (total <= 0) {
+            seed = static_cast<int>(rng() % expertCount);
+            continue;
+        }
+        auto target = std::uniform_real_distribution<double>(0, total)(rng);
+        for (seed = 0; seed + 1 < expertCount && (target -= distance[seed]) > 0; ++seed) {
+        }
+    }
+
+    // Lloyd iterations, assignment by the fused gating of the host
+    mAssignment.assign(expertCount, -1);
+    std::vector<int> assignment(expertCount);
+    std::vector<float> similarity(expertCount);
+    for (int it = 0; it < KMEANS_ITERATIONS; ++it) {
+        gate_topk_cpu(directions.data(), expertCount, embeddingSize, mListCentroids.data(), listCount, nullptr, 0, 1,
+                      assignment.data(), similarity.data(), workers);
+        if (assignment == mAssignment) break;
+        mAssignment = assignment;
+        std::vector<int> size(listCount, 0);
+        std::fill(mListCentroids.begin(), mListCentroids.end(), 0.0f);
+        for (int e = 0; e < expertCount; ++e) {
+            auto *sum = mListCentroids.data() + mAssignment[e] * row_size;
+            auto *row = directions.data() + e * row_size;
+            for (size_t i = 0; i < row_size; ++i) sum[i] += row[i];
+            ++size[mAssignment[e]];
+        }
+        // an empty list takes over the expert that fits its own list worst
+        for (int list = 0; list < listCount; ++list) {
+            if (size[list] > 0) continue;
+            auto worst = std::min_element(similarity.begin(), similarity.end()) - similarity.begin();
+            similarity[worst] = FLT_MAX;
+            std::copy_n(directions.data() + worst * row_size, row_size, mListCentroids.data() + list * row_size);
+        }
+        normalizeRows(mListCentroids.data(), listCount, embeddingSize);
+    }
+    buildLists(centroids);
+}
+
+CentroidIndex::CentroidIndex(const float *centroids, int expertCount, int embeddingSize, int listCount,
+                             const int *assignment)
+    : mExpertCount(expertCount),
+      mEmbeddingSize(embeddingSize),
+      mListCount(listCount),
+      mAssignment(assignment, assignment + expertCount) {
+    assert(listCount >= MAX_PROBES && listCount <= expertCount);
+    auto row_size = static_cast<size_t>(embeddingSize);
+    mListCentroids.assign(listCount * row_size, 0.0f);
+    std::vector<float> direction(row_size);
+    for (int e = 0; e < expertCount; ++e) {
+        assert(mAssignment[e] >= 0 && mAssignment[e] < listCount);
+        std::copy_n(centroids + e * row_size, row_size, direction.data());
+        normalizeRows(direction.data(), 1, embeddingSize);
+        auto *sum = mListCentroids.data() + mAssignment[e] * row_size;
+        for (size_t i = 0; i < row_size; ++i) sum[i] += direction[i];
+    }
+    normalizeRows(mListCentroids.data(), listCount, embeddingSize);
+    buildLists(centroids);
+}
+
+void CentroidIndex::buildLists(const float *centroids) {
+    auto row_size = static_cast<size_t>(mEmbeddingSize);
+    mListOffset.assign(mListCount + 1, 0);
+    for (auto list : mAssignment) ++mListOffset[list + 1];
+    for (int list = 0; list < mListCount; ++list) mListOffset[list + 1] += mListOffset[list];
+    mListExperts.resize(mExpertCount);
+    mSortedCentroids.resize(mExpertCount * row_size);
+    auto next = mListOffset;
+    for (int e = 0; e < mExpertCount; ++e) {
+        auto pos = next[mAssignment[e]]++;
+        mListExperts[pos] = e;
+        std::copy_n(centroids + e * row_size, row_size, mSortedCentroids.data() + pos * row_size);
+    }
+}
+
+void CentroidIndex::search(const float *queries, int32_t count, int k, int probes, int *selection,
+                           float *score) const {
+    assert(probes >= 1 && probes <= mListCount && k >= 1);
+    auto &pool = ThreadPool::instance();
+    std::vector<int> lists(static_cast<size_t>(count) * probes);
+    gate_topk_cpu(queries, count, mEmbeddingSize, mListCentroids.data(), mListCount, nullptr, 0, probes, lists.data(),
+                  nullptr, pool.workerCount());
+    pool.parallelFor(0, count, 16, [&](int64_t begin, int64_t end) {
+        std::vector<float> best(k);
+        for (auto q = begin; q < end; ++q) {
+            auto *query = queries + q * mEmbeddingSize;
+            auto *out = selection + q * k;
+            std::fill(best.begin(), best.end(), -FLT_MAX);
+            std::fill(out, out + k, -1);
+            for (int p = 0; p < probes; ++p) {
+                auto list = lists[q * probes + p];
+                for (auto pos = mListOffset[list]; pos < mListOffset[list + 1]; ++pos) {
+                    auto s = simd::dot(query, mSortedCentroids.data() + static_cast<size_t>(pos) * mEmbeddingSize,
+                                       mEmbeddingSize);
+                    auto expert = mListExperts[pos];
+                    if (!better(s, expert, best[k - 1], out[k - 1])) continue;
+                    auto i = k - 1;
+                    for (; i > 0 && better(s, expert, best[i - 1], out[i - 1]); --i) {
+                        best[i] = best[i - 1];
+                        out[i] = out[i - 1];
+                    }
+                    best[i] = s;
+                    out[i] = expert;
+                }
+            }
+            if (score != nullptr) std::copy(best.begin(), best.end(), score + q * k);
+        }
+    });
+}
+
+void CentroidIndex::exactSearch(const float *queries, int32_t count, int k, int *selection) const {
+    // in the original expert order, so that ties are broken as in routing without index
+    std::vector<float> centroids(mSortedCentroids.size());
+    for (int pos = 0; pos < mExpertCount; ++pos) {
+        std::copy_n(mSortedCentroids.data() + static_cast<size_t>(pos) * mEmbeddingSize, mEmbeddingSize,
+                    centroids.data() + static_cast<size_t>(mListExperts[pos]) * mEmbeddingSize);
+    }
+    gate_topk_cpu(queries, count, mEmbeddingSize, centroids.data(), mExpertCount, nullptr, 0, k, selection, nullptr,
+                  ThreadPool::instance().workerCount());
+}
+
+double CentroidIndex::recall(const float *queries, int32_t count, int k, int probes, const int *exact) const {
+    if (count == 0) return 1;
+    std::vector<int> approximate(static_cast<size_t>(count) * k);
+    search(queries, count, k, probes, approximate.data(), nullptr);
+    int64_t hits = 0;
+    for (int32_t q = 0; q < count; ++q) {
+        auto *e = exact + static_cast<size_t>(q) * k;
+        auto *a = approximate.data() + static_cast<size_t>(q) * k;
+        for (int i = 0; i < k; ++i) hits += std::find(a, a + k, e[i]) != a + k;
+    }
+    return static_cast<double>(hits) / (static_cast<double>(count) * k);
+}
+
+double CentroidIndex::recall(const float *queries, int32_t count, int k, int probes) const {
+    std::vector<int> exact(static_cast<size_t>(count) * k);
+    exactSearch(queries, count, k, exact.data());
+    return recall(queries, count, k, probes, exact.data());
+}
+
+int CentroidIndex::calibrate(const float *queries, int32_t count, int k, double target, double *achieved) const {
+    std::vector<int> exact(static_cast<size_t>(count) * k);
+    exactSearch(queries, count, k, exact.data());
+    auto max_probes = std::min(MAX_PROBES, mListCount);
+    double result = 0;
+    int probes = 1;
+    for (; probes <= max_probes; ++probes) {
+        result = recall(queries, count, k, probes, exact.data());
+        if (result >= target) break;
+    }
+    probes = std::min(probes, max_probes);
+    if (achieved != nullptr) *achieved = result;
+    return probes;
+}
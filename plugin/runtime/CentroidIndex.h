@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef CENTROID_INDEX_H
+#define CENTROID_INDEX_H
+
+#include <cstdint>
+#include <vector>
+
+// Inverted-file (IVF) index over expert centroids for approximate routing.
+//
+// Experts are clustered by direction into lists (spherical k-means). A token is first scored against the unit mean
+// direction of every list, then against the experts of the best `probes` lists only, so routing reads
+// lists + experts * probes / lists centroids instead of all of them. More probes give better agreement with exact
+// routing: calibrate() picks the smallest number reaching a recall target on recorded inputs.
+//
+// Centroids are copied and grouped by list, so that the experts of one list are contiguous.
+class CentroidIndex {
+   public:
+    // lists selected by the fused gating kernel, see moe_expert_fused_gate_topk
+    constexpr static int MAX_PROBES = 8;
+
+   private:
+    int mExpertCount;
+    int mEmbeddingSize;
+    int mListCount;
+    std::vector<int> mAssignment;         // list of each expert
+    std::vector<float> mListCentroids;    // (listCount, embeddingSize) unit mean directions
+    std::vector<int> mListOffset;         // listCount + 1, into list experts
+    std::vector<int> mListExperts;        // experts grouped by list, in increasing order inside a list
+    std::vector<float> mSortedCentroids;  // (expertCount, embeddingSize) in the order of list experts
+
+    void buildLists(const float *centroids);
+    void exactSearch(const float *queries, int32_t count, int k, int *selection) const;
+    double recall(const float *queries, int32_t count, int k, int probes, const int *exact) const;
+
+   public:
+    // centroids: (expertCount, embeddingSize), clustered into listCount lists
+    CentroidIndex(const float *centroids, int expertCount, int embeddingSize, int listCount);
+    // restore an index from the list of each expert (as returned by assignment())
+    CentroidIndex(const float *centroids, int expertCount, int embeddingSize, int listCount, const int *assignment);
+
+    int expertCount() const { return mExpertCount; }
+    int embeddingSize() const { return mEmbeddingSize; }
+    int listCount() const { return mListCount; }
+    const std::vector<int> &assignment() const { return mAssignment; }
+    const std::vector<float> &listCentroids() const { return mListCentroids; }
+    const std::vector<int> &listOffset() const { return mListOffset; }
+    const std::vector<int> &listExperts() const { return mListExperts; }
+    const std::vector<float> &sortedCentroids() const { return mSortedCentroids; }
+
+    // best k experts of each query (already layer-normed if needed) among the best `probes` lists, same output as
+    // gate_topk_cpu
+    void search(const float *queries, int32_t count, int k, int probes, int *selection, float *score) const;
+    // recall@k of search against exact top-k over all experts
+    double recall(const float *queries, int32_t count, int k, int probes) const;
+    // smallest probes (up to MAX_PROBES) reaching the recall target on queries, recall of the result in achieved
+    int calibrate(const float *queries, int32_t count, int k, double target, double *achieved = nullptr) const;
+};
+
+#endif  // CENTROID_INDEX_H
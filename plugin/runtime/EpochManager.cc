@@ -0,0 +1,35 @@
+#include "EpochManager.h"
+
+#include <functional>
+#include <thread>
+
+EpochManager::EpochManager() : mReaders(new std::atomic<uint64_t>[MAX_READERS]) {
+    for (int i = 0; i < MAX_READERS; ++i) mReaders[i] = 0;
+}
+
+// Slots, the epoch & memory published by writers are all sequentially consistent: a reader that may load the old
+// memory stored its slot before, and loaded an epoch not after the one retiring the memory, so that synchronize() on
+// that epoch sees it.
+EpochManager::Guard EpochManager::enter() {
+    // threads start probing at different slots, so that concurrent readers rarely contend on one
+    auto start = std::hash<std::thread::id>()(std::this_thread::get_id()) % MAX_READERS;
+    while (true) {
+        for (int k = 0; k < MAX_READERS; ++k) {
+            auto &slot = mReaders[(start + k) % MAX_READERS];
+            uint64_t free = 0;
+            auto epoch = mEpoch.load();
+            if (slot.load() == 0 && slot.compare_exchange_strong(free, epoch)) return Guard(&slot, epoch);
+        }
+        std::this_thread::yield();
+    }
+}
+
+void EpochManager::synchronize(uint64_t epoch) const {
+    for (int i = 0; i < MAX_READERS; ++i) {
+        while (true) {
+            auto entered = mReaders[i].load();
+            if (entered == 0 || entered > epoch) break;
+            std::this_thread::yield();
+        }
+    }
+}
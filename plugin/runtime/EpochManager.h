@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef EPOCH_MANAGER_H
+#define EPOCH_MANAGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Epoch-based reclamation of memory replaced while readers may still use it (e.g. weights of a reloaded expert),
+// without any lock nor reference count on the read path.
+//
+// A reader enters the current epoch for the duration of a read-side section (Guard), publishing it in one of
+// MAX_READERS slots. A writer first publishes the replacement of some memory, then retires the old one: retire()
+// advances the epoch and returns the last epoch in which readers may still have picked up the old memory, which may be
+// reused once synchronize() on that epoch returned, i.e. once every reader that entered up to it left.
+//
+// Readers only wait for a free slot when MAX_READERS of them are active at once.
+class EpochManager {
+   public:
+    constexpr static int MAX_READERS = 256;
+
+    // a read-side section, from enter() until destroyed
+    class Guard {
+       private:
+        std::atomic<uint64_t> *mSlot = nullptr;
+        uint64_t mEpoch = 0;
+
+       public:
+        Guard() = default;
+        Guard(std::atomic<uint64_t> *slot, uint64_t epoch) : mSlot(slot), mEpoch(epoch) {}
+        Guard(Guard &&other) noexcept : mSlot(other.mSlot), mEpoch(other.mEpoch) { other.mSlot = nullptr; }
+        Guard &operator=(Guard &&other) noexcept {
+            std::swap(mSlot, other.mSlot);
+            std::swap(mEpoch, other.mEpoch);
+            return *this;
+        }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+        ~Guard() {
+            if (mSlot != nullptr) mSlot->store(0);
+        }
+        uint64_t epoch() const { return mEpoch; }
+    };
+
+   private:
+    std::atomic<uint64_t> mEpoch{1};
+    // epoch of the reader holding each slot, 0 if free
+    std::unique_ptr<std::atomic<uint64_t>[]> mReaders;
+
+   public:
+    EpochManager();
+    EpochManager(const EpochManager &) = delete;
+    EpochManager &operator=(const EpochManager &) = delete;
+
+    uint64_t epoch() const { return mEpoch.load(); }
+    Guard enter();
+    // called once memory was replaced, returns its retirement epoch
+    uint64_t retire() { return mEpoch.fetch_add(1); }
+    // wait until no reader that entered at or before epoch is active
+    void synchronize(uint64_t epoch) const;
+};
+
+#endif  // EPOCH_MANAGER_H
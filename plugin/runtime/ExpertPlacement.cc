@@ -0,0 +1,129 @@
+#include "ExpertPlacement.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+#include "../thirdparty/dbg.h"
+
+ExpertPlacement::ExpertPlacement(int expertCount, const ThreadPool &pool)
+    : mExpertCount(expertCount),
+      mHome(expertCount, 0),
+      mReplicas(pool.nodeCount()),
+      mReplicaSlot(new std::atomic<int>[static_cast<size_t>(pool.nodeCount()) * expertCount]),
+      mReplicated(new std::atomic<bool>[expertCount]) {
+    assert(expertCount > 0);
+    int workers = 0;
+    for (int node = 0; node < pool.nodeCount(); ++node) {
+        if (pool.workersOnNode(node) == 0) continue;
+        mNodes.push_back(node);
+        workers += pool.workersOnNode(node);
+    }
+    // contiguous ranges of experts, sized by the workers of each node
+    int before = 0;
+    for (auto node : mNodes) {
+        auto begin = static_cast<int>(static_cast<int64_t>(expertCount) * before / workers);
+        before += pool.workersOnNode(node);
+        auto end = static_cast<int>(static_cast<int64_t>(expertCount) * before / workers);
+        std::fill(mHome.begin() + begin, mHome.begin() + end, node);
+    }
+    for (size_t i = 0; i < static_cast<size_t>(pool.nodeCount()) * expertCount; ++i) mReplicaSlot[i] = -1;
+    for (int i = 0; i < expertCount; ++i) mReplicated[i] = false;
+    dbg(expertCount, mNodes.size());
+}
+
+std::vector<int> ExpertPlacement::expertsOn(int node) const {
+    std::vector<int> experts;
+    for (int i = 0; i < mExpertCount; ++i) {
+        if (mHome[i] == node) experts.push_back(i);
+    }
+    return experts;
+}
+
+void ExpertPlacement::replicate(const std::vector<int> &experts, size_t weightBytes, HostAllocator::Backend backend,
+                                const Source &source) {
+    if (!numa() || experts.empty()) return;
+    std::lock_guard<std::mutex> guard(mReplicateLock);
+    if (mWeightBytes == 0) {
+        mWeightBytes = weightBytes;
+        for (auto node : mNodes) {
+            auto &replicas = mReplicas[node];
+            replicas.slotCount = static_cast<int>(experts.size());
+            replicas.block = HostMemory(weightBytes * replicas.slotCount, backend, node);
+            replicas.slots.reset(new Slot[replicas.slotCount]);
+        }
+    }
+    assert(weightBytes == mWeightBytes);
+    // as many as there are slots
+    std::vector<int> wanted(experts.begin(), experts.begin() + std::min<size_t>(experts.size(),
+                                                                                 mReplicas[mNodes[0]].slotCount));
+    std::vector<bool> listed(mExpertCount, false);
+    for (auto expert : wanted) listed[expert] = true;
+    for (int i = 0; i < mExpertCount; ++i) {
+        if (!listed[i]) mReplicated[i] = false;
+    }
+
+    for (auto node : mNodes) {
+        auto &replicas = mReplicas[node];
+        auto slot_of = &mReplicaSlot[static_cast<size_t>(node) * mExpertCount];
+        for (auto expert : wanted) {
+            if (mHome[expert] == node) continue;
+            auto copy = source(expert);
+            // a replica of another version (copied from the weights a reload just replaced) is copied again in place
+            int index = slot_of[expert];
+            if (index >= 0 && replicas.slots[index].version.load() == copy.version) continue;
+            if (index < 0) {
+                index = 0;
+                while (index < replicas.slotCount) {
+                    auto current = replicas.slots[index].expert.load();
+                    if (current < 0 || !listed[current]) break;
+                    ++index;
+                }
+            }
+            assert(index < replicas.slotCount);
+            auto &slot = replicas.slots[index];
+            auto evicted = slot.expert.load();
+            if (evicted >= 0) slot_of[evicted] = -1;
+            // readers check the slot after pinning it, so no new pin holds once it is cleared
+            slot.expert = -1;
+            while (slot.pins.load() > 0) std::this_thread::yield();
+            dbg(node, expert, evicted);
+            memcpy(replicas.block.data() + mWeightBytes * index, copy.data, mWeightBytes);
+            slot.version = copy.version;
+            slot.expert = expert;
+            slot_of[expert] = index;
+        }
+    }
+    for (auto expert : wanted) mReplicated[expert] = true;
+}
+
+void ExpertPlacement::refresh(int expert, const Source &source) {
+    if (!numa()) return;
+    std::lock_guard<std::mutex> guard(mReplicateLock);
+    auto copy = source(expert);
+    for (auto node : mNodes) {
+        auto index = mReplicaSlot[static_cast<size_t>(node) * mExpertCount + expert].load();
+        if (index < 0) continue;
+        auto &slot = mReplicas[node].slots[index];
+        slot.expert = -1;
+        while (slot.pins.load() > 0) std::this_thread::yield();
+        memcpy(mReplicas[node].block.data() + mWeightBytes * index, copy.data, mWeightBytes);
+        slot.version = copy.version;
+        slot.expert = expert;
+    }
+}
+
+ExpertPlacement::Pin ExpertPlacement::pin(int expert, int node, uint64_t version) {
+    if (node < 0 || !numa()) return Pin();
+    auto index = mReplicaSlot[static_cast<size_t>(node) * mExpertCount + expert].load();
+    if (index < 0) return Pin();
+    auto &slot = mReplicas[node].slots[index];
+    slot.pins.fetch_add(1);
+    // the version is set before the expert, so that it is the one of the weights in the slot
+    if (slot.expert.load() != expert || slot.version.load() != version) {
+        slot.pins.fetch_sub(1);
+        return Pin();
+    }
+    return Pin(&slot.pins, mReplicas[node].block.data() + mWeightBytes * index);
+}
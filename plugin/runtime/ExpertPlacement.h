@@ -0,0 +1,115 @@
+#pragma once
+
+#ifndef EXPERT_PLACEMENT_H
+#define EXPERT_PLACEMENT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "HostAllocator.h"
+#include "ThreadPool.h"
+
+// Placement of experts on the NUMA nodes of a ThreadPool, for host execution on multi-socket machines.
+//
+// Each expert has a home node: experts are split into contiguous ranges, one per node with workers, sized by the
+// number of workers of the node. Weights of an expert are allocated on its home node and ExpertScheduler submits its
+// tokens to workers of that node, so that weights are never streamed across the interconnect. Optionally, hot experts
+// are replicated on every node: each node then holds a copy in one of its replica slots, and their tokens may be run
+// on any node.
+//
+// On a single node (or a pool without workers on other nodes), every expert is at home on node 0 and there is neither
+// a replica nor any node constraint, so that scheduling falls back to plain work stealing.
+//
+// Thread-safe: replicas are read through pins, and a slot is only overwritten once its pins are released. Each replica
+// holds one version of the weights of its expert (see MoESubLayer::reloadExperts), and is only pinned by readers of
+// that version: others read the home copy of their own version instead.
+class ExpertPlacement {
+   public:
+    // home copy of the weights of an expert, copied to replicas, and its version
+    struct Copy {
+        const char *data;
+        uint64_t version;
+    };
+    using Source = std::function<Copy(int expert)>;
+
+    // weights of an expert in a replica slot, which is not overwritten until the handle is destroyed
+    class Pin {
+       private:
+        std::atomic<int> *mPins = nullptr;
+        const char *mData = nullptr;
+
+       public:
+        Pin() = default;
+        Pin(std::atomic<int> *pins, const char *data) : mPins(pins), mData(data) {}
+        Pin(Pin &&other) noexcept : mPins(other.mPins), mData(other.mData) { other.mPins = nullptr; }
+        Pin &operator=(Pin &&other) noexcept {
+            std::swap(mPins, other.mPins);
+            std::swap(mData, other.mData);
+            return *this;
+        }
+        Pin(const Pin &) = delete;
+        Pin &operator=(const Pin &) = delete;
+        ~Pin() {
+            if (mPins != nullptr) mPins->fetch_sub(1);
+        }
+        // nullptr when the expert has no replica on the node, read its home copy instead
+        const char *data() const { return mData; }
+    };
+
+   private:
+    struct Slot {
+        std::atomic<int> expert{-1};
+        std::atomic<uint64_t> version{0};  // of the weights of expert, set before expert
+        std::atomic<int> pins{0};
+    };
+
+    struct NodeReplicas {
+        HostMemory block;
+        std::unique_ptr<Slot[]> slots;
+        int slotCount = 0;
+    };
+
+    int mExpertCount;
+    size_t mWeightBytes = 0;
+    std::vector<int> mHome;   // node of each expert
+    std::vector<int> mNodes;  // nodes with workers, in order
+    std::vector<NodeReplicas> mReplicas;                 // indexed by node
+    std::unique_ptr<std::atomic<int>[]> mReplicaSlot;    // slot of (node, expert), -1 if none
+    std::unique_ptr<std::atomic<bool>[]> mReplicated;    // expert has a replica on every node
+    std::mutex mReplicateLock;                           // serializes replicate() & refresh()
+
+   public:
+    explicit ExpertPlacement(int expertCount, const ThreadPool &pool = ThreadPool::instance());
+    ExpertPlacement(const ExpertPlacement &) = delete;
+    ExpertPlacement &operator=(const ExpertPlacement &) = delete;
+
+    // false on a single node, where placement is topology-agnostic
+    bool numa() const { return mNodes.size() > 1; }
+    // nodes (indices into Topology::nodes()) holding experts
+    const std::vector<int> &nodes() const { return mNodes; }
+    int home(int expert) const { return mHome[expert]; }
+    // experts at home on node, in order
+    std::vector<int> expertsOn(int node) const;
+    bool replicated(int expert) const { return mReplicated[expert].load(std::memory_order_relaxed); }
+
+    // keep a replica of each of experts (weightBytes each, read from source) on every node other than its home one,
+    // reusing the slots of experts that are no longer listed. Slots are allocated on the first call, one per expert
+    // listed then, and a replica of a version other than the one of source is copied again. No-op on a single node
+    void replicate(const std::vector<int> &experts, size_t weightBytes, HostAllocator::Backend backend,
+                   const Source &source);
+    // copy the weights of a replicated expert, changed in source, again to its replicas. Readers meanwhile take its
+    // home copy, those holding a pin on a replica keep reading the old weights until they release it, and readers of
+    // the old version no longer pin the replica once it holds the new one
+    void refresh(int expert, const Source &source);
+    // replica of version of the weights of expert on node, an empty pin when there is none (on its home node, node -1
+    // outside the pool, or a replica of another version)
+    Pin pin(int expert, int node, uint64_t version);
+};
+
+#endif  // EXPERT_PLACEMENT_H
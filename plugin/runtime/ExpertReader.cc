@@ -0,0 +1,327 @@
+#include "ExpertReader.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../thirdparty/dbg.h"
+
+namespace {
+
+// user_data of the no-op waking the reaping thread up on destruction
+const uint64_t STOP_TOKEN = ~0ull;
+
+int envInt(const char *name, int defaultValue) {
+    auto value = getenv(name);
+    if (value == nullptr || *value == '\0') return defaultValue;
+    return atoi(value);
+}
+
+uint64_t alignDown(uint64_t value) { return value & ~static_cast<uint64_t>(ExpertReader::ALIGNMENT - 1); }
+
+uint64_t alignUp(uint64_t value) { return alignDown(value + ExpertReader::ALIGNMENT - 1); }
+
+unsigned loadAcquire(const unsigned *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+
+void storeRelease(unsigned *p, unsigned value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+
+}  // namespace
+
+ExpertReader::ExpertReader(Engine engine, int queueDepth, bool direct, bool hugePages)
+    : mEngine(engine), mQueueDepth(queueDepth), mDirect(direct) {
+    assert(queueDepth > 0);
+    if (mEngine == URING && !setupRing()) {
+        fprintf(stderr, "WARNING: io_uring unavailable (%s), reading expert weights with pread\n", strerror(errno));
+        mEngine = PREAD;
+    }
+    allocateStaging(hugePages);
+    if (mEngine == URING) {
+        mThreads.emplace_back(&ExpertReader::reapLoop, this);
+    } else {
+        for (int i = 0; i < mQueueDepth; ++i) mThreads.emplace_back(&ExpertReader::preadLoop, this, i);
+    }
+    dbg(mEngine, mQueueDepth, mDirect, hugePages);
+}
+
+ExpertReader::~ExpertReader() {
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mStop = true;
+        if (mEngine == URING) {
+            auto tail = *mRing.sqTail;
+            auto index = tail & *mRing.sqMask;
+            auto sqe = static_cast<io_uring_sqe *>(mRing.sqes) + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = STOP_TOKEN;
+            mRing.sqArray[index] = index;
+            storeRelease(mRing.sqTail, tail + 1);
+            enter(1, 0);
+        }
+    }
+    mChanged.notify_all();
+    for (auto &thread : mThreads) thread.join();
+    closeRing();
+}
+
+ExpertReader &ExpertReader::instance() {
+    std::string engine = getenv("INFMOE_IO_ENGINE") != nullptr ? getenv("INFMOE_IO_ENGINE") : "uring";
+    if (engine != "uring" && engine != "pread") {
+        fprintf(stderr, "ERROR: INFMOE_IO_ENGINE must be uring or pread, got %s\n", engine.c_str());
+        assert(false);
+    }
+    static ExpertReader reader(engine == "pread" ? PREAD : URING, std::max(1, envInt("INFMOE_IO_DEPTH", 32)),
+                               envInt("INFMOE_IO_DIRECT", 1) == 1, envInt("INFMOE_IO_HUGE_PAGES", 0) == 1);
+    return reader;
+}
+
+bool ExpertReader::setupRing() {
+    io_uring_params params{};
+    mRing.fd = static_cast<int>(syscall(__NR_io_uring_setup, mQueueDepth + 1, &params));
+    if (mRing.fd < 0) return false;
+    mRing.sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mRing.cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        mRing.sqMapSize = mRing.cqMapSize = std::max(mRing.sqMapSize, mRing.cqMapSize);
+    }
+    mRing.sqMap = mmap(nullptr, mRing.sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd,
+                       IORING_OFF_SQ_RING);
+    if (mRing.sqMap == MAP_FAILED) {
+        mRing.sqMap = nullptr;
+        closeRing();
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        mRing.cqMap = mRing.sqMap;
+    } else {
+        mRing.cqMap = mmap(nullptr, mRing.cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd,
+                           IORING_OFF_CQ_RING);
+    }
+    mRing.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mRing.sqes = mmap(nullptr, mRing.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd,
+                      IORING_OFF_SQES);
+    if (mRing.cqMap == MAP_FAILED || mRing.sqes == MAP_FAILED) {
+        if (mRing.cqMap == MAP_FAILED) mRing.cqMap = nullptr;
+        if (mRing.sqes == MAP_FAILED) mRing.sqes = nullptr;
+        closeRing();
+        return false;
+    }
+    auto sq = static_cast<char *>(mRing.sqMap), cq = static_cast<char *>(mRing.cqMap);
+    mRing.sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    mRing.sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    mRing.sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    mRing.sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    mRing.cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    mRing.cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    mRing.cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    mRing.cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+void ExpertReader::closeRing() {
+    if (mRing.sqes != nullptr) munmap(mRing.sqes, mRing.sqesSize);
+    if (mRing.cqMap != nullptr && mRing.cqMap != mRing.sqMap) munmap(mRing.cqMap, mRing.cqMapSize);
+    if (mRing.sqMap != nullptr) munmap(mRing.sqMap, mRing.sqMapSize);
+    if (mRing.fd >= 0) close(mRing.fd);
+    mRing = Ring();
+}
+
+// a window of a chunk spans at most one more alignment unit on each side
+void ExpertReader::allocateStaging(bool hugePages) {
+    auto slot_size = CHUNK_SIZE + 2 * ALIGNMENT;
+    // both backends align large allocations to pages
+    mStaging = HostMemory(slot_size * mQueueDepth, hugePages ? HostAllocator::HUGE_PAGE : HostAllocator::ALIGNED);
+    mSlots.resize(mQueueDepth);
+    for (int i = 0; i < mQueueDepth; ++i) {
+        mSlots[i].buffer = mStaging.data() + slot_size * i;
+        mFreeSlots.push_back(mQueueDepth - 1 - i);
+    }
+}
+
+int ExpertReader::openFile(const char *path) const {
+    if (mDirect) {
+        auto fd = open(path, O_RDONLY | O_DIRECT);
+        if (fd >= 0 || errno != EINVAL) return fd;
+        dbg("O_DIRECT not supported, reading through the page cache", path);
+    }
+    return open(path, O_RDONLY);
+}
+
+void ExpertReader::read(int fd, const std::vector<Extent> &extents, Callback done) {
+    auto flags = fcntl(fd, F_GETFL);
+    assert(flags != -1);
+    bool direct = (flags & O_DIRECT) != 0;
+    std::vector<Chunk> chunks;
+    auto read = new Read();
+    read->done = std::move(done);
+    for (auto &extent : extents) {
+        for (size_t begin = 0; begin < extent.size; begin += CHUNK_SIZE) {
+            auto size = std::min(CHUNK_SIZE, extent.size - begin);
+            chunks.push_back(Chunk{read, fd, direct, extent.offset + begin, size, extent.dst + begin});
+        }
+    }
+    if (chunks.empty()) {
+        read->done(0);
+        delete read;
+        return;
+    }
+    read->remaining = static_cast<int>(chunks.size());
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mPending.insert(mPending.end(), chunks.begin(), chunks.end());
+        if (mEngine == URING) pump();
+    }
+    if (mEngine == PREAD) mChanged.notify_all();
+}
+
+int ExpertReader::readAll(int fd, const std::vector<Extent> &extents) {
+    std::mutex lock;
+    std::condition_variable landed;
+    bool finished = false;
+    int result = 0;
+    read(fd, extents, [&](int error) {
+        std::lock_guard<std::mutex> guard(lock);
+        result = error;
+        finished = true;
+        landed.notify_one();
+    });
+    std::unique_lock<std::mutex> guard(lock);
+    landed.wait(guard, [&] { return finished; });
+    return result;
+}
+
+void ExpertReader::pump() {
+    unsigned submitted = 0;
+    while (!mPending.empty() && !mFreeSlots.empty()) {
+        auto index = mFreeSlots.back();
+        mFreeSlots.pop_back();
+        auto &slot = mSlots[index];
+        slot.chunk = mPending.front();
+        mPending.pop_front();
+        slot.start = slot.chunk.direct ? alignDown(slot.chunk.offset) : slot.chunk.offset;
+        slot.length = slot.chunk.direct ? alignUp(slot.chunk.offset + slot.chunk.size) - slot.start : slot.chunk.size;
+        slot.filled = 0;
+        pushRead(index);
+        ++submitted;
+    }
+    if (submitted > 0) enter(submitted, 0);
+}
+
+void ExpertReader::pushRead(int slot) {
+    auto &s = mSlots[slot];
+    auto tail = *mRing.sqTail;
+    auto index = tail & *mRing.sqMask;
+    auto sqe = static_cast<io_uring_sqe *>(mRing.sqes) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s.chunk.fd;
+    sqe->off = s.start + s.filled;
+    sqe->addr = reinterpret_cast<uint64_t>((s.chunk.direct ? s.buffer : s.chunk.dst) + s.filled);
+    sqe->len = static_cast<uint32_t>(s.length - s.filled);
+    sqe->user_data = static_cast<uint64_t>(slot);
+    mRing.sqArray[index] = index;
+    storeRelease(mRing.sqTail, tail + 1);
+}
+
+void ExpertReader::enter(unsigned submit, unsigned wait) {
+    while (true) {
+        auto result = syscall(__NR_io_uring_enter, mRing.fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                              nullptr, 0);
+        if (result >= 0) {
+            submit -= std::min<unsigned>(submit, static_cast<unsigned>(result));
+            if (submit == 0) return;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter failed");
+            assert(false);
+        }
+    }
+}
+
+bool ExpertReader::complete(Slot &slot, int64_t result) {
+    auto &chunk = slot.chunk;
+    auto skip = chunk.offset - slot.start;
+    if (result < 0) {
+        finish(chunk, static_cast<int>(-result));
+        return true;
+    }
+    slot.filled += result;
+    // O_DIRECT windows may end past the end of file, only the chunk itself has to be read
+    if (slot.filled < skip + chunk.size) {
+        if (result > 0) return false;
+        finish(chunk, EIO);  // unexpected end of file
+        return true;
+    }
+    if (chunk.direct) memcpy(chunk.dst, slot.buffer + skip, chunk.size);
+    finish(chunk, 0);
+    return true;
+}
+
+void ExpertReader::finish(const Chunk &chunk, int error) {
+    auto read = chunk.read;
+    if (error != 0) {
+        int expected = 0;
+        read->error.compare_exchange_strong(expected, error);
+    }
+    if (read->remaining.fetch_sub(1) == 1) {
+        read->done(read->error.load());
+        delete read;
+    }
+}
+
+void ExpertReader::reapLoop() {
+    auto cqes = static_cast<io_uring_cqe *>(mRing.cqes);
+    while (true) {
+        auto head = *mRing.cqHead;
+        if (head == loadAcquire(mRing.cqTail)) {
+            enter(0, 1);
+            continue;
+        }
+        auto cqe = cqes[head & *mRing.cqMask];
+        storeRelease(mRing.cqHead, head + 1);
+        if (cqe.user_data == STOP_TOKEN) return;
+        auto index = static_cast<int>(cqe.user_data);
+        auto &slot = mSlots[index];
+        if (complete(slot, cqe.res)) {
+            std::lock_guard<std::mutex> guard(mLock);
+            mFreeSlots.push_back(index);
+            pump();
+        } else {
+            std::lock_guard<std::mutex> guard(mLock);
+            pushRead(index);
+            enter(1, 0);
+        }
+    }
+}
+
+void ExpertReader::preadLoop(int index) {
+    auto &slot = mSlots[index];
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(mLock);
+            mChanged.wait(guard, [&] { return mStop || !mPending.empty(); });
+            if (mStop) return;
+            slot.chunk = mPending.front();
+            mPending.pop_front();
+        }
+        auto &chunk = slot.chunk;
+        slot.start = chunk.direct ? alignDown(chunk.offset) : chunk.offset;
+        slot.length = chunk.direct ? alignUp(chunk.offset + chunk.size) - slot.start : chunk.size;
+        slot.filled = 0;
+        while (true) {
+            auto result = pread(chunk.fd, (chunk.direct ? slot.buffer : chunk.dst) + slot.filled,
+                                slot.length - slot.filled, slot.start + slot.filled);
+            if (result < 0 && errno == EINTR) continue;
+            if (complete(slot, result < 0 ? -errno : result)) break;
+        }
+    }
+}
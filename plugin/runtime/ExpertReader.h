@@ -0,0 +1,133 @@
+#pragma once
+
+#ifndef EXPERT_READER_H
+#define EXPERT_READER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "HostAllocator.h"
+
+// Process-wide asynchronous reader of expert weights from disk.
+//
+// Reads are split into chunks of CHUNK_SIZE bytes, up to queueDepth chunks in flight, so that reading one expert
+// keeps a NVMe drive busy. Two engines:
+//   URING: chunks are submitted to an io_uring (raw system calls, no liburing needed), one thread reaps completions
+//   PREAD: queueDepth I/O threads each pread one chunk at a time, used when io_uring is unavailable (old kernels,
+//          seccomp of containers)
+// Files opened by openFile() bypass the page cache (O_DIRECT) where the file system supports it: chunks are then read
+// into aligned staging buffers (optionally huge pages) and copied to their destination, otherwise read in place.
+// Completion callbacks run on the reaping / I/O threads and must not block.
+//
+// I/O threads are not in ThreadPool on purpose: blocking on disk there would stall expert execution.
+//
+// Configured by environment variables read on first use of instance():
+//   INFMOE_IO_ENGINE: uring or pread (default: uring, pread if io_uring cannot be set up)
+//   INFMOE_IO_DEPTH: chunks in flight (default: 32)
+//   INFMOE_IO_DIRECT: open weight files with O_DIRECT when set to 1 (default: 1)
+//   INFMOE_IO_HUGE_PAGES: back staging buffers by huge pages when set to 1 (default: 0)
+class ExpertReader {
+   public:
+    enum Engine { URING = 0, PREAD = 1 };
+    // alignment of O_DIRECT offsets, sizes & buffers, a multiple of the logical block size of every common device
+    constexpr static size_t ALIGNMENT = 4096;
+    constexpr static size_t CHUNK_SIZE = 1 << 20;
+
+    // bytes [offset, offset + size) of the file go to dst
+    struct Extent {
+        uint64_t offset;
+        size_t size;
+        char *dst;
+    };
+    // called once every extent of a read landed, with 0 or the errno of the first failed chunk
+    using Callback = std::function<void(int error)>;
+
+   private:
+    struct Read {
+        std::atomic<int> remaining{0};
+        std::atomic<int> error{0};
+        Callback done;
+    };
+
+    struct Chunk {
+        Read *read;
+        int fd;
+        bool direct;
+        uint64_t offset;
+        size_t size;
+        char *dst;
+    };
+
+    // a chunk in flight and its staging buffer
+    struct Slot {
+        char *buffer;
+        Chunk chunk;
+        uint64_t start;  // file offset of the window read to (buffer or dst)
+        size_t length;   // length of the window
+        size_t filled;   // bytes of the window read so far
+    };
+
+    // mapped io_uring queues
+    struct Ring {
+        int fd = -1;
+        void *sqMap = nullptr, *cqMap = nullptr, *sqes = nullptr;
+        size_t sqMapSize = 0, cqMapSize = 0, sqesSize = 0;
+        unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+        unsigned *cqHead, *cqTail, *cqMask;
+        void *cqes;
+    };
+
+    Engine mEngine;
+    int mQueueDepth;
+    bool mDirect;
+    HostMemory mStaging;
+    std::vector<Slot> mSlots;
+    std::vector<int> mFreeSlots;
+    std::deque<Chunk> mPending;
+    Ring mRing;
+    std::vector<std::thread> mThreads;
+    bool mStop = false;
+    std::mutex mLock;
+    std::condition_variable mChanged;
+
+    bool setupRing();
+    void closeRing();
+    void allocateStaging(bool hugePages);
+    // start reading chunks while slots are free, with mLock held
+    void pump();
+    // queue the (rest of the) window of a slot to the ring, with mLock held
+    void pushRead(int slot);
+    void enter(unsigned submit, unsigned wait);
+    void reapLoop();
+    void preadLoop(int slot);
+    // bytes read to the window of a slot (negative errno on failure), true when the chunk is done
+    bool complete(Slot &slot, int64_t result);
+    void finish(const Chunk &chunk, int error);
+
+   public:
+    ExpertReader(Engine engine, int queueDepth, bool direct, bool hugePages);
+    ~ExpertReader();
+    ExpertReader(const ExpertReader &) = delete;
+    ExpertReader &operator=(const ExpertReader &) = delete;
+
+    // the shared reader of this process
+    static ExpertReader &instance();
+
+    Engine engine() const { return mEngine; }
+    int queueDepth() const { return mQueueDepth; }
+    // open a file read-only, with O_DIRECT if enabled & supported by its file system, -1 (and errno) on failure
+    int openFile(const char *path) const;
+    // start reading extents of fd, done is called from an I/O thread once all of them landed
+    void read(int fd, const std::vector<Extent> &extents, Callback done);
+    // read extents of fd, return 0 or an errno once all of them landed
+    int readAll(int fd, const std::vector<Extent> &extents);
+};
+
+#endif  // EXPERT_READER_H
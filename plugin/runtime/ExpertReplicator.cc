@@ -0,0 +1,39 @@
+#include "ExpertReplicator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "../thirdparty/dbg.h"
+
+ExpertReplicator::ExpertReplicator(int expertCount, double threshold, int maxReplicas)
+    : mThreshold(threshold), mMaxReplicas(maxReplicas), mLoad(expertCount, 0.0), mReplicas(expertCount, 1) {
+    assert(expertCount > 0 && threshold > 1 && maxReplicas >= 1);
+}
+
+int ExpertReplicator::replicasFor(double load, double mean, double threshold) const {
+    if (mean <= 0 || load <= threshold * mean) return 1;
+    auto replicas = 1 + std::floor(load / (threshold * mean));
+    return static_cast<int>(std::min<double>(replicas, mMaxReplicas));
+}
+
+void ExpertReplicator::record(const int *expertTokenCount) {
+    auto expert_count = static_cast<int>(mLoad.size());
+    double total = 0;
+    for (int i = 0; i < expert_count; ++i) {
+        mLoad[i] = mLoad[i] * LOAD_DECAY + expertTokenCount[i];
+        total += mLoad[i];
+    }
+    auto mean = total / expert_count;
+    mStats.replicated = 0;
+    for (int i = 0; i < expert_count; ++i) {
+        // grow as soon as the threshold is crossed, shrink only below the lower expiry threshold
+        auto grown = std::max(mReplicas[i], replicasFor(mLoad[i], mean, mThreshold));
+        auto kept = std::min(grown, replicasFor(mLoad[i], mean, mThreshold * EXPIRY));
+        if (kept > mReplicas[i]) mStats.grown += kept - mReplicas[i];
+        if (kept < mReplicas[i]) mStats.expired += mReplicas[i] - kept;
+        if (kept != mReplicas[i]) dbg(i, mLoad[i], mean, mReplicas[i], kept);
+        mReplicas[i] = kept;
+        if (kept > 1) ++mStats.replicated;
+    }
+}
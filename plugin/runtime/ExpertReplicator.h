@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef EXPERT_REPLICATOR_H
+#define EXPERT_REPLICATOR_H
+
+#include <cstdint>
+#include <vector>
+
+// Replication of hot experts under skewed routing, so that one popular expert does not bound layer latency while
+// other workers or expert slots are idle.
+//
+// The load of each expert is its routed token count (from moe_expert_count), decaying with every recorded batch. An
+// expert whose load exceeds threshold times the mean load of all experts gets
+//     replicas = 1 + floor(load / (threshold * mean))
+// replicas (at most maxReplicas), each running a slice of its token segment in parallel: token chunks on separate
+// tasks (worker groups or NUMA nodes) on host, separate max_concurrency slots on device. Replicas expire by
+// themselves as load decays: an expert only loses a replica once its load falls below half of what would be needed
+// to gain it, so that replicas do not flap around the threshold.
+class ExpertReplicator {
+   public:
+    // weight of past batches in load
+    constexpr static double LOAD_DECAY = 0.8;
+    // share of the threshold below which replicas expire
+    constexpr static double EXPIRY = 0.5;
+
+    struct Stats {
+        int64_t grown = 0;    // replicas added
+        int64_t expired = 0;  // replicas dropped
+        int replicated = 0;   // experts currently with more than one replica
+    };
+
+   private:
+    double mThreshold;
+    int mMaxReplicas;
+    std::vector<double> mLoad;
+    std::vector<int> mReplicas;
+    Stats mStats;
+
+    int replicasFor(double load, double mean, double threshold) const;
+
+   public:
+    // threshold: ratio to the mean load above which an expert is replicated (> 1)
+    ExpertReplicator(int expertCount, double threshold, int maxReplicas);
+    // tokens routed to each expert by one batch, updating replica counts
+    void record(const int *expertTokenCount);
+    // number of replicas (1 when not replicated) of each expert
+    const std::vector<int> &replicas() const { return mReplicas; }
+    const std::vector<double> &load() const { return mLoad; }
+    const Stats &stats() const { return mStats; }
+};
+
+#endif  // EXPERT_REPLICATOR_H
@@ -0,0 +1,139 @@
+#include "ExpertScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "../thirdparty/dbg.h"
+
+namespace {
+
+// flops that cost as much as streaming one byte of weights from DRAM
+const double MACHINE_BALANCE = 8.0;
+// a token chunk of a split expert is never smaller than one GEMM token tile
+const int MIN_CHUNK_TOKENS = 32;
+
+}  // namespace
+
+ExpertScheduler::ExpertScheduler(size_t weightBytesPerExpert, double flopsPerToken, ThreadPool &pool,
+                                 std::shared_ptr<const ExpertPlacement> placement)
+    : mWeightCost(weightBytesPerExpert * MACHINE_BALANCE),
+      mFlopsPerToken(flopsPerToken),
+      mPool(pool),
+      mPlacement(placement != nullptr && placement->numa() ? std::move(placement) : nullptr) {}
+
+ExpertScheduler::Plan ExpertScheduler::plan(int expertCount, const int *expertTokenCount, const int *expertOffset,
+                                            const int *expertReplicas) const {
+    Plan plan;
+    auto workers = mPool.workerCount();
+    for (int i = 0; i < expertCount; ++i) {
+        if (expertTokenCount[i] > 0) plan.totalCost += cost(expertTokenCount[i]);
+    }
+    if (plan.totalCost == 0) return plan;
+    auto share = plan.totalCost / workers;
+
+    // node of a task holding an expert (chunk k of it, or all of it when k is -1): its home, unless it is replicated
+    std::vector<double> node_loads(mPool.nodeCount(), 0);
+    auto node_of = [&](int expert, int k) {
+        if (mPlacement == nullptr) return -1;
+        if (!mPlacement->replicated(expert)) return mPlacement->home(expert);
+        auto &nodes = mPlacement->nodes();
+        if (k >= 0) return nodes[(expert + k) % nodes.size()];
+        return *std::min_element(nodes.begin(), nodes.end(), [&](int a, int b) {
+            return node_loads[a] / mPool.workersOnNode(a) < node_loads[b] / mPool.workersOnNode(b);
+        });
+    };
+
+    // split large experts, collect small ones
+    std::vector<std::pair<double, int>> small_experts;
+    for (int i = 0; i < expertCount; ++i) {
+        auto count = expertTokenCount[i];
+        if (count == 0) continue;
+        auto expert_cost = cost(count);
+        // replicas of an expert only split tokens into chunks that stay large enough
+        auto replicas = expertReplicas == nullptr ? 1 : std::min(expertReplicas[i], count / MIN_CHUNK_TOKENS);
+        if ((expert_cost <= share && replicas <= 1) || workers == 1) {
+            small_experts.emplace_back(expert_cost, i);
+            continue;
+        }
+        // an expert bound to its home node cannot use workers of other nodes
+        auto home = mPlacement != nullptr && !mPlacement->replicated(i) ? mPlacement->home(i) : -1;
+        auto limit = home < 0 ? workers : mPool.workersOnNode(home);
+        replicas = std::min(replicas, limit);
+        auto wanted = std::min(limit, std::max(replicas, static_cast<int>(std::ceil(expert_cost / share))));
+        // prefer token chunks while they stay large enough, use feature tiles for the rest
+        auto chunks = std::max({1, replicas, std::min(wanted, count / MIN_CHUNK_TOKENS)});
+        auto parallelism = (wanted + chunks - 1) / chunks;
+        for (int k = 0; k < chunks; ++k) {
+            auto begin = static_cast<int>(static_cast<int64_t>(count) * k / chunks);
+            auto end = static_cast<int>(static_cast<int64_t>(count) * (k + 1) / chunks);
+            auto node = node_of(i, k);
+            plan.tasks.push_back(
+                Task{{WorkItem{i, expertOffset[i] + begin, end - begin, parallelism}}, cost(end - begin), node});
+            if (node >= 0) node_loads[node] += cost(end - begin);
+        }
+    }
+
+    // pack small experts (of the same node) into tasks of at most one share (first fit decreasing)
+    std::sort(small_experts.begin(), small_experts.end(), std::greater<>());
+    auto first_pack = plan.tasks.size();
+    for (auto &[expert_cost, i] : small_experts) {
+        auto node = node_of(i, -1);
+        auto pack = plan.tasks.begin() + first_pack;
+        while (pack != plan.tasks.end() && (pack->node != node || pack->cost + expert_cost > share)) ++pack;
+        if (pack == plan.tasks.end()) {
+            plan.tasks.push_back(Task{{}, 0, node});
+            pack = plan.tasks.end() - 1;
+        }
+        pack->items.push_back(WorkItem{i, expertOffset[i], expertTokenCount[i], 1});
+        pack->cost += expert_cost;
+        if (node >= 0) node_loads[node] += expert_cost;
+    }
+
+    std::stable_sort(plan.tasks.begin(), plan.tasks.end(),
+                     [](const Task &a, const Task &b) { return a.cost > b.cost; });
+
+    // estimate makespan by list scheduling, a task with parallelism p occupies the p least loaded workers (of its
+    // node when placed)
+    std::vector<std::vector<double>> loads(mPlacement != nullptr ? mPool.nodeCount() : 1);
+    for (size_t node = 0; node < loads.size(); ++node) {
+        loads[node].assign(mPlacement != nullptr ? mPool.workersOnNode(node) : workers, 0);
+    }
+    for (auto &task : plan.tasks) {
+        auto &node_workers = loads[std::max(task.node, 0)];
+        auto parallelism = std::min(static_cast<int>(node_workers.size()),
+                                    task.items.size() == 1 ? task.items[0].parallelism : 1);
+        std::partial_sort(node_workers.begin(), node_workers.begin() + parallelism, node_workers.end());
+        for (int p = 0; p < parallelism; ++p) node_workers[p] += task.cost / parallelism;
+    }
+    for (auto &node_workers : loads) {
+        if (node_workers.empty()) continue;
+        plan.estimatedMakespan =
+            std::max(plan.estimatedMakespan, *std::max_element(node_workers.begin(), node_workers.end()));
+    }
+    return plan;
+}
+
+void ExpertScheduler::execute(const Plan &plan, const Runner &runner) {
+    auto start = std::chrono::steady_clock::now();
+    auto busy_start = mPool.busyNanoseconds();
+
+    TaskGroup group(mPool);
+    for (auto &task : plan.tasks) {
+        group.run(
+            [&task, &runner] {
+                for (auto &item : task.items) runner(item);
+            },
+            task.node);
+    }
+    group.wait();
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto busy = (mPool.busyNanoseconds() - busy_start) * 1e-9;
+    mStats.calls++;
+    mStats.lastLatencyMs = elapsed * 1e3;
+    mStats.lastUtilization = elapsed > 0 ? std::min(1.0, busy / (elapsed * mPool.workerCount())) : 0;
+    mStats.lastImbalance = plan.totalCost > 0 ? plan.estimatedMakespan / (plan.totalCost / mPool.workerCount()) : 0;
+    mStats.averageUtilization += (mStats.lastUtilization - mStats.averageUtilization) / mStats.calls;
+    dbg(plan.tasks.size(), mStats.lastLatencyMs, mStats.lastUtilization, mStats.lastImbalance);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef EXPERT_SCHEDULER_H
+#define EXPERT_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ExpertPlacement.h"
+#include "ThreadPool.h"
+
+// Two-level (inter-expert x intra-expert) scheduling of host expert execution.
+//
+// From the expert_count / expert_offset arrays produced by moe_expert_count, every expert is given a cost:
+//     cost(tokens) = weight_bytes * MACHINE_BALANCE + tokens * flops_per_token
+// (streaming the weights once is paid per work item, compute is paid per token). With a fair share of
+// total_cost / workers per worker:
+//   * large experts are split into token chunks (re-reading weights once per chunk) and each chunk may further
+//     occupy several workers by splitting its GEMMs along hidden features (no extra weight traffic)
+//   * small experts are packed together (first-fit decreasing) into tasks of about one fair share, so that many
+//     tiny experts do not pay one task each
+//   * experts replicated by ExpertReplicator are split into at least one token chunk per replica, whatever their
+//     cost, so that replicas of a hot expert run in parallel on separate tasks
+// Tasks are then submitted largest first, and work stealing absorbs what the cost model gets wrong.
+//
+// With an ExpertPlacement spanning several NUMA nodes, each task is bound to a node: chunks and packs of an expert go
+// to its home node, packs only hold experts of one node, and chunks of replicated experts are spread over every node
+// (small replicated experts go to the least loaded node). Workers steal across nodes only once their node runs dry.
+class ExpertScheduler {
+   public:
+    // a range of tokens of one expert, in the routed (expert-sorted) token order
+    struct WorkItem {
+        int expert;
+        int tokenOffset;
+        int tokenCount;
+        int parallelism;  // number of workers the item may occupy (GEMM tiles)
+    };
+
+    // items executed one after another by the same task
+    struct Task {
+        std::vector<WorkItem> items;
+        double cost;
+        int node = -1;  // NUMA node (index into Topology::nodes()) to run on, -1 for any
+    };
+
+    struct Plan {
+        std::vector<Task> tasks;  // sorted by cost, largest first
+        double totalCost = 0;
+        double estimatedMakespan = 0;  // cost units, list scheduling of tasks over workers
+    };
+
+    struct Stats {
+        int64_t calls = 0;
+        double lastLatencyMs = 0;
+        double lastUtilization = 0;  // busy worker time / (latency * workers)
+        double lastImbalance = 0;    // estimated makespan / ideal makespan
+        double averageUtilization = 0;
+    };
+
+    using Runner = std::function<void(const WorkItem &)>;
+
+   private:
+    double mWeightCost;
+    double mFlopsPerToken;
+    ThreadPool &mPool;
+    std::shared_ptr<const ExpertPlacement> mPlacement;
+    Stats mStats;
+
+   public:
+    // without placement (or with one on a single node), tasks may run on any node
+    ExpertScheduler(size_t weightBytesPerExpert, double flopsPerToken, ThreadPool &pool = ThreadPool::instance(),
+                    std::shared_ptr<const ExpertPlacement> placement = nullptr);
+    double cost(int tokenCount) const { return mWeightCost + tokenCount * mFlopsPerToken; }
+    // expertReplicas: replicas of each expert (see ExpertReplicator), may be null
+    Plan plan(int expertCount, const int *expertTokenCount, const int *expertOffset,
+              const int *expertReplicas = nullptr) const;
+    // run every item of the plan on the pool and record stats, returns when all items are finished
+    void execute(const Plan &plan, const Runner &runner);
+    const Stats &stats() const { return mStats; }
+};
+
+#endif  // EXPERT_SCHEDULER_H
@@ -0,0 +1,362 @@
+#include "ExpertShards.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include "../thirdparty/dbg.h"
+#include "Topology.h"
+
+extern char **environ;
+
+// head of the shared memory segment, followed by the request & response rings of each worker
+struct ExpertShards::Shared {
+    uint32_t magic;
+    int32_t shardCount;
+    int32_t expertCount;
+    int32_t embeddingSize;
+    int32_t hiddenSize;
+    uint64_t ringCapacity;
+    uint64_t hotBytes;
+    uint64_t warmBytes;
+    char sublayerType[64];
+    char weightFile[4096];
+    std::atomic<int32_t> attached;  // workers that mapped the segment
+    std::atomic<int32_t> ready;     // workers that loaded their experts
+};
+
+namespace {
+
+constexpr uint32_t MAGIC = 0x53456f4d;  // "MoES"
+constexpr size_t PAGE = 4096;
+const char *WORKER = "moe_shard_worker";
+
+// messages on the request ring: Request, segmentCount Segment, then the rows of each segment in order. On the
+// response ring: Response, then the result rows in the same order
+enum Op : int32_t { RUN = 1, STOP = 2 };
+struct Request {
+    int32_t op;
+    int32_t segmentCount;
+    int32_t tokenCount;
+    int32_t reserved;
+};
+struct Segment {
+    int32_t expert;
+    int32_t tokenCount;
+};
+struct Response {
+    int32_t status;
+    int32_t tokenCount;
+};
+
+int envInt(const char *name, int defaultValue) {
+    auto value = getenv(name);
+    return value != nullptr ? atoi(value) : defaultValue;
+}
+
+size_t roundUp(size_t size, size_t alignment) { return (size + alignment - 1) / alignment * alignment; }
+
+// ring index: 2 * shard for requests, 2 * shard + 1 for responses, index 2 * shardCount gives the segment size
+size_t ringOffset(int index, size_t capacity) {
+    return roundUp(sizeof(ExpertShards::Shared), PAGE) + index * roundUp(ShmRing::sizeFor(capacity), PAGE);
+}
+
+std::string workerPath() {
+    if (getenv("INFMOE_SHARD_WORKER") != nullptr) return getenv("INFMOE_SHARD_WORKER");
+    // installed along with the library holding this code
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&ExpertShards::range), &info) != 0 && info.dli_fname != nullptr) {
+        std::string library = info.dli_fname;
+        auto slash = library.rfind('/');
+        auto path = (slash == std::string::npos ? std::string(".") : library.substr(0, slash)) + "/" + WORKER;
+        if (access(path.c_str(), X_OK) == 0) return path;
+    }
+    return WORKER;
+}
+
+// CPUs of a worker as a comma-separated list: whole nodes if there are enough of them, a range of CPUs else
+std::string cpusOf(int shard, int shardCount) {
+    auto &nodes = Topology::host().nodes();
+    auto node_count = static_cast<int>(nodes.size());
+    std::vector<int> cpus;
+    if (node_count >= shardCount) {
+        for (auto node = node_count * shard / shardCount; node < node_count * (shard + 1) / shardCount; ++node) {
+            cpus.insert(cpus.end(), nodes[node].cpus.begin(), nodes[node].cpus.end());
+        }
+    } else {
+        std::vector<int> all;
+        for (auto &node : nodes) all.insert(all.end(), node.cpus.begin(), node.cpus.end());
+        auto count = all.size();
+        auto begin = count * shard / shardCount;
+        auto end = std::max(begin + 1, count * (shard + 1) / shardCount);
+        cpus.assign(all.begin() + begin, all.begin() + end);
+    }
+    std::string list;
+    for (auto cpu : cpus) list += (list.empty() ? "" : ",") + std::to_string(cpu);
+    return list;
+}
+
+}  // namespace
+
+std::pair<int, int> ExpertShards::range(int shard, int shardCount, int expertCount) {
+    return {static_cast<int>(static_cast<int64_t>(expertCount) * shard / shardCount),
+            static_cast<int>(static_cast<int64_t>(expertCount) * (shard + 1) / shardCount)};
+}
+
+ExpertShards::ExpertShards(const Config &config)
+    : mConfig(config), mShardTokens(config.shardCount), mRow(config.embeddingSize) {
+    assert(config.shardCount > 0 && config.shardCount <= config.expertCount);
+    assert(config.sublayerType.size() < sizeof(Shared::sublayerType));
+    assert(config.weightFile.size() < sizeof(Shared::weightFile));
+    auto ring_bytes = static_cast<size_t>(std::max(1, envInt("INFMOE_SHARD_RING_MB", 16))) << 20;
+    size_t capacity = PAGE;
+    while (capacity < ring_bytes) capacity <<= 1;
+
+    static std::atomic<int> segments{0};
+    mName = "/infmoe-shards-" + std::to_string(getpid()) + "-" + std::to_string(segments++);
+    mSharedSize = ringOffset(2 * config.shardCount, capacity);
+    auto fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(mSharedSize)) != 0) {
+        perror("Cannot create shared memory of expert shards");
+        assert(false);
+    }
+    auto memory = mmap(nullptr, mSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("Cannot map shared memory of expert shards");
+        assert(false);
+    }
+    mShared = new (memory) Shared{};
+    mShared->magic = MAGIC;
+    mShared->shardCount = config.shardCount;
+    mShared->expertCount = config.expertCount;
+    mShared->embeddingSize = config.embeddingSize;
+    mShared->hiddenSize = config.hiddenSize;
+    mShared->ringCapacity = capacity;
+    mShared->hotBytes = config.hotBytes;
+    mShared->warmBytes = config.warmBytes;
+    strcpy(mShared->sublayerType, config.sublayerType.c_str());
+    strcpy(mShared->weightFile, config.weightFile.c_str());
+    auto base = static_cast<char *>(memory);
+    for (int shard = 0; shard < config.shardCount; ++shard) {
+        mRequests.emplace_back(base + ringOffset(2 * shard, capacity), capacity, true);
+        mResponses.emplace_back(base + ringOffset(2 * shard + 1, capacity), capacity, true);
+    }
+
+    auto path = workerPath();
+    for (int shard = 0; shard < config.shardCount; ++shard) {
+        std::vector<std::string> args{path, mName, std::to_string(shard), cpusOf(shard, config.shardCount)};
+        std::vector<char *> argv;
+        for (auto &arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        pid_t pid;
+        auto err = posix_spawnp(&pid, path.c_str(), nullptr, nullptr, argv.data(), environ);
+        if (err != 0) {
+            fprintf(stderr, "ERROR: cannot spawn shard worker %s: %s\n", path.c_str(), strerror(err));
+            assert(false);
+        }
+        dbg(shard, pid, args[3]);
+        mWorkers.push_back(pid);
+    }
+    auto wait_for = [&](const std::atomic<int32_t> &workers, const char *what) {
+        while (workers.load() < config.shardCount) {
+            for (int shard = 0; shard < config.shardCount; ++shard) {
+                if (alive(shard)) continue;
+                fprintf(stderr, "ERROR: shard worker %d exited while %s\n", shard, what);
+                shm_unlink(mName.c_str());
+                assert(false);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+    // the segment only lives as long as its mappings once every worker has mapped it
+    wait_for(mShared->attached, "mapping shared memory");
+    shm_unlink(mName.c_str());
+    wait_for(mShared->ready, "loading its experts");
+    dbg(mName, config.shardCount, capacity);
+}
+
+ExpertShards::~ExpertShards() {
+    Request stop{STOP, 0, 0, 0};
+    for (int shard = 0; shard < shardCount(); ++shard) {
+        if (mWorkers[shard] > 0) mRequests[shard].write(&stop, sizeof(stop), [this, shard] { return alive(shard); });
+    }
+    for (auto pid : mWorkers) {
+        if (pid > 0) waitpid(pid, nullptr, 0);
+    }
+    munmap(mShared, mSharedSize);
+}
+
+bool ExpertShards::alive(int shard) {
+    if (mWorkers[shard] <= 0) return false;
+    if (waitpid(mWorkers[shard], nullptr, WNOHANG) == 0) return true;
+    mWorkers[shard] = -1;
+    return false;
+}
+
+void ExpertShards::send(int shard, const void *data, size_t size) {
+    if (mRequests[shard].write(data, size, [this, shard] { return alive(shard); })) return;
+    fprintf(stderr, "ERROR: shard worker %d exited\n", shard);
+    assert(false);
+}
+
+void ExpertShards::receive(int shard, void *data, size_t size) {
+    if (mResponses[shard].read(data, size, [this, shard] { return alive(shard); })) return;
+    fprintf(stderr, "ERROR: shard worker %d exited\n", shard);
+    assert(false);
+}
+
+void ExpertShards::run(const int *expertTokenCount, const int *expertOffset, const int *tokenPos, const float *input,
+                       const float *mixCoeff, float *output) {
+    std::lock_guard<std::mutex> guard(mRunLock);
+    auto row_size = sizeof(float) * mConfig.embeddingSize;
+    auto row_of = [&](int r) { return static_cast<size_t>(tokenPos != nullptr ? tokenPos[r] : r); };
+    // scatter: every worker gets the rows of its experts, and runs them while the next one is being sent
+    std::vector<Segment> segments;
+    for (int shard = 0; shard < shardCount(); ++shard) {
+        auto [begin, end] = range(shard, shardCount(), mConfig.expertCount);
+        segments.clear();
+        mShardTokens[shard] = 0;
+        for (int i = begin; i < end; ++i) {
+            if (expertTokenCount[i] == 0) continue;
+            segments.push_back(Segment{i, expertTokenCount[i]});
+            mShardTokens[shard] += expertTokenCount[i];
+        }
+        if (segments.empty()) continue;
+        Request request{RUN, static_cast<int32_t>(segments.size()), mShardTokens[shard], 0};
+        send(shard, &request, sizeof(request));
+        send(shard, segments.data(), sizeof(Segment) * segments.size());
+        for (auto &segment : segments) {
+            for (int r = expertOffset[segment.expert]; r < expertOffset[segment.expert] + segment.tokenCount; ++r) {
+                send(shard, input + row_of(r) * mConfig.embeddingSize, row_size);
+            }
+        }
+    }
+    // gather: results of each worker in the order of its rows, straight to their place in the output
+    for (int shard = 0; shard < shardCount(); ++shard) {
+        if (mShardTokens[shard] == 0) continue;
+        Response response;
+        receive(shard, &response, sizeof(response));
+        if (response.status != 0 || response.tokenCount != mShardTokens[shard]) {
+            fprintf(stderr, "ERROR: shard worker %d failed (status %d, %d tokens)\n", shard, response.status,
+                    response.tokenCount);
+            assert(false);
+        }
+        auto [begin, end] = range(shard, shardCount(), mConfig.expertCount);
+        for (int i = begin; i < end; ++i) {
+            for (int r = expertOffset[i]; r < expertOffset[i] + expertTokenCount[i]; ++r) {
+                auto row = row_of(r) * mConfig.embeddingSize;
+                if (mixCoeff == nullptr) {
+                    receive(shard, output + row, row_size);
+                    continue;
+                }
+                receive(shard, mRow.data(), row_size);
+                auto alpha = 1.0f / (1.0f + std::exp(-mixCoeff[row_of(r)]));
+                for (int c = 0; c < mConfig.embeddingSize; ++c) {
+                    output[row + c] = input[row + c] + alpha * (mRow[c] - input[row + c]);
+                }
+            }
+        }
+    }
+}
+
+int ExpertShards::serve(int argc, char **argv, const Loader &loader) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <segment> <shard> <cpus>\n", argv[0]);
+        return 2;
+    }
+    auto shard = atoi(argv[2]);
+    // before anything (the thread pool) reads the usable CPUs of this process
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    std::string cpus = argv[3];
+    for (size_t begin = 0; begin < cpus.size();) {
+        auto end = std::min(cpus.find(',', begin), cpus.size());
+        CPU_SET(atoi(cpus.substr(begin, end - begin).c_str()), &cpuset);
+        begin = end + 1;
+    }
+    if (CPU_COUNT(&cpuset) > 0 && sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) perror("sched_setaffinity");
+
+    auto parent = getppid();
+    auto fd = shm_open(argv[1], O_RDWR, 0);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        perror("Cannot open shared memory of expert shards");
+        return 1;
+    }
+    auto memory = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("Cannot map shared memory of expert shards");
+        return 1;
+    }
+    auto shared = static_cast<Shared *>(memory);
+    if (shared->magic != MAGIC || shard < 0 || shard >= shared->shardCount) {
+        fprintf(stderr, "ERROR: %s is not the shared memory of shard %d\n", argv[1], shard);
+        return 1;
+    }
+    shared->attached.fetch_add(1);
+    Config config;
+    config.shardCount = shared->shardCount;
+    config.expertCount = shared->expertCount;
+    config.embeddingSize = shared->embeddingSize;
+    config.hiddenSize = shared->hiddenSize;
+    config.sublayerType = shared->sublayerType;
+    config.weightFile = shared->weightFile;
+    config.hotBytes = shared->hotBytes;
+    config.warmBytes = shared->warmBytes;
+    auto capacity = shared->ringCapacity;
+    auto base = static_cast<char *>(memory);
+    ShmRing requests(base + ringOffset(2 * shard, capacity), capacity, false);
+    ShmRing responses(base + ringOffset(2 * shard + 1, capacity), capacity, false);
+    auto [begin, end] = range(shard, config.shardCount, config.expertCount);
+    auto runner = loader(config, begin, end);
+    shared->ready.fetch_add(1);
+    dbg(shard, begin, end);
+
+    // the layer process went away without stopping its workers
+    auto alive = [parent] { return getppid() == parent; };
+    std::vector<Segment> segments;
+    std::vector<int> count(config.expertCount), offset(config.expertCount);
+    std::vector<float> input, output;
+    while (true) {
+        Request request;
+        if (!requests.read(&request, sizeof(request), alive)) return 1;
+        if (request.op == STOP) return 0;
+        segments.resize(request.segmentCount);
+        if (!requests.read(segments.data(), sizeof(Segment) * segments.size(), alive)) return 1;
+        std::fill(count.begin(), count.end(), 0);
+        int rows = 0;
+        for (auto &segment : segments) {
+            assert(segment.expert >= begin && segment.expert < end);
+            count[segment.expert] = segment.tokenCount;
+            offset[segment.expert] = rows;
+            rows += segment.tokenCount;
+        }
+        assert(rows == request.tokenCount);
+        input.resize(static_cast<size_t>(rows) * config.embeddingSize);
+        output.resize(input.size());
+        if (!requests.read(input.data(), sizeof(float) * input.size(), alive)) return 1;
+        runner(count.data(), offset.data(), rows, input.data(), output.data());
+        Response response{0, rows};
+        if (!responses.write(&response, sizeof(response), alive)) return 1;
+        if (!responses.write(output.data(), sizeof(float) * output.size(), alive)) return 1;
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#ifndef EXPERT_SHARDS_H
+#define EXPERT_SHARDS_H
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ShmRing.h"
+
+// Expert parallelism across local worker processes: experts are split into shardCount contiguous ranges, each one
+// loaded and run by its own moe_shard_worker process, so that neither the weights nor the compute of a layer have to
+// fit in one process (one worker per socket, or per container sharing /dev/shm).
+//
+// The layer process and its workers share one memory segment holding, for each worker, a request ring and a response
+// ring (ShmRing). run() is an all-to-all over them: the token rows routed to each expert (its expert_offset range,
+// read in place through token positions) are streamed to the worker of the expert, then the results of every worker
+// are read back and written (and mixed, for base layers) to the rows of their tokens, in token order. Each worker
+// plans its experts with its own ExpertScheduler while the rows of the next worker are still being sent.
+//
+// Workers are spawned when constructed and stopped when destroyed. Each one is bound to its share of the CPUs of the
+// layer process: whole NUMA nodes when there are at least as many nodes as workers, a contiguous range of CPUs else.
+//
+// Configured by environment variables read when constructed:
+//   INFMOE_SHARD_WORKER: path of the worker executable (default: moe_shard_worker next to the plugin library, then
+//                        in PATH)
+//   INFMOE_SHARD_RING_MB: capacity of each ring in MiB, rounded up to a power of 2 (default: 16)
+//
+// Thread-safe: clones of a layer share the workers, and their concurrent run() calls are serialized.
+class ExpertShards {
+   public:
+    // what workers need to load their experts, copied into shared memory
+    struct Config {
+        int shardCount = 0;
+        int expertCount = 0;
+        int embeddingSize = 0;
+        int hiddenSize = 0;
+        std::string sublayerType;
+        std::string weightFile;
+        size_t hotBytes = 0;  // weight budgets of each worker, see MoESubLayer::setWeightBudgets
+        size_t warmBytes = 0;
+    };
+    // runs the experts of a worker: tokens of expert e are rows [expertOffset[e], expertOffset[e] +
+    // expertTokenCount[e]) of input & output, tokenCount rows in all (arrays cover every expert of the layer)
+    using Runner = std::function<void(const int *expertTokenCount, const int *expertOffset, int tokenCount,
+                                      const float *input, float *output)>;
+    // loads experts [begin, end) in a worker, returning how to run them
+    using Loader = std::function<Runner(const Config &config, int begin, int end)>;
+
+    struct Shared;
+
+   private:
+    Config mConfig;
+    std::string mName;  // of the shared memory segment
+    Shared *mShared = nullptr;
+    size_t mSharedSize = 0;
+    std::vector<pid_t> mWorkers;
+    std::vector<ShmRing> mRequests, mResponses;
+    std::vector<int> mShardTokens;  // rows sent to each worker by the current run()
+    std::vector<float> mRow;
+    std::mutex mRunLock;  // serializes run()
+
+    // false once worker has exited
+    bool alive(int shard);
+    void send(int shard, const void *data, size_t size);
+    void receive(int shard, void *data, size_t size);
+
+   public:
+    explicit ExpertShards(const Config &config);
+    ~ExpertShards();
+    ExpertShards(const ExpertShards &) = delete;
+    ExpertShards &operator=(const ExpertShards &) = delete;
+
+    int shardCount() const { return mConfig.shardCount; }
+    // experts [first, second) of shard
+    static std::pair<int, int> range(int shard, int shardCount, int expertCount);
+
+    // same contract as MoESubLayer::runHostIndexed over every expert: routed token r (in the range of its expert) is
+    // read from row tokenPos[r] of input (row r without tokenPos) and its result written to the same row of output,
+    // mixed as input + sigmoid(mixCoeff[row]) * (expert(input) - input) with mixCoeff
+    void run(const int *expertTokenCount, const int *expertOffset, const int *tokenPos, const float *input,
+             const float *mixCoeff, float *output);
+
+    // main of a worker process: moe_shard_worker <segment> <shard> <cpus>, returns its exit status
+    static int serve(int argc, char **argv, const Loader &loader);
+};
+
+#endif  // EXPERT_SHARDS_H
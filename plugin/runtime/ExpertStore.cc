@@ -0,0 +1,258 @@
+#include "ExpertStore.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "../thirdparty/dbg.h"
+
+namespace {
+
+int64_t elapsedNanoseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// byte b of every 32-bit word goes to plane b: sign, exponent & high mantissa bytes of weights compress well once
+// gathered, low mantissa bytes hardly do and are then kept as is
+void splitPlanes(const char *src, size_t words, unsigned char *dst) {
+    for (size_t i = 0; i < words; ++i) {
+        for (int b = 0; b < 4; ++b) dst[b * words + i] = src[i * 4 + b];
+    }
+}
+
+void joinPlanes(const unsigned char *const *planes, size_t words, char *dst) {
+    for (size_t i = 0; i < words; ++i) {
+        for (int b = 0; b < 4; ++b) dst[i * 4 + b] = planes[b][i];
+    }
+}
+
+}  // namespace
+
+ExpertStore::ExpertStore(int expertCount, size_t expertSize, size_t hotBudget, size_t compressedBudget, Loader loader)
+    : mExpertSize(expertSize),
+      mHotBudget(hotBudget),
+      mCompressedBudget(compressedBudget),
+      mLoader(std::move(loader)),
+      mEntries(expertCount) {
+    assert(expertCount > 0 && expertSize > 0 && expertSize % 4 == 0);
+    dbg(expertCount, expertSize, hotBudget, compressedBudget);
+}
+
+ExpertStore::Tier ExpertStore::tierOf(const Entry &entry) const {
+    if (entry.hot.data() != nullptr) return HOT;
+    return entry.compressed.empty() ? DISK : COMPRESSED;
+}
+
+int ExpertStore::coldestHot() const {
+    int result = -1;
+    for (int i = 0; i < static_cast<int>(mEntries.size()); ++i) {
+        auto &entry = mEntries[i];
+        if (entry.hot.data() == nullptr || entry.pins > 0 || entry.busy) continue;
+        if (result == -1 || entry.frequency < mEntries[result].frequency) result = i;
+    }
+    return result;
+}
+
+bool ExpertStore::admissible(int expert, size_t bytes) const {
+    auto frequency = mEntries[expert].frequency;
+    size_t colder = 0;
+    for (int i = 0; i < static_cast<int>(mEntries.size()); ++i) {
+        auto &entry = mEntries[i];
+        if (i != expert && !entry.compressed.empty() && !entry.busy && entry.frequency < frequency) {
+            colder += entry.compressedBytes;
+        }
+    }
+    return mCompressedBytes + bytes <= mCompressedBudget + colder;
+}
+
+bool ExpertStore::admit(int expert, std::vector<std::vector<unsigned char>> &pieces, size_t bytes) {
+    auto frequency = mEntries[expert].frequency;
+    while (mCompressedBytes + bytes > mCompressedBudget) {
+        // colder compressed copies, of experts in COMPRESSED or HOT, make room
+        int victim = -1;
+        for (int i = 0; i < static_cast<int>(mEntries.size()); ++i) {
+            auto &entry = mEntries[i];
+            if (i == expert || entry.compressed.empty() || entry.busy || entry.frequency >= frequency) continue;
+            if (victim == -1 || entry.frequency < mEntries[victim].frequency) victim = i;
+        }
+        if (victim == -1) return false;
+        auto &entry = mEntries[victim];
+        if (entry.hot.data() == nullptr) ++mMetrics[DISK].demotions;
+        mCompressedBytes -= entry.compressedBytes;
+        entry.compressed = {};
+        entry.compressedBytes = 0;
+    }
+    auto &entry = mEntries[expert];
+    entry.compressed = std::move(pieces);
+    entry.compressedBytes = bytes;
+    mCompressedBytes += bytes;
+    return true;
+}
+
+size_t ExpertStore::compress(const char *src, std::vector<std::vector<unsigned char>> &pieces) const {
+    auto chunk_count = (mExpertSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    pieces.resize(chunk_count * 4);
+    thread_local std::vector<unsigned char> planes;
+    size_t bytes = 0;
+    for (size_t c = 0; c < chunk_count; ++c) {
+        auto offset = c * CHUNK_SIZE;
+        auto words = std::min(CHUNK_SIZE, mExpertSize - offset) / 4;
+        planes.resize(words * 4);
+        splitPlanes(src + offset, words, planes.data());
+        for (int b = 0; b < 4; ++b) {
+            auto plane = planes.data() + b * words;
+            auto &piece = pieces[c * 4 + b];
+            piece.resize(compressBound(words));
+            uLongf compressed_length = piece.size();
+            auto err = compress2(piece.data(), &compressed_length, plane, words, Z_BEST_SPEED);
+            if (err != Z_OK) {
+                fprintf(stderr, "ERROR: failed to compress expert weights: %d\n", err);
+                assert(false);
+            }
+            // incompressible planes are kept as is, told apart by their length
+            if (compressed_length >= words) {
+                piece.assign(plane, plane + words);
+            } else {
+                piece.resize(compressed_length);
+                piece.shrink_to_fit();
+            }
+            bytes += piece.size();
+        }
+    }
+    return bytes;
+}
+
+void ExpertStore::decompress(const std::vector<std::vector<unsigned char>> &pieces, char *dst) const {
+    thread_local std::vector<unsigned char> planes;
+    for (size_t c = 0; c < pieces.size() / 4; ++c) {
+        auto offset = c * CHUNK_SIZE;
+        auto words = std::min(CHUNK_SIZE, mExpertSize - offset) / 4;
+        planes.resize(words * 4);
+        const unsigned char *sources[4];
+        for (int b = 0; b < 4; ++b) {
+            auto &piece = pieces[c * 4 + b];
+            if (piece.size() == words) {
+                sources[b] = piece.data();
+                continue;
+            }
+            sources[b] = planes.data() + b * words;
+            uLongf plane_length = words;
+            auto err = uncompress(planes.data() + b * words, &plane_length, piece.data(), piece.size());
+            if (err != Z_OK || plane_length != words) {
+                fprintf(stderr, "ERROR: failed to decompress expert weights: %d\n", err);
+                assert(false);
+            }
+        }
+        joinPlanes(sources, words, dst + offset);
+    }
+}
+
+ExpertStore::Pin ExpertStore::acquire(int expert) {
+    assert(expert >= 0 && expert < static_cast<int>(mEntries.size()));
+    std::unique_lock<std::mutex> lock(mLock);
+    auto &entry = mEntries[expert];
+    mChanged.wait(lock, [&] { return !entry.busy; });
+    auto from = tierOf(entry);
+    ++mMetrics[from].hits;
+    if (from == HOT) {
+        ++entry.pins;
+        return Pin(this, expert, entry.hot.data());
+    }
+
+    // make room by taking blocks of the coldest experts, the last one is reused for this expert
+    entry.busy = true;
+    std::vector<int> victims;
+    std::vector<HostMemory> blocks;
+    std::vector<bool> compressing;
+    while (mHotBytes + mExpertSize > mHotBudget) {
+        auto victim = coldestHot();
+        if (victim == -1) break;  // everything is pinned, go over budget
+        victims.push_back(victim);
+        mEntries[victim].busy = true;
+        blocks.push_back(std::move(mEntries[victim].hot));
+        mHotBytes -= mExpertSize;
+        // only compress victims without a compressed copy that are likely to be kept
+        auto estimate = static_cast<size_t>(mExpertSize * mCompressionRatio);
+        compressing.push_back(mEntries[victim].compressed.empty() && admissible(victim, estimate));
+    }
+    mHotBytes += mExpertSize;
+    lock.unlock();
+
+    std::vector<std::vector<std::vector<unsigned char>>> demoted(victims.size());
+    std::vector<size_t> demoted_bytes(victims.size(), 0);
+    auto demote_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < victims.size(); ++i) {
+        if (compressing[i]) demoted_bytes[i] = compress(blocks[i].data(), demoted[i]);
+    }
+    auto demote_ns = elapsedNanoseconds(demote_start);
+    // promote
+    auto load_start = std::chrono::steady_clock::now();
+    auto block = blocks.empty() ? HostMemory(mExpertSize, HostAllocator::HUGE_PAGE) : std::move(blocks.back());
+    blocks.clear();
+    if (from == COMPRESSED) {
+        decompress(entry.compressed, block.data());
+    } else {
+        mLoader(expert, block.data());
+    }
+    auto load_ns = elapsedNanoseconds(load_start);
+
+    lock.lock();
+    for (size_t i = 0; i < victims.size(); ++i) {
+        auto &victim = mEntries[victims[i]];
+        auto kept = !victim.compressed.empty();
+        if (compressing[i]) {
+            mCompressionRatio = static_cast<double>(demoted_bytes[i]) / mExpertSize;
+            kept = admit(victims[i], demoted[i], demoted_bytes[i]);
+        }
+        ++mMetrics[kept ? COMPRESSED : DISK].demotions;
+        victim.busy = false;
+    }
+    mMetrics[COMPRESSED].demoteNanoseconds += demote_ns;
+    mMetrics[from].loadNanoseconds += load_ns;
+    entry.hot = std::move(block);
+    entry.pins = 1;
+    entry.busy = false;
+    auto data = entry.hot.data();
+    lock.unlock();
+    mChanged.notify_all();
+    return Pin(this, expert, data);
+}
+
+void ExpertStore::release(int expert) {
+    std::lock_guard<std::mutex> lock(mLock);
+    assert(mEntries[expert].pins > 0);
+    --mEntries[expert].pins;
+}
+
+void ExpertStore::recordRouting(const int *expertTokenCount) {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        mEntries[i].frequency = mEntries[i].frequency * FREQUENCY_DECAY + expertTokenCount[i];
+    }
+}
+
+ExpertStore::Tier ExpertStore::tier(int expert) const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return tierOf(mEntries[expert]);
+}
+
+double ExpertStore::frequency(int expert) const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mEntries[expert].frequency;
+}
+
+ExpertStore::Metrics ExpertStore::metrics(Tier tier) const {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto result = mMetrics[tier];
+    for (auto &entry : mEntries) {
+        if (tierOf(entry) == tier) ++result.experts;
+        if (tier == COMPRESSED && !entry.compressed.empty()) result.rawBytes += mExpertSize;
+    }
+    result.bytes = tier == HOT ? mHotBytes : tier == COMPRESSED ? mCompressedBytes : 0;
+    if (tier == HOT) result.rawBytes = mHotBytes;
+    return result;
+}
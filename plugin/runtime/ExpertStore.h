@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef EXPERT_STORE_H
+#define EXPERT_STORE_H
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "HostAllocator.h"
+
+// Tiered host storage of expert weights, for checkpoints that do not fit in host memory.
+//
+// Weights of each expert are one block of expertSize bytes (32-bit words), held in one of three tiers:
+//   DISK:       only in the weight file, read by the loader on use
+//   COMPRESSED: in memory, 32-bit words split into byte planes, each plane deflated (zlib) if that makes it smaller
+//   HOT:        in memory as is (HostAllocator::HUGE_PAGE), read in place by experts
+// Experts are promoted to HOT when acquired and pinned there until released. When HOT is over budget, the least
+// routed unpinned experts are demoted: to COMPRESSED if it has room for them once colder experts are dropped to
+// DISK, to DISK otherwise. An expert promoted from COMPRESSED keeps its compressed copy, so demoting it again is free.
+// How often an expert is routed is its routed token count, decaying with every recorded batch.
+//
+// Thread-safe: loading, compression and decompression run outside the lock, so that experts run by different tasks
+// are promoted concurrently. They run on the calling thread, never waiting for pool tasks: a waiting worker could
+// pick up another acquire of an expert it is promoting itself.
+class ExpertStore {
+   public:
+    enum Tier { DISK = 0, COMPRESSED = 1, HOT = 2, TIER_COUNT = 3 };
+    // weight of past batches in routing frequency
+    constexpr static double FREQUENCY_DECAY = 0.9;
+    // compressed independently, bounding scratch memory of (de)compression
+    constexpr static size_t CHUNK_SIZE = 1 << 20;
+
+    // reads the expertSize bytes of an expert (from disk) to dst
+    using Loader = std::function<void(int expert, char *dst)>;
+
+    struct Metrics {
+        int64_t hits = 0;               // acquire calls finding the expert in this tier
+        int64_t loadNanoseconds = 0;    // time spent promoting experts from this tier to HOT
+        int64_t demotions = 0;          // experts demoted to this tier
+        int64_t demoteNanoseconds = 0;  // time spent compressing experts demoted to COMPRESSED
+        size_t bytes = 0;               // memory held by this tier
+        size_t rawBytes = 0;            // size of these weights uncompressed, compressed copies of HOT included
+        int experts = 0;                // experts currently in this tier
+    };
+
+    // weights of one expert in HOT, which stay there until the handle is destroyed
+    class Pin {
+       private:
+        ExpertStore *mStore = nullptr;
+        int mExpert = -1;
+        const char *mData = nullptr;
+
+       public:
+        Pin(ExpertStore *store, int expert, const char *data) : mStore(store), mExpert(expert), mData(data) {}
+        Pin(Pin &&other) noexcept : mStore(other.mStore), mExpert(other.mExpert), mData(other.mData) {
+            other.mStore = nullptr;
+        }
+        Pin(const Pin &) = delete;
+        Pin &operator=(const Pin &) = delete;
+        ~Pin() {
+            if (mStore != nullptr) mStore->release(mExpert);
+        }
+        const char *data() const { return mData; }
+    };
+
+   private:
+    struct Entry {
+        HostMemory hot;  // HUGE_PAGE memory
+        std::vector<std::vector<unsigned char>> compressed;  // 4 planes of each chunk, empty when not compressed
+        size_t compressedBytes = 0;
+        int pins = 0;
+        bool busy = false;  // being promoted or demoted, outside the lock
+        double frequency = 0;
+    };
+
+    size_t mExpertSize;
+    size_t mHotBudget;
+    size_t mCompressedBudget;
+    Loader mLoader;
+    std::vector<Entry> mEntries;
+    size_t mHotBytes = 0;
+    size_t mCompressedBytes = 0;
+    double mCompressionRatio = 1.0;  // of the last compressed expert, to foresee whether the next one is kept
+    std::array<Metrics, TIER_COUNT> mMetrics{};
+    mutable std::mutex mLock;
+    std::condition_variable mChanged;
+
+    Tier tierOf(const Entry &entry) const;
+    // unpinned expert of HOT with the lowest frequency, -1 if there is none
+    int coldestHot() const;
+    // whether COMPRESSED has room for bytes more of expert once colder experts are dropped
+    bool admissible(int expert, size_t bytes) const;
+    // keep compressed planes of a demoted expert if COMPRESSED has room for them once colder experts are dropped
+    bool admit(int expert, std::vector<std::vector<unsigned char>> &pieces, size_t bytes);
+    size_t compress(const char *src, std::vector<std::vector<unsigned char>> &pieces) const;
+    void decompress(const std::vector<std::vector<unsigned char>> &pieces, char *dst) const;
+    void release(int expert);
+
+   public:
+    ExpertStore(int expertCount, size_t expertSize, size_t hotBudget, size_t compressedBudget, Loader loader);
+    ExpertStore(const ExpertStore &) = delete;
+    ExpertStore &operator=(const ExpertStore &) = delete;
+
+    size_t expertSize() const { return mExpertSize; }
+    // weights of an expert, promoted to HOT if needed
+    Pin acquire(int expert);
+    // tokens routed to each expert by one batch
+    void recordRouting(const int *expertTokenCount);
+    Tier tier(int expert) const;
+    double frequency(int expert) const;
+    Metrics metrics(Tier tier) const;
+};
+
+#endif  // EXPERT_STORE_H
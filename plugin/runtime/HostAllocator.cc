@@ -0,0 +1,234 @@
+#include "HostAllocator.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../thirdparty/dbg.h"
+#include "Topology.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace {
+
+const size_t PAGE_SIZE = 4096;
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+const size_t GIANT_PAGE_SIZE = 1 << 30;
+// memory policy of mbind (numaif.h), so that libnuma is not needed
+const int MPOL_PREFERRED_NODE = 1;
+
+size_t roundUp(size_t value, size_t unit) { return (value + unit - 1) / unit * unit; }
+
+int classOf(size_t size) {
+    int index = 0;
+    for (size_t block = HostAllocator::MIN_CLASS_SIZE; block < size; block <<= 1) ++index;
+    return index;
+}
+
+size_t classSize(int index) { return HostAllocator::MIN_CLASS_SIZE << index; }
+
+void *mapAnonymous(size_t size, int flags) {
+    auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return data == MAP_FAILED ? nullptr : data;
+}
+
+[[noreturn]] void outOfMemory(HostAllocator::Backend backend, size_t size) {
+    fprintf(stderr, "ERROR: cannot allocate %zu bytes of %s host memory: %s\n", size,
+            HostAllocator::backendName(backend), strerror(errno));
+    exit(-1);
+}
+
+}  // namespace
+
+HostAllocator::HostAllocator() {
+    for (auto &pool : mPools) pool.freeBlocks.resize(classOf(SMALL_LIMIT) + 1);
+}
+
+HostAllocator &HostAllocator::instance() {
+    static auto allocator = new HostAllocator();
+    return *allocator;
+}
+
+const char *HostAllocator::backendName(Backend backend) {
+    const char *names[] = {"pinned", "huge_page", "locked", "aligned"};
+    return names[backend];
+}
+
+HostAllocator::Backend HostAllocator::weightBackend() {
+    static Backend backend = [] {
+        auto value = getenv("INFMOE_WEIGHT_MEMORY");
+        if (value == nullptr || *value == '\0') return PINNED;
+        for (int i = 0; i < BACKEND_COUNT; ++i) {
+            if (strcmp(value, backendName(static_cast<Backend>(i))) == 0) return static_cast<Backend>(i);
+        }
+        fprintf(stderr, "ERROR: INFMOE_WEIGHT_MEMORY must be pinned, huge_page, locked or aligned, got %s\n", value);
+        assert(false);
+        return PINNED;
+    }();
+    return backend;
+}
+
+void HostAllocator::setPinner(Pinner pinner) { mPinner = pinner; }
+
+size_t HostAllocator::mappedSize(Backend backend, size_t size) const {
+    if (backend == HUGE_PAGE) return roundUp(size, size % GIANT_PAGE_SIZE == 0 ? GIANT_PAGE_SIZE : HUGE_PAGE_SIZE);
+    return roundUp(size, PAGE_SIZE);
+}
+
+// pages go to node when it has free memory, to other nodes otherwise
+void HostAllocator::bind(void *data, size_t size, int node) {
+    auto &topology = Topology::host();
+    if (node < 0 || topology.nodeCount() <= 1) return;
+    assert(node < topology.nodeCount());
+    auto id = topology.nodes()[node].id;
+    std::vector<unsigned long> mask(id / 64 + 1, 0);
+    mask[id / 64] |= 1ul << (id % 64);
+    // the kernel reads one bit less than maxnode
+    if (syscall(SYS_mbind, data, size, MPOL_PREFERRED_NODE, mask.data(), mask.size() * 64 + 1, 0) != 0 &&
+        !mWarnedBind.exchange(true)) {
+        fprintf(stderr, "WARNING: cannot bind host memory to NUMA node %d: %s\n", id, strerror(errno));
+    }
+}
+
+void *HostAllocator::map(Backend backend, size_t size, int node) {
+    void *data = nullptr;
+    switch (backend) {
+        case HUGE_PAGE:
+            if (size % GIANT_PAGE_SIZE == 0) data = mapAnonymous(size, MAP_HUGETLB | MAP_HUGE_1GB);
+            if (data == nullptr) data = mapAnonymous(size, MAP_HUGETLB | MAP_HUGE_2MB);
+            if (data == nullptr) {
+                dbg("no reserved huge pages, falling back to transparent huge pages", size);
+                data = mapAnonymous(size, 0);
+                if (data != nullptr) madvise(data, size, MADV_HUGEPAGE);
+            }
+            if (data != nullptr) bind(data, size, node);
+            break;
+        case PINNED:
+        case LOCKED:
+            data = mapAnonymous(size, 0);
+            if (data == nullptr) break;
+            // before pinning or locking, which fault pages in
+            bind(data, size, node);
+            if (size >= HUGE_PAGE_SIZE) madvise(data, size, MADV_HUGEPAGE);
+            if (backend == PINNED) {
+                if (mPinner != nullptr && !mPinner(data, size, true)) {
+                    munmap(data, size);
+                    data = nullptr;
+                }
+            } else if (mlock(data, size) != 0 && !mWarnedLock.exchange(true)) {
+                // RLIMIT_MEMLOCK too low, memory is still usable
+                fprintf(stderr, "WARNING: cannot lock %zu bytes of %s host memory: %s\n", size, backendName(backend),
+                        strerror(errno));
+            }
+            break;
+        case ALIGNED:
+            data = aligned_alloc(size >= PAGE_SIZE ? PAGE_SIZE : MIN_CLASS_SIZE, size);
+            if (data != nullptr && size >= PAGE_SIZE) bind(data, size, node);
+            break;
+        default:
+            assert(false);
+    }
+    if (data == nullptr) outOfMemory(backend, size);
+    return data;
+}
+
+void HostAllocator::unmap(Backend backend, void *data, size_t size) {
+    switch (backend) {
+        case ALIGNED:
+            free(data);
+            return;
+        case PINNED:
+            if (mPinner != nullptr) mPinner(data, size, false);
+            break;
+        case LOCKED:
+            munlock(data, size);
+            break;
+        default:
+            break;
+    }
+    munmap(data, size);
+}
+
+void *HostAllocator::allocate(size_t size, Backend backend, int node) {
+    assert(size > 0 && backend >= 0 && backend < BACKEND_COUNT);
+    auto &pool = mPools[backend];
+    if (size > SMALL_LIMIT) {
+        auto mapped = mappedSize(backend, size);
+        auto data = map(backend, mapped, node);
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.usage.bytes += mapped;
+        pool.usage.mappedBytes += mapped;
+        pool.usage.peakBytes = std::max(pool.usage.peakBytes, pool.usage.bytes);
+        ++pool.usage.allocations;
+        return data;
+    }
+    auto index = classOf(size);
+    auto block = classSize(index);
+    std::lock_guard<std::mutex> guard(pool.lock);
+    auto &blocks = pool.freeBlocks[index];
+    if (blocks.empty()) {
+        // slabs of small classes are shared in one mapping, not to lock (or register) each one
+        auto slab = static_cast<char *>(map(backend, SLAB_SIZE));
+        pool.slabs.emplace_back(slab, SLAB_SIZE);
+        pool.usage.mappedBytes += SLAB_SIZE;
+        for (auto offset = SLAB_SIZE; offset >= block; offset -= block) blocks.push_back(slab + offset - block);
+    }
+    auto data = blocks.back();
+    blocks.pop_back();
+    pool.usage.bytes += block;
+    pool.usage.peakBytes = std::max(pool.usage.peakBytes, pool.usage.bytes);
+    ++pool.usage.allocations;
+    return data;
+}
+
+void HostAllocator::deallocate(void *data, size_t size, Backend backend) {
+    if (data == nullptr) return;
+    auto &pool = mPools[backend];
+    if (size > SMALL_LIMIT) {
+        auto mapped = mappedSize(backend, size);
+        {
+            std::lock_guard<std::mutex> guard(pool.lock);
+            pool.usage.bytes -= mapped;
+            pool.usage.mappedBytes -= mapped;
+            --pool.usage.allocations;
+        }
+        unmap(backend, data, mapped);
+        return;
+    }
+    auto index = classOf(size);
+    std::lock_guard<std::mutex> guard(pool.lock);
+    pool.freeBlocks[index].push_back(data);
+    pool.usage.bytes -= classSize(index);
+    --pool.usage.allocations;
+}
+
+HostAllocator::Usage HostAllocator::usage(Backend backend) {
+    std::lock_guard<std::mutex> guard(mPools[backend].lock);
+    return mPools[backend].usage;
+}
+
+void HostAllocator::report(FILE *stream) {
+    for (int i = 0; i < BACKEND_COUNT; ++i) {
+        auto backend = static_cast<Backend>(i);
+        auto current = usage(backend);
+        if (current.peakBytes == 0) continue;
+        fprintf(stream, "host memory %-10s %10.1f MiB in use (peak %.1f MiB), %.1f MiB mapped, %ld allocations\n",
+                backendName(backend), current.bytes / 1048576.0, current.peakBytes / 1048576.0,
+                current.mappedBytes / 1048576.0, static_cast<long>(current.allocations));
+    }
+}
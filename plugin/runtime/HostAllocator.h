@@ -0,0 +1,129 @@
+#pragma once
+
+#ifndef HOST_ALLOCATOR_H
+#define HOST_ALLOCATOR_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Process-wide host memory of the plugin, from one of interchangeable backends:
+//   PINNED:    page-locked for fast copies to device by the pinner the plugin sets (plain memory without one, as in
+//              CPU-only builds), used for staging buffers and weights copied to device
+//   HUGE_PAGE: backed by 2 MiB (1 GiB for allocations of whole GiBs) reserved huge pages, transparent huge pages if
+//              none are reserved, used for weights read on host
+//   LOCKED:    mlock'd, so that weights are never swapped out
+//   ALIGNED:   plain memory aligned to cache lines (to pages from 4 KiB), used for scratch
+// Allocations up to SMALL_LIMIT are carved out of slabs of SLAB_SIZE bytes per power-of-two size class and recycled
+// through free lists, so that thousands of small arrays or per-call scratch buffers cost neither one system call
+// (nor one page-locking) each nor fragmentation. Larger allocations are mapped and unmapped one by one, and may be
+// placed on a NUMA node (preferred with mbind before their pages are first touched, ignored on a single node).
+//
+// Thread-safe, with one lock per backend. Never destroyed, so that memory may be released by static destructors.
+class HostAllocator {
+   public:
+    enum Backend { PINNED = 0, HUGE_PAGE = 1, LOCKED = 2, ALIGNED = 3, BACKEND_COUNT = 4 };
+    constexpr static size_t SMALL_LIMIT = 256 << 10;
+    constexpr static size_t SLAB_SIZE = 2 << 20;
+    constexpr static size_t MIN_CLASS_SIZE = 64;
+
+    // page-locks (pin = true) or unlocks memory mapped by the allocator, returns false on failure
+    using Pinner = bool (*)(void *data, size_t size, bool pin);
+
+    struct Usage {
+        size_t bytes = 0;         // in use by live allocations (rounded to their size class)
+        size_t peakBytes = 0;     // maximum of bytes
+        size_t mappedBytes = 0;   // obtained from the system, slabs included
+        int64_t allocations = 0;  // live allocations
+    };
+
+   private:
+    struct Pool {
+        std::mutex lock;
+        std::vector<std::vector<void *>> freeBlocks;  // of each size class
+        std::vector<std::pair<void *, size_t>> slabs;
+        Usage usage;
+    };
+
+    std::array<Pool, BACKEND_COUNT> mPools;
+    Pinner mPinner = nullptr;
+    std::atomic<bool> mWarnedLock{false};
+    std::atomic<bool> mWarnedBind{false};
+
+    HostAllocator();
+    // memory of the system for a backend, size already rounded, on node unless it is -1
+    void *map(Backend backend, size_t size, int node = -1);
+    void bind(void *data, size_t size, int node);
+    void unmap(Backend backend, void *data, size_t size);
+    size_t mappedSize(Backend backend, size_t size) const;
+
+   public:
+    HostAllocator(const HostAllocator &) = delete;
+    HostAllocator &operator=(const HostAllocator &) = delete;
+
+    // the shared allocator of this process
+    static HostAllocator &instance();
+    // backend for expert weights, PINNED unless INFMOE_WEIGHT_MEMORY (pinned, huge_page, locked or aligned) says
+    // otherwise
+    static Backend weightBackend();
+    static const char *backendName(Backend backend);
+
+    // set before the first PINNED allocation
+    void setPinner(Pinner pinner);
+    // never nullptr, aborts when out of memory; size must be passed back to deallocate. Allocations larger than
+    // SMALL_LIMIT are placed on node (index into Topology::nodes()) unless it is -1
+    void *allocate(size_t size, Backend backend, int node = -1);
+    void deallocate(void *data, size_t size, Backend backend);
+    Usage usage(Backend backend);
+    // one line per backend in use
+    void report(FILE *stream);
+};
+
+// RAII allocation of HostAllocator::instance()
+class HostMemory {
+   private:
+    void *mData = nullptr;
+    size_t mSize = 0;
+    HostAllocator::Backend mBackend = HostAllocator::ALIGNED;
+
+   public:
+    HostMemory() = default;
+    HostMemory(size_t size, HostAllocator::Backend backend, int node = -1)
+        : mData(size > 0 ? HostAllocator::instance().allocate(size, backend, node) : nullptr),
+          mSize(size),
+          mBackend(backend) {}
+    HostMemory(HostMemory &&other) noexcept { *this = std::move(other); }
+    HostMemory &operator=(HostMemory &&other) noexcept {
+        if (this != &other) {
+            reset();
+            mData = other.mData;
+            mSize = other.mSize;
+            mBackend = other.mBackend;
+            other.mData = nullptr;
+            other.mSize = 0;
+        }
+        return *this;
+    }
+    HostMemory(const HostMemory &) = delete;
+    HostMemory &operator=(const HostMemory &) = delete;
+    ~HostMemory() { reset(); }
+
+    void reset() {
+        if (mData != nullptr) HostAllocator::instance().deallocate(mData, mSize, mBackend);
+        mData = nullptr;
+        mSize = 0;
+    }
+    template <typename T = char>
+    T *data() const {
+        return static_cast<T *>(mData);
+    }
+    size_t size() const { return mSize; }
+    HostAllocator::Backend backend() const { return mBackend; }
+};
+
+#endif  // HOST_ALLOCATOR_H
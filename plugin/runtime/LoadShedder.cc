@@ -0,0 +1,132 @@
+#include "LoadShedder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "../thirdparty/dbg.h"
+
+namespace {
+
+int envInt(const char *name, int defaultValue) {
+    auto value = getenv(name);
+    if (value == nullptr || *value == '\0') return defaultValue;
+    return atoi(value);
+}
+
+// capacity factor & gate weight threshold of each level above 0
+const LoadShedder::Policy LEVELS[] = {{2.0, 0.0f}, {1.5, 0.1f}, {1.25, 0.2f}, {1.0, 0.3f}};
+
+}  // namespace
+
+LoadShedder::LoadShedder(double queueTargetUs, double layerTargetUs)
+    : mQueueTarget(queueTargetUs), mLayerTarget(layerTargetUs) {}
+
+LoadShedder &LoadShedder::instance() {
+    static LoadShedder shedder(std::max(0, envInt("INFMOE_SLO_QUEUE_US", 0)),
+                               std::max(0, envInt("INFMOE_SLO_LAYER_US", 0)));
+    return shedder;
+}
+
+LoadShedder::Policy LoadShedder::policyAt(int level) {
+    assert(level >= 0 && level <= maxLevel());
+    return level == 0 ? Policy{} : LEVELS[level - 1];
+}
+
+int LoadShedder::maxLevel() { return static_cast<int>(sizeof(LEVELS) / sizeof(LEVELS[0])); }
+
+void LoadShedder::recordQueueDelay(double us) {
+    if (mQueueTarget <= 0) return;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueueDelay = mQueueDelay * DELAY_DECAY + us * (1 - DELAY_DECAY);
+    adjust(mQueueDelay / mQueueTarget);
+}
+
+void LoadShedder::recordLayerLatency(const void *layer, double us, int tokenCount) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mStats.layerCalls;
+    mStats.tokens += tokenCount;
+    if (mLayerTarget <= 0) return;
+    // the first call of a layer counts as is
+    auto [latency, first] = mLayerLatency.emplace(layer, us);
+    if (!first) latency->second = latency->second * DELAY_DECAY + us * (1 - DELAY_DECAY);
+    adjust(latency->second / mLayerTarget);
+}
+
+void LoadShedder::adjust(double pressure) {
+    mRecentPressure = std::max(pressure, mRecentPressure * DELAY_DECAY);
+    if (++mSinceChange < HOLD) return;
+    auto level = mStats.level;
+    if (pressure > 1 && level < maxLevel()) {
+        ++level;
+    } else if (mRecentPressure < RECOVERY && level > 0) {
+        --level;
+    }
+    if (level == mStats.level) return;
+    dbg(pressure, mRecentPressure, mStats.level, level);
+    mStats.level = level;
+    ++mStats.levelChanges;
+    mSinceChange = 0;
+}
+
+LoadShedder::Policy LoadShedder::policy() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return policyAt(mStats.level);
+}
+
+int LoadShedder::shed(const Policy &policy, int tokenCount, int expertCount, int *selection, const float *gateScore,
+                      double flopsPerToken) {
+    int routed = 0, gate_skipped = 0, dropped = 0;
+    double skipped_weight = 0;
+    auto gate_weight = [gateScore](int token) { return 1.0f / (1.0f + std::exp(-gateScore[token])); };
+    if (gateScore != nullptr && policy.minGateWeight > 0) {
+        for (int i = 0; i < tokenCount; ++i) {
+            if (selection[i] < 0) continue;
+            ++routed;
+            auto weight = gate_weight(i);
+            if (weight >= policy.minGateWeight) continue;
+            selection[i] = SKIPPED;
+            skipped_weight += weight;
+            ++gate_skipped;
+        }
+    } else {
+        routed = static_cast<int>(std::count_if(selection, selection + tokenCount, [](int e) { return e >= 0; }));
+    }
+    if (policy.capacityFactor > 0 && routed > 0) {
+        // capacity from tokens routed before any skipping, the first tokens of each expert keep it
+        auto capacity = static_cast<int>(std::ceil(policy.capacityFactor * routed / expertCount));
+        std::vector<int> load(expertCount, 0);
+        for (int i = 0; i < tokenCount; ++i) {
+            if (selection[i] < 0 || ++load[selection[i]] <= capacity) continue;
+            if (gateScore != nullptr) skipped_weight += gate_weight(i);
+            selection[i] = SKIPPED;
+            ++dropped;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mStats.degradedBatches;
+    mStats.degradedTokens += routed;
+    mStats.gateSkippedTokens += gate_skipped;
+    mStats.capacityDroppedTokens += dropped;
+    mStats.skippedFlops += (gate_skipped + dropped) * flopsPerToken;
+    mStats.skippedGateWeight += skipped_weight;
+    return gate_skipped + dropped;
+}
+
+LoadShedder::Stats LoadShedder::stats() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+void LoadShedder::report(FILE *stream) const {
+    if (!enabled()) return;
+    auto current = stats();
+    fprintf(stream,
+            "load shedding: level %d (%ld changes), %ld of %ld tokens degraded, %ld skipped by gate weight, %ld "
+            "dropped by capacity, %.3g GFLOP & %.3g gate weight skipped\n",
+            current.level, static_cast<long>(current.levelChanges), static_cast<long>(current.degradedTokens),
+            static_cast<long>(current.tokens), static_cast<long>(current.gateSkippedTokens),
+            static_cast<long>(current.capacityDroppedTokens), current.skippedFlops / 1e9, current.skippedGateWeight);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#ifndef LOAD_SHEDDER_H
+#define LOAD_SHEDDER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+// Process-wide control loop degrading routing of every MoELayerPlugin under overload, so that requests slow down
+// gracefully instead of timing out, and restoring full routing once load recovers.
+//
+// Pressure is the ratio of an observed delay to its target: queueing delay of requests (reported by the frontend
+// batching them, e.g. MoEServer) or latency of one layer (host time of enqueue, reported by each layer), smoothed over
+// recent observations of the same kind (and layer). Above 1 the degradation level goes up one step, and it goes down
+// one step once recent pressure of every kind stayed below RECOVERY, at most once every HOLD observations so that the
+// effect of a step is seen before the next one.
+// Each level tightens the policy applied to routed tokens before they are counted & sorted by expert:
+//   capacity: an expert keeps at most ceil(capacityFactor * routed tokens / experts) tokens, the first ones in batch
+//             order (as capacity-constrained routing of GShard or Switch Transformer)
+//   gate weight: tokens of base_layer whose gate weight sigmoid(score), which mixes expert output with input, is
+//                below minGateWeight skip their expert
+// Top-1 routing leaves no lower top-k to fall back to. Skipped tokens (gate selection SKIPPED) are left out of
+// experts: their output is their input for base_layer, as with a gate weight of 0, and zeros otherwise (no expert
+// contribution). Every skipped token is accounted for in Stats.
+//
+// Configured by environment variables read on first use, the control loop is off (level 0) when both are 0:
+//   INFMOE_SLO_QUEUE_US: target queueing delay of requests in microseconds (default: 0, not watched)
+//   INFMOE_SLO_LAYER_US: target latency of one layer in microseconds (default: 0, not watched)
+class LoadShedder {
+   public:
+    // gate selection of tokens whose expert is skipped, besides -1 of padding tokens
+    constexpr static int SKIPPED = -2;
+    // weight of past observations in smoothed delays
+    constexpr static double DELAY_DECAY = 0.8;
+    // pressure below which degradation steps down
+    constexpr static double RECOVERY = 0.6;
+    // observations between two level changes
+    constexpr static int HOLD = 8;
+
+    struct Policy {
+        double capacityFactor = 0;  // 0 for unlimited capacity
+        float minGateWeight = 0;    // 0 to keep every token
+        bool active() const { return capacityFactor > 0 || minGateWeight > 0; }
+    };
+
+    struct Stats {
+        int level = 0;
+        int64_t levelChanges = 0;
+        int64_t layerCalls = 0;
+        int64_t tokens = 0;             // tokens of these calls
+        int64_t degradedBatches = 0;    // (micro-)batches routed under an active policy
+        int64_t degradedTokens = 0;     // routed tokens of these batches
+        int64_t gateSkippedTokens = 0;  // skipped for a gate weight below the threshold
+        int64_t capacityDroppedTokens = 0;
+        double skippedFlops = 0;        // expert work of skipped tokens
+        double skippedGateWeight = 0;   // sum of gate weights of skipped tokens (base_layer only)
+    };
+
+   private:
+    double mQueueTarget, mLayerTarget;
+    mutable std::mutex mMutex;
+    double mQueueDelay = 0;
+    std::unordered_map<const void *, double> mLayerLatency;
+    int mSinceChange = 0;
+    double mRecentPressure = 0;  // largest pressure of recent observations, decaying
+    Stats mStats;
+
+    LoadShedder(double queueTargetUs, double layerTargetUs);
+    // one observation of pressure, under mMutex
+    void adjust(double pressure);
+
+   public:
+    static LoadShedder &instance();
+    // policy of each level, level 0 is full routing
+    static Policy policyAt(int level);
+    static int maxLevel();
+
+    bool enabled() const { return mQueueTarget > 0 || mLayerTarget > 0; }
+    // delay between arrival of a request and the start of the batch running it
+    void recordQueueDelay(double us);
+    // latency of one call of a layer on tokenCount tokens
+    void recordLayerLatency(const void *layer, double us, int tokenCount);
+    Policy policy() const;
+    // applies policy to the gate selection of one batch in place, marking skipped tokens with SKIPPED: gateScore
+    // (score of the selected expert, before sigmoid) may be null to only apply capacity. Returns skipped tokens
+    int shed(const Policy &policy, int tokenCount, int expertCount, int *selection, const float *gateScore,
+             double flopsPerToken);
+    Stats stats() const;
+    void report(FILE *stream) const;
+};
+
+#endif  // LOAD_SHEDDER_H
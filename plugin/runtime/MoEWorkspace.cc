@@ -0,0 +1,87 @@
+#include "MoEWorkspace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+namespace {
+// phases of one micro-batch, used as steps of buffer lifetimes in workspace planning
+enum EnqueuePhase { PHASE_GATE, PHASE_COUNT, PHASE_SCATTER, PHASE_EXPERTS, PHASE_GATHER };
+}  // namespace
+
+int MoEWorkspaceLayout::slotTokens(int microBatchSize, int expertCount, bool balanced) {
+    auto bound = balanced ? (microBatchSize + expertCount - 1) / expertCount : microBatchSize;
+    return std::max(1, std::min(bound, SLOT_TOKENS));
+}
+
+// The workspace consists of:
+// 1. slotCount sub-layer slots (weights + intermediate variables of up to slotTokens tokens), absent when experts run
+//    on host
+// 2. MoE buffers, shared by all micro-batches (routing only):
+//     a. coefficient to mix routed features after & before expert (token_num) where token_num = tokens of the
+//        micro-batch, absent with hash or external routing
+//     b. lists of centroid index probed by each token (token_num * probe stride), only with approximate routing
+//     c. token-expert affiliation (token_num * expert_count), only with balanced assignment
+//     d. hashes of token rows (2 * token_num), only with token deduplication
+// 3. MoE buffers of every micro-batch in flight (depth), each including:
+//     a. gate selection (int, token_num)
+//     b. token original position (int, token_num)
+//     c. routed features (token_num * d_model)
+//     d. routed features after expert (token_num * d_model)
+//     e. routed coefficient to mix routed features after & before expert (token_num)
+//     f. (duplicate, representative) pairs (int, 2 * token_num), only with token deduplication
+// b. to f. are only on device when experts are. They are not all used simultaneously: with a single micro-batch, a
+// buffer only lives through the phases using it, e.g. the mix coefficient is dead before sub-layer slots are filled,
+// so the two share memory. With pipelining, phases of different micro-batches overlap, so only buffers private to
+// routing keep short lifetimes.
+MoEWorkspaceLayout MoEWorkspaceLayout::plan(const MoEWorkspaceShape &shape, int microBatchSize, int depth) {
+    MoEWorkspaceLayout layout;
+    auto &planner = layout.planner;
+    size_t token_count = microBatchSize;
+    auto feature_size = token_count * shape.embeddingSize * sizeof(float);
+    auto pipelined = depth > 1;
+    auto first = [pipelined](int phase) { return pipelined ? PHASE_GATE : phase; };
+    auto last = [pipelined](int phase) { return pipelined ? PHASE_GATHER : phase; };
+
+    auto slots_size = shape.expertsOnHost ? 0 : shape.slotSize * shape.slotCount;
+    layout.sublayerSlots = planner.add("sublayer_slots", slots_size, first(PHASE_EXPERTS), last(PHASE_EXPERTS));
+    if (shape.scoresTokens) {
+        layout.mixCoeff = planner.add("mix_coeff", token_count * sizeof(float), PHASE_GATE, PHASE_SCATTER);
+    }
+    if (shape.probeStride > 0) {
+        layout.probeLists =
+            planner.add("probe_lists", token_count * shape.probeStride * sizeof(int), PHASE_GATE, PHASE_GATE);
+    }
+    if (shape.balanced) {
+        layout.tokenExpertAff = planner.add("token_expert_aff", token_count * shape.expertCount * sizeof(float),
+                                            PHASE_GATE, PHASE_GATE);
+    }
+    if (shape.dedup) {
+        layout.rowHash = planner.add("row_hash", token_count * 2 * sizeof(uint64_t), PHASE_COUNT, PHASE_COUNT);
+    }
+    for (int i = 0; i < depth; ++i) {
+        auto suffix = "." + std::to_string(i);
+        Slot slot;
+        slot.gateSelection = planner.add("gate_selection" + suffix, token_count * sizeof(int), first(PHASE_GATE),
+                                         last(PHASE_GATHER));
+        // experts on host read & write tokens in place, through token positions kept on host
+        if (!shape.expertsOnHost) {
+            slot.tokenPos = planner.add("token_pos" + suffix, token_count * sizeof(int), first(PHASE_COUNT),
+                                        last(PHASE_GATHER));
+            // read again by the mix of base layer
+            slot.routedFeatures = planner.add("routed_features" + suffix, feature_size, first(PHASE_SCATTER),
+                                              last(shape.baseLayerOutputMix ? PHASE_GATHER : PHASE_EXPERTS));
+            slot.postExpertFeatures = planner.add("post_expert_features" + suffix, feature_size,
+                                                  first(PHASE_EXPERTS), last(PHASE_GATHER));
+            slot.routedMixCoeff = planner.add("routed_mix_coeff" + suffix, token_count * sizeof(float),
+                                              first(PHASE_SCATTER), last(PHASE_GATHER));
+            if (shape.dedup) {
+                slot.duplicates = planner.add("duplicates" + suffix, token_count * 2 * sizeof(int),
+                                              first(PHASE_COUNT), last(PHASE_GATHER));
+            }
+        }
+        layout.slots.push_back(slot);
+    }
+    planner.plan();
+    return layout;
+}
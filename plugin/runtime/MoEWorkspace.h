@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef MOE_WORKSPACE_H
+#define MOE_WORKSPACE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "WorkspacePlanner.h"
+
+// GPU workspace of one enqueue call of MoELayerPlugin, planned from sizes & features of the layer alone (no CUDA), so
+// that getWorkspaceSize, enqueue and host tests lay it out the same way.
+
+// what the workspace depends on, besides tokens of a micro-batch and micro-batches in flight
+struct MoEWorkspaceShape {
+    size_t embeddingSize = 0;
+    size_t expertCount = 0;
+    // sub-layer slots, each holding weights & intermediate variables of one expert (MoEWorkspaceLayout::slotTokens)
+    size_t slotSize = 0;
+    int slotCount = 0;
+    size_t probeStride = 0;  // lists probed by each token, 0 without centroid index
+    bool scoresTokens = false;  // routing by token scores, not hash nor external routing
+    bool balanced = false;  // balanced assignment
+    bool dedup = false;  // token deduplication
+    bool expertsOnHost = false;  // no sub-layer slots nor tokens sorted by expert on device
+    bool baseLayerOutputMix = false;
+};
+
+// buffers of the workspace, as ids in planner (-1 when absent)
+struct MoEWorkspaceLayout {
+    // tokens of an expert whose intermediate variables a slot holds at most, experts with more run in chunks of that
+    // many: slots sized for a whole micro-batch each held intermediate variables for tokens of every expert at once
+    constexpr const static int SLOT_TOKENS = 512;
+
+    WorkspacePlanner planner;
+    int sublayerSlots = -1;
+    // private to routing, which is serialized on one stream, so shared by all micro-batches
+    int mixCoeff = -1;  // not with hash or external routing
+    int probeLists = -1;  // only with centroid index
+    int tokenExpertAff = -1;  // only with balanced assignment
+    int rowHash = -1;  // only with token deduplication
+    // buffers of each micro-batch in flight, tokens sorted by expert are only on device when experts are (-1 else)
+    struct Slot {
+        int gateSelection = -1;
+        int tokenPos = -1;
+        int routedFeatures = -1;
+        int postExpertFeatures = -1;
+        int routedMixCoeff = -1;
+        int duplicates = -1;  // only with token deduplication
+    };
+    std::vector<Slot> slots;
+
+    // tokens per slot for micro-batches of microBatchSize tokens: at most SLOT_TOKENS, and no more than the share of
+    // each expert under balanced assignment
+    static int slotTokens(int microBatchSize, int expertCount, bool balanced);
+    // layout of depth micro-batches of microBatchSize tokens in flight
+    static MoEWorkspaceLayout plan(const MoEWorkspaceShape &shape, int microBatchSize, int depth);
+};
+
+#endif  // MOE_WORKSPACE_H
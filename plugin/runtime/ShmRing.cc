@@ -0,0 +1,85 @@
+#include "ShmRing.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace {
+// busy checks before yielding, yields before sleeping, short sleeps before long ones (an idle peer, e.g. a worker
+// between two calls), and sleeps between two calls of alive()
+constexpr int SPINS = 1 << 12;
+constexpr int YIELDS = 1 << 8;
+constexpr int SHORT_SLEEPS = 1 << 10;
+constexpr int SLEEPS_PER_CHECK = 1 << 6;
+constexpr auto SHORT_SLEEP = std::chrono::microseconds(20);
+constexpr auto LONG_SLEEP = std::chrono::microseconds(500);
+}  // namespace
+
+ShmRing::ShmRing(void *memory, size_t capacity, bool create) {
+    mHeader = static_cast<Header *>(memory);
+    mData = static_cast<char *>(memory) + sizeof(Header);
+    if (create) {
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+        new (&mHeader->head) std::atomic<uint64_t>(0);
+        new (&mHeader->tail) std::atomic<uint64_t>(0);
+        mHeader->capacity = capacity;
+    }
+    assert(mHeader->capacity == capacity);
+    mMask = capacity - 1;
+}
+
+bool ShmRing::backoff(int64_t &spins, const Alive &alive) {
+    ++spins;
+    if (spins < SPINS) return true;
+    if (spins < SPINS + YIELDS) {
+        std::this_thread::yield();
+        return true;
+    }
+    auto sleeps = spins - SPINS - YIELDS;
+    std::this_thread::sleep_for(sleeps < SHORT_SLEEPS ? SHORT_SLEEP : LONG_SLEEP);
+    return sleeps % SLEEPS_PER_CHECK != 0 || alive == nullptr || alive();
+}
+
+bool ShmRing::write(const void *data, size_t size, const Alive &alive) {
+    auto src = static_cast<const char *>(data);
+    auto tail = mHeader->tail.load(std::memory_order_relaxed);
+    while (size > 0) {
+        uint64_t free;
+        int64_t spins = 0;
+        while ((free = capacity() - (tail - mHeader->head.load(std::memory_order_acquire))) == 0) {
+            if (!backoff(spins, alive)) return false;
+        }
+        // up to the end of the buffer, the rest wraps around on the next round
+        auto offset = tail & mMask;
+        auto count = std::min<uint64_t>({size, free, capacity() - offset});
+        memcpy(mData + offset, src, count);
+        tail += count;
+        src += count;
+        size -= count;
+        mHeader->tail.store(tail, std::memory_order_release);
+    }
+    return true;
+}
+
+bool ShmRing::read(void *data, size_t size, const Alive &alive) {
+    auto dst = static_cast<char *>(data);
+    auto head = mHeader->head.load(std::memory_order_relaxed);
+    while (size > 0) {
+        uint64_t written;
+        int64_t spins = 0;
+        while ((written = mHeader->tail.load(std::memory_order_acquire) - head) == 0) {
+            if (!backoff(spins, alive)) return false;
+        }
+        auto offset = head & mMask;
+        auto count = std::min<uint64_t>({size, written, capacity() - offset});
+        memcpy(dst, mData + offset, count);
+        head += count;
+        dst += count;
+        size -= count;
+        mHeader->head.store(head, std::memory_order_release);
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Lock-free single-producer single-consumer byte ring in memory shared between processes, the channel of the
+// all-to-all of ExpertShards. Head (bytes read) and tail (bytes written) only grow and live on separate cache lines:
+// the producer copies into the free part and publishes its tail, the consumer copies out of the written part and
+// publishes its head, so that neither takes a lock nor makes a system call while data flows.
+//
+// Writes and reads larger than the ring stream through it, as long as the other side keeps reading or writing. A
+// side waiting for the other one spins, then yields, then sleeps, calling alive() from time to time to give up when
+// the peer process is gone.
+class ShmRing {
+   public:
+    // false once the peer is known to be gone
+    using Alive = std::function<bool()>;
+
+    struct Header {
+        alignas(64) std::atomic<uint64_t> head;  // bytes read by the consumer
+        alignas(64) std::atomic<uint64_t> tail;  // bytes written by the producer
+        alignas(64) uint64_t capacity;           // bytes of data after the header, a power of 2
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions must be address-free atomics");
+
+   private:
+    Header *mHeader = nullptr;
+    char *mData = nullptr;
+    uint64_t mMask = 0;
+
+   public:
+    // one step of waiting for the peer after spins unsuccessful checks, false when the peer is gone
+    static bool backoff(int64_t &spins, const Alive &alive);
+
+    // bytes of shared memory taken by a ring of capacity bytes
+    static size_t sizeFor(size_t capacity) { return sizeof(Header) + capacity; }
+
+    ShmRing() = default;
+    // ring in sizeFor(capacity) bytes of memory, initialized when create is set (capacity is then read from memory)
+    ShmRing(void *memory, size_t capacity, bool create);
+
+    // block until size bytes of data are written, false if the peer is gone
+    bool write(const void *data, size_t size, const Alive &alive = nullptr);
+    // block until size bytes are read into data, false if the peer is gone
+    bool read(void *data, size_t size, const Alive &alive = nullptr);
+    size_t capacity() const { return mMask + 1; }
+    // bytes read() (consumer side) or write() (producer side) would take right now without waiting
+    size_t readable() const {
+        return mHeader->tail.load(std::memory_order_acquire) - mHeader->head.load(std::memory_order_relaxed);
+    }
+    size_t writable() const {
+        return capacity() -
+               (mHeader->tail.load(std::memory_order_relaxed) - mHeader->head.load(std::memory_order_acquire));
+    }
+    // bytes written into (tail) and read out of (head) the ring since it was created, growing as both sides go on
+    uint64_t written() const { return mHeader->tail.load(std::memory_order_acquire); }
+    uint64_t consumed() const { return mHeader->head.load(std::memory_order_acquire); }
+};
+
+#endif  // SHM_RING_H
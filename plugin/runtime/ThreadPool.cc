@@ -0,0 +1,259 @@
+#include "ThreadPool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../thirdparty/dbg.h"
+#include "Topology.h"
+
+namespace {
+
+// identify the pool & worker index of the current thread
+thread_local const ThreadPool *CURRENT_POOL = nullptr;
+thread_local int CURRENT_WORKER = -1;
+
+// rounds of yielding before an idle worker goes to sleep, unless kept awake
+const int IDLE_SPIN_ROUNDS = 64;
+
+int64_t steadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int envInt(const char *name, int defaultValue) {
+    auto value = getenv(name);
+    if (value == nullptr || *value == '\0') return defaultValue;
+    return atoi(value);
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(int workerCount, bool pinThreads)
+    : mPinThreads(pinThreads), mSpinNanoseconds(static_cast<int64_t>(envInt("INFMOE_SPIN_US", 1000)) * 1000) {
+    assert(workerCount > 0);
+    auto &nodes = Topology::host().nodes();
+    auto node_count = static_cast<int>(nodes.size());
+    mNodeWorkers.resize(node_count);
+    for (int i = 0; i < node_count; ++i) mNodeQueues.push_back(std::make_unique<TaskQueue>());
+
+    // interleave workers over nodes so that a partial pool still covers every node
+    for (int i = 0; i < workerCount; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->node = i % node_count;
+        auto &cpus = nodes[worker->node].cpus;
+        worker->cpu = cpus[(i / node_count) % cpus.size()];
+        mNodeWorkers[worker->node].push_back(i);
+        mWorkers.push_back(std::move(worker));
+    }
+    for (int i = 0; i < workerCount; ++i) {
+        mWorkers[i]->thread = std::thread(&ThreadPool::workerLoop, this, i);
+    }
+    dbg(workerCount, node_count, mPinThreads);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(mSleepLock);
+        mStop = true;
+    }
+    mWakeup.notify_all();
+    for (auto &worker : mWorkers) {
+        if (worker->thread.joinable()) worker->thread.join();
+    }
+}
+
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool(std::max(1, envInt("INFMOE_NUM_THREADS", Topology::host().cpuCount())),
+                           envInt("INFMOE_PIN_THREADS", 0) == 1);
+    return pool;
+}
+
+int ThreadPool::currentWorker() const { return CURRENT_POOL == this ? CURRENT_WORKER : -1; }
+
+int ThreadPool::currentNode() const {
+    auto worker = currentWorker();
+    return worker < 0 ? -1 : mWorkers[worker]->node;
+}
+
+int64_t ThreadPool::busyNanoseconds() const {
+    int64_t total = 0;
+    for (auto &worker : mWorkers) total += worker->busyNanoseconds.load(std::memory_order_relaxed);
+    return total;
+}
+
+void ThreadPool::push(TaskQueue &queue, Task &&task, bool front) {
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (front) {
+            queue.tasks.push_front(std::move(task));
+        } else {
+            queue.tasks.push_back(std::move(task));
+        }
+    }
+    mQueued.fetch_add(1, std::memory_order_release);
+    // take the sleep lock so that a worker between its last check and wait() cannot miss the notification
+    { std::lock_guard<std::mutex> guard(mSleepLock); }
+    mWakeup.notify_one();
+}
+
+bool ThreadPool::popBack(TaskQueue &queue, Task &task) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tasks.empty()) return false;
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    mQueued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ThreadPool::popFront(TaskQueue &queue, Task &task) {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tasks.empty()) return false;
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    mQueued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+// search order: own deque (LIFO), own node (injection queue, then stealing FIFO), then remote nodes
+bool ThreadPool::findTask(int worker, int node, Task &task) {
+    if (mQueued.load(std::memory_order_acquire) <= 0) return false;
+    if (worker >= 0 && popBack(mWorkers[worker]->queue, task)) return true;
+    auto node_count = nodeCount();
+    if (node < 0) node = 0;
+    // start stealing at a varying victim to spread contention
+    auto seed = static_cast<uint32_t>(worker + 1) * 2654435761u + mNextNode.load(std::memory_order_relaxed);
+    for (int n = 0; n < node_count; ++n) {
+        auto current = (node + n) % node_count;
+        if (popFront(*mNodeQueues[current], task)) return true;
+        auto &victims = mNodeWorkers[current];
+        for (size_t v = 0; v < victims.size(); ++v) {
+            auto victim = victims[(seed + v) % victims.size()];
+            if (victim != worker && popFront(mWorkers[victim]->queue, task)) return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int index) {
+    CURRENT_POOL = this;
+    CURRENT_WORKER = index;
+    auto &self = *mWorkers[index];
+    if (mPinThreads) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(self.cpu, &cpuset);
+        auto err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (err != 0) fprintf(stderr, "WARNING: cannot pin worker %d to CPU %d (error %d)\n", index, self.cpu, err);
+    } else if (nodeCount() > 1) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (auto cpu : Topology::host().nodes()[self.node].cpus) CPU_SET(cpu, &cpuset);
+        auto err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (err != 0) fprintf(stderr, "WARNING: cannot bind worker %d to node %d (error %d)\n", index, self.node, err);
+    }
+
+    Task task;
+    while (true) {
+        if (findTask(index, self.node, task)) {
+            auto start = std::chrono::steady_clock::now();
+            task();
+            task = nullptr;
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            self.busyNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                           std::memory_order_relaxed);
+            continue;
+        }
+        // spin briefly before going to sleep, as tasks usually come in bursts
+        bool found = false;
+        for (int i = 0; !found && (i < IDLE_SPIN_ROUNDS || steadyNanoseconds() < mSpinUntil.load()); ++i) {
+            std::this_thread::yield();
+            found = mQueued.load(std::memory_order_acquire) > 0;
+        }
+        if (found) continue;
+        std::unique_lock<std::mutex> lock(mSleepLock);
+        mWakeup.wait(lock, [this] {
+            return mStop || mQueued.load(std::memory_order_acquire) > 0 || steadyNanoseconds() < mSpinUntil.load();
+        });
+        if (mStop && mQueued.load() <= 0) return;
+    }
+}
+
+void ThreadPool::submit(Task task, int node) {
+    auto worker = currentWorker();
+    if (worker >= 0 && (node < 0 || node == mWorkers[worker]->node)) {
+        // local submission, will be popped LIFO by the owner or stolen by idle workers
+        push(mWorkers[worker]->queue, std::move(task), false);
+        return;
+    }
+    if (node < 0 || node >= nodeCount()) {
+        node = mNextNode.fetch_add(1, std::memory_order_relaxed) % nodeCount();
+    }
+    push(*mNodeQueues[node], std::move(task), false);
+}
+
+bool ThreadPool::runPending(int node) {
+    auto worker = currentWorker();
+    if (node < 0) node = currentNode();
+    Task task;
+    if (!findTask(worker, node, task)) return false;
+    task();
+    return true;
+}
+
+void ThreadPool::parallelFor(int64_t begin, int64_t end, int64_t grain, const RangeTask &body, int node) {
+    if (end <= begin) return;
+    grain = std::max<int64_t>(grain, 1);
+    auto total = end - begin;
+    // do not create more chunks than can be balanced among workers
+    auto chunks = std::min<int64_t>((total + grain - 1) / grain, 4 * static_cast<int64_t>(workerCount()));
+    if (chunks <= 1) {
+        body(begin, end);
+        return;
+    }
+    auto chunk_size = (total + chunks - 1) / chunks;
+    TaskGroup group(*this);
+    // the calling thread takes the first chunk itself
+    for (auto chunk_begin = begin + chunk_size; chunk_begin < end; chunk_begin += chunk_size) {
+        auto chunk_end = std::min(end, chunk_begin + chunk_size);
+        group.run([&body, chunk_begin, chunk_end] { body(chunk_begin, chunk_end); }, node);
+    }
+    body(begin, std::min(end, begin + chunk_size));
+    group.wait();
+}
+
+void ThreadPool::keepAwake() {
+    if (mSpinNanoseconds <= 0) return;
+    auto now = steadyNanoseconds();
+    auto until = now + mSpinNanoseconds;
+    auto current = mSpinUntil.load();
+    while (current < until && !mSpinUntil.compare_exchange_weak(current, until)) {
+    }
+    // workers blocked since the last window are woken now, so that they spin by the time tasks come
+    if (current < now) {
+        { std::lock_guard<std::mutex> guard(mSleepLock); }
+        mWakeup.notify_all();
+    }
+}
+
+void TaskGroup::run(ThreadPool::Task task, int node) {
+    mPending.fetch_add(1, std::memory_order_relaxed);
+    mPool.submit(
+        [this, task = std::move(task)] {
+            task();
+            // must be the last access to this group, as the waiter might destroy it right after
+            mPending.fetch_sub(1, std::memory_order_release);
+        },
+        node);
+}
+
+void TaskGroup::wait() {
+    while (mPending.load(std::memory_order_acquire) > 0) {
+        if (!mPool.runPending()) std::this_thread::yield();
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process-wide work-stealing task scheduler for host-side work.
+// Every MoELayerPlugin instance, the weight loader and other host helpers submit to ThreadPool::instance(), so
+// stacking many layers in one engine never creates more threads than there are cores.
+//
+// Each worker owns a deque: it pushes / pops its own tasks at the back and idle workers steal from the front,
+// preferring workers on the same NUMA node. Tasks submitted from outside the pool (or to another node) go through a
+// per-node injection queue. Blocking in TaskGroup::wait() executes pending tasks, so tasks may freely spawn and wait
+// for sub-tasks (e.g. an expert splitting into GEMM tiles).
+//
+// Configured by environment variables read on first use:
+//   INFMOE_NUM_THREADS: number of workers (default: number of usable CPUs)
+//   INFMOE_PIN_THREADS: pin each worker to one CPU when set to 1 (default: 0, workers are then only bound to the CPUs
+//                       of their node on multi-node hosts, so that tasks submitted to a node stay there)
+//   INFMOE_SPIN_US: how long idle workers keep spinning after keepAwake() before they block (default: 1000)
+class ThreadPool {
+   public:
+    using Task = std::function<void()>;
+    using RangeTask = std::function<void(int64_t, int64_t)>;
+
+   private:
+    struct alignas(64) TaskQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    struct Worker {
+        TaskQueue queue;
+        int node;
+        int cpu;
+        std::atomic<int64_t> busyNanoseconds{0};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::vector<std::unique_ptr<TaskQueue>> mNodeQueues;  // injection queue of each node
+    std::vector<std::vector<int>> mNodeWorkers;           // worker indices of each node
+    bool mPinThreads;
+    int64_t mSpinNanoseconds;
+    std::atomic<int64_t> mSpinUntil{0};  // steady clock time until which idle workers spin instead of blocking
+
+    std::atomic<int64_t> mQueued{0};
+    std::atomic<uint32_t> mNextNode{0};
+    std::atomic<bool> mStop{false};
+    std::mutex mSleepLock;
+    std::condition_variable mWakeup;
+
+    void workerLoop(int index);
+    void push(TaskQueue &queue, Task &&task, bool front);
+    bool popBack(TaskQueue &queue, Task &task);
+    bool popFront(TaskQueue &queue, Task &task);
+    bool findTask(int worker, int node, Task &task);
+
+   public:
+    explicit ThreadPool(int workerCount, bool pinThreads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // the shared pool of this process
+    static ThreadPool &instance();
+
+    int workerCount() const { return static_cast<int>(mWorkers.size()); }
+    int nodeCount() const { return static_cast<int>(mNodeQueues.size()); }
+    int workersOnNode(int node) const { return static_cast<int>(mNodeWorkers[node].size()); }
+    // index of the calling worker in this pool, -1 for threads outside the pool
+    int currentWorker() const;
+    // NUMA node (index into Topology::nodes()) of the calling worker, -1 for threads outside the pool
+    int currentNode() const;
+
+    // total time workers spent running tasks, used to derive utilization over an interval
+    int64_t busyNanoseconds() const;
+
+    // queue a task, preferably executed on the given node (-1 for any)
+    void submit(Task task, int node = -1);
+    // execute one queued task on the calling thread, return false if there is none
+    bool runPending(int node = -1);
+    // run body on [begin, end) split into chunks of at least grain items, returns when all chunks are done
+    void parallelFor(int64_t begin, int64_t end, int64_t grain, const RangeTask &body, int node = -1);
+    // keep idle workers spinning (instead of blocking) for INFMOE_SPIN_US from now, for latency-bound callers that
+    // come back soon (e.g. decoding): waking blocked workers costs tens of microseconds per call
+    void keepAwake();
+};
+
+// a set of tasks that can be waited on together, waiting helps executing queued tasks
+class TaskGroup {
+   private:
+    ThreadPool &mPool;
+    std::atomic<int> mPending{0};
+
+   public:
+    explicit TaskGroup(ThreadPool &pool = ThreadPool::instance()) : mPool(pool) {}
+    ~TaskGroup() { wait(); }
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+    void run(ThreadPool::Task task, int node = -1);
+    void wait();
+};
+
+#endif  // THREAD_POOL_H
@@ -0,0 +1,30 @@
+#include "TokenDedup.h"
+
+int TokenDedup::dedup(int expertCount, int *expertTokenCount, int *expertOffset, int *tokenPos,
+                      const uint64_t *rowHash, std::vector<int> &duplicates) {
+    duplicates.clear();
+    // write position never passes read position, tokens keep their order within each segment
+    int kept = 0;
+    for (int e = 0; e < expertCount; ++e) {
+        auto begin = expertOffset[e], end = begin + expertTokenCount[e];
+        expertOffset[e] = kept;
+        mFirst.clear();
+        for (int r = begin; r < end; ++r) {
+            auto token = tokenPos[r];
+            auto [it, inserted] = mFirst.try_emplace(rowHash[2 * token], token);
+            // rows only equal in their low hash are left apart
+            if (!inserted && rowHash[2 * it->second + 1] == rowHash[2 * token + 1]) {
+                duplicates.push_back(token);
+                duplicates.push_back(it->second);
+                continue;
+            }
+            tokenPos[kept++] = token;
+        }
+        expertTokenCount[e] = kept - expertOffset[e];
+    }
+    auto routed = expertOffset[expertCount];
+    expertOffset[expertCount] = kept;
+    mStats.tokens += routed;
+    mStats.duplicates += routed - kept;
+    return kept;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#ifndef TOKEN_DEDUP_H
+#define TOKEN_DEDUP_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Deduplication of routed tokens (dedup_tokens): bit-identical rows routed to the same expert, e.g. tokens of long
+// prefixes shared by sequences of a batch, only run through the expert once.
+//
+// Rows are told apart by a 128-bit hash (moe_expert_row_hash or row_hash_cpu). Within the segment of each expert,
+// the first token of each distinct row is kept as its representative and later ones are dropped from token
+// positions, so that scatter, experts and gather run on unique rows only. Each dropped token is recorded as a
+// (duplicate, representative) pair, whose output is copied from its representative once experts are done
+// (moe_expert_fan_out or fan_out_rows_cpu). Expert output only depends on the row and its gate score, both equal for
+// duplicates, so the layer output is unchanged up to the rounding of expert GEMMs tiled over fewer rows.
+class TokenDedup {
+   public:
+    struct Stats {
+        int64_t tokens = 0;      // routed tokens, before deduplication
+        int64_t duplicates = 0;  // of these, tokens that reused the output of an identical row
+        double hitRate() const { return tokens > 0 ? static_cast<double>(duplicates) / tokens : 0; }
+    };
+
+   private:
+    // first token of each low hash in the current segment, kept between calls so that dedup does not allocate
+    std::unordered_map<uint64_t, int> mFirst;
+    Stats mStats;
+
+   public:
+    // compacts tokenPos, expertTokenCount and expertOffset (as filled by moe_expert_count) in place to unique rows of
+    // each expert, given rowHash of every token of the batch, and fills duplicates with (duplicate, representative)
+    // pairs of token indexes. Returns the routed token count after deduplication
+    int dedup(int expertCount, int *expertTokenCount, int *expertOffset, int *tokenPos, const uint64_t *rowHash,
+              std::vector<int> &duplicates);
+    const Stats &stats() const { return mStats; }
+};
+
+#endif  // TOKEN_DEDUP_H
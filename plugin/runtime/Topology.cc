@@ -0,0 +1,101 @@
+#include "Topology.h"
+
+#include <dirent.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../thirdparty/dbg.h"
+
+namespace {
+
+// parse a sysfs cpulist such as "0-3,8-11"
+std::vector<int> parseCpuList(const char *path) {
+    std::vector<int> cpus;
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr) return cpus;
+    char buffer[4096];
+    if (fgets(buffer, sizeof(buffer), fp) != nullptr) {
+        char *saveptr = nullptr;
+        for (char *range = strtok_r(buffer, ",\n", &saveptr); range != nullptr;
+             range = strtok_r(nullptr, ",\n", &saveptr)) {
+            int first, last;
+            auto matched = sscanf(range, "%d-%d", &first, &last);
+            if (matched == 1) last = first;
+            if (matched < 1) continue;
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+    }
+    fclose(fp);
+    return cpus;
+}
+
+}  // namespace
+
+Topology::Topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &allowed);
+    }
+
+    // enumerate /sys/devices/system/node/node<N>
+    std::vector<int> node_ids;
+    if (auto dir = opendir("/sys/devices/system/node")) {
+        while (auto entry = readdir(dir)) {
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) == 1) node_ids.push_back(id);
+        }
+        closedir(dir);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+
+    for (auto id : node_ids) {
+        auto path = "/sys/devices/system/node/node" + std::to_string(id) + "/cpulist";
+        NumaNode node{id, {}};
+        for (auto cpu : parseCpuList(path.c_str())) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+        }
+        // memory-only nodes (or nodes we are not allowed to run on) cannot host workers
+        if (!node.cpus.empty()) mNodes.push_back(std::move(node));
+    }
+
+    // topology-agnostic fallback
+    if (mNodes.empty()) {
+        NumaNode node{0, {}};
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+        }
+        if (node.cpus.empty()) node.cpus.push_back(0);
+        mNodes.push_back(std::move(node));
+    }
+
+    int max_cpu = 0;
+    for (auto &node : mNodes) max_cpu = std::max(max_cpu, node.cpus.back());
+    mCpuToNode.assign(max_cpu + 1, -1);
+    for (int i = 0; i < nodeCount(); ++i) {
+        for (auto cpu : mNodes[i].cpus) mCpuToNode[cpu] = i;
+    }
+    dbg(nodeCount(), cpuCount());
+}
+
+const Topology &Topology::host() {
+    static const Topology topology;
+    return topology;
+}
+
+int Topology::cpuCount() const {
+    int count = 0;
+    for (auto &node : mNodes) count += node.cpus.size();
+    return count;
+}
+
+int Topology::nodeOfCpu(int cpu) const {
+    if (cpu < 0 || cpu >= static_cast<int>(mCpuToNode.size()) || mCpuToNode[cpu] < 0) return 0;
+    return mCpuToNode[cpu];
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+
+// a NUMA node and the CPUs (usable by this process) attached to it
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// host CPU topology, read from sysfs once per process
+// falls back to a single node holding every usable CPU when sysfs has no NUMA information
+class Topology {
+   private:
+    std::vector<NumaNode> mNodes;
+    std::vector<int> mCpuToNode;  // indexed by CPU id, -1 when not usable
+    Topology();
+
+   public:
+    static const Topology &host();
+    const std::vector<NumaNode> &nodes() const { return mNodes; }
+    int nodeCount() const { return static_cast<int>(mNodes.size()); }
+    int cpuCount() const;
+    // index into nodes() of the node owning cpu, 0 if unknown
+    int nodeOfCpu(int cpu) const;
+};
+
+#endif  // TOPOLOGY_H
@@ -0,0 +1,85 @@
+#include "WorkspacePlanner.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+namespace {
+
+size_t alignUp(size_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+bool overlapInTime(const WorkspacePlanner::Buffer &a, const WorkspacePlanner::Buffer &b) {
+    return a.firstUse <= b.lastUse && b.firstUse <= a.lastUse;
+}
+
+}  // namespace
+
+WorkspacePlanner::WorkspacePlanner(size_t alignment) : mAlignment(alignment) {
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+}
+
+int WorkspacePlanner::add(const std::string &name, size_t size, int firstUse, int lastUse) {
+    assert(firstUse <= lastUse);
+    mBuffers.push_back(Buffer{name, size, firstUse, lastUse, 0});
+    mPlanned = false;
+    return static_cast<int>(mBuffers.size()) - 1;
+}
+
+size_t WorkspacePlanner::plan() {
+    std::vector<int> order(mBuffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    // largest first, earlier use first for equal sizes so that the layout is deterministic
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+        if (mBuffers[a].size != mBuffers[b].size) return mBuffers[a].size > mBuffers[b].size;
+        return mBuffers[a].firstUse < mBuffers[b].firstUse;
+    });
+
+    mTotalSize = 0;
+    std::vector<int> placed;
+    std::vector<const Buffer *> conflicts;
+    for (auto id : order) {
+        auto &buffer = mBuffers[id];
+        conflicts.clear();
+        for (auto other : placed) {
+            if (overlapInTime(buffer, mBuffers[other]) && mBuffers[other].size > 0) {
+                conflicts.push_back(&mBuffers[other]);
+            }
+        }
+        std::sort(conflicts.begin(), conflicts.end(),
+                  [](const Buffer *a, const Buffer *b) { return a->offset < b->offset; });
+        // first gap large enough between conflicting buffers
+        size_t offset = 0;
+        for (auto other : conflicts) {
+            if (offset + buffer.size <= other->offset) break;
+            offset = std::max(offset, alignUp(other->offset + other->size, mAlignment));
+        }
+        buffer.offset = offset;
+        placed.push_back(id);
+        mTotalSize = std::max(mTotalSize, alignUp(offset + buffer.size, mAlignment));
+    }
+    mPlanned = true;
+    return mTotalSize;
+}
+
+size_t WorkspacePlanner::unsharedSize() const {
+    size_t total = 0;
+    for (auto &buffer : mBuffers) total += alignUp(buffer.size, mAlignment);
+    return total;
+}
+
+size_t WorkspacePlanner::offset(int id) const {
+    assert(mPlanned && id >= 0 && id < static_cast<int>(mBuffers.size()));
+    return mBuffers[id].offset;
+}
+
+void WorkspacePlanner::dump(FILE *out) const {
+    assert(mPlanned);
+    std::vector<const Buffer *> sorted;
+    for (auto &buffer : mBuffers) sorted.push_back(&buffer);
+    std::sort(sorted.begin(), sorted.end(), [](const Buffer *a, const Buffer *b) { return a->offset < b->offset; });
+    fprintf(out, "workspace layout: %zu bytes (%zu bytes without sharing)\n", mTotalSize, unsharedSize());
+    for (auto buffer : sorted) {
+        fprintf(out, "  [%12zu, %12zu) steps %d-%d %s\n", buffer->offset, buffer->offset + buffer->size,
+                buffer->firstUse, buffer->lastUse, buffer->name.c_str());
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef WORKSPACE_PLANNER_H
+#define WORKSPACE_PLANNER_H
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Assigns offsets inside one workspace to buffers with known lifetimes.
+//
+// Every buffer is used from step firstUse to step lastUse (inclusive) of an abstract timeline (e.g. phases of
+// enqueue). Buffers alive at a common step never overlap, others may share memory. Offsets are assigned greedily,
+// largest buffer first, each at the lowest aligned offset that does not collide with already placed buffers whose
+// lifetime intersects its own (interval coloring with sizes).
+class WorkspacePlanner {
+   public:
+    struct Buffer {
+        std::string name;
+        size_t size;
+        int firstUse;
+        int lastUse;
+        size_t offset;
+    };
+
+   private:
+    std::vector<Buffer> mBuffers;
+    size_t mAlignment;
+    size_t mTotalSize = 0;
+    bool mPlanned = false;
+
+   public:
+    explicit WorkspacePlanner(size_t alignment = 256);
+    // register a buffer, return its id
+    int add(const std::string &name, size_t size, int firstUse, int lastUse);
+    // assign offsets of all buffers, return total workspace size
+    size_t plan();
+    size_t totalSize() const { return mTotalSize; }
+    // sum of all buffer sizes, i.e. the workspace size without any sharing
+    size_t unsharedSize() const;
+    size_t offset(int id) const;
+    template <typename T>
+    T *at(void *base, int id) const {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset(id));
+    }
+    const std::vector<Buffer> &buffers() const { return mBuffers; }
+    // print the layout (one buffer per line, by offset) for inspection
+    void dump(FILE *out = stderr) const;
+};
+
+#endif  // WORKSPACE_PLANNER_H
@@ -0,0 +1,143 @@
+#include "MoEClient.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+using namespace moe_server;
+
+MoEClient::MoEClient(const std::string &socketPath) {
+    mSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    assert(socketPath.size() < sizeof(address.sun_path));
+    strcpy(address.sun_path, socketPath.c_str());
+    if (mSocket < 0 || connect(mSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        perror(("Cannot connect to moe_server at " + socketPath).c_str());
+        disconnect();
+        return;
+    }
+    // hello, with the shared memory of this client as ancillary data
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec data{&mHello, sizeof(mHello)};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto received = recvmsg(mSocket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    auto header = CMSG_FIRSTHDR(&message);
+    if (received != sizeof(mHello) || header == nullptr || header->cmsg_type != SCM_RIGHTS ||
+        mHello.magic != MAGIC || mHello.version != VERSION) {
+        fprintf(stderr, "ERROR: %s is not a moe_server of version %u\n", socketPath.c_str(), VERSION);
+        if (header != nullptr && header->cmsg_type == SCM_RIGHTS) close(*reinterpret_cast<int *>(CMSG_DATA(header)));
+        disconnect();
+        return;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(fd));
+    auto capacity = mHello.ringCapacity;
+    auto memory = mmap(nullptr, ringOffset(2, capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("Cannot map shared memory of moe_server");
+        disconnect();
+        return;
+    }
+    mMemory = memory;
+    mSize = ringOffset(2, capacity);
+    auto base = static_cast<char *>(mMemory);
+    mRequests = ShmRing(base + ringOffset(0, capacity), capacity, false);
+    mResponses = ShmRing(base + ringOffset(1, capacity), capacity, false);
+}
+
+MoEClient::~MoEClient() { disconnect(); }
+
+void MoEClient::disconnect() {
+    if (mMemory != nullptr) munmap(mMemory, mSize);
+    if (mSocket >= 0) close(mSocket);
+    mMemory = nullptr;
+    mSocket = -1;
+}
+
+bool MoEClient::forward(int tokenCount, const float *input, float *output, const int *routing, int sequenceLength) {
+    assert(connected() && tokenCount > 0 && (routing != nullptr || !routingInput()));
+    auto alive = [this] { return this->alive(); };
+    RequestHeader request{tokenCount, sequenceLength};
+    if (!mRequests.write(&request, sizeof(request), alive)) return false;
+    if (routingInput() && !mRequests.write(routing, sizeof(int) * tokenCount, alive)) return false;
+
+    // the server may answer the first rows before it got the last ones, which would not fit in the request ring
+    // while the response ring is full: write rows and read results as they can go
+    auto size = sizeof(float) * tokenCount * mHello.embeddingSize;
+    auto src = reinterpret_cast<const char *>(input);
+    auto dst = reinterpret_cast<char *>(output);
+    size_t sent = 0, received = 0;
+    bool answered = false;
+    int64_t spins = 0;
+    while (received < size) {
+        auto progress = false;
+        if (auto count = std::min(size - sent, mRequests.writable()); count > 0) {
+            mRequests.write(src + sent, count);
+            sent += count;
+            progress = true;
+        }
+        if (!answered && mResponses.readable() >= sizeof(ResponseHeader)) {
+            ResponseHeader response;
+            mResponses.read(&response, sizeof(response));
+            if (response.tokenCount != tokenCount) {
+                fprintf(stderr, "ERROR: moe_server answered %d tokens to a request of %d\n", response.tokenCount,
+                        tokenCount);
+                return false;
+            }
+            answered = true;
+            progress = true;
+        }
+        if (auto count = std::min(size - received, mResponses.readable()); answered && count > 0) {
+            mResponses.read(dst + received, count);
+            received += count;
+            progress = true;
+        }
+        if (progress) {
+            spins = 0;
+        } else if (!ShmRing::backoff(spins, alive)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MoEClient::stats(Stats &stats) {
+    assert(connected());
+    auto alive = [this] { return this->alive(); };
+    RequestHeader request{0, 0};
+    ResponseHeader response;
+    return mRequests.write(&request, sizeof(request), alive) && mResponses.read(&response, sizeof(response), alive) &&
+           response.tokenCount == 0 && mResponses.read(&stats, sizeof(stats), alive);
+}
+
+MoEClient *infmoe_client_connect(const char *socketPath) {
+    auto client = new MoEClient(socketPath);
+    if (client->connected()) return client;
+    delete client;
+    return nullptr;
+}
+
+void infmoe_client_close(MoEClient *client) { delete client; }
+
+int infmoe_client_embedding_size(const MoEClient *client) { return client->embeddingSize(); }
+
+int infmoe_client_routing_input(const MoEClient *client) { return client->routingInput(); }
+
+int infmoe_client_forward(MoEClient *client, int tokenCount, const float *input, float *output, const int *routing,
+                          int sequenceLength) {
+    return client->forward(tokenCount, input, output, routing, sequenceLength);
+}
+
+int infmoe_client_stats(MoEClient *client, Stats *stats) { return client->stats(*stats); }
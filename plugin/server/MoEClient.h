@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef MOE_CLIENT_H
+#define MOE_CLIENT_H
+
+#include <cstddef>
+#include <string>
+
+#include "../runtime/ShmRing.h"
+#include "ServerProtocol.h"
+
+// Client of moe_server (see MoEServer): runs the MoE layer loaded by the server on token rows of this process, which
+// go through shared memory without being copied by the kernel. Requests of concurrent clients are batched together
+// by the server, so each call may wait for others up to the batching delay of the server.
+//
+// Not thread-safe: one forward() at a time, use one client per thread.
+class MoEClient {
+   private:
+    int mSocket = -1;
+    void *mMemory = nullptr;
+    size_t mSize = 0;
+    moe_server::Hello mHello{};
+    ShmRing mRequests, mResponses;
+
+    bool alive() const { return moe_server::peerAlive(mSocket); }
+    void disconnect();
+
+   public:
+    // connects to the server listening on socketPath, see connected()
+    explicit MoEClient(const std::string &socketPath);
+    ~MoEClient();
+    MoEClient(const MoEClient &) = delete;
+    MoEClient &operator=(const MoEClient &) = delete;
+
+    // false if the server could not be reached, then nothing else may be called
+    bool connected() const { return mMemory != nullptr; }
+    int embeddingSize() const { return mHello.embeddingSize; }
+    int maxBatchTokens() const { return mHello.maxBatchTokens; }
+    // whether forward needs a routing id per token (token ids of hash_layer, experts of external_routing)
+    bool routingInput() const { return mHello.routingInput != 0; }
+
+    // output of the layer for tokenCount rows of input (tokens of sequences of sequenceLength, 0 for a single
+    // sequence), false if the server is gone. Rows are streamed to the server while results are read back, so
+    // requests may be larger than the rings
+    bool forward(int tokenCount, const float *input, float *output, const int *routing = nullptr,
+                 int sequenceLength = 0);
+    // counters & histograms of the server (of all its clients), false if the server is gone
+    bool stats(moe_server::Stats &stats);
+};
+
+// C interface of MoEClient for bindings (python/infmoe/server.py), functions returning int give 1 on success
+extern "C" {
+MoEClient *infmoe_client_connect(const char *socketPath);  // null if the server could not be reached
+void infmoe_client_close(MoEClient *client);
+int infmoe_client_embedding_size(const MoEClient *client);
+int infmoe_client_routing_input(const MoEClient *client);
+int infmoe_client_forward(MoEClient *client, int tokenCount, const float *input, float *output, const int *routing,
+                          int sequenceLength);
+int infmoe_client_stats(MoEClient *client, moe_server::Stats *stats);
+}
+
+#endif  // MOE_CLIENT_H
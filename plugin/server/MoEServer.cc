@@ -0,0 +1,413 @@
+#include "MoEServer.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <thread>
+#include <utility>
+
+#include "../runtime/LoadShedder.h"
+#include "../runtime/ShmRing.h"
+#include "../thirdparty/dbg.h"
+#include "../utility.h"
+#include "ServerProtocol.h"
+
+using namespace moe_server;
+using namespace nvinfer1;
+
+struct MoEServer::Client {
+    int socket = -1;
+    void *memory = nullptr;
+    size_t size = 0;
+    ShmRing requests, responses;
+    bool closed = false;
+    // current request: its header & routing ids (routed of them read so far, started until all are), tokens already
+    // run, and when its routing ids were all read
+    bool started = false, waiting = false;
+    RequestHeader request{};
+    std::vector<int> routing;
+    int routed = 0, done = 0;
+    std::chrono::steady_clock::time_point arrival;
+    // bytes moved by the client (written requests & read responses) when last seen moving, and when it was
+    uint64_t moved = 0;
+    std::chrono::steady_clock::time_point progress;
+
+    ~Client() {
+        if (memory != nullptr) munmap(memory, size);
+        if (socket >= 0) close(socket);
+    }
+    bool alive() {
+        if (!closed && !peerAlive(socket)) closed = true;
+        return !closed;
+    }
+    uint64_t position() const { return requests.written() + responses.consumed(); }
+    // false, closing the client, once it has moved none of its rings for timeout
+    bool progressing(std::chrono::steady_clock::duration timeout) {
+        auto now = std::chrono::steady_clock::now();
+        if (auto current = position(); current != moved) {
+            moved = current;
+            progress = now;
+        } else if (!closed && now - progress >= timeout) {
+            fprintf(stderr, "moe_server: client stalled for %ld ms, closing it\n",
+                    static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(now - progress).count()));
+            closed = true;
+        }
+        return !closed;
+    }
+};
+
+namespace {
+// how often peers of idle clients are checked, and the accepting thread looks at stop
+constexpr auto CHECK_INTERVAL = std::chrono::milliseconds(100);
+
+int64_t microseconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+Dims dims(std::initializer_list<int> sizes) {
+    Dims result{};
+    result.nbDims = static_cast<int>(sizes.size());
+    std::copy(sizes.begin(), sizes.end(), result.d);
+    return result;
+}
+}  // namespace
+
+MoEServer::MoEServer(IPluginV2DynamicExt *layer, const Config &config) : mLayer(layer), mConfig(config) {
+    assert(config.embeddingSize > 0 && config.maxBatchTokens > 0);
+    assert(config.ringCapacity >= PAGE && (config.ringCapacity & (config.ringCapacity - 1)) == 0);
+    // token features of shape (1, tokens, d_model), then routing ids of shape (1, tokens), up to maxBatchTokens
+    auto input_count = config.routingInput ? 2 : 1;
+    auto max_tokens = config.maxBatchTokens;
+    DynamicPluginTensorDesc in[2]{}, out{};
+    in[0].desc.dims = dims({1, max_tokens, config.embeddingSize});
+    in[0].desc.type = DataType::kFLOAT;
+    in[0].desc.format = TensorFormat::kLINEAR;
+    in[0].min = dims({1, 1, config.embeddingSize});
+    in[0].max = in[0].desc.dims;
+    in[1].desc.dims = dims({1, max_tokens});
+    in[1].desc.type = DataType::kINT32;
+    in[1].desc.format = TensorFormat::kLINEAR;
+    in[1].min = dims({1, 1});
+    in[1].max = in[1].desc.dims;
+    out = in[0];
+    mLayer->configurePlugin(in, input_count, &out, 1);
+    PluginTensorDesc descs[2]{in[0].desc, in[1].desc};
+    auto workspace_size = mLayer->getWorkspaceSize(descs, input_count, &out.desc, 1);
+    mLayer->initialize();
+
+    auto feature_size = sizeof(float) * max_tokens * config.embeddingSize;
+    auto buffer_size = feature_size * 2 + sizeof(int) * max_tokens;
+    mHostBuffer = HostMemory(buffer_size, HostAllocator::PINNED);
+    mHostInput = mHostBuffer.data<float>();
+    mHostOutput = reinterpret_cast<float *>(mHostBuffer.data() + feature_size);
+    mHostRouting = reinterpret_cast<int *>(mHostBuffer.data() + feature_size * 2);
+    CUDA_SAFE_CALL(cudaMalloc(&mDeviceBuffer, buffer_size));
+    mDeviceInput = static_cast<float *>(mDeviceBuffer);
+    mDeviceOutput = reinterpret_cast<float *>(static_cast<char *>(mDeviceBuffer) + feature_size);
+    mDeviceRouting = reinterpret_cast<int *>(static_cast<char *>(mDeviceBuffer) + feature_size * 2);
+    if (workspace_size > 0) CUDA_SAFE_CALL(cudaMalloc(&mWorkspace, workspace_size));
+    CUDA_SAFE_CALL(cudaStreamCreate(&mStream));
+    dbg(max_tokens, workspace_size);
+}
+
+MoEServer::~MoEServer() {
+    mClients.clear();
+    mAccepted.clear();
+    CUDA_SAFE_CALL(cudaStreamDestroy(mStream));
+    CUDA_SAFE_CALL(cudaFree(mDeviceBuffer));
+    if (mWorkspace != nullptr) CUDA_SAFE_CALL(cudaFree(mWorkspace));
+    mLayer->terminate();
+}
+
+void MoEServer::serve(const std::atomic<bool> &stop) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    assert(mConfig.socketPath.size() < sizeof(address.sun_path));
+    strcpy(address.sun_path, mConfig.socketPath.c_str());
+    // a socket file left behind by a server that did not exit cleanly
+    unlink(mConfig.socketPath.c_str());
+    mListener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mListener < 0 || bind(mListener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(mListener, SOMAXCONN) != 0) {
+        perror(("Cannot listen on " + mConfig.socketPath).c_str());
+        assert(false);
+    }
+    std::thread acceptor([&] { accept(stop); });
+
+    int64_t spins = 0;
+    auto checked = std::chrono::steady_clock::now();
+    while (!stop.load()) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (auto &client : mAccepted) mClients.push_back(std::move(client));
+            mAccepted.clear();
+        }
+        poll();
+        auto now = std::chrono::steady_clock::now();
+        if (mWaiting.empty()) {
+            // clients with a request are found out when their rings are read or written
+            if (now - checked >= CHECK_INTERVAL) {
+                for (auto &client : mClients) client->alive();
+                dropClosed();
+                checked = now;
+            }
+            ShmRing::backoff(spins, nullptr);
+            continue;
+        }
+        if (waitingTokens() >= mConfig.maxBatchTokens || now - mWaiting.front()->arrival >= mConfig.maxDelay) {
+            auto tokens = runBatch();
+            dropClosed();
+            // none of the waiting requests has rows in its ring yet
+            if (tokens == 0) {
+                ShmRing::backoff(spins, nullptr);
+                continue;
+            }
+        } else {
+            std::this_thread::yield();
+        }
+        spins = 0;
+    }
+    acceptor.join();
+    close(mListener);
+    unlink(mConfig.socketPath.c_str());
+    fprintf(stderr, "moe_server: %ld requests, %ld tokens in %ld batches\n", static_cast<long>(mStats.requests),
+            static_cast<long>(mStats.tokens), static_cast<long>(mStats.batches));
+    for (auto [name, histogram] : {std::make_pair("queue time (us)", mStats.queueTimeUs),
+                                   std::make_pair("latency (us)", mStats.latencyUs),
+                                   std::make_pair("batch tokens", mStats.batchTokens),
+                                   std::make_pair("batch requests", mStats.batchRequests)}) {
+        fprintf(stderr, "moe_server: %-15s p50 < %ld, p90 < %ld, p99 < %ld\n", name,
+                static_cast<long>(histogramQuantile(histogram, 0.5)),
+                static_cast<long>(histogramQuantile(histogram, 0.9)),
+                static_cast<long>(histogramQuantile(histogram, 0.99)));
+    }
+    LoadShedder::instance().report(stderr);
+}
+
+void MoEServer::accept(const std::atomic<bool> &stop) {
+    while (!stop.load()) {
+        pollfd listener{mListener, POLLIN, 0};
+        auto ready = ::poll(&listener, 1, static_cast<int>(CHECK_INTERVAL.count()));
+        if (ready <= 0) continue;
+        auto socket = accept4(mListener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+        auto client = handshake(socket);
+        if (client == nullptr) continue;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAccepted.push_back(std::move(client));
+    }
+}
+
+std::unique_ptr<MoEServer::Client> MoEServer::handshake(int socket) {
+    auto client = std::make_unique<Client>();
+    client->socket = socket;
+    auto capacity = mConfig.ringCapacity;
+    client->size = ringOffset(2, capacity);
+    // anonymous memory, only reachable through the descriptor passed to the client
+    auto fd = memfd_create("infmoe-client", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(client->size)) != 0) {
+        perror("Cannot create shared memory of a moe_server client");
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+    auto memory = mmap(nullptr, client->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("Cannot map shared memory of a moe_server client");
+        close(fd);
+        return nullptr;
+    }
+    client->memory = memory;
+    auto base = static_cast<char *>(memory);
+    client->requests = ShmRing(base + ringOffset(0, capacity), capacity, true);
+    client->responses = ShmRing(base + ringOffset(1, capacity), capacity, true);
+
+    Hello hello{MAGIC, VERSION, mConfig.embeddingSize, mConfig.routingInput && !mConfig.positionRouting,
+                mConfig.maxBatchTokens, 0, capacity};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec data{&hello, sizeof(hello)};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    auto header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+    auto sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+    close(fd);
+    if (sent != sizeof(hello)) {
+        perror("Cannot greet a moe_server client");
+        return nullptr;
+    }
+    dbg(socket, capacity);
+    return client;
+}
+
+ShmRing::Alive MoEServer::writing(Client *client) {
+    client->moved = client->position();
+    client->progress = std::chrono::steady_clock::now();
+    return [client, timeout = mConfig.clientTimeout] { return client->progressing(timeout) && client->alive(); };
+}
+
+void MoEServer::poll() {
+    for (auto &client : mClients) {
+        if (client->closed || client->waiting) continue;
+        auto &request = client->request;
+        if (!client->started) {
+            if (client->requests.readable() < sizeof(RequestHeader)) continue;
+            client->requests.read(&request, sizeof(request));
+            if (request.tokenCount == 0) {
+                ResponseHeader response{0, 0};
+                auto alive = writing(client.get());
+                if (!client->responses.write(&response, sizeof(response), alive) ||
+                    !client->responses.write(&mStats, sizeof(mStats), alive)) {
+                    client->closed = true;
+                }
+                continue;
+            }
+            if (request.tokenCount < 0 || request.sequenceLength < 0) {
+                fprintf(stderr, "moe_server: malformed request of %d tokens, closing client\n", request.tokenCount);
+                client->closed = true;
+                continue;
+            }
+            client->started = true;
+            client->routed = 0;
+            if (mConfig.routingInput && !mConfig.positionRouting) client->routing.resize(request.tokenCount);
+        }
+        if (mConfig.routingInput && !mConfig.positionRouting) {
+            // routing ids as they come, they may not fit in the ring at once
+            auto count =
+                std::min<size_t>(request.tokenCount - client->routed, client->requests.readable() / sizeof(int));
+            if (count > 0) {
+                client->requests.read(client->routing.data() + client->routed, sizeof(int) * count);
+                client->routed += static_cast<int>(count);
+            }
+            if (client->routed < request.tokenCount) {
+                client->progressing(mConfig.clientTimeout);
+                continue;
+            }
+        }
+        client->started = false;
+        client->waiting = true;
+        client->done = 0;
+        client->arrival = std::chrono::steady_clock::now();
+        mWaiting.push_back(client.get());
+        ++mStats.requests;
+    }
+}
+
+int MoEServer::waitingTokens() const {
+    auto row_size = sizeof(float) * mConfig.embeddingSize;
+    int tokens = 0;
+    for (auto client : mWaiting) {
+        auto rows = static_cast<int>(std::min<size_t>(client->requests.readable() / row_size, INT32_MAX));
+        tokens += std::min(client->request.tokenCount - client->done, rows);
+    }
+    return tokens;
+}
+
+int MoEServer::runBatch() {
+    auto token_len = mConfig.embeddingSize;
+    auto row_size = sizeof(float) * token_len;
+    mParts.clear();
+    int tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto client : mWaiting) {
+        if (tokens == mConfig.maxBatchTokens) break;
+        auto &request = client->request;
+        // only rows already written, a client slow to write the rest of its request does not hold up the batch
+        auto rows = static_cast<int>(std::min<size_t>(client->requests.readable() / row_size, INT32_MAX));
+        auto count = std::min({request.tokenCount - client->done, mConfig.maxBatchTokens - tokens, rows});
+        if (count == 0) {
+            client->progressing(mConfig.clientTimeout);
+            continue;
+        }
+        // rows go straight from the ring of the client into the batch
+        auto input = mHostInput + static_cast<size_t>(tokens) * token_len;
+        client->requests.read(input, row_size * count);
+        if (mConfig.positionRouting) {
+            for (int i = 0; i < count; ++i) {
+                auto position = client->done + i;
+                mHostRouting[tokens + i] = request.sequenceLength > 0 ? position % request.sequenceLength : position;
+            }
+        } else if (mConfig.routingInput) {
+            std::copy_n(client->routing.data() + client->done, count, mHostRouting + tokens);
+        }
+        if (client->done == 0) {
+            auto queue_time = microseconds(start - client->arrival);
+            ++mStats.queueTimeUs[histogramBucket(queue_time)];
+            LoadShedder::instance().recordQueueDelay(static_cast<double>(queue_time));
+        }
+        mParts.push_back(Part{client, count});
+        tokens += count;
+    }
+    if (tokens == 0) return 0;
+
+    auto feature_size = row_size * tokens;
+    CUDA_SAFE_CALL(cudaMemcpyAsync(mDeviceInput, mHostInput, feature_size, cudaMemcpyHostToDevice, mStream));
+    if (mConfig.routingInput) {
+        CUDA_SAFE_CALL(cudaMemcpyAsync(mDeviceRouting, mHostRouting, sizeof(int) * tokens, cudaMemcpyHostToDevice,
+                                       mStream));
+    }
+    PluginTensorDesc in[2]{}, out{};
+    in[0].dims = dims({1, tokens, token_len});
+    in[0].type = DataType::kFLOAT;
+    in[0].format = TensorFormat::kLINEAR;
+    in[1].dims = dims({1, tokens});
+    in[1].type = DataType::kINT32;
+    in[1].format = TensorFormat::kLINEAR;
+    out = in[0];
+    const void *inputs[2]{mDeviceInput, mDeviceRouting};
+    void *outputs[1]{mDeviceOutput};
+    mLayer->enqueue(in, &out, inputs, outputs, mWorkspace, mStream);
+    CUDA_SAFE_CALL(cudaMemcpyAsync(mHostOutput, mDeviceOutput, feature_size, cudaMemcpyDeviceToHost, mStream));
+    CUDA_SAFE_CALL(cudaStreamSynchronize(mStream));
+    ++mStats.batches;
+    mStats.tokens += tokens;
+    ++mStats.batchTokens[histogramBucket(tokens)];
+    ++mStats.batchRequests[histogramBucket(static_cast<int64_t>(mParts.size()))];
+    dbg(tokens, mParts.size());
+
+    // results in the order of parts, a request leaves the queue once its last part is answered
+    auto output = mHostOutput;
+    for (auto &part : mParts) {
+        auto client = part.client;
+        auto alive = writing(client);
+        ResponseHeader response{client->request.tokenCount, 0};
+        auto sent = !client->closed &&
+                    (client->done > 0 || client->responses.write(&response, sizeof(response), alive)) &&
+                    client->responses.write(output, row_size * part.tokenCount, alive);
+        if (!sent) client->closed = true;
+        output += static_cast<size_t>(part.tokenCount) * token_len;
+        client->done += part.tokenCount;
+        if (client->done == client->request.tokenCount) {
+            client->waiting = false;
+            auto latency = microseconds(std::chrono::steady_clock::now() - client->arrival);
+            ++mStats.latencyUs[histogramBucket(latency)];
+        }
+    }
+    mWaiting.erase(std::remove_if(mWaiting.begin(), mWaiting.end(), [](Client *client) { return !client->waiting; }),
+                   mWaiting.end());
+    return tokens;
+}
+
+void MoEServer::dropClosed() {
+    auto closed = [](Client *client) { return client->closed; };
+    mWaiting.erase(std::remove_if(mWaiting.begin(), mWaiting.end(), closed), mWaiting.end());
+    mClients.erase(std::remove_if(mClients.begin(), mClients.end(),
+                                  [&](const std::unique_ptr<Client> &client) { return closed(client.get()); }),
+                   mClients.end());
+}
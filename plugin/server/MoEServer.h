@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef MOE_SERVER_H
+#define MOE_SERVER_H
+
+#include <NvInferPlugin.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../runtime/HostAllocator.h"
+#include "../runtime/ShmRing.h"
+#include "ServerProtocol.h"
+
+// Long-running owner of one MoE layer (moe_server), shared by the processes of a host through MoEClient: weights are
+// loaded once, and tokens of concurrent requests are batched into one enqueue of the layer.
+//
+// Every client gets its own pair of shared memory rings (see ServerProtocol.h). The serving thread polls the request
+// rings of all clients: a batch is closed once the tokens waiting reach maxBatchTokens, or the oldest waiting request
+// has waited maxDelay, then rows of the waiting requests are read straight from their rings into the batch, oldest
+// first, and results are written back to the response rings of their clients. A request larger than a batch is run
+// over several batches, its results streamed back as they come. Clients are accepted on a separate thread.
+//
+// The serving thread never waits for the rows of one client: a batch only takes the rows already in the rings, the
+// rest of a request goes into later batches. Writes of responses wait for a client to read at most clientTimeout,
+// after which (as when its rows stop coming) the client is closed.
+//
+// Queue time & latency of requests and the size of batches are counted in log2 histograms, which clients may ask for
+// (MoEClient::stats) and which are summed up when the server stops.
+class MoEServer {
+   public:
+    struct Config {
+        std::string socketPath;
+        int embeddingSize = 0;
+        // a routing id per token is part of the layer input: given by clients, or positions of tokens in their
+        // sequence filled by the server (hash_layer with hash_key = position, run as token ids)
+        bool routingInput = false;
+        bool positionRouting = false;
+        int maxBatchTokens = 4096;
+        std::chrono::microseconds maxDelay{500};
+        size_t ringCapacity = 16 << 20;  // bytes of each ring, a power of 2
+        // a client with a request under way that neither writes requests nor reads responses for this long is
+        // closed, so that it cannot hold up the others
+        std::chrono::milliseconds clientTimeout{1000};
+    };
+
+    struct Client;
+
+   private:
+    nvinfer1::IPluginV2DynamicExt *mLayer;
+    Config mConfig;
+    int mListener = -1;
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<Client>> mAccepted;  // by the accepting thread, not served yet
+    std::vector<std::unique_ptr<Client>> mClients;
+    std::deque<Client *> mWaiting;  // clients with a request not run to the end, oldest first
+
+    // one batch: layer input & output on host (page-locked) and device, and the share of each client in it
+    struct Part {
+        Client *client;
+        int tokenCount;
+    };
+    std::vector<Part> mParts;
+    HostMemory mHostBuffer;
+    float *mHostInput = nullptr, *mHostOutput = nullptr;
+    int *mHostRouting = nullptr;
+    void *mDeviceBuffer = nullptr, *mWorkspace = nullptr;
+    float *mDeviceInput = nullptr, *mDeviceOutput = nullptr;
+    int *mDeviceRouting = nullptr;
+    cudaStream_t mStream = nullptr;
+
+    moe_server::Stats mStats{};
+
+    void accept(const std::atomic<bool> &stop);
+    std::unique_ptr<Client> handshake(int socket);
+    // reads the header (& routing ids, as they come) of the next request of clients with none waiting
+    void poll();
+    // runs the waiting tokens of one batch, oldest first, returns the tokens run
+    int runBatch();
+    void dropClosed();
+    // tokens of waiting requests whose rows can be read right now
+    int waitingTokens() const;
+    // alive() of a write to client: false once its peer is gone, or it read nothing for clientTimeout from now on
+    ShmRing::Alive writing(Client *client);
+
+   public:
+    // layer is created but not configured nor initialized
+    MoEServer(nvinfer1::IPluginV2DynamicExt *layer, const Config &config);
+    ~MoEServer();
+    MoEServer(const MoEServer &) = delete;
+    MoEServer &operator=(const MoEServer &) = delete;
+
+    // listen & serve until stop is set
+    void serve(const std::atomic<bool> &stop);
+    // only consistent on the serving thread, or once serve returned
+    const moe_server::Stats &stats() const { return mStats; }
+};
+
+#endif  // MOE_SERVER_H
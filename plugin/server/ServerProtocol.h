@@ -0,0 +1,96 @@
+#pragma once
+
+#ifndef SERVER_PROTOCOL_H
+#define SERVER_PROTOCOL_H
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "../runtime/ShmRing.h"
+
+// Messages between moe_server (MoEServer) and its clients (MoEClient). A client connects to the Unix socket of the
+// server, which answers with a Hello along with the file descriptor (SCM_RIGHTS) of a shared memory segment holding
+// two rings of ringCapacity bytes: requests of this client, then responses of the server. Token rows only go through
+// the rings, the socket then only tells either side that the other one is gone.
+//
+// request ring: RequestHeader, tokenCount int32 routing ids if Hello::routingInput is set, then tokenCount rows of
+// embeddingSize floats. response ring: ResponseHeader, then tokenCount result rows in the order of the request.
+// Requests of a client are answered in order, rows of a response may be read while the request is still written. A
+// request of 0 tokens asks for the Stats of the server instead, answered by a ResponseHeader of 0 tokens then Stats. A
+// malformed request closes the connection.
+namespace moe_server {
+
+constexpr uint32_t MAGIC = 0x76456f4d;  // "MoEv"
+constexpr uint32_t VERSION = 2;
+constexpr size_t PAGE = 4096;
+
+struct Hello {
+    uint32_t magic;
+    uint32_t version;
+    int32_t embeddingSize;
+    int32_t routingInput;  // token ids (hash_layer) or experts (external_routing) follow each request header
+    int32_t maxBatchTokens;
+    int32_t reserved;
+    uint64_t ringCapacity;
+};
+
+struct RequestHeader {
+    int32_t tokenCount;
+    // tokens of each sequence, positions hashed by hash_layer (hash_key = position) restart every sequenceLength
+    // tokens, 0 for a single sequence
+    int32_t sequenceLength;
+};
+
+struct ResponseHeader {
+    int32_t tokenCount;
+    int32_t reserved;
+};
+
+// log2 histograms: bucket 0 counts values of 0, bucket i values in [2^(i-1), 2^i), the last one also larger values
+constexpr int HISTOGRAM_BUCKETS = 32;
+
+inline int histogramBucket(int64_t value) {
+    if (value <= 0) return 0;
+    return std::min(HISTOGRAM_BUCKETS - 1, 64 - __builtin_clzll(static_cast<uint64_t>(value)));
+}
+
+// upper bound (exclusive) of the bucket holding quantile q of a histogram, 0 if empty
+inline int64_t histogramQuantile(const int64_t *histogram, double q) {
+    int64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) total += histogram[i];
+    int64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && total > 0; ++i) {
+        seen += histogram[i];
+        if (seen >= q * total) return int64_t(1) << i;
+    }
+    return 0;
+}
+
+// counters of the server since it started
+struct Stats {
+    int64_t requests;
+    int64_t tokens;
+    int64_t batches;
+    int64_t queueTimeUs[HISTOGRAM_BUCKETS];  // arrival of a request to the start of the batch running its first token
+    int64_t latencyUs[HISTOGRAM_BUCKETS];    // arrival of a request to its last result row written
+    int64_t batchTokens[HISTOGRAM_BUCKETS];
+    int64_t batchRequests[HISTOGRAM_BUCKETS];  // requests with tokens in a batch
+};
+
+// ring 0 for requests, 1 for responses, 2 gives the segment size
+inline size_t ringOffset(int index, size_t capacity) {
+    return index * ((ShmRing::sizeFor(capacity) + PAGE - 1) / PAGE * PAGE);
+}
+
+// false once the other end of a connected socket is closed
+inline bool peerAlive(int socket) {
+    pollfd fd{socket, POLLRDHUP, 0};
+    return poll(&fd, 1, 0) == 0 || (fd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) == 0;
+}
+
+}  // namespace moe_server
+
+#endif  // SERVER_PROTOCOL_H
@@ -0,0 +1,160 @@
+// Standalone MoE layer server: loads one MoELayerPlugin from plugin attributes given on the command line, then serves
+// clients of the host (MoEClient) on a Unix socket until SIGINT or SIGTERM, batching their concurrent requests.
+// SIGHUP reloads the weight file while serving, reading only the experts whose arrays changed.
+//
+// usage: moe_server <socket> <attribute>=<value> ...
+//
+// Attributes are those of the plugin (see README). INT32 and FLOAT32 scalars are given as numbers, strings as is, and
+// FLOAT32 arrays (expert_centroids, layernorm_weight) as an npy file or an array of an npz file (file.npz:name).
+
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../MoELayerPlugin.h"
+#include "../thirdparty/cnpy/cnpy.h"
+#include "MoEServer.h"
+#include "ServerProtocol.h"
+
+namespace {
+
+std::atomic<bool> stopping{false};
+
+void stop(int) { stopping.store(true); }
+
+std::atomic<bool> reloading{false};
+
+void reload(int) { reloading.store(true); }
+
+int envInt(const char *name, int defaultValue) {
+    auto value = getenv(name);
+    return value != nullptr ? atoi(value) : defaultValue;
+}
+
+// FLOAT32 array of an npy file, or of an npz file as file.npz:name
+std::vector<float> loadArray(const std::string &value) {
+    auto npz = value.find(".npz:");
+    auto array = npz != std::string::npos ? cnpy::npz_load(value.substr(0, npz + 4), value.substr(npz + 5))
+                                          : cnpy::npy_load(value);
+    if (array.word_size != sizeof(float)) {
+        fprintf(stderr, "ERROR: %s is not a FLOAT32 array\n", value.c_str());
+        exit(1);
+    }
+    return array.as_vec<float>();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <socket> <attribute>=<value> ...\n", argv[0]);
+        return 2;
+    }
+    MoELayerPluginCreator creator;
+    auto known = creator.getFieldNames();
+    // values outlive the fields pointing to them
+    std::deque<std::vector<char>> values;
+    std::vector<PluginField> fields;
+    std::map<std::string, std::string> given;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto equal = arg.find('=');
+        auto name = arg.substr(0, std::min(equal, arg.size()));
+        auto attribute = std::find_if(known->fields, known->fields + known->nbFields,
+                                      [&](const PluginField &field) { return name == field.name; });
+        if (equal == std::string::npos || attribute == known->fields + known->nbFields) {
+            fprintf(stderr, "ERROR: %s is not <attribute>=<value> of a known attribute\n", argv[i]);
+            return 2;
+        }
+        auto value = arg.substr(equal + 1);
+        given[name] = value;
+        auto &data = values.emplace_back();
+        int32_t length = 1;
+        if (attribute->type == PluginFieldType::kINT32) {
+            int32_t number = std::stoi(value);
+            data.resize(sizeof(number));
+            memcpy(data.data(), &number, sizeof(number));
+        } else if (attribute->type == PluginFieldType::kFLOAT32 && value.find(".np") == std::string::npos) {
+            float number = std::stof(value);
+            data.resize(sizeof(number));
+            memcpy(data.data(), &number, sizeof(number));
+        } else if (attribute->type == PluginFieldType::kFLOAT32) {
+            auto array = loadArray(value);
+            length = static_cast<int32_t>(array.size());
+            data.resize(sizeof(float) * array.size());
+            memcpy(data.data(), array.data(), data.size());
+        } else {
+            data.assign(value.c_str(), value.c_str() + value.size() + 1);
+        }
+        fields.push_back(PluginField{attribute->name, data.data(), attribute->type, length});
+    }
+
+    MoEServer::Config config;
+    config.socketPath = argv[1];
+    if (given.count("embedding_size") == 0) {
+        fprintf(stderr, "ERROR: embedding_size must be given\n");
+        return 2;
+    }
+    config.embeddingSize = std::stoi(given["embedding_size"]);
+    // positions of tokens in their request are hashed as token ids, as requests are concatenated into one sequence
+    auto variant = given["moe_variant"];
+    config.routingInput = variant == moe_variant::EXTERNAL_ROUTING || variant == moe_variant::HASH_LAYER;
+    if (variant == moe_variant::HASH_LAYER && given["hash_key"] == hash_key::POSITION) {
+        config.positionRouting = true;
+        for (auto &field : fields) {
+            if (strcmp(field.name, "hash_key") == 0) field.data = hash_key::TOKEN_ID;
+        }
+    }
+    config.maxBatchTokens = std::max(1, envInt("INFMOE_SERVER_MAX_TOKENS", 4096));
+    config.maxDelay = std::chrono::microseconds(std::max(0, envInt("INFMOE_SERVER_MAX_DELAY_US", 500)));
+    config.clientTimeout = std::chrono::milliseconds(std::max(1, envInt("INFMOE_SERVER_CLIENT_TIMEOUT_MS", 1000)));
+    auto ring_bytes = static_cast<size_t>(std::max(1, envInt("INFMOE_SERVER_RING_MB", 16))) << 20;
+    config.ringCapacity = moe_server::PAGE;
+    while (config.ringCapacity < ring_bytes) config.ringCapacity <<= 1;
+
+    PluginFieldCollection collection{static_cast<int32_t>(fields.size()), fields.data()};
+    auto layer = static_cast<IPluginV2DynamicExt *>(creator.createPlugin("moe_server", &collection));
+    if (layer == nullptr) return 1;
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGHUP, reload);
+    {
+        MoEServer server(layer, config);
+        fprintf(stderr, "moe_server: serving on %s (batches of up to %d tokens, %ld us)\n", config.socketPath.c_str(),
+                config.maxBatchTokens, static_cast<long>(config.maxDelay.count()));
+        // off the serving thread, which keeps running batches on the old weights meanwhile
+        std::thread reloader([&] {
+            auto plugin = static_cast<MoELayerPlugin *>(layer);
+            while (!stopping.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                if (!reloading.exchange(false)) continue;
+                auto reloaded = plugin->reloadExperts();
+                if (reloaded < 0) continue;
+                fprintf(stderr, "moe_server: reloaded %d experts, weight version %llu\n", reloaded,
+                        static_cast<unsigned long long>(plugin->weightVersion()));
+            }
+        });
+        server.serve(stopping);
+        reloader.join();
+    }
+    if (given.count("gate_skip_threshold") > 0) {
+        fprintf(stderr, "moe_server: %.2f%% of routed tokens skipped their expert for a gate weight below %s\n",
+                100 * static_cast<MoELayerPlugin *>(layer)->gateSkipRate(), given["gate_skip_threshold"].c_str());
+    }
+    if (given.count("dedup_tokens") > 0) {
+        fprintf(stderr, "moe_server: %.2f%% of routed tokens reused the expert output of an identical row\n",
+                100 * static_cast<MoELayerPlugin *>(layer)->dedupHitRate());
+    }
+    layer->destroy();
+    return 0;
+}
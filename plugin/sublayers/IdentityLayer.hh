@@ -6,6 +6,8 @@
 #include <NvInferPlugin.h>
 #include <cuda_runtime.h>
 
+#include <cstring>
+
 #include "../thirdparty/dbg.h"
 #include "SubLayer.h"
 
@@ -27,19 +29,43 @@ class IdentityLayer : public MoESubLayer {
                                           [[maybe_unused]] IExprBuilder &exprBuilder) override {
         return nvinfer1::DimsExprs(inputs[0]);
     }
-    virtual void copyWeights([[maybe_unused]] void *dst, [[maybe_unused]] int expert,
-                             [[maybe_unused]] cudaStream_t stream) override {
+    virtual void copyWeights([[maybe_unused]] const ExpertWeightTable &weights, [[maybe_unused]] void *dst,
+                             [[maybe_unused]] int expert, [[maybe_unused]] cudaStream_t stream) override {
         return;
     }
     virtual bool run([[maybe_unused]] int32_t tokenCount, [[maybe_unused]] const void *weights, const void *input,
                      void *output, [[maybe_unused]] void *workspace, cudaStream_t stream) override {
         CUDA_SAFE_CALL(cudaMemcpyAsync(output, input, sizeof(float) * mEmbeddingSize * tokenCount,
                                        cudaMemcpyDeviceToDevice, stream));
-        CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
         return true;
     }
-    virtual void terminate() { dbg("call terminate"); }
-    virtual void initialize() { dbg("call initialize"); }
+    virtual size_t hostWorkspaceSize([[maybe_unused]] int32_t tokenCount) override { return 0; }
+    virtual bool runHost([[maybe_unused]] const ExpertWeightTable &weights, [[maybe_unused]] int expert,
+                         int32_t tokenCount, const float *input, float *output, [[maybe_unused]] void *workspace,
+                         [[maybe_unused]] int parallelism) override {
+        memcpy(output, input, sizeof(float) * mEmbeddingSize * tokenCount);
+        return true;
+    }
+    // mixing a token with itself leaves it unchanged
+    virtual bool runHostIndexed([[maybe_unused]] const ExpertWeightTable &weights, [[maybe_unused]] int expert,
+                                int32_t tokenCount, const int *tokenPos, const float *input, float *output,
+                                [[maybe_unused]] const float *mixCoeff, [[maybe_unused]] void *workspace,
+                                [[maybe_unused]] int parallelism) override {
+        for (int32_t r = 0; r < tokenCount; ++r) {
+            auto offset = static_cast<size_t>(tokenPos[r]) * mEmbeddingSize;
+            memcpy(output + offset, input + offset, sizeof(float) * mEmbeddingSize);
+        }
+        return true;
+    }
+    virtual void terminate() {
+        dbg("call terminate");
+        clearWeights();
+    }
+    // no weight at all
+    virtual void initialize() {
+        dbg("call initialize");
+        if (liveWeights() == nullptr) publishWeights(std::make_unique<ExpertWeightTable>());
+    }
 };
 
 #endif  // IDENTITYLAYER_H
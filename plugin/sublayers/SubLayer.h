@@ -6,8 +6,15 @@
 #include <NvInferPlugin.h>
 #include <cublas_v2.h>
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
 
+#include "../runtime/EpochManager.h"
+#include "../runtime/ExpertPlacement.h"
 #include "utility.h"
 
 using nvinfer1::Dims;
@@ -15,7 +22,33 @@ using nvinfer1::DimsExprs;
 using nvinfer1::IExprBuilder;
 using nvinfer1::Weights;
 
+// Expert weights of one version of a sub-layer, immutable once published (see MoESubLayer::readWeights): the block
+// of each expert laid out as on device (nullptr for weights kept elsewhere, e.g. arrays of an npz file) and the
+// reloads of each expert it reflects
+struct ExpertWeightTable {
+    std::vector<const char *> blocks;
+    std::vector<uint64_t> versions;
+};
+
+// the version of expert weights read by one call, which stays valid until the snapshot is destroyed
+class WeightSnapshot {
+   private:
+    EpochManager::Guard mGuard;
+    const ExpertWeightTable *mTable = nullptr;
+
+   public:
+    WeightSnapshot(EpochManager::Guard guard, const ExpertWeightTable *table)
+        : mGuard(std::move(guard)), mTable(table) {}
+    // nullptr before the sub-layer is initialized
+    const ExpertWeightTable *table() const { return mTable; }
+};
+
 class MoESubLayer {
+   private:
+    std::atomic<const ExpertWeightTable *> mWeightTable{nullptr};
+    std::unique_ptr<const ExpertWeightTable> mLiveTable, mRetiredTable;
+    uint64_t mTableRetired = 0;  // epoch in which mRetiredTable was replaced
+
    protected:
     int mExpertCount;
     int mEmbeddingSize;
@@ -23,6 +56,32 @@ class MoESubLayer {
     int mMaxConcurrency;
     const char *mWeightFile;
     cublasHandle_t mCublasHandle = nullptr;  // passed by MoELayerPlugin
+    // NUMA placement of host weights, passed by MoELayerPlugin before initialize (experts on CPU only)
+    std::shared_ptr<ExpertPlacement> mPlacement = nullptr;
+    // experts [mShardBegin, mShardEnd) are the only ones loaded & run, all of them unless set by a shard worker
+    int mShardBegin;
+    int mShardEnd;
+    bool sharded() const { return mShardEnd - mShardBegin < mExpertCount; }
+    // readers of expert weights, which reloadExperts may replace while they run (see readWeights)
+    EpochManager mEpochs;
+    std::atomic<uint64_t> mWeightVersion{0};
+    // make table the weights read by calls entering from now on, freeing the one it replaced once its readers left.
+    // Returns the epoch in which the previous table was retired, after which its blocks may be reused
+    uint64_t publishWeights(std::unique_ptr<const ExpertWeightTable> table) {
+        mEpochs.synchronize(mTableRetired);
+        mRetiredTable = std::move(mLiveTable);
+        mLiveTable = std::move(table);
+        mWeightTable = mLiveTable.get();
+        mTableRetired = mEpochs.retire();
+        return mTableRetired;
+    }
+    // once no call reads weights anymore
+    void clearWeights() {
+        mWeightTable = nullptr;
+        mLiveTable = nullptr;
+        mRetiredTable = nullptr;
+    }
+    const ExpertWeightTable *liveWeights() const { return mLiveTable.get(); }
 
    public:
     explicit MoESubLayer(int expertCount, int embeddingSize, int hiddenSize, const char *weightFile, int maxConcurrency)
@@ -30,17 +89,78 @@ class MoESubLayer {
           mEmbeddingSize(embeddingSize),
           mHiddenSize(hiddenSize),
           mMaxConcurrency(maxConcurrency),
-          mWeightFile(weightFile){};
+          mWeightFile(weightFile),
+          mShardBegin(0),
+          mShardEnd(expertCount){};
     void setCuBlasHandle(cublasHandle_t handle) { mCublasHandle = handle; }
+    void setPlacement(std::shared_ptr<ExpertPlacement> placement) { mPlacement = std::move(placement); }
+    const std::shared_ptr<ExpertPlacement> &placement() const { return mPlacement; }
+    // only load & run experts [begin, end) (expert parallelism, see ExpertShards), called before initialize
+    void setShard(int begin, int end) {
+        assert(0 <= begin && begin < end && end <= mExpertCount);
+        mShardBegin = begin;
+        mShardEnd = end;
+    }
     virtual ~MoESubLayer(){};
     virtual bool configureWithFormat(const Dims *inputDims, int32_t nbInputs, const Dims *outputDims,
                                      int32_t nbOutputs) = 0;
     virtual size_t weightSize() = 0;
     virtual size_t workspaceSize(int32_t tokenCount) = 0;
     virtual DimsExprs getOutputDimensions(const DimsExprs *inputs, IExprBuilder &exprBuilder) = 0;
-    virtual void copyWeights(void *dst, int expert, cudaStream_t stream) = 0;
+    // weights of expert at the version of weights (see readWeights)
+    virtual void copyWeights(const ExpertWeightTable &weights, void *dst, int expert, cudaStream_t stream) = 0;
     virtual bool run(int32_t tokenCount, const void *weights, const void *input, void *output, void *workspace,
                      cudaStream_t stream) = 0;
+    // host execution (expert_backend = cpu): weights are read in place from host memory, input / output / workspace
+    // are host buffers, and the sub-layer may split the work into at most parallelism tasks on ThreadPool::instance()
+    // host workspace must grow linearly with tokenCount, as experts share one buffer sliced by token offset
+    virtual size_t hostWorkspaceSize(int32_t tokenCount) { return workspaceSize(tokenCount); }
+    // used by the cost model of ExpertScheduler
+    virtual double flopsPerToken() { return 0; }
+    virtual bool runHost([[maybe_unused]] const ExpertWeightTable &weights, [[maybe_unused]] int expert,
+                         [[maybe_unused]] int32_t tokenCount, [[maybe_unused]] const float *input,
+                         [[maybe_unused]] float *output, [[maybe_unused]] void *workspace,
+                         [[maybe_unused]] int parallelism) {
+        unimplemented();
+    }
+    // runHost on the tokens tokenPos[0, tokenCount) of a micro-batch kept in token order: token r is read from row
+    // tokenPos[r] of input and its result is written to row tokenPos[r] of output, so that tokens are neither copied
+    // into expert order before nor back after the expert. With mixCoeff (base layer), the result is mixed as
+    // input + sigmoid(mixCoeff[tokenPos[r]]) * (expert(input) - input)
+    virtual bool runHostIndexed([[maybe_unused]] const ExpertWeightTable &weights, [[maybe_unused]] int expert,
+                                [[maybe_unused]] int32_t tokenCount, [[maybe_unused]] const int *tokenPos,
+                                [[maybe_unused]] const float *input, [[maybe_unused]] float *output,
+                                [[maybe_unused]] const float *mixCoeff, [[maybe_unused]] void *workspace,
+                                [[maybe_unused]] int parallelism) {
+        unimplemented();
+    }
+    // tiered expert weights (see ExpertStore): at most hotBytes of uncompressed and warmBytes of compressed experts
+    // stay in host memory, others are read from the weight file when used. 0 keeps every expert in memory
+    virtual void setWeightBudgets([[maybe_unused]] size_t hotBytes, [[maybe_unused]] size_t warmBytes) {}
+    // tokens routed to each expert by one batch, promoting & demoting tiered expert weights
+    virtual void recordRouting([[maybe_unused]] const int *expertTokenCount) {}
+    // keep a copy of the weights of these experts on every NUMA node of the placement (see ExpertPlacement), called
+    // while no expert of the caller runs on host
+    virtual void replicateExperts([[maybe_unused]] const ExpertWeightTable &weights,
+                                  [[maybe_unused]] const std::vector<int> &experts) {}
+    // hot swap of expert weights while serving: reread the weights of experts from weightFile (the weight file of the
+    // sub-layer if null), skipping those whose arrays are unchanged, and publish them at once as a new table. Callers
+    // reading host weights (runHost, runHostIndexed, copyWeights) take one snapshot (readWeights) for a whole call and
+    // pass its table to each of them: the call runs on one version, which stays valid until the snapshot is
+    // destroyed. Returns experts reloaded, -1 (weights unchanged) on failure
+    virtual int reloadExperts([[maybe_unused]] const std::vector<int> &experts,
+                              [[maybe_unused]] const char *weightFile) {
+        fprintf(stderr, "ERROR: this sub-layer cannot reload its weights\n");
+        return -1;
+    }
+    // weights published last, once initialized. The reader enters the epoch before loading the table, so that the
+    // table stays alive until it leaves
+    WeightSnapshot readWeights() {
+        auto guard = mEpochs.enter();
+        return WeightSnapshot(std::move(guard), mWeightTable.load());
+    }
+    // bumped by every reload of some experts
+    uint64_t weightVersion() const { return mWeightVersion.load(); }
     // read weights to memory, etc.
     virtual void initialize() = 0;
     // free weights, etc.
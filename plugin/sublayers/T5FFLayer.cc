@@ -2,8 +2,17 @@
 
 #include <NvInferPlugin.h>
 #include <cublas_v2.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <stdexcept>
 #include <string>
 
 #include "../cuda/ops.h"
@@ -12,6 +21,7 @@
 
 using namespace nvinfer1;
 
+
 T5FFLayer::~T5FFLayer() {
     this->terminate();
     dbg("destructing T5FFLayer");
@@ -42,6 +52,8 @@ DimsExprs T5FFLayer::getOutputDimensions(const DimsExprs *inputs, IExprBuilder &
 
 size_t T5FFLayer::weightSize() { return layernormWeightSize() + 3 * intermediateFFWeightSize(); }
 
+double T5FFLayer::flopsPerToken() { return 6.0 * mEmbeddingSize * mHiddenSize; }
+
 size_t T5FFLayer::workspaceSize(int32_t tokenCount) {
     dbg("call workspaceSize");
     // calculate intermediate matrix size for given count of tokens
@@ -52,8 +64,20 @@ size_t T5FFLayer::workspaceSize(int32_t tokenCount) {
     return layernormOutputSize(tokenCount) + 2 * intermediateFFOutputSize(tokenCount);
 }
 
-void T5FFLayer::copyWeights(void *dst, int expert, cudaStream_t stream) {
+void T5FFLayer::copyWeights(const ExpertWeightTable &weights, void *dst, int expert, cudaStream_t stream) {
     // dbg(expert);
+    if (mStore != nullptr) {
+        // blocks of the store are pageable, so the copy is staged before returning and the pin may be released
+        auto pin = mStore->acquire(expert);
+        CUDA_SAFE_CALL(cudaMemcpyAsync(dst, pin.data(), weightSize(), cudaMemcpyHostToDevice, stream));
+        return;
+    }
+    if (auto block = weights.blocks[expert]; block != nullptr) {
+        // a swapped block may still be in flight once the caller stopped reading weights, see reloadExperts
+        if (weights.versions[expert] > 0) mSwapsCopied = true;
+        CUDA_SAFE_CALL(cudaMemcpyAsync(dst, block, weightSize(), cudaMemcpyHostToDevice, stream));
+        return;
+    }
     // copy weight of specified expert to dst
     auto weight_ptr_byte = static_cast<char *>(dst);
 
@@ -140,17 +164,358 @@ bool T5FFLayer::run(int32_t tokenCount, const void *weights, const void *input,
     return true;
 }
 
+T5FFWeights T5FFLayer::weightsOf(const char *block) const {
+    return T5FFWeights{
+        reinterpret_cast<const float *>(block),
+        reinterpret_cast<const float *>(block + layernormWeightSize()),
+        reinterpret_cast<const float *>(block + layernormWeightSize() + intermediateFFWeightSize()),
+        reinterpret_cast<const float *>(block + layernormWeightSize() + intermediateFFWeightSize() * 2),
+    };
+}
+
+T5FFWeights T5FFLayer::hostWeightsOf(const ExpertWeightTable &weights, int expert,
+                                     ExpertPlacement::Pin &replica) const {
+    if (mPlacement != nullptr) {
+        replica = mPlacement->pin(expert, ThreadPool::instance().currentNode(), weights.versions[expert]);
+    }
+    if (replica.data() != nullptr) return weightsOf(replica.data());
+    auto block = weights.blocks[expert];
+    return block != nullptr ? weightsOf(block) : mHostWeights[expert];
+}
+
+bool T5FFLayer::runHost(const ExpertWeightTable &weights, int expert, int32_t tokenCount, const float *input,
+                        float *output, void *workspace, int parallelism) {
+    assert(expert >= 0 && expert < mExpertCount);
+    if (mStore != nullptr) {
+        auto pin = mStore->acquire(expert);
+        t5_ff_cpu(weightsOf(pin.data()), tokenCount, mEmbeddingSize, mHiddenSize, input, output,
+                  static_cast<float *>(workspace), parallelism);
+        return true;
+    }
+    ExpertPlacement::Pin replica;
+    t5_ff_cpu(hostWeightsOf(weights, expert, replica), tokenCount, mEmbeddingSize, mHiddenSize, input, output,
+              static_cast<float *>(workspace), parallelism);
+    return true;
+}
+
+bool T5FFLayer::runHostIndexed(const ExpertWeightTable &weights, int expert, int32_t tokenCount, const int *tokenPos,
+                               const float *input, float *output, const float *mixCoeff, void *workspace,
+                               int parallelism) {
+    assert(expert >= 0 && expert < mExpertCount);
+    if (mStore != nullptr) {
+        auto pin = mStore->acquire(expert);
+        t5_ff_cpu_indexed(weightsOf(pin.data()), tokenCount, mEmbeddingSize, mHiddenSize, tokenPos, input, output,
+                          mixCoeff, static_cast<float *>(workspace), parallelism);
+        return true;
+    }
+    ExpertPlacement::Pin replica;
+    t5_ff_cpu_indexed(hostWeightsOf(weights, expert, replica), tokenCount, mEmbeddingSize, mHiddenSize, tokenPos, input,
+                      output, mixCoeff, static_cast<float *>(workspace), parallelism);
+    return true;
+}
+
+void T5FFLayer::setWeightBudgets(size_t hotBytes, size_t warmBytes) {
+    assert(mSavedWeights == nullptr && mWeightBlocks.empty() && mStore == nullptr);
+    mHotBudget = hotBytes;
+    mWarmBudget = warmBytes;
+}
+
+void T5FFLayer::recordRouting(const int *expertTokenCount) {
+    if (mStore != nullptr) mStore->recordRouting(expertTokenCount);
+}
+
+// replicas are copied from the blocks of the weight table read by the caller, which a reload does not reuse until it
+// is done, tiered weights are not replicated
+void T5FFLayer::replicateExperts(const ExpertWeightTable &weights, const std::vector<int> &experts) {
+    if (mPlacement == nullptr || mExpertBlocks.empty()) return;
+    mPlacement->replicate(experts, weightSize(), HostAllocator::weightBackend(), [&weights](int expert) {
+        return ExpertPlacement::Copy{weights.blocks[expert], weights.versions[expert]};
+    });
+}
+
+// Changed experts (an array of a different size or CRC, or without CRC) are read into the block their live weights
+// replaced, once every reader that may still use it left: those of the tables holding it, and copies to device they
+// issued. They are all published at once in a new weight table, so that a call reads either all old or all new
+// weights, and replicas of the new weights are only pinned by readers of the new table. The path of the weight file
+// is kept: rolling out a file in place (renamed over the old one) and reloading it also updates engines serialized
+// afterwards.
+int T5FFLayer::reloadExperts(const std::vector<int> &experts, const char *weightFile) {
+    std::lock_guard<std::mutex> guard(mReloadLock);
+    if (mStore != nullptr || mSwaps == nullptr) {
+        fprintf(stderr, "ERROR: cannot reload weights %s\n",
+                mStore != nullptr ? "of tiered experts" : "before initialize");
+        return -1;
+    }
+    auto file = weightFile != nullptr ? weightFile : mWeightFile;
+    std::vector<int> changed;
+    std::vector<cnpy::NpzEntry> entries;  // 4 of each changed expert
+    std::vector<char *> targets;
+    int fd = -1;
+    try {
+        std::map<std::string, cnpy::NpzEntry> index;
+        for (auto &entry : cnpy::npz_index(file)) index[entry.varname] = entry;
+        for (auto expert : experts) {
+            assert(expert >= 0 && expert < mExpertCount);
+            if (expert < mShardBegin || expert >= mShardEnd) continue;
+            if (std::find(changed.begin(), changed.end(), expert) != changed.end()) continue;
+            bool same = true;
+            std::vector<cnpy::NpzEntry> expert_entries;
+            for (auto name : {"/layer_norm_weight", "/wi_0_weight", "/wi_1_weight", "/wo_weight"}) {
+                auto found = index.find(std::to_string(expert) + name);
+                if (found == index.end()) {
+                    fprintf(stderr, "ERROR: %d%s not found in weight file %s\n", expert, name, file);
+                    return -1;
+                }
+                auto &loaded = mWeightEntries[expert * 4 + expert_entries.size()];
+                same = same && found->second.crc != 0 && found->second.crc == loaded.crc &&
+                       found->second.uncompr_bytes == loaded.uncompr_bytes;
+                expert_entries.push_back(found->second);
+            }
+            if (same) continue;
+            changed.push_back(expert);
+            entries.insert(entries.end(), expert_entries.begin(), expert_entries.end());
+        }
+        if (changed.empty()) return 0;
+
+        bool synchronized = false;
+        for (auto expert : changed) {
+            auto &swap = mSwaps[expert];
+            auto target = swap.liveBlock == 0 ? 1 : 0;
+            if (swap.blocks[target].data() == nullptr) {
+                auto node = mPlacement != nullptr && mPlacement->numa() ? mPlacement->home(expert) : -1;
+                swap.blocks[target] = HostMemory(weightSize(), HostAllocator::weightBackend(), node);
+            } else {
+                mEpochs.synchronize(swap.retired[target]);
+                if (mSwapsCopied && !synchronized) {
+                    CUDA_SAFE_CALL(cudaDeviceSynchronize());
+                    synchronized = true;
+                }
+            }
+            targets.push_back(swap.blocks[target].data());
+        }
+        fd = open(file, O_RDONLY);
+        if (fd < 0) throw std::runtime_error(strerror(errno));
+        // arrays stored uncompressed are read at once through ExpertReader, others inflated one after the other
+        std::vector<ExpertReader::Extent> extents;
+        for (size_t i = 0; i < changed.size(); ++i) {
+            auto dst = targets[i];
+            for (int k = 0; k < 4; ++k) {
+                auto size = k == 0 ? layernormWeightSize() : intermediateFFWeightSize();
+                size_t offset;
+                if (cnpy::npz_locate(fd, entries[i * 4 + k], size, offset)) {
+                    extents.push_back(ExpertReader::Extent{offset, size, dst});
+                } else {
+                    cnpy::npz_read(fd, entries[i * 4 + k], dst, size);
+                }
+                dst += size;
+            }
+        }
+        close(fd);
+        fd = -1;
+        if (!extents.empty()) {
+            fd = ExpertReader::instance().openFile(file);
+            auto err = fd < 0 ? errno : ExpertReader::instance().readAll(fd, extents);
+            if (err != 0) throw std::runtime_error(strerror(err));
+            close(fd);
+            fd = -1;
+        }
+    } catch (const std::exception &e) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "ERROR: failed to reload experts from %s: %s\n", file, e.what());
+        return -1;
+    }
+
+    auto table = std::make_unique<ExpertWeightTable>(*liveWeights());
+    for (size_t i = 0; i < changed.size(); ++i) {
+        auto &swap = mSwaps[changed[i]];
+        swap.liveBlock = swap.liveBlock == 0 ? 1 : 0;
+        table->blocks[changed[i]] = targets[i];
+        ++table->versions[changed[i]];
+        std::copy(entries.begin() + i * 4, entries.begin() + i * 4 + 4, mWeightEntries.begin() + changed[i] * 4);
+    }
+    auto &live = *table;
+    auto retired = publishWeights(std::move(table));
+    auto source = [&live](int expert) { return ExpertPlacement::Copy{live.blocks[expert], live.versions[expert]}; };
+    for (auto expert : changed) {
+        auto &swap = mSwaps[expert];
+        swap.retired[1 - swap.liveBlock] = retired;
+        if (mPlacement != nullptr) mPlacement->refresh(expert, source);
+    }
+    mWeightVersion.fetch_add(1);
+    dbg(file, changed.size(), retired);
+    return static_cast<int>(changed.size());
+}
+
+void T5FFLayer::locateWeights() {
+    std::map<std::string, cnpy::NpzEntry> entries;
+    for (auto &entry : cnpy::npz_index(mWeightFile)) entries[entry.varname] = entry;
+    mWeightEntries.clear();
+    for (int i = 0; i < mExpertCount; ++i) {
+        for (auto name : {"/layer_norm_weight", "/wi_0_weight", "/wi_1_weight", "/wo_weight"}) {
+            auto found = entries.find(std::to_string(i) + name);
+            if (found == entries.end()) {
+                fprintf(stderr, "ERROR: %d%s not found in weight file %s\n", i, name, mWeightFile);
+                assert(false);
+            }
+            mWeightEntries.push_back(found->second);
+        }
+    }
+    mWeightFd = open(mWeightFile, O_RDONLY);
+    if (mWeightFd < 0) {
+        perror("Cannot open weight file");
+        assert(false);
+    }
+    mWeightOffsets.clear();
+    for (int i = 0; i < mExpertCount * 4; ++i) {
+        size_t offset;
+        auto size = i % 4 == 0 ? layernormWeightSize() : intermediateFFWeightSize();
+        if (!cnpy::npz_locate(mWeightFd, mWeightEntries[i], size, offset)) {
+            dbg("compressed weight file, reading arrays serially", mWeightFile);
+            mWeightOffsets.clear();
+            return;
+        }
+        mWeightOffsets.push_back(offset);
+    }
+    // reopen, bypassing the page cache if possible
+    close(mWeightFd);
+    mWeightFd = ExpertReader::instance().openFile(mWeightFile);
+    if (mWeightFd < 0) {
+        perror("Cannot open weight file");
+        assert(false);
+    }
+}
+
+std::vector<ExpertReader::Extent> T5FFLayer::extentsOf(int expert, char *block) const {
+    std::vector<ExpertReader::Extent> extents;
+    for (int k = 0; k < 4; ++k) {
+        auto size = k == 0 ? layernormWeightSize() : intermediateFFWeightSize();
+        extents.push_back(ExpertReader::Extent{mWeightOffsets[expert * 4 + k], size, block});
+        block += size;
+    }
+    return extents;
+}
+
+void T5FFLayer::readArrays(int expert, char *block) const {
+    for (int k = 0; k < 4; ++k) {
+        auto size = k == 0 ? layernormWeightSize() : intermediateFFWeightSize();
+        cnpy::npz_read(mWeightFd, mWeightEntries[expert * 4 + k], block, size);
+        block += size;
+    }
+}
+
+// only locate arrays of each expert in the weight file, experts are read when first used
+void T5FFLayer::initializeStore() {
+    locateWeights();
+    auto loader = [this](int expert, char *dst) {
+        if (!mWeightOffsets.empty()) {
+            auto err = ExpertReader::instance().readAll(mWeightFd, extentsOf(expert, dst));
+            if (err != 0) {
+                fprintf(stderr, "ERROR: failed to read expert %d from %s: %s\n", expert, mWeightFile, strerror(err));
+                assert(false);
+            }
+            return;
+        }
+        readArrays(expert, dst);
+    };
+    mStore = std::make_unique<ExpertStore>(mExpertCount, weightSize(), mHotBudget, mWarmBudget, loader);
+}
+
+// version 0 of every expert: its block if loaded in one, none for tiered experts (read from the store instead) nor
+// arrays of mSavedWeights
+void T5FFLayer::publishInitialWeights() {
+    if (liveWeights() != nullptr) return;
+    auto table = std::make_unique<ExpertWeightTable>();
+    table->blocks.assign(mExpertCount, nullptr);
+    std::copy(mExpertBlocks.begin(), mExpertBlocks.end(), table->blocks.begin());
+    table->versions.assign(mExpertCount, 0);
+    publishWeights(std::move(table));
+}
+
 void T5FFLayer::initialize() {
+    if (mHotBudget > 0) {
+        if (mStore == nullptr) initializeStore();
+        publishInitialWeights();
+        return;
+    }
     // load all weights to CPU memory (WARNING: huge memory consumption!)
+    if (mWeightBlocks.empty() && mSavedWeights == nullptr) {
+        locateWeights();
+        auto numa = mPlacement != nullptr && mPlacement->numa();
+        if (!mWeightOffsets.empty() || numa || sharded()) {
+            mExpertBlocks.assign(mExpertCount, nullptr);
+            // one block per node (a single one on any node without placement), pages are placed before being read to
+            for (auto node : numa ? mPlacement->nodes() : std::vector<int>{-1}) {
+                std::vector<int> experts(mExpertCount);
+                std::iota(experts.begin(), experts.end(), 0);
+                if (numa) experts = mPlacement->expertsOn(node);
+                experts.erase(std::remove_if(experts.begin(), experts.end(),
+                                             [this](int e) { return e < mShardBegin || e >= mShardEnd; }),
+                              experts.end());
+                if (experts.empty()) continue;
+                HostMemory block(weightSize() * experts.size(), HostAllocator::weightBackend(), node);
+                // every array of every expert in flight at once
+                std::vector<ExpertReader::Extent> extents;
+                for (size_t k = 0; k < experts.size(); ++k) {
+                    auto dst = block.data() + weightSize() * k;
+                    mExpertBlocks[experts[k]] = dst;
+                    if (mWeightOffsets.empty()) {
+                        readArrays(experts[k], dst);
+                        continue;
+                    }
+                    auto expert_extents = extentsOf(experts[k], dst);
+                    extents.insert(extents.end(), expert_extents.begin(), expert_extents.end());
+                }
+                auto err = extents.empty() ? 0 : ExpertReader::instance().readAll(mWeightFd, extents);
+                if (err != 0) {
+                    fprintf(stderr, "ERROR: failed to read weight file %s: %s\n", mWeightFile, strerror(err));
+                    assert(false);
+                }
+                dbg(node, experts.size());
+                mWeightBlocks.push_back(std::move(block));
+            }
+        }
+        close(mWeightFd);
+        mWeightFd = -1;
+    }
+    if (mSwaps == nullptr) mSwaps.reset(new ExpertSwap[mExpertCount]);
+    publishInitialWeights();
+    if (!mExpertBlocks.empty()) {
+        dbg("weights loaded");
+        mHostWeights.resize(mExpertCount);
+        for (int i = 0; i < mExpertCount; ++i) {
+            if (mExpertBlocks[i] != nullptr) mHostWeights[i] = weightsOf(mExpertBlocks[i]);
+        }
+        return;
+    }
     if (mSavedWeights == nullptr) mSavedWeights = cnpy::npz_load(mWeightFile);
     dbg("weights loaded");
+    mHostWeights.resize(mExpertCount);
+    for (int i = 0; i < mExpertCount; ++i) {
+        auto prefix = std::to_string(i);
+        mHostWeights[i] = T5FFWeights{
+            (*mSavedWeights)[prefix + "/layer_norm_weight"].data<float>(),
+            (*mSavedWeights)[prefix + "/wi_0_weight"].data<float>(),
+            (*mSavedWeights)[prefix + "/wi_1_weight"].data<float>(),
+            (*mSavedWeights)[prefix + "/wo_weight"].data<float>(),
+        };
+    }
 }
 
 void T5FFLayer::terminate() {
     dbg("call terminate");
     // free CPU memory
+    mHostWeights.clear();
     if (mSavedWeights != nullptr) {
         delete mSavedWeights;
         mSavedWeights = nullptr;
     }
+    mWeightBlocks.clear();
+    mExpertBlocks.clear();
+    clearWeights();
+    mSwaps = nullptr;
+    mStore = nullptr;
+    if (mWeightFd >= 0) {
+        close(mWeightFd);
+        mWeightFd = -1;
+    }
 }
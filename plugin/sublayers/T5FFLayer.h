@@ -5,6 +5,15 @@
 
 #include <cuda_runtime.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../host/t5ff.h"
+#include "../runtime/ExpertReader.h"
+#include "../runtime/ExpertStore.h"
+#include "../runtime/HostAllocator.h"
 #include "../thirdparty/cnpy/cnpy.h"
 #include "SubLayer.h"
 
@@ -16,6 +25,44 @@ class T5FFLayer : public MoESubLayer {
     // weights
    private:
     cnpy::npz_t *mSavedWeights = nullptr;
+    // weights of every expert laid out as on device, one after the other, instead of mSavedWeights when the weight
+    // file is not compressed. With a NUMA placement, there is one block per node holding its experts, allocated there
+    std::vector<HostMemory> mWeightBlocks;
+    std::vector<char *> mExpertBlocks;  // weights of each expert in mWeightBlocks
+    // pointers into mSavedWeights or mWeightBlocks of each expert, used by host execution
+    std::vector<T5FFWeights> mHostWeights;
+    // with weight budgets, experts are read from the weight file into mStore instead, each one as a block laid out
+    // as on device
+    size_t mHotBudget = 0, mWarmBudget = 0;
+    std::unique_ptr<ExpertStore> mStore = nullptr;
+    std::vector<cnpy::NpzEntry> mWeightEntries;  // layer_norm_weight, wi_0_weight, wi_1_weight, wo_weight of each
+    // offsets of the data of these arrays, read by ExpertReader, empty when the weight file is compressed
+    std::vector<size_t> mWeightOffsets;
+    int mWeightFd = -1;
+    // weights of an expert reloaded while serving (see reloadExperts): two blocks laid out as on device, allocated on
+    // its first reload, the one of the live weight table and the one it replaced (the weights loaded by initialize
+    // before any reload). A replaced block is only overwritten once the readers of the tables holding it are gone
+    struct ExpertSwap {
+        HostMemory blocks[2];
+        int liveBlock = -1;
+        uint64_t retired[2] = {0, 0};  // epoch in which each block was replaced, 0 if it never was
+    };
+    std::unique_ptr<ExpertSwap[]> mSwaps;
+    std::mutex mReloadLock;                 // serializes reloadExperts
+    std::atomic<bool> mSwapsCopied{false};  // copyWeights copied a swapped block, which may still be in flight
+    // index arrays of the weight file and open it, through ExpertReader if it is not compressed
+    void locateWeights();
+    // where the arrays of an expert go in its block
+    std::vector<ExpertReader::Extent> extentsOf(int expert, char *block) const;
+    // read the arrays of an expert one after the other from a compressed weight file
+    void readArrays(int expert, char *block) const;
+    void initializeStore();
+    // weight table of the weights loaded by initialize
+    void publishInitialWeights();
+    T5FFWeights weightsOf(const char *block) const;
+    // weights of an expert read in place on host: its replica (of the same version) on the node of the calling
+    // worker, its home copy in weights else
+    T5FFWeights hostWeightsOf(const ExpertWeightTable &weights, int expert, ExpertPlacement::Pin &replica) const;
     size_t layernormWeightSize() const { return mEmbeddingSize * sizeof(float); }
     size_t intermediateFFWeightSize() const { return mEmbeddingSize * mHiddenSize * sizeof(float); }
     size_t layernormOutputSize(int32_t tokenCount) const { return tokenCount * mEmbeddingSize * sizeof(float); }
@@ -29,9 +76,19 @@ class T5FFLayer : public MoESubLayer {
     virtual size_t weightSize() override;
     virtual size_t workspaceSize(int32_t tokenCount) override;
     virtual DimsExprs getOutputDimensions(const DimsExprs *inputs, IExprBuilder &exprBuilder) override;
-    virtual void copyWeights(void *dst, int expert, cudaStream_t stream) override;
+    virtual void copyWeights(const ExpertWeightTable &weights, void *dst, int expert, cudaStream_t stream) override;
     virtual bool run(int32_t tokenCount, const void *weights, const void *input, void *output, void *workspace,
                      cudaStream_t stream) override;
+    virtual double flopsPerToken() override;
+    virtual bool runHost(const ExpertWeightTable &weights, int expert, int32_t tokenCount, const float *input,
+                         float *output, void *workspace, int parallelism) override;
+    virtual bool runHostIndexed(const ExpertWeightTable &weights, int expert, int32_t tokenCount, const int *tokenPos,
+                                const float *input, float *output, const float *mixCoeff, void *workspace,
+                                int parallelism) override;
+    virtual void setWeightBudgets(size_t hotBytes, size_t warmBytes) override;
+    virtual void recordRouting(const int *expertTokenCount) override;
+    virtual void replicateExperts(const ExpertWeightTable &weights, const std::vector<int> &experts) override;
+    virtual int reloadExperts(const std::vector<int> &experts, const char *weightFile) override;
     virtual void initialize();
     virtual void terminate();
 };
@@ -0,0 +1,112 @@
+// Workspace layout of runtime/WorkspacePlanner: buffers alive at a common step never overlap, for random buffers and
+// for the layouts MoEWorkspaceLayout::plan gives MoELayerPlugin, whose peak must stay below all buffers side by side,
+// and with slots bounded by slotTokens, not above slots sized for a whole micro-batch.
+//
+// usage: test_workspace_planner [random_rounds]
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "../runtime/MoEWorkspace.h"
+#include "../runtime/WorkspacePlanner.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        ++failures;
+        printf("FAIL %s\n", what.c_str());
+    }
+}
+
+// every pair of buffers alive at a common step lies in disjoint bytes, all within the planned size
+void checkDisjoint(const WorkspacePlanner &planner, const std::string &name) {
+    auto &buffers = planner.buffers();
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        auto &a = buffers[i];
+        check(a.offset + a.size <= planner.totalSize(), name + ": " + a.name + " out of workspace");
+        for (size_t j = i + 1; j < buffers.size(); ++j) {
+            auto &b = buffers[j];
+            auto alive = a.firstUse <= b.lastUse && b.firstUse <= a.lastUse;
+            auto overlap = a.size > 0 && b.size > 0 && a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+            check(!(alive && overlap), name + ": " + a.name + " overlaps " + b.name);
+        }
+    }
+}
+
+struct Case {
+    const char *name;
+    int microBatchSize;
+    int depth;  // micro-batches in flight
+    MoEWorkspaceShape shape;  // slotSize filled from hiddenSize
+    size_t hiddenSize;
+};
+
+// bytes of a T5FF slot (T5FFLayer::weightSize & workspaceSize) holding intermediate variables of tokens
+size_t t5ffSlotSize(size_t embeddingSize, size_t hiddenSize, size_t tokens) {
+    return (embeddingSize + 3 * embeddingSize * hiddenSize + tokens * (embeddingSize + 2 * hiddenSize)) * sizeof(float);
+}
+
+MoEWorkspaceShape shapeOf(const Case &c, int slotTokens) {
+    auto shape = c.shape;
+    shape.slotSize = t5ffSlotSize(shape.embeddingSize, c.hiddenSize, slotTokens);
+    return shape;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto rounds = argc > 1 ? atoi(argv[1]) : 1000;
+
+    std::mt19937 rng(42);
+    for (int round = 0; round < rounds; ++round) {
+        WorkspacePlanner planner(1 << (rng() % 9));
+        auto count = 1 + rng() % 24;
+        for (unsigned i = 0; i < count; ++i) {
+            int first = rng() % 8;
+            int last = first + rng() % 4;
+            // a few empty buffers, as absent features would register
+            planner.add("buffer" + std::to_string(i), rng() % 8 == 0 ? 0 : 1 + rng() % 100000, first, last);
+        }
+        auto total = planner.plan();
+        checkDisjoint(planner, "random round " + std::to_string(round));
+        check(total <= planner.unsharedSize(), "random round " + std::to_string(round) + ": larger than unshared");
+    }
+
+    // embedding, experts, slot size (filled), slots, probe stride, scores, balanced, dedup, host, base layer mix
+    const Case cases[] = {
+        {"t5 mb4096", 4096, 1, {1024, 64, 0, 2, 0, true, false, false, false, false}, 4096},
+        {"t5 lists dedup mb4096", 4096, 1, {1024, 64, 0, 2, 4, true, false, true, false, false}, 4096},
+        {"base_layer mb4096 balanced", 4096, 1, {1024, 512, 0, 2, 0, true, true, false, false, true}, 4096},
+        {"t5 pipelined mb1024 x4", 1024, 2, {1024, 64, 0, 4, 0, true, false, false, false, false}, 4096},
+        {"base_layer pipelined mb1024 balanced", 1024, 2, {1024, 2048, 0, 2, 0, true, true, true, false, true}, 4096},
+        {"hash_layer cpu mb4096", 4096, 1, {1024, 64, 0, 2, 0, false, false, false, true, false}, 4096},
+        {"decode mb8", 8, 1, {4096, 128, 0, 2, 0, true, false, false, false, false}, 16384},
+    };
+    // peak of slots sized for a whole micro-batch, as before slot tokens were bounded, and of the plugin layout
+    printf("%-40s %12s %14s %14s %14s\n", "shape", "slot tokens", "unshared(B)", "mb slots(B)", "planned(B)");
+    for (auto &c : cases) {
+        auto slot_tokens = MoEWorkspaceLayout::slotTokens(c.microBatchSize, static_cast<int>(c.shape.expertCount),
+                                                          c.shape.balanced);
+        auto whole = MoEWorkspaceLayout::plan(shapeOf(c, c.microBatchSize), c.microBatchSize, c.depth);
+        auto layout = MoEWorkspaceLayout::plan(shapeOf(c, slot_tokens), c.microBatchSize, c.depth);
+        checkDisjoint(layout.planner, c.name);
+        check(layout.planner.totalSize() <= whole.planner.totalSize(), std::string(c.name) + ": bounded slots larger");
+        check(layout.planner.totalSize() <= whole.planner.unsharedSize(), std::string(c.name) + ": above unshared");
+        check(static_cast<int>(layout.slots.size()) == c.depth, std::string(c.name) + ": micro-batches in flight");
+        check(slot_tokens <= MoEWorkspaceLayout::SLOT_TOKENS && slot_tokens <= c.microBatchSize,
+              std::string(c.name) + ": slot tokens");
+        check((c.shape.probeStride > 0) == (layout.probeLists >= 0) && c.shape.dedup == (layout.rowHash >= 0) &&
+                  c.shape.expertsOnHost == (layout.slots[0].routedFeatures < 0),
+              std::string(c.name) + ": buffers of features");
+        printf("%-40s %12d %14zu %14zu %14zu\n", c.name, slot_tokens, whole.planner.unsharedSize(),
+               whole.planner.totalSize(), layout.planner.totalSize());
+    }
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -14,6 +14,10 @@
 #include <regex>
 #include <stdexcept>
 
+#include <unistd.h>
+
+#include "../../runtime/ThreadPool.h"
+
 char cnpy::BigEndianTest() {
     int x = 1;
     return (((char*)&x)[0]) ? '<' : '>';
@@ -188,12 +192,9 @@ cnpy::NpyArray load_the_npy_file(FILE* fp) {
     return arr;
 }
 
-cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncompr_bytes) {
+cnpy::NpyArray inflate_the_npz_array(unsigned char* buffer_compr, uint32_t compr_bytes, uint32_t uncompr_bytes) {
 
-    std::vector<unsigned char> buffer_compr(compr_bytes);
     std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
-    size_t nread = fread(&buffer_compr[0], 1, compr_bytes, fp);
-    if (nread != compr_bytes) throw std::runtime_error("load_the_npy_file: failed fread");
 
     int err;
     z_stream d_stream;
@@ -206,7 +207,7 @@ cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncom
     err = inflateInit2(&d_stream, -MAX_WBITS);
 
     d_stream.avail_in = compr_bytes;
-    d_stream.next_in = &buffer_compr[0];
+    d_stream.next_in = buffer_compr;
     d_stream.avail_out = uncompr_bytes;
     d_stream.next_out = &buffer_uncompr[0];
 
@@ -226,15 +227,99 @@ cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncom
     return array;
 }
 
-cnpy::npz_t* cnpy::npz_load(std::string fname) {
-    FILE* fp = fopen(fname.c_str(), "rb");
+cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncompr_bytes) {
 
-    if (!fp) {
-        throw std::runtime_error("npz_load: Error! Unable to open file " + fname + "!");
+    std::vector<unsigned char> buffer_compr(compr_bytes);
+    size_t nread = fread(&buffer_compr[0], 1, compr_bytes, fp);
+    if (nread != compr_bytes) throw std::runtime_error("load_the_npy_file: failed fread");
+    return inflate_the_npz_array(&buffer_compr[0], compr_bytes, uncompr_bytes);
+}
+
+// read exactly size bytes at offset, retrying on short reads
+void pread_fully(int fd, void* buffer, size_t size, size_t offset) {
+    auto ptr = static_cast<char*>(buffer);
+    while (size > 0) {
+        auto res = pread(fd, ptr, size, offset);
+        if (res <= 0) throw std::runtime_error("npz_load: failed pread");
+        ptr += res;
+        offset += res;
+        size -= res;
     }
+}
 
-    auto* arrays = new cnpy::npz_t;
+cnpy::NpyArray load_the_npz_entry(int fd, const cnpy::NpzEntry& entry) {
+    if (entry.compr_method != 0) {
+        std::vector<unsigned char> buffer_compr(entry.compr_bytes);
+        pread_fully(fd, &buffer_compr[0], entry.compr_bytes, entry.data_offset);
+        return inflate_the_npz_array(&buffer_compr[0], entry.compr_bytes, entry.uncompr_bytes);
+    }
+    // preamble: magic string (6), version (2), header length (2)
+    unsigned char preamble[10];
+    pread_fully(fd, preamble, sizeof(preamble), entry.data_offset);
+    uint16_t header_len = *reinterpret_cast<uint16_t*>(preamble + 8);
+    std::vector<unsigned char> header(sizeof(preamble) + header_len);
+    pread_fully(fd, &header[0], header.size(), entry.data_offset);
+
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    cnpy::parse_npy_header(&header[0], word_size, shape, fortran_order);
+    cnpy::NpyArray arr(shape, word_size, fortran_order);
+    pread_fully(fd, arr.data<char>(), arr.num_bytes(), entry.data_offset + header.size());
+    return arr;
+}
 
+void cnpy::npz_read(int fd, const NpzEntry& entry, void* dst, size_t size) {
+    size_t offset;
+    if (npz_locate(fd, entry, size, offset)) {
+        pread_fully(fd, dst, size, offset);
+        return;
+    }
+    // inflate the whole npy file, header included
+    std::vector<unsigned char> buffer_compr(entry.compr_bytes);
+    pread_fully(fd, &buffer_compr[0], entry.compr_bytes, entry.data_offset);
+    std::vector<unsigned char> buffer(entry.uncompr_bytes);
+    z_stream d_stream{};
+    inflateInit2(&d_stream, -MAX_WBITS);
+    d_stream.avail_in = entry.compr_bytes;
+    d_stream.next_in = &buffer_compr[0];
+    d_stream.avail_out = entry.uncompr_bytes;
+    d_stream.next_out = &buffer[0];
+    auto err = inflate(&d_stream, Z_FINISH);
+    inflateEnd(&d_stream);
+    if (err != Z_STREAM_END) throw std::runtime_error("npz_read: failed inflate of " + entry.varname);
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    cnpy::parse_npy_header(&buffer[0], word_size, shape, fortran_order);
+    auto header_size = 10 + *reinterpret_cast<uint16_t*>(&buffer[8]);
+    auto num_bytes = word_size;
+    for (auto dim : shape) num_bytes *= dim;
+    if (num_bytes != size) throw std::runtime_error("npz_read: unexpected size of " + entry.varname);
+    memcpy(dst, &buffer[0] + header_size, size);
+}
+
+bool cnpy::npz_locate(int fd, const NpzEntry& entry, size_t size, size_t& offset) {
+    if (entry.compr_method != 0) return false;
+    // preamble: magic string (6), version (2), header length (2)
+    std::vector<unsigned char> buffer(10);
+    pread_fully(fd, &buffer[0], buffer.size(), entry.data_offset);
+    buffer.resize(buffer.size() + *reinterpret_cast<uint16_t*>(&buffer[8]));
+    pread_fully(fd, &buffer[0], buffer.size(), entry.data_offset);
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    cnpy::parse_npy_header(&buffer[0], word_size, shape, fortran_order);
+    auto num_bytes = word_size;
+    for (auto dim : shape) num_bytes *= dim;
+    if (num_bytes != size) throw std::runtime_error("npz_locate: unexpected size of " + entry.varname);
+    offset = entry.data_offset + buffer.size();
+    return true;
+}
+
+// walk through local headers and record where each array lives
+std::vector<cnpy::NpzEntry> index_npz_file(FILE* fp) {
+    std::vector<cnpy::NpzEntry> entries;
     while (1) {
         std::vector<char> local_header(30);
         size_t headerres = fread(&local_header[0], sizeof(char), 30, fp);
@@ -252,26 +337,75 @@ cnpy::npz_t* cnpy::npz_load(std::string fname) {
         // erase the lagging .npy
         varname.erase(varname.end() - 4, varname.end());
 
-        // read in the extra field
+        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0] + 8);
+        size_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0] + 18);
+        size_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0] + 22);
+        uint32_t crc = *reinterpret_cast<uint32_t*>(&local_header[0] + 14);
+
+        // read in the extra field, which carries the real sizes of arrays >= 4GB (ZIP64)
         uint16_t extra_field_len = *(uint16_t*)&local_header[28];
         if (extra_field_len > 0) {
             std::vector<char> buff(extra_field_len);
             size_t efield_res = fread(&buff[0], sizeof(char), extra_field_len, fp);
             if (efield_res != extra_field_len) throw std::runtime_error("npz_load: failed fread");
+            for (size_t pos = 0; pos + 4 <= extra_field_len;) {
+                uint16_t tag = *reinterpret_cast<uint16_t*>(&buff[pos]);
+                uint16_t size = *reinterpret_cast<uint16_t*>(&buff[pos + 2]);
+                if (tag == 0x0001 && size >= 16 && pos + 20 <= extra_field_len) {
+                    uncompr_bytes = *reinterpret_cast<uint64_t*>(&buff[pos + 4]);
+                    compr_bytes = *reinterpret_cast<uint64_t*>(&buff[pos + 12]);
+                }
+                pos += 4 + size;
+            }
         }
 
-        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0] + 8);
-        uint32_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0] + 18);
-        uint32_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0] + 22);
+        entries.push_back(
+            cnpy::NpzEntry{varname, static_cast<size_t>(ftell(fp)), compr_method, compr_bytes, uncompr_bytes, crc});
+        fseek(fp, compr_bytes, SEEK_CUR);
+    }
+    return entries;
+}
 
-        if (compr_method == 0) {
-            (*arrays)[varname] = load_the_npy_file(fp);
-        } else {
-            (*arrays)[varname] = load_the_npz_array(fp, compr_bytes, uncompr_bytes);
-        }
+std::vector<cnpy::NpzEntry> cnpy::npz_index(std::string fname) {
+    FILE* fp = fopen(fname.c_str(), "rb");
+    if (!fp) throw std::runtime_error("npz_index: Unable to open file " + fname);
+    auto entries = index_npz_file(fp);
+    fclose(fp);
+    return entries;
+}
+
+cnpy::npz_t* cnpy::npz_load(std::string fname) {
+    FILE* fp = fopen(fname.c_str(), "rb");
+
+    if (!fp) {
+        throw std::runtime_error("npz_load: Error! Unable to open file " + fname + "!");
     }
 
+    // first pass: record where each array lives
+    auto entries = index_npz_file(fp);
+
+    // second pass: read (and inflate) all arrays in parallel on the shared pool
+    std::vector<NpyArray> loaded(entries.size());
+    std::vector<std::string> errors(entries.size());
+    auto fd = fileno(fp);
+    ThreadPool::instance().parallelFor(0, entries.size(), 1, [&](int64_t begin, int64_t end) {
+        for (auto i = begin; i < end; ++i) {
+            try {
+                loaded[i] = load_the_npz_entry(fd, entries[i]);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        }
+    });
     fclose(fp);
+
+    for (auto& error : errors) {
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+    auto* arrays = new cnpy::npz_t;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        (*arrays)[entries[i].varname] = std::move(loaded[i]);
+    }
     return arrays;
 }
 
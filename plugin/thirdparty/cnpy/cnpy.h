@@ -20,30 +20,19 @@
 #include <typeinfo>
 #include <vector>
 
+#include "../../runtime/HostAllocator.h"
 #include "../../utility.h"
 #include "../dbg.h"
 
 namespace cnpy {
 
-// RAII page-locked host memory
-struct CudaHostMemory {
-   public:
-    CudaHostMemory(size_t size) : mSize(size) { CUDA_SAFE_CALL(cudaHostAlloc(&mData, size, cudaHostAllocDefault)); }
-    ~CudaHostMemory() { CUDA_SAFE_CALL(cudaFreeHost(mData)); }
-    size_t size() { return mSize; }
-    void* data() { return mData; }
-
-   private:
-    size_t mSize;
-    void* mData;
-};
-
 struct NpyArray {
     NpyArray(const std::vector<size_t>& _shape, size_t _word_size, bool _fortran_order)
         : shape(_shape), word_size(_word_size), fortran_order(_fortran_order) {
         num_vals = 1;
         for (size_t i = 0; i < shape.size(); i++) num_vals *= shape[i];
-        data_holder = std::make_shared<CudaHostMemory>(num_vals * word_size);
+        // arrays hold expert weights, small ones share slabs
+        data_holder = std::make_shared<HostMemory>(num_vals * word_size, HostAllocator::weightBackend());
     }
 
     NpyArray() : shape(0), word_size(0), fortran_order(0), num_vals(0) {}
@@ -66,7 +55,7 @@ struct NpyArray {
 
     size_t num_bytes() const { return data_holder->size(); }
 
-    std::shared_ptr<CudaHostMemory> data_holder;
+    std::shared_ptr<HostMemory> data_holder;
     std::vector<size_t> shape;
     size_t word_size;
     bool fortran_order;
@@ -75,6 +64,16 @@ struct NpyArray {
 
 using npz_t = std::map<std::string, NpyArray>;
 
+// position of one array inside a npz file
+struct NpzEntry {
+    std::string varname;
+    size_t data_offset;
+    uint16_t compr_method;
+    size_t compr_bytes;
+    size_t uncompr_bytes;
+    uint32_t crc;  // CRC-32 of the uncompressed data, 0 if only given after the data (streamed archives)
+};
+
 char BigEndianTest();
 char map_type(const std::type_info& t);
 template <typename T>
@@ -83,6 +82,12 @@ void parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, b
 void parse_npy_header(unsigned char* buffer, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
 void parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
 npz_t* npz_load(std::string fname);
+// positions of every array of a npz file, without reading them
+std::vector<NpzEntry> npz_index(std::string fname);
+// read the data of one array (of size bytes) from a npz file opened as fd to dst, inflating it if needed
+void npz_read(int fd, const NpzEntry& entry, void* dst, size_t size);
+// offset in the npz file of the data of one array (of size bytes) stored uncompressed, false if it is compressed
+bool npz_locate(int fd, const NpzEntry& entry, size_t size, size_t& offset);
 NpyArray npz_load(std::string fname, std::string varname);
 NpyArray npy_load(std::string fname);
 
@@ -0,0 +1,61 @@
+// Worker process of expert parallelism (runtime/ExpertShards.h), spawned by MoELayerPlugin when expert_shards is
+// set: loads the experts of its shard from the weight file, then runs the tokens streamed to them on its own thread
+// pool, planned by ExpertScheduler, until the layer stops it.
+//
+// usage: moe_shard_worker <segment> <shard> <cpus>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "../MoELayerPlugin.h"
+#include "../runtime/ExpertPlacement.h"
+#include "../runtime/ExpertScheduler.h"
+#include "../runtime/ExpertShards.h"
+#include "../runtime/HostAllocator.h"
+#include "../runtime/ThreadPool.h"
+#include "../sublayers/T5FFLayer.h"
+
+int main(int argc, char **argv) {
+    std::string weight_file;
+    std::unique_ptr<T5FFLayer> sublayer;
+    std::unique_ptr<ExpertScheduler> scheduler;
+    HostMemory workspace;
+    auto loader = [&](const ExpertShards::Config &config, int begin, int end) -> ExpertShards::Runner {
+        if (config.sublayerType != sublayer_type::T5FF) {
+            fprintf(stderr, "ERROR: shard workers only run sublayer type %s, got %s\n", sublayer_type::T5FF,
+                    config.sublayerType.c_str());
+            exit(1);
+        }
+        weight_file = config.weightFile;
+        sublayer = std::make_unique<T5FFLayer>(config.expertCount, config.embeddingSize, config.hiddenSize,
+                                               weight_file.c_str(), 1);
+        sublayer->setShard(begin, end);
+        sublayer->setWeightBudgets(config.hotBytes, config.warmBytes);
+        sublayer->setPlacement(std::make_shared<ExpertPlacement>(config.expertCount));
+        sublayer->initialize();
+        scheduler = std::make_unique<ExpertScheduler>(sublayer->weightSize(), sublayer->flopsPerToken(),
+                                                      ThreadPool::instance(), sublayer->placement());
+        auto expert_count = config.expertCount;
+        auto embedding_size = config.embeddingSize;
+        return [&, expert_count, embedding_size](const int *expertTokenCount, const int *expertOffset, int tokenCount,
+                                                 const float *input, float *output) {
+            sublayer->recordRouting(expertTokenCount);
+            // host workspace grows linearly with token count, experts share it sliced by token offset
+            auto token_workspace_size = sublayer->hostWorkspaceSize(1);
+            if (workspace.size() < token_workspace_size * tokenCount) {
+                workspace = HostMemory(token_workspace_size * tokenCount, HostAllocator::ALIGNED);
+            }
+            auto weights = sublayer->readWeights();
+            auto plan = scheduler->plan(expert_count, expertTokenCount, expertOffset);
+            scheduler->execute(plan, [&](const ExpertScheduler::WorkItem &item) {
+                auto offset = static_cast<size_t>(item.tokenOffset) * embedding_size;
+                sublayer->runHost(*weights.table(), item.expert, item.tokenCount, input + offset, output + offset,
+                                  workspace.data() + token_workspace_size * item.tokenOffset, item.parallelism);
+            });
+        };
+    };
+    auto status = ExpertShards::serve(argc, argv, loader);
+    if (sublayer != nullptr) sublayer->terminate();
+    return status;
+}
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+import argparse
+import threading
+import time
+import numpy as np
+
+from common import create_moe_config_with_random_weight
+from infmoe import MoEServer, MoEClient, histogram_quantile
+
+
+def run_client(socket_path: str, args, seed: int, latencies: list):
+    r"""
+    Open-loop load of one client: requests of log-uniform sizes with exponential gaps between their arrivals
+    """
+    rng = np.random.default_rng(seed)
+    with MoEClient(socket_path) as client:
+        next_arrival = time.perf_counter()
+        for _ in range(args.requests):
+            next_arrival += rng.exponential(1 / args.rate)
+            tokens = int(np.exp(rng.uniform(np.log(args.min_tokens), np.log(args.max_tokens + 1))))
+            x = rng.standard_normal((tokens, client.embedding_size), dtype=np.float32)
+            routing = rng.integers(0, args.expert_count, tokens, dtype=np.int32) if client.routing_input else None
+            time.sleep(max(0, next_arrival - time.perf_counter()))
+            # a late request is measured from when it was due
+            client.forward(x, routing)
+            latencies.append((time.perf_counter() - next_arrival) * 1000)
+
+
+def print_histogram(name: str, histogram: np.ndarray):
+    quantiles = ', '.join(f'p{int(q * 100)} < {histogram_quantile(histogram, q)}' for q in (0.5, 0.9, 0.99))
+    print(f'{name:16}{quantiles}')
+    for bucket in np.nonzero(histogram)[0]:
+        print(f'{"":16}[{0 if bucket == 0 else 1 << (bucket - 1)}, {1 << bucket}): {histogram[bucket]}')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Synthetic load of concurrent clients on a moe_server')
+    parser.add_argument('--clients', type=int, default=8)
+    parser.add_argument('--requests', type=int, default=200, help='requests of each client')
+    parser.add_argument('--rate', type=float, default=100, help='requests per second of each client')
+    parser.add_argument('--min-tokens', type=int, default=1)
+    parser.add_argument('--max-tokens', type=int, default=256)
+    parser.add_argument('--expert-count', type=int, default=16)
+    parser.add_argument('--embedding-size', type=int, default=512)
+    parser.add_argument('--hidden-size', type=int, default=2048)
+    parser.add_argument('--moe-variant', default='default')
+    parser.add_argument('--expert-backend', default='cpu')
+    parser.add_argument('--max-batch-tokens', type=int, default=1024)
+    parser.add_argument('--max-delay-us', type=int, default=500)
+    parser.add_argument('--socket', default='/tmp/infmoe-load.sock')
+    args = parser.parse_args()
+
+    moe_config = create_moe_config_with_random_weight(
+        f'/tmp/moe_load_weight_{args.expert_count}_{args.embedding_size}_{args.hidden_size}.npz',
+        seq_len=args.max_tokens, expert_count=args.expert_count, embedding_size=args.embedding_size,
+        hidden_size=args.hidden_size, max_concurrency=2, moe_variant=args.moe_variant, sublayer_type="T5_FF",
+        max_batch_size=1, expert_centroids=None, layernorm_weight=None, weight_file_path=None,
+        expert_backend=args.expert_backend
+    )
+    with MoEServer(moe_config, args.socket, max_batch_tokens=args.max_batch_tokens,
+                   max_delay_us=args.max_delay_us) as server:
+        latencies = []
+        threads = [threading.Thread(target=run_client, args=(server.socket_path, args, seed, latencies))
+                   for seed in range(args.clients)]
+        start = time.perf_counter()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.perf_counter() - start
+        with MoEClient(server.socket_path) as client:
+            stats = client.stats()
+
+    print(f'{stats["requests"]} requests, {stats["tokens"]} tokens in {stats["batches"]} batches, '
+          f'{stats["tokens"] / elapsed:.0f} tokens/s')
+    print(f'{"latency (ms)":16}' + ', '.join(f'p{q} {np.percentile(latencies, q):.2f}' for q in (50, 90, 99)))
+    print('server histograms:')
+    print_histogram('queue time (us)', stats['queue_time_us'])
+    print_histogram('latency (us)', stats['latency_us'])
+    print_histogram('batch tokens', stats['batch_tokens'])
+    print_histogram('batch requests', stats['batch_requests'])
+
+
+if __name__ == '__main__':
+    main()
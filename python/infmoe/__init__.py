@@ -5,6 +5,7 @@ main package of trt_moe
 
 from .config import MoELayerConfig
 from .plugin import MoELayerPlugin
+from .server import MoEServer, MoEClient, histogram_quantile
 from .utils import *
 
 __version__ = '0.0.1'
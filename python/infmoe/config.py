@@ -23,6 +23,23 @@ class MoELayerConfig:
     expert_centroids: np.ndarray
     layernorm_weight: np.ndarray
     weight_file_path: str
+    expert_backend: str = 'gpu'
+    micro_batch_size: int = 0
+    padding_output: str = 'zero'
+    routing_lists: int = 0
+    routing_probes: int = 0
+    routing_recall: float = 0.95
+    routing_calibration_file: str = None
+    balanced_assignment: str = 'none'
+    hash_key: str = 'token_id'
+    hot_expert_budget: int = 0
+    warm_expert_budget: int = 0
+    device_experts: int = 0
+    replicated_experts: int = 0
+    replication_threshold: float = 0
+    expert_shards: int = 0
+    gate_skip_threshold: float = 0
+    dedup_tokens: bool = False
 
     def generate_random_centroids(self) -> None:
         self.expert_centroids = np.random.rand(self.expert_count, self.embedding_size).astype('f')
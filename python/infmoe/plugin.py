@@ -83,7 +83,8 @@ class MoELayerPlugin:
         assert config.max_concurrency > 0
         assert config.max_batch_size > 0
         assert config.sublayer_type != ''
-        assert config.expert_centroids.size > 0
+        # hash & external routing need no centroids
+        assert config.moe_variant in ('hash_layer', 'external_routing') or config.expert_centroids.size > 0
         assert config.weight_file_path != ''
         assert config.moe_variant != ''
         # C++ plugin will do the other validity check
@@ -97,6 +98,8 @@ class MoELayerPlugin:
         self.weight_file_path_encoded = self.config.weight_file_path.encode('utf-8')
         self.sublayer_type_encoded = self.config.sublayer_type.encode('utf-8')
         self.moe_variant_encoded = self.config.moe_variant.encode('utf-8')
+        self.expert_backend_encoded = self.config.expert_backend.encode('utf-8')
+        self.padding_output_encoded = self.config.padding_output.encode('utf-8')
 
         attributes = [
             trt.PluginField("expert_count", np.int32(
@@ -107,12 +110,69 @@ class MoELayerPlugin:
                 self.config.hidden_size), trt.PluginFieldType.INT32),
             trt.PluginField("max_concurrency", np.int32(
                 self.config.max_concurrency), trt.PluginFieldType.INT32),
-            trt.PluginField("expert_centroids", self.config.expert_centroids, trt.PluginFieldType.FLOAT32),
             trt.PluginField("expert_weight_file", self.weight_file_path_encoded, trt.PluginFieldType.UNKNOWN),
             trt.PluginField("expert_sublayer_type", self.sublayer_type_encoded, trt.PluginFieldType.UNKNOWN),
             trt.PluginField("moe_variant", self.moe_variant_encoded, trt.PluginFieldType.UNKNOWN),
+            trt.PluginField("expert_backend", self.expert_backend_encoded, trt.PluginFieldType.UNKNOWN),
+            trt.PluginField("micro_batch_size", np.int32(
+                self.config.micro_batch_size), trt.PluginFieldType.INT32),
+            trt.PluginField("padding_output", self.padding_output_encoded, trt.PluginFieldType.UNKNOWN),
         ]
 
+        if self.config.expert_centroids is not None:
+            attributes.append(trt.PluginField("expert_centroids", self.config.expert_centroids,
+                                              trt.PluginFieldType.FLOAT32))
+
+        if self.config.moe_variant == 'hash_layer':
+            self.hash_key_encoded = self.config.hash_key.encode('utf-8')
+            attributes.append(trt.PluginField("hash_key", self.hash_key_encoded, trt.PluginFieldType.UNKNOWN))
+
+        if self.config.routing_lists > 0:
+            attributes.append(trt.PluginField("routing_lists", np.int32(
+                self.config.routing_lists), trt.PluginFieldType.INT32))
+            attributes.append(trt.PluginField("routing_probes", np.int32(
+                self.config.routing_probes), trt.PluginFieldType.INT32))
+            attributes.append(trt.PluginField("routing_recall", np.float32(
+                self.config.routing_recall), trt.PluginFieldType.FLOAT32))
+            if self.config.routing_calibration_file is not None:
+                self.routing_calibration_file_encoded = self.config.routing_calibration_file.encode('utf-8')
+                attributes.append(trt.PluginField("routing_calibration_file", self.routing_calibration_file_encoded,
+                                                  trt.PluginFieldType.UNKNOWN))
+
+        if self.config.balanced_assignment != 'none':
+            self.balanced_assignment_encoded = self.config.balanced_assignment.encode('utf-8')
+            attributes.append(trt.PluginField("balanced_assignment", self.balanced_assignment_encoded,
+                                              trt.PluginFieldType.UNKNOWN))
+
+        if self.config.hot_expert_budget > 0:
+            attributes.append(trt.PluginField("hot_expert_budget", np.int32(
+                self.config.hot_expert_budget), trt.PluginFieldType.INT32))
+            attributes.append(trt.PluginField("warm_expert_budget", np.int32(
+                self.config.warm_expert_budget), trt.PluginFieldType.INT32))
+
+        if self.config.device_experts > 0:
+            attributes.append(trt.PluginField("device_experts", np.int32(
+                self.config.device_experts), trt.PluginFieldType.INT32))
+
+        if self.config.replicated_experts > 0:
+            attributes.append(trt.PluginField("replicated_experts", np.int32(
+                self.config.replicated_experts), trt.PluginFieldType.INT32))
+
+        if self.config.replication_threshold > 0:
+            attributes.append(trt.PluginField("replication_threshold", np.float32(
+                self.config.replication_threshold), trt.PluginFieldType.FLOAT32))
+
+        if self.config.expert_shards > 0:
+            attributes.append(trt.PluginField("expert_shards", np.int32(
+                self.config.expert_shards), trt.PluginFieldType.INT32))
+
+        if self.config.gate_skip_threshold > 0:
+            attributes.append(trt.PluginField("gate_skip_threshold", np.float32(
+                self.config.gate_skip_threshold), trt.PluginFieldType.FLOAT32))
+
+        if self.config.dedup_tokens:
+            attributes.append(trt.PluginField("dedup_tokens", np.int32(1), trt.PluginFieldType.INT32))
+
         if self.config.layernorm_weight is not None:
             attributes.append(trt.PluginField("layernorm_weight", self.config.layernorm_weight, trt.PluginFieldType.FLOAT32))
 
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+
+import os
+import time
+import ctypes
+import signal
+import tempfile
+import subprocess
+import numpy as np
+
+from .config import MoELayerConfig
+from .plugin import TRT_MOE_PLUGIN_INFO, TRT_MOE_LAYER_LIB
+
+
+# moe_server is built (and installed) along with libtrtmoelayer.so
+MOE_SERVER_PATH = os.path.join(os.path.dirname(TRT_MOE_PLUGIN_INFO['path']), 'moe_server')
+
+# keep in sync with plugin/server/ServerProtocol.h
+HISTOGRAM_BUCKETS = 32
+
+
+class _Stats(ctypes.Structure):
+    _fields_ = [
+        ('requests', ctypes.c_int64),
+        ('tokens', ctypes.c_int64),
+        ('batches', ctypes.c_int64),
+        ('queue_time_us', ctypes.c_int64 * HISTOGRAM_BUCKETS),
+        ('latency_us', ctypes.c_int64 * HISTOGRAM_BUCKETS),
+        ('batch_tokens', ctypes.c_int64 * HISTOGRAM_BUCKETS),
+        ('batch_requests', ctypes.c_int64 * HISTOGRAM_BUCKETS),
+    ]
+
+
+_float_p = ctypes.POINTER(ctypes.c_float)
+_int_p = ctypes.POINTER(ctypes.c_int)
+TRT_MOE_LAYER_LIB.infmoe_client_connect.restype = ctypes.c_void_p
+TRT_MOE_LAYER_LIB.infmoe_client_connect.argtypes = [ctypes.c_char_p]
+TRT_MOE_LAYER_LIB.infmoe_client_close.argtypes = [ctypes.c_void_p]
+TRT_MOE_LAYER_LIB.infmoe_client_embedding_size.argtypes = [ctypes.c_void_p]
+TRT_MOE_LAYER_LIB.infmoe_client_routing_input.argtypes = [ctypes.c_void_p]
+TRT_MOE_LAYER_LIB.infmoe_client_forward.argtypes = [
+    ctypes.c_void_p, ctypes.c_int, _float_p, _float_p, _int_p, ctypes.c_int]
+TRT_MOE_LAYER_LIB.infmoe_client_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Stats)]
+
+
+def histogram_quantile(histogram: np.ndarray, q: float) -> int:
+    r"""
+    Upper bound (exclusive) of the log2 bucket holding quantile q of a histogram of MoEClient.stats(), 0 if empty
+    """
+    total = histogram.sum()
+    if total == 0:
+        return 0
+    return 1 << int(np.searchsorted(np.cumsum(histogram), q * total))
+
+
+class MoEServer:
+    r"""
+    A moe_server process serving one MoE layer to MoEClient of this host, stopped by stop() or on leaving a with block
+
+    Tokens of concurrent requests are batched until max_batch_tokens are waiting or the oldest request has waited
+    max_delay_us microseconds, whichever comes first. A client that stops writing its request or reading its results
+    for client_timeout_ms milliseconds is closed.
+    """
+
+    def __init__(self, config: MoELayerConfig, socket_path: str, max_batch_tokens: int = 4096,
+                 max_delay_us: int = 500, ring_mb: int = 16, client_timeout_ms: int = 1000, env: dict = None) -> None:
+        self.socket_path = socket_path
+        self.__arrays = tempfile.TemporaryDirectory(prefix='infmoe-server-')
+        args = [MOE_SERVER_PATH, socket_path] + [f'{k}={v}' for k, v in self.__get_attributes(config).items()]
+        if os.path.exists(socket_path):
+            os.unlink(socket_path)
+        self.process = subprocess.Popen(args, env=dict(os.environ if env is None else env, **{
+            'INFMOE_SERVER_MAX_TOKENS': str(max_batch_tokens),
+            'INFMOE_SERVER_MAX_DELAY_US': str(max_delay_us),
+            'INFMOE_SERVER_RING_MB': str(ring_mb),
+            'INFMOE_SERVER_CLIENT_TIMEOUT_MS': str(client_timeout_ms),
+        }))
+        # the socket is bound once the layer is initialized
+        while not os.path.exists(socket_path):
+            if self.process.poll() is not None:
+                raise Exception(f'moe_server exited with {self.process.returncode}')
+            time.sleep(0.01)
+
+    def __get_attributes(self, config: MoELayerConfig) -> dict:
+        attributes = {
+            'expert_count': config.expert_count,
+            'embedding_size': config.embedding_size,
+            'hidden_size': config.hidden_size,
+            'max_concurrency': config.max_concurrency,
+            'expert_weight_file': config.weight_file_path,
+            'expert_sublayer_type': config.sublayer_type,
+            'moe_variant': config.moe_variant,
+            'expert_backend': config.expert_backend,
+            'micro_batch_size': config.micro_batch_size,
+            'padding_output': config.padding_output,
+        }
+        arrays = {}
+        if config.moe_variant not in ('hash_layer', 'external_routing'):
+            arrays['expert_centroids'] = config.expert_centroids
+        if config.moe_variant == 'cpm_2':
+            arrays['layernorm_weight'] = config.layernorm_weight
+        for name, array in arrays.items():
+            if array is not None:
+                attributes[name] = os.path.join(self.__arrays.name, f'{name}.npy')
+                np.save(attributes[name], np.ascontiguousarray(array, dtype=np.float32))
+        if config.moe_variant == 'hash_layer':
+            attributes['hash_key'] = config.hash_key
+        if config.routing_lists > 0:
+            attributes['routing_lists'] = config.routing_lists
+            attributes['routing_probes'] = config.routing_probes
+            attributes['routing_recall'] = config.routing_recall
+            if config.routing_calibration_file is not None:
+                attributes['routing_calibration_file'] = config.routing_calibration_file
+        if config.balanced_assignment != 'none':
+            attributes['balanced_assignment'] = config.balanced_assignment
+        if config.hot_expert_budget > 0:
+            attributes['hot_expert_budget'] = config.hot_expert_budget
+            attributes['warm_expert_budget'] = config.warm_expert_budget
+        if config.device_experts > 0:
+            attributes['device_experts'] = config.device_experts
+        if config.replicated_experts > 0:
+            attributes['replicated_experts'] = config.replicated_experts
+        if config.replication_threshold > 0:
+            attributes['replication_threshold'] = config.replication_threshold
+        if config.expert_shards > 0:
+            attributes['expert_shards'] = config.expert_shards
+        if config.gate_skip_threshold > 0:
+            attributes['gate_skip_threshold'] = config.gate_skip_threshold
+        if config.dedup_tokens:
+            attributes['dedup_tokens'] = 1
+        return attributes
+
+    def reload(self) -> None:
+        r"""
+        Reload the weight file of the layer, replaced in place (e.g. renamed over the old one), without stopping the
+        server: only experts whose arrays changed are read, and requests in flight finish on the old weights
+        """
+        self.process.send_signal(signal.SIGHUP)
+
+    def stop(self) -> int:
+        if self.process.poll() is None:
+            self.process.send_signal(signal.SIGTERM)
+        returncode = self.process.wait()
+        self.__arrays.cleanup()
+        return returncode
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.stop()
+
+
+class MoEClient:
+    r"""
+    Python binding of MoEClient (plugin/server/MoEClient.h): runs the layer of a moe_server on token rows
+
+    Not thread-safe, use one client per thread. The GIL is released while waiting for the server.
+    """
+
+    def __init__(self, socket_path: str) -> None:
+        self.__client = TRT_MOE_LAYER_LIB.infmoe_client_connect(socket_path.encode('utf-8'))
+        if not self.__client:
+            raise Exception(f'Cannot connect to moe_server at {socket_path}')
+        self.embedding_size = TRT_MOE_LAYER_LIB.infmoe_client_embedding_size(self.__client)
+        self.routing_input = TRT_MOE_LAYER_LIB.infmoe_client_routing_input(self.__client) != 0
+
+    def close(self) -> None:
+        if self.__client:
+            TRT_MOE_LAYER_LIB.infmoe_client_close(self.__client)
+            self.__client = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def forward(self, x: np.ndarray, routing: np.ndarray = None, out: np.ndarray = None,
+                seq_len: int = 0) -> np.ndarray:
+        r"""
+        Output of the layer for x of shape (..., embedding_size), written by the client straight from shared memory
+        into out (allocated if not given). routing: token ids (hash_layer) or experts (external_routing) of shape
+        x.shape[:-1], seq_len: tokens of each sequence when hash_layer hashes positions (default to x.shape[-2])
+        """
+        assert x.shape[-1] == self.embedding_size
+        x = np.ascontiguousarray(x, dtype=np.float32)
+        if out is None:
+            out = np.empty_like(x)
+        assert out.shape == x.shape and out.dtype == np.float32 and out.flags['C_CONTIGUOUS']
+        token_count = x.size // self.embedding_size
+        routing_p = None
+        if self.routing_input:
+            assert routing is not None and routing.size == token_count
+            routing = np.ascontiguousarray(routing, dtype=np.int32)
+            routing_p = routing.ctypes.data_as(_int_p)
+        if seq_len == 0 and x.ndim > 2:
+            seq_len = x.shape[-2]
+        if not TRT_MOE_LAYER_LIB.infmoe_client_forward(self.__client, token_count, x.ctypes.data_as(_float_p),
+                                                       out.ctypes.data_as(_float_p), routing_p, seq_len):
+            raise Exception('moe_server is gone')
+        return out
+
+    def stats(self) -> dict:
+        r"""
+        Counters of the server, and its log2 histograms (see histogram_quantile) of queue time & latency of requests
+        (in microseconds), tokens & requests of batches
+        """
+        stats = _Stats()
+        if not TRT_MOE_LAYER_LIB.infmoe_client_stats(self.__client, ctypes.byref(stats)):
+            raise Exception('moe_server is gone')
+        result = {name: getattr(stats, name) for name in ('requests', 'tokens', 'batches')}
+        for name in ('queue_time_us', 'latency_us', 'batch_tokens', 'batch_requests'):
+            result[name] = np.ctypeslib.as_array(getattr(stats, name)).copy()
+        return result
@@ -54,10 +54,8 @@ class build_ext(distutils.cmd.Command):
         p.wait()
         assert p.returncode == 0, 'Build with meson failed'
 
-        shutil.copy(
-            os.path.join("build", "libtrtmoelayer.so"),
-            os.path.join("infmoe", "libtrtmoelayer.so"),
-        )
+        for name in ('libtrtmoelayer.so', 'moe_server', 'moe_shard_worker'):
+            shutil.copy(os.path.join("build", name), os.path.join("infmoe", name))
 
 
 if __name__ == '__main__':
@@ -74,6 +72,6 @@ if __name__ == '__main__':
             'build_ext': build_ext
         },
         package_data={
-            'infmoe': ['libtrtmoelayer.so'],
+            'infmoe': ['libtrtmoelayer.so', 'moe_server', 'moe_shard_worker'],
         },
     )